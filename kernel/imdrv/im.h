@@ -32,17 +32,35 @@ Kernel mode
 //------------------------------------------------------------------------
 
 // todo consider to not to hardcode it.
-#define IM_AMOUNT_OF_TARGET_PROCESSES 2
-#define IM_HL_PROCESS_INFO_INDEX 0
-#define IM_CS_PROCESS_INFO_INDEX 1
 #define IM_HL_PROCESS_NAME L"hl.exe"
 #define IM_CS_PROCESS_NAME L"csgo.exe"
 
+//
+// buckets of the target processes table
+//
+#define IM_PROCESS_TABLE_BITS 6
+#define IM_PROCESS_TABLE_BUCKETS (1 << IM_PROCESS_TABLE_BITS)
+
+//
+// buckets of the interned names table
+//
+#define IM_NAME_TABLE_BITS 8
+#define IM_NAME_TABLE_BUCKETS (1 << IM_NAME_TABLE_BITS)
+
+//
+// buckets and windows of the records coalescer, a record with no free
+// window is not coalesced
+//
+#define IM_COALESCE_TABLE_BITS 6
+#define IM_COALESCE_TABLE_BUCKETS (1 << IM_COALESCE_TABLE_BITS)
+#define IM_COALESCE_WINDOWS 256
+
 //
 // tags for memory
 //
 #define IM_KLIST_TAG ('IMkt')
 #define IM_BUFFER_TAG ('IMbt')
+#define IM_NAME_TAG ('IMnt')
 
 //------------------------------------------------------------------------
 //  Callback definitions.
@@ -55,7 +73,9 @@ typedef VOID (*IM_KELEMENT_FREE_CALLBACK)(PLIST_ENTRY ListEntry);
 //------------------------------------------------------------------------
 
 //
-// Similar to file name information
+// Similar to file name information. Allocated as one buffer with the full
+// name behind it, the other strings are views into FullName, so free it
+// only with IMReleaseNameInformation and never free the strings.
 //
 typedef struct _IM_NAME_INFORMATION
 {
@@ -74,12 +94,17 @@ typedef struct _IM_NAME_INFORMATION
 } IM_NAME_INFORMATION, *PIM_NAME_INFORMATION;
 
 //
-// Information about our process
+// Information about one running instance of a target process
 //
 typedef struct _IM_PROCESS_INFO
 {
   //
-  // unique id from windows
+  // link in the bucket of the target processes table
+  //
+  LIST_ENTRY Link;
+
+  //
+  // unique id from windows, key in the table
   //
   HANDLE ProcessId;
 
@@ -89,24 +114,147 @@ typedef struct _IM_PROCESS_INFO
   PIM_NAME_INFORMATION NameInfo;
 
   //
-  // Name for which we are looking for
+  // full name of the process as its records refer to it, see im_ntab.h
   //
-  UNICODE_STRING TargetName;
+  struct _IM_NAME_ENTRY *InternedName;
 
   //
-  // Process is now active
+  // compiled allow and deny roots of the process, see im_trie.h
   //
-  BOOLEAN isActive;
+  struct _IM_TRIE *Policy;
 
   //
-  // Currently we are not allow duplications
+  // verdicts of the files the process has loaded, see im_vcache.h
   //
-  BOOLEAN isDuplicate;
+  struct _IM_VERDICT_CACHE *Verdicts;
 
 } IM_PROCESS_INFO, *PIM_PROCESS_INFO;
 
 //
-// List head in globals
+// Running target processes hashed by process id, see im_ptab.h
+//
+typedef struct _IM_PROCESS_TABLE
+{
+  //
+  // shared for lookups, exclusive for insert and remove
+  //
+  EX_SPIN_LOCK Lock;
+
+  //
+  // amount of processes in the table
+  //
+  __volatile LONG Count;
+
+  LIST_ENTRY Buckets[IM_PROCESS_TABLE_BUCKETS];
+
+} IM_PROCESS_TABLE, *PIM_PROCESS_TABLE;
+
+//
+// lanes of the list, processors after the last one share them
+//
+#define IM_KLIST_MAX_LANES 64
+
+//
+// sequence numbers a lane takes from the list at once
+//
+#define IM_KLIST_SEQUENCE_BLOCK 64
+
+//
+// slots of the priority lane, see IMPushPriority
+//
+#define IM_KLIST_PRIORITY_SLOTS 256
+
+//
+// Slot of the ring of a lane, see im_list.c
+//
+typedef struct _IM_KRING_SLOT
+{
+  PLIST_ENTRY Element;
+
+  //
+  // number of the element in the order of the list
+  //
+  ULONGLONG SequenceNumber;
+
+  //
+  // what the element takes from the budget, see IMHasRoom
+  //
+  ULONG Bytes;
+
+} IM_KRING_SLOT, *PIM_KRING_SLOT;
+
+//
+// Lane of the list, one per processor. Producer owns the lane while it
+// pushes, so producers of different processors write nothing they share.
+// Consumer takes elements of all lanes in order of their numbers.
+//
+typedef struct _IM_KLIST_LANE
+{
+  //
+  //  Lock of the lane: free, busy while a producer or the consumer is in
+  //  it, or resizing while the ring is moved, see im_list.c
+  //
+  DECLSPEC_CACHEALIGN __volatile LONG State;
+
+  //
+  //  Next position to push, written by the owner of the lane
+  //
+  __volatile LONG Tail;
+
+  //
+  //  Head as the owner saw it last, read again when the ring looks full
+  //
+  LONG HeadCache;
+
+  //
+  //  Sequence numbers of the lane from NextSequenceNumber up to
+  //  SequenceLimit, none left when they are equal
+  //
+  ULONGLONG NextSequenceNumber;
+  ULONGLONG SequenceLimit;
+
+  //
+  //  Last number an element of this processor took in another lane, its
+  //  next ones are above it in whatever lane they go
+  //
+  __volatile LONGLONG SequenceFloor;
+
+  //
+  //  Bytes of the elements ever pushed to the lane
+  //
+  __volatile LONGLONG PushedBytes;
+
+  //
+  //  Ring of elements, power of 2 slots
+  //
+  PIM_KRING_SLOT Slots;
+
+  ULONG SlotMask;
+
+  //
+  //  Next position to pop and bytes of the popped elements, only the
+  //  owner of ConsumerLock moves them
+  //
+  DECLSPEC_CACHEALIGN __volatile LONG Head;
+
+  __volatile LONGLONG PoppedBytes;
+
+} IM_KLIST_LANE, *PIM_KLIST_LANE;
+
+//
+// Lane in the k-way merge of the consumer with the number of its head
+//
+typedef struct _IM_KLIST_MERGE_ENTRY
+{
+  ULONGLONG SequenceNumber;
+
+  ULONG Lane;
+
+} IM_KLIST_MERGE_ENTRY, *PIM_KLIST_MERGE_ENTRY;
+
+//
+// List head in globals: bounded lanes of elements, many producers and one
+// consumer
 //
 typedef struct _IM_KLIST_HEAD
 {
@@ -121,42 +269,409 @@ typedef struct _IM_KLIST_HEAD
   NPAGED_LOOKASIDE_LIST ElementsLookaside;
 
   //
-  //  Variable for maintaining sequence numbers.
+  //  Last sequence number given to a lane or taken by IMNextSequenceNumber.
+  //  Lanes take blocks of them, so producers come here once per block.
+  //
+  DECLSPEC_CACHEALIGN __volatile LONGLONG SequenceNumber;
+
+  //
+  //  Lanes in use, one per active processor up to IM_KLIST_MAX_LANES
   //
-  __volatile LONGLONG SequenceNumber;
+  ULONG LaneCount;
 
   //
-  //  List of elements with data to send to user mode.
+  //  Elements and bytes a lane takes before its producer looks at the
+  //  other lanes, see IMHasRoom
   //
-  LIST_ENTRY ElementList;
+  LONG LaneElements;
+
+  LONG LaneBytes;
 
   //
-  //  Protection for the list of elements
+  //  One consumer at a time, taken once per drain
   //
-  KSPIN_LOCK ElementListLock;
+  DECLSPEC_CACHEALIGN FAST_MUTEX ConsumerLock;
 
   //
-  // pushing element event
+  //  Heap of the lanes with elements below MergeLimit, lowest number
+  //  first, the consumer takes from its top. Lanes which have no element
+  //  below the limit are looked at again once the heap is empty.
+  //
+  IM_KLIST_MERGE_ENTRY Merge[IM_KLIST_MAX_LANES];
+
+  ULONG MergeCount;
+
+  ULONGLONG MergeLimit;
+
+  //
+  //  Lane the last IMPeek took its element from, IMPop takes it from there
+  //
+  PIM_KLIST_LANE PeekedLane;
+
+  //
+  // pushing element event, set once LowWatermark elements are there
   //
   PKEVENT NewElementEvent;
 
+  //
+  //  Elements the waiting consumer wants before it is woken up
+  //
+  __volatile LONG LowWatermark;
+
+  //
+  //  set by the consumer after it took elements if producers wait for
+  //  room, see IMWaitForRoom
+  //
+  PKEVENT RoomEvent;
+
+  __volatile LONG RoomWaiters;
+
+  //
+  //  set once the resized rings are there, producers which found a lane
+  //  resized by IMResizeList wait for it
+  //
+  PKEVENT ResizedEvent;
+
   //
   //  Maximum amount of elements we could keep in memory
   //
   LONG MaxElementsToPush;
 
   //
-  //  Current amount of elements we keep in memory
+  //  Budget of the pushed elements in bytes, 0 if only their amount is
+  //  limited. Bytes of an element are what its owner says they are.
+  //
+  LONG MaxBytesToPush;
+
+  //
+  //  High-water mark of the pushed bytes, taken whenever the lanes are
+  //  summed up: by the consumer and by the producers past their share
   //
-  __volatile LONGLONG ElementsPushed;
+  __volatile LONG MaxBytesPushed;
 
   //
   // Callback to free list element
   //
   IM_KELEMENT_FREE_CALLBACK ElementFreeCallback;
 
+  IM_KLIST_LANE Lanes[IM_KLIST_MAX_LANES];
+
+  //
+  //  Lane of IMPushPriority, drained before the others. Its slots are
+  //  its own and out of the budget, so a flood of the other lanes does not
+  //  take them.
+  //
+  IM_KLIST_LANE PriorityLane;
+
 } IM_KLIST_HEAD, *PIM_KLIST_HEAD;
 
+//
+// Interned process or file name, records refer to it by Id, see im_ntab.h
+//
+typedef struct _IM_NAME_ENTRY
+{
+  //
+  // link in the bucket of the names table
+  //
+  LIST_ENTRY Link;
+
+  //
+  // records and processes holding it, unreferenced one stays in the
+  // table until its slot is needed for another name
+  //
+  __volatile LONG References;
+
+  //
+  // 1 to IM_MAX_INTERNED_NAMES, index of its slot plus one
+  //
+  ULONG Id;
+
+  ULONG Hash;
+
+  //
+  // set by lookups, the eviction clock passes the name once more then
+  //
+  BOOLEAN IsRecent;
+
+  //
+  // client generation the name was sent in, with IM_NAME_SENDING while
+  // a writer is about to send it
+  //
+  __volatile LONG SentIn;
+
+  //
+  // null terminated, points behind the entry
+  //
+  UNICODE_STRING Name;
+
+} IM_NAME_ENTRY, *PIM_NAME_ENTRY;
+
+//
+// Names of the records hashed by the string, see im_ntab.h
+//
+typedef struct _IM_NAME_TABLE
+{
+  //
+  // shared for lookups, exclusive for insert and eviction
+  //
+  EX_SPIN_LOCK Lock;
+
+  //
+  // names by Id - 1, IM_MAX_INTERNED_NAMES of them
+  //
+  PIM_NAME_ENTRY *Slots;
+
+  //
+  // slots taken, they are only freed with the table
+  //
+  ULONG Count;
+
+  //
+  // next slot to look at for the name to evict
+  //
+  ULONG Clock;
+
+  //
+  // changed for every client, it has none of the names yet
+  //
+  __volatile LONG Generation;
+
+  LIST_ENTRY Buckets[IM_NAME_TABLE_BUCKETS];
+
+} IM_NAME_TABLE, *PIM_NAME_TABLE;
+
+//
+//  What information we actually log, the client gets it as IM_WIRE_RECORD
+//
+typedef struct _IM_KRECORD
+{
+  //
+  // Just marker for the debug to navigate in memory
+  // equals 0xCEFAADDE which will be in memory shown as FACEDEAD due to little indean
+  //
+  ULONG Debug;
+
+  //
+  // Order number of the record for logging
+  //
+  ULONGLONG SequenceNumber;
+
+  //
+  // Time when record was created, also for logging
+  //
+  LARGE_INTEGER Time;
+
+  //
+  // Is loading of the binary is blocked or not
+  //
+  BOOLEAN IsBlocked;
+
+  //
+  // is pre operation callback succeded (just for log)
+  //
+  BOOLEAN IsSucceded;
+
+  //
+  // status of loading game in certain video mode
+  //
+  IM_VIDEO_MODE_STATUS VideoModeStatus;
+
+  //
+  // records dropped right before this one, the client gets a gap marker
+  // for them ahead of it
+  //
+  ULONG Lost;
+
+  //
+  // what the record takes from the budget of the queue while it is there,
+  // see IMRecordBytes
+  //
+  ULONG Bytes;
+
+  //
+  // identical records coalesced into this one from Time to LastTime, 0
+  // or 1 if it is not coalesced, see im_coal.h
+  //
+  ULONG Count;
+
+  LARGE_INTEGER LastTime;
+
+  //
+  // file information (must be freed before push)
+  //
+  PVOID FileNameInformation;
+
+} IM_KRECORD, *PIM_KRECORD;
+
+//
+//  How the mini-filter manages the log records.
+//
+typedef struct _IM_KRECORD_LIST
+{
+  //
+  // List element
+  //
+  LIST_ENTRY List;
+
+  //
+  // interned names in order of IM_*_NAME_INDEX, referenced until the
+  // record is freed
+  //
+  PIM_NAME_ENTRY Names[IM_AMOUNT_OF_DATA];
+
+  //
+  // names claimed for the record by the drain which took it off the list,
+  // it writes the record after the lock, see IMGetRecords
+  //
+  BOOLEAN IsSending[IM_AMOUNT_OF_DATA];
+
+  //
+  // Data itself
+  //
+  IM_KRECORD Record;
+
+} IM_KRECORD_LIST, *PIM_KRECORD_LIST;
+
+//
+// Ring of records mapped into the client, see im_shm.h
+//
+typedef struct _IM_SHARED_RECORDS
+{
+  //
+  // writers in flight, run down while the ring is not mapped
+  //
+  EX_RUNDOWN_REF Rundown;
+
+  //
+  // serializes map and unmap
+  //
+  FAST_MUTEX Lock;
+
+  //
+  // locked pages of the ring and their mappings
+  //
+  PMDL Mdl;
+  PIM_RING_HEADER Header;
+  PVOID UserAddress;
+
+  //
+  // client process the ring is mapped into
+  //
+  PEPROCESS Process;
+
+  IM_RING_PRODUCER Producer;
+
+  //
+  // set when the client waits for records and one was written
+  //
+  KEVENT Doorbell;
+
+} IM_SHARED_RECORDS, *PIM_SHARED_RECORDS;
+
+//
+// part of the shared ring only blocked and video mode records are written
+// to, as a shift of its size
+//
+#define IM_SHARED_PRIORITY_SHIFT 3
+
+//
+// What is done with records the queue has no room for and how many of
+// them were dropped, see im_rec.h
+//
+typedef struct _IM_RECORDS_OVERFLOW
+{
+  //
+  // IM_OVERFLOW_POLICY and the wait of IMOverflowBlock, set by the client
+  //
+  __volatile LONG Policy;
+  __volatile LONG Milliseconds;
+
+  //
+  // by IM_DROP_REASON, since the driver started
+  //
+  __volatile LONGLONG Dropped[IMDropReasons];
+
+  //
+  // dropped records the client was not told about yet, the next record
+  // it gets takes them
+  //
+  __volatile LONG Lost;
+
+} IM_RECORDS_OVERFLOW, *PIM_RECORDS_OVERFLOW;
+
+//
+// Window of identical records, see im_coal.h. The first record of the
+// window goes to the client, the next ones are coalesced into Record.
+//
+typedef struct _IM_COALESCE_WINDOW
+{
+  //
+  // link in the bucket, or in the free windows
+  //
+  LIST_ENTRY Link;
+
+  //
+  // link in the windows in order of Deadline
+  //
+  LIST_ENTRY Expiry;
+
+  ULONG Hash;
+
+  //
+  // key: referenced names and the verdict of the records
+  //
+  PIM_NAME_ENTRY Names[IM_AMOUNT_OF_DATA];
+  BOOLEAN IsBlocked;
+  BOOLEAN IsSucceded;
+  IM_VIDEO_MODE_STATUS VideoModeStatus;
+
+  //
+  // interrupt time the window closes at
+  //
+  ULONGLONG Deadline;
+
+  //
+  // second record of the window with the count of the ones after the
+  // first, NULL until it comes
+  //
+  PIM_KRECORD_LIST Record;
+
+} IM_COALESCE_WINDOW, *PIM_COALESCE_WINDOW;
+
+//
+// Open windows of identical records hashed by their key, see im_coal.h
+//
+typedef struct _IM_COALESCER
+{
+  //
+  // producers of records and the client expiring windows
+  //
+  FAST_MUTEX Lock;
+
+  //
+  // length of the windows, 0 if records are not coalesced
+  //
+  __volatile LONG Milliseconds;
+
+  //
+  // open windows, the oldest first. All of them are of the same length,
+  // so it is also the order they close in.
+  //
+  LIST_ENTRY Expiry;
+
+  LIST_ENTRY FreeWindows;
+
+  //
+  // records coalesced, since the driver started
+  //
+  __volatile LONGLONG Coalesced;
+
+  LIST_ENTRY Buckets[IM_COALESCE_TABLE_BUCKETS];
+
+  IM_COALESCE_WINDOW Windows[IM_COALESCE_WINDOWS];
+
+} IM_COALESCER, *PIM_COALESCER;
+
 //
 // Global driver data structure
 //
@@ -191,9 +706,46 @@ typedef struct _IM_GLOBALS
   IM_KLIST_HEAD RecordsHead;
 
   //
-  // hl and cs processes info
+  // records go here instead of RecordsHead while the client maps it
+  //
+  IM_SHARED_RECORDS SharedRecords;
+
+  //
+  // overflow policy and drop counters of the records
+  //
+  IM_RECORDS_OVERFLOW Overflow;
+
+  //
+  // identical records are coalesced here before they are pushed
+  //
+  IM_COALESCER Coalescer;
+
+  //
+  // process and file names of the records
+  //
+  IM_NAME_TABLE Names;
+
+  //
+  // running instances of the target processes
+  //
+  IM_PROCESS_TABLE TargetProcesses;
+
+  //
+  // restricted fragments of the loaded file names, see im_match.h
+  //
+  struct _IM_MATCHER *RestrictedFiles;
+
+  //
+  // bumped by IMInvalidateVerdicts, cached verdicts of older generations
+  // are not used, see im_vcache.h
+  //
+  __volatile LONG PolicyGeneration;
+
+  //
+  // lookups of the verdict caches of all target processes
   //
-  IM_PROCESS_INFO TargetProcessInfo[IM_AMOUNT_OF_TARGET_PROCESSES];
+  __volatile LONGLONG VerdictHits;
+  __volatile LONGLONG VerdictMisses;
 
 } IM_GLOBALS, *PIM_GLOBALS;
 
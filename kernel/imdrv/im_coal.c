@@ -0,0 +1,391 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_coal.c
+
+Abstract:
+Coalescing of identical records within a window
+
+Environment:
+
+Kernel mode
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_coal.h"
+#include "im_ntab.h"
+#include "im_rec.h"
+#include "im_utils.h"
+
+//------------------------------------------------------------------------
+//  Defines.
+//------------------------------------------------------------------------
+
+#define IM_COALESCE_HASH_PRIME 0x9E3779B1u
+
+//
+// interrupt time is in 100 ns
+//
+#define IM_COALESCE_TICKS_PER_MS 10000
+
+//------------------------------------------------------------------------
+//  Local function prototypes.
+//------------------------------------------------------------------------
+
+static ULONG
+IMCoalesceHash(
+    _In_ PIM_KRECORD_LIST RecordList);
+
+static BOOLEAN
+IMWindowEquals(
+    _In_ PIM_COALESCE_WINDOW Window,
+    _In_ ULONG Hash,
+    _In_ PIM_KRECORD_LIST RecordList);
+
+static VOID IMCloseWindows(
+    _Inout_ PIM_COALESCER Coalescer,
+    _In_ ULONGLONG Now,
+    _In_ BOOLEAN IsAll,
+    _Inout_ PLIST_ENTRY Closed);
+
+//------------------------------------------------------------------------
+//  Text sections.
+//------------------------------------------------------------------------
+
+//
+// Records are pushed at PASSIVE_LEVEL, the lock is a fast mutex
+//
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, IMCoalescerInit)
+#pragma alloc_text(PAGE, IMCoalescerDeinit)
+#pragma alloc_text(PAGE, IMCoalescerSetWindow)
+#pragma alloc_text(PAGE, IMCoalesceRecord)
+#pragma alloc_text(PAGE, IMCoalescerClose)
+#pragma alloc_text(PAGE, IMCoalescerTimeout)
+#pragma alloc_text(PAGE, IMCoalesceHash)
+#pragma alloc_text(PAGE, IMWindowEquals)
+#pragma alloc_text(PAGE, IMCloseWindows)
+#endif // ALLOC_PRAGMA
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+VOID IMCoalescerInit(
+    _Out_ PIM_COALESCER Coalescer)
+{
+  ULONG i = 0;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN(Coalescer != NULL);
+
+  RtlZeroMemory(Coalescer, sizeof(IM_COALESCER));
+
+  ExInitializeFastMutex(&Coalescer->Lock);
+
+  InitializeListHead(&Coalescer->Expiry);
+  InitializeListHead(&Coalescer->FreeWindows);
+
+  for (; i < IM_COALESCE_TABLE_BUCKETS; i++)
+  {
+    InitializeListHead(&Coalescer->Buckets[i]);
+  }
+
+  for (i = 0; i < IM_COALESCE_WINDOWS; i++)
+  {
+    InsertTailList(&Coalescer->FreeWindows, &Coalescer->Windows[i].Link);
+  }
+}
+
+VOID IMCoalescerDeinit(
+    _Inout_ PIM_COALESCER Coalescer)
+{
+  LIST_ENTRY closed;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN(Coalescer != NULL);
+
+  // not initialized
+  IF_FALSE_RETURN(Coalescer->FreeWindows.Flink != NULL);
+
+  IMCoalescerClose(Coalescer, TRUE, &closed);
+
+  while (!IsListEmpty(&closed))
+  {
+    IMFreeRecord(CONTAINING_RECORD(RemoveHeadList(&closed), IM_KRECORD_LIST, List));
+  }
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMCoalescerSetWindow(
+        _Inout_ PIM_COALESCER Coalescer,
+        _In_ ULONG Milliseconds,
+        _Out_ PLIST_ENTRY Closed)
+{
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(Coalescer != NULL, STATUS_INVALID_PARAMETER_1);
+  IF_FALSE_RETURN_RESULT(Milliseconds <= IM_MAX_COALESCE_WINDOW, STATUS_INVALID_PARAMETER_2);
+  IF_FALSE_RETURN_RESULT(Closed != NULL, STATUS_INVALID_PARAMETER_3);
+
+  InitializeListHead(Closed);
+
+  ExAcquireFastMutex(&Coalescer->Lock);
+
+  // windows of another length would close out of order
+  WriteNoFence(&Coalescer->Milliseconds, (LONG)Milliseconds);
+  IMCloseWindows(Coalescer, 0, TRUE, Closed);
+
+  ExReleaseFastMutex(&Coalescer->Lock);
+
+  LOG(("[IM] Records coalesced within %u ms\n", Milliseconds));
+
+  return STATUS_SUCCESS;
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+BOOLEAN
+IMCoalesceRecord(
+    _Inout_ PIM_COALESCER Coalescer,
+    _In_ PIM_KRECORD_LIST RecordList,
+    _Out_ PLIST_ENTRY Closed)
+{
+  PIM_COALESCE_WINDOW window = NULL;
+  PIM_KRECORD_LIST coalesced = NULL;
+  PLIST_ENTRY bucket = NULL;
+  PLIST_ENTRY entry = NULL;
+  ULONGLONG now = 0;
+  ULONG hash = 0;
+  ULONG i = 0;
+  BOOLEAN isCoalesced = FALSE;
+
+  PAGED_CODE();
+
+  InitializeListHead(Closed);
+
+  // plain read first, coalescing is off by default and then there is no
+  // window open
+  if (0 == ReadNoFence(&Coalescer->Milliseconds))
+  {
+    return FALSE;
+  }
+
+  now = KeQueryInterruptTime();
+  hash = IMCoalesceHash(RecordList);
+  bucket = &Coalescer->Buckets[hash & (IM_COALESCE_TABLE_BUCKETS - 1)];
+
+  ExAcquireFastMutex(&Coalescer->Lock);
+
+  IMCloseWindows(Coalescer, now, FALSE, Closed);
+
+  for (entry = bucket->Flink; entry != bucket; entry = entry->Flink)
+  {
+    if (IMWindowEquals(CONTAINING_RECORD(entry, IM_COALESCE_WINDOW, Link), hash, RecordList))
+    {
+      window = CONTAINING_RECORD(entry, IM_COALESCE_WINDOW, Link);
+      break;
+    }
+  }
+
+  if (NULL != window)
+  {
+    isCoalesced = TRUE;
+
+    if (NULL == window->Record)
+    {
+      // the record stands for the ones after it in the window
+      window->Record = RecordList;
+      RecordList->Record.Count = 1;
+      RecordList->Record.LastTime = RecordList->Record.Time;
+    }
+    else
+    {
+      coalesced = RecordList;
+      window->Record->Record.Count++;
+      window->Record->Record.LastTime = RecordList->Record.Time;
+    }
+  }
+  else if (0 != Coalescer->Milliseconds && !IsListEmpty(&Coalescer->FreeWindows))
+  {
+    // the record goes to the client and opens the window
+    window = CONTAINING_RECORD(RemoveHeadList(&Coalescer->FreeWindows), IM_COALESCE_WINDOW, Link);
+
+    window->Hash = hash;
+    window->IsBlocked = RecordList->Record.IsBlocked;
+    window->IsSucceded = RecordList->Record.IsSucceded;
+    window->VideoModeStatus = RecordList->Record.VideoModeStatus;
+    window->Deadline = now + (ULONGLONG)Coalescer->Milliseconds * IM_COALESCE_TICKS_PER_MS;
+    window->Record = NULL;
+
+    // the names may not be taken by others while the window is open
+    for (; i < IM_AMOUNT_OF_DATA; i++)
+    {
+      IMNameTableReference(RecordList->Names[i]);
+      window->Names[i] = RecordList->Names[i];
+    }
+
+    InsertTailList(bucket, &window->Link);
+    InsertTailList(&Coalescer->Expiry, &window->Expiry);
+  }
+
+  ExReleaseFastMutex(&Coalescer->Lock);
+
+  if (NULL != coalesced)
+  {
+    InterlockedIncrement64(&Coalescer->Coalesced);
+    IMFreeRecord(coalesced);
+  }
+
+  return isCoalesced;
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID IMCoalescerClose(
+    _Inout_ PIM_COALESCER Coalescer,
+    _In_ BOOLEAN IsAll,
+    _Out_ PLIST_ENTRY Closed)
+{
+  PAGED_CODE();
+
+  InitializeListHead(Closed);
+
+  if (!IsAll && 0 == ReadNoFence(&Coalescer->Milliseconds))
+  {
+    return;
+  }
+
+  ExAcquireFastMutex(&Coalescer->Lock);
+
+  IMCloseWindows(Coalescer, KeQueryInterruptTime(), IsAll, Closed);
+
+  ExReleaseFastMutex(&Coalescer->Lock);
+}
+
+ULONG
+IMCoalescerTimeout(
+    _In_ PIM_COALESCER Coalescer)
+{
+  ULONGLONG deadline = 0;
+  ULONGLONG now = 0;
+
+  PAGED_CODE();
+
+  if (0 == ReadNoFence(&Coalescer->Milliseconds))
+  {
+    return MAXULONG;
+  }
+
+  ExAcquireFastMutex(&Coalescer->Lock);
+
+  if (!IsListEmpty(&Coalescer->Expiry))
+  {
+    deadline = CONTAINING_RECORD(Coalescer->Expiry.Flink, IM_COALESCE_WINDOW, Expiry)->Deadline;
+  }
+
+  ExReleaseFastMutex(&Coalescer->Lock);
+
+  if (0 == deadline)
+  {
+    return MAXULONG;
+  }
+
+  now = KeQueryInterruptTime();
+
+  // rounded up, the window is due when the wait ends
+  return deadline > now ? (ULONG)((deadline - now + IM_COALESCE_TICKS_PER_MS - 1) / IM_COALESCE_TICKS_PER_MS) : 0;
+}
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+//
+// Ids of the names do not change while the record refers to them
+//
+static ULONG
+IMCoalesceHash(
+    _In_ PIM_KRECORD_LIST RecordList)
+{
+  ULONG hash = 0;
+
+  PAGED_CODE();
+
+  hash = RecordList->Names[IM_PROCESS_NAME_INDEX]->Id * IM_COALESCE_HASH_PRIME;
+  hash ^= RecordList->Names[IM_FILE_NAME_INDEX]->Id;
+  hash *= IM_COALESCE_HASH_PRIME;
+
+  return hash ^ (hash >> 16);
+}
+
+static BOOLEAN
+IMWindowEquals(
+    _In_ PIM_COALESCE_WINDOW Window,
+    _In_ ULONG Hash,
+    _In_ PIM_KRECORD_LIST RecordList)
+{
+  PAGED_CODE();
+
+  return Window->Hash == Hash &&
+         Window->Names[IM_PROCESS_NAME_INDEX] == RecordList->Names[IM_PROCESS_NAME_INDEX] &&
+         Window->Names[IM_FILE_NAME_INDEX] == RecordList->Names[IM_FILE_NAME_INDEX] &&
+         Window->IsBlocked == RecordList->Record.IsBlocked &&
+         Window->IsSucceded == RecordList->Record.IsSucceded &&
+         Window->VideoModeStatus == RecordList->Record.VideoModeStatus;
+}
+
+//
+// Windows are taken from the head of the expiry list while they are due,
+// their records go to Closed. Called under the lock.
+//
+static VOID IMCloseWindows(
+    _Inout_ PIM_COALESCER Coalescer,
+    _In_ ULONGLONG Now,
+    _In_ BOOLEAN IsAll,
+    _Inout_ PLIST_ENTRY Closed)
+{
+  PIM_COALESCE_WINDOW window = NULL;
+  ULONG i = 0;
+
+  PAGED_CODE();
+
+  while (!IsListEmpty(&Coalescer->Expiry))
+  {
+    window = CONTAINING_RECORD(Coalescer->Expiry.Flink, IM_COALESCE_WINDOW, Expiry);
+
+    // the ones behind it are not due either
+    if (!IsAll && window->Deadline > Now)
+    {
+      break;
+    }
+
+    RemoveEntryList(&window->Expiry);
+    RemoveEntryList(&window->Link);
+
+    if (NULL != window->Record)
+    {
+      InsertTailList(Closed, &window->Record->List);
+      window->Record = NULL;
+    }
+
+    for (i = 0; i < IM_AMOUNT_OF_DATA; i++)
+    {
+      IMNameTableRelease(window->Names[i]);
+      window->Names[i] = NULL;
+    }
+
+    InsertTailList(&Coalescer->FreeWindows, &window->Link);
+  }
+}
@@ -0,0 +1,92 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_coal.h
+
+Abstract:
+
+Coalescing of identical records. A game that fails to load a blocked
+binary retries it in a loop, every retry is a record with the same
+process, file and verdict. The first record of such a burst goes to the
+client as it is, the next ones within the window are counted into one
+record which goes when the window closes.
+
+Windows are of the same length and opened in order of time, so they
+close in the order they were opened: the list in that order is the timer
+queue, closing the due ones takes the head while it is due. Nothing runs
+on its own, windows are closed by the next record and by the client
+asking for records, see IMCoalescerTimeout.
+
+Environment:
+
+Kernel mode
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im.h"
+
+//------------------------------------------------------------------------
+//  Function prototypes.
+//------------------------------------------------------------------------
+
+VOID IMCoalescerInit(
+    _Out_ PIM_COALESCER Coalescer);
+
+//
+// Frees the records of open windows, they are not pushed anymore
+//
+VOID IMCoalescerDeinit(
+    _Inout_ PIM_COALESCER Coalescer);
+
+//
+// Window of Milliseconds, up to IM_MAX_COALESCE_WINDOW, 0 turns it off.
+// Open windows are closed, their records are put to Closed.
+//
+_IRQL_requires_max_(APC_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMCoalescerSetWindow(
+        _Inout_ PIM_COALESCER Coalescer,
+        _In_ ULONG Milliseconds,
+        _Out_ PLIST_ENTRY Closed);
+
+//
+// Returns TRUE if the record was coalesced, it is not the caller's then.
+// FALSE if it goes to the client now, it may have opened a window. Due
+// windows are closed first, their records are put to Closed by their
+// List, older ones first, and go to the client before this one.
+//
+_IRQL_requires_max_(APC_LEVEL)
+BOOLEAN
+IMCoalesceRecord(
+    _Inout_ PIM_COALESCER Coalescer,
+    _In_ PIM_KRECORD_LIST RecordList,
+    _Out_ PLIST_ENTRY Closed);
+
+//
+// Closes the due windows, or every one of them if IsAll
+//
+_IRQL_requires_max_(APC_LEVEL)
+VOID IMCoalescerClose(
+    _Inout_ PIM_COALESCER Coalescer,
+    _In_ BOOLEAN IsAll,
+    _Out_ PLIST_ENTRY Closed);
+
+//
+// Milliseconds until the oldest open window is due, MAXULONG if there is
+// none. Whoever waits for records does not wait longer.
+//
+ULONG
+IMCoalescerTimeout(
+    _In_ PIM_COALESCER Coalescer);
@@ -23,6 +23,11 @@ Kernel mode
 //------------------------------------------------------------------------
 
 #include "im_comm.h"
+#include "im_list.h"
+#include "im_shm.h"
+#include "im_ntab.h"
+#include "im_rec.h"
+#include "im_coal.h"
 
 //------------------------------------------------------------------------
 //  Local functions definitions.
@@ -52,17 +57,16 @@ LONG IMExceptionFilter(
     _In_ PEXCEPTION_POINTERS ExceptionPointer,
     _In_ BOOLEAN AccessingUserBuffer);
 
-//
-// Message functions
-//
-_IRQL_requires_(PASSIVE_LEVEL)
-    _Check_return_
-    NTSTATUS
-    IMGetRecords(
-        _In_ PIM_KLIST_HEAD RecordsHead,
-        _Out_ PVOID OutputBuffer,
-        _In_ ULONG OutputBufferSize,
-        _Out_ PULONG ReturnOutputBufferLength);
+NTSTATUS
+IMReplyMapping(
+    _Out_writes_bytes_(sizeof(IM_SHARED_RECORDS_MAPPING)) PVOID OutputBuffer,
+    _In_ PVOID UserAddress,
+    _Out_ PULONG ReturnOutputBufferLength);
+
+NTSTATUS
+IMReplyStatistics(
+    _Out_writes_bytes_(sizeof(IM_RECORDS_STATISTICS)) PVOID OutputBuffer,
+    _Out_ PULONG ReturnOutputBufferLength);
 
 //------------------------------------------------------------------------
 //  Text sections.
@@ -77,6 +81,8 @@ _IRQL_requires_(PASSIVE_LEVEL)
 #pragma alloc_text(PAGE, IMDisconnect)
 #pragma alloc_text(PAGE, IMMessage)
 #pragma alloc_text(PAGE, IMExceptionFilter)
+#pragma alloc_text(PAGE, IMReplyMapping)
+#pragma alloc_text(PAGE, IMReplyStatistics)
 
 #endif // ALLOC_PRAGMA
 
@@ -173,6 +179,12 @@ IMConnect(
   FLT_ASSERT(Globals.ClientPort == NULL);
   Globals.ClientPort = ClientPort;
 
+  //
+  //  Names are sent again with the first records of the new client
+  //
+
+  IMNameTableNewClient(&Globals.Names);
+
   LOG(("[IM] Client connected\n"));
 
   return STATUS_SUCCESS;
@@ -181,6 +193,8 @@ IMConnect(
 VOID IMDisconnect(
     _In_opt_ PVOID ConnectionCookie)
 {
+  IM_OVERFLOW overflow;
+
   PAGED_CODE();
 
   UNREFERENCED_PARAMETER(ConnectionCookie);
@@ -188,6 +202,33 @@ VOID IMDisconnect(
   FLT_ASSERT(Globals.Filter != NULL);
   FLT_ASSERT(Globals.ClientPort != NULL);
 
+  //
+  //  Take the shared ring back while still in the client context
+  //
+
+  IMUnmapSharedRecords(&Globals.SharedRecords);
+
+  //
+  //  Let the client waiting for records go
+  //
+
+  KeSetEvent(Globals.RecordsHead.NewElementEvent, IO_NO_INCREMENT, FALSE);
+
+  //
+  //  Records of the open coalescing windows are queued for the next
+  //  client, the next ones are not coalesced
+  //
+
+  (VOID) IMSetCoalesceWindow(0);
+
+  //
+  //  Nobody drains the queue now, producers do not wait for room
+  //
+
+  overflow.Policy = IMOverflowDropNewest;
+  overflow.Milliseconds = IM_OVERFLOW_WAIT;
+  (VOID) IMSetOverflow(&overflow);
+
   //
   //  Close our handle
   //
@@ -208,6 +249,12 @@ IMMessage(
 {
   IM_INTERFACE_COMMAND command;
   NTSTATUS status;
+  PVOID userAddress = NULL;
+  IM_GET_RECORDS get;
+  IM_WAIT_RECORDS wait;
+  IM_OVERFLOW overflow;
+  IM_RECORDS_BUDGET budget;
+  IM_COALESCE coalesce;
 
   PAGED_CODE();
 
@@ -234,6 +281,19 @@ IMMessage(
                            sizeof(IM_INTERFACE_COMMAND))))
   {
 
+    RtlZeroMemory(&get, sizeof(get));
+    wait.LowWatermark = 1;
+    wait.Milliseconds = IM_RECORDS_WAIT;
+
+    // no policy without the input
+    overflow.Policy = IMOverflowPolicies;
+    overflow.Milliseconds = IM_OVERFLOW_WAIT;
+
+    // nor budget, nor window
+    RtlZeroMemory(&budget, sizeof(budget));
+    coalesce.Milliseconds = MAXULONG;
+    coalesce.Reserved = 0;
+
     __try
     {
 
@@ -243,6 +303,36 @@ IMMessage(
       //
 
       command = ((PIM_COMMAND_MESSAGE)InputBuffer)->Command;
+
+      if (GetRecordsCommand == command &&
+          InputBufferSize >= FIELD_OFFSET(IM_COMMAND_MESSAGE, Data) + sizeof(IM_GET_RECORDS))
+      {
+        RtlCopyMemory(&get, ((PIM_COMMAND_MESSAGE)InputBuffer)->Data, sizeof(IM_GET_RECORDS));
+      }
+
+      if (WaitRecordsCommand == command &&
+          InputBufferSize >= FIELD_OFFSET(IM_COMMAND_MESSAGE, Data) + sizeof(IM_WAIT_RECORDS))
+      {
+        RtlCopyMemory(&wait, ((PIM_COMMAND_MESSAGE)InputBuffer)->Data, sizeof(IM_WAIT_RECORDS));
+      }
+
+      if (SetOverflowCommand == command &&
+          InputBufferSize >= FIELD_OFFSET(IM_COMMAND_MESSAGE, Data) + sizeof(IM_OVERFLOW))
+      {
+        RtlCopyMemory(&overflow, ((PIM_COMMAND_MESSAGE)InputBuffer)->Data, sizeof(IM_OVERFLOW));
+      }
+
+      if (SetBudgetCommand == command &&
+          InputBufferSize >= FIELD_OFFSET(IM_COMMAND_MESSAGE, Data) + sizeof(IM_RECORDS_BUDGET))
+      {
+        RtlCopyMemory(&budget, ((PIM_COMMAND_MESSAGE)InputBuffer)->Data, sizeof(IM_RECORDS_BUDGET));
+      }
+
+      if (SetCoalesceCommand == command &&
+          InputBufferSize >= FIELD_OFFSET(IM_COMMAND_MESSAGE, Data) + sizeof(IM_COALESCE))
+      {
+        RtlCopyMemory(&coalesce, ((PIM_COMMAND_MESSAGE)InputBuffer)->Data, sizeof(IM_COALESCE));
+      }
     }
     __except (IMExceptionFilter(GetExceptionInformation(), TRUE))
     {
@@ -267,59 +357,135 @@ IMMessage(
       }
 
       //
-      //  We want to validate that the given buffer is POINTER
-      //  aligned.  But if this is a 64bit system and we want to
-      //  support 32bit applications we need to be careful with how
-      //  we do the check.  Note that the way SpyGetLog is written
-      //  it actually does not care about alignment but we are
-      //  demonstrating how to do this type of check.
+      //  Records are written byte by byte in the wire format, so the
+      //  buffer of a 32 or 64 bit client needs no alignment
       //
 
-#if defined(_WIN64)
+      //
+      //  Records of the due coalescing windows go with this drain
+      //
 
-      if (IoIs32bitProcess(NULL))
+      IMCloseCoalescedRecords(FALSE);
+
+      //
+      //  Get the log record.
+      //
+
+      status = IMGetRecords(
+          &Globals.RecordsHead,
+          get.Flags,
+          OutputBuffer,
+          OutputBufferSize,
+          ReturnOutputBufferLength);
+    }
+    else if (command == MapRecordsCommand)
+    {
+      //
+      //  Records are written to the ring from now on, the port only
+      //  carries the doorbell
+      //
+
+      if ((OutputBuffer == NULL) || (OutputBufferSize < sizeof(IM_SHARED_RECORDS_MAPPING)))
       {
+        status = STATUS_BUFFER_TOO_SMALL;
+        LOG_B(("[IM] message processed with STATUS_BUFFER_TOO_SMALL\n"));
+        return status;
+      }
 
-        //
-        //  Validate alignment for the 32bit process on a 64bit
-        //  system
-        //
+      status = IMMapSharedRecords(&Globals.SharedRecords, IM_SHARED_RECORDS_SIZE, &userAddress);
 
-        if (!IS_ALIGNED(OutputBuffer, sizeof(ULONG)))
-        {
+      if (NT_SUCCESS(status))
+      {
+        status = IMReplyMapping(OutputBuffer, userAddress, ReturnOutputBufferLength);
+      }
 
-          status = STATUS_DATATYPE_MISALIGNMENT;
-          LOG_B(("[IM] message processed with STATUS_DATATYPE_MISALIGNMENT\n"));
-          return status;
-        }
+      if (NT_SUCCESS(status))
+      {
+        IMMoveRecordsToShared(&Globals.RecordsHead, &Globals.SharedRecords);
       }
-      else
+      else if (NULL != userAddress)
       {
+        IMUnmapSharedRecords(&Globals.SharedRecords);
+      }
+    }
+    else if (command == WaitRecordsCommand)
+    {
+      //
+      //  Client sleeps here instead of polling GetRecordsCommand, the
+      //  wait is bounded so the port can always be closed
+      //
+
+      *ReturnOutputBufferLength = 0;
+
+      wait.Milliseconds = min(wait.Milliseconds, IM_RECORDS_MAX_WAIT);
 
-#endif
+      //
+      //  Nothing closes coalescing windows while the client sleeps, so it
+      //  does not sleep past the oldest one. Its record is pushed here if
+      //  the client maps the ring, or with the next GetRecordsCommand.
+      //
+
+      IMCloseCoalescedRecords(FALSE);
+
+      wait.Milliseconds = min(wait.Milliseconds, IMCoalescerTimeout(&Globals.Coalescer));
+
+      //
+      //  Records lost since the last one are reported before the client
+      //  sleeps
+      //
 
-        if (!IS_ALIGNED(OutputBuffer, sizeof(PVOID)))
-        {
+      IMWriteSharedLost(&Globals.SharedRecords);
 
-          status = STATUS_DATATYPE_MISALIGNMENT;
-          LOG_B(("[IM] message processed with STATUS_DATATYPE_MISALIGNMENT\n"));
-          return status;
-        }
+      status = IMWaitSharedRecords(&Globals.SharedRecords, wait.Milliseconds);
 
-#if defined(_WIN64)
+      if (STATUS_DEVICE_NOT_CONNECTED == status)
+      {
+        status = IMWaitForElements(&Globals.RecordsHead, (LONG)min(wait.LowWatermark, MAXLONG), wait.Milliseconds);
       }
 
-#endif
+      IMCloseCoalescedRecords(FALSE);
+    }
+    else if (command == SetOverflowCommand)
+    {
+      //
+      //  What is done with records while the queue is full
+      //
+
+      *ReturnOutputBufferLength = 0;
+
+      status = IMSetOverflow(&overflow);
+    }
+    else if (command == GetStatisticsCommand)
+    {
+      if ((OutputBuffer == NULL) || (OutputBufferSize < sizeof(IM_RECORDS_STATISTICS)))
+      {
+        status = STATUS_BUFFER_TOO_SMALL;
+        LOG_B(("[IM] message processed with STATUS_BUFFER_TOO_SMALL\n"));
+        return status;
+      }
 
+      status = IMReplyStatistics(OutputBuffer, ReturnOutputBufferLength);
+    }
+    else if (command == SetBudgetCommand)
+    {
       //
-      //  Get the log record.
+      //  Queue is resized, records in it are kept
       //
 
-      status = IMGetRecords(
-          &Globals.RecordsHead,
-          OutputBuffer,
-          OutputBufferSize,
-          ReturnOutputBufferLength);
+      *ReturnOutputBufferLength = 0;
+
+      status = IMSetRecordsBudget(budget.Bytes);
+    }
+    else if (command == SetCoalesceCommand)
+    {
+      //
+      //  Records of the open windows are pushed, the new ones are
+      //  coalesced within the new window
+      //
+
+      *ReturnOutputBufferLength = 0;
+
+      status = IMSetCoalesceWindow(coalesce.Milliseconds);
     }
     else
     {
@@ -365,102 +531,53 @@ LONG IMExceptionFilter(
   return EXCEPTION_EXECUTE_HANDLER;
 }
 
-//
-// Message functions
-//
-
-_IRQL_requires_(PASSIVE_LEVEL)
-    _Check_return_
-    NTSTATUS
-    IMGetRecords(
-        _In_ PIM_KLIST_HEAD RecordsHead,
-        _Out_ PVOID OutputBuffer,
-        _In_ ULONG OutputBufferSize,
-        _Out_ PULONG ReturnOutputBufferLength)
+NTSTATUS
+IMReplyMapping(
+    _Out_writes_bytes_(sizeof(IM_SHARED_RECORDS_MAPPING)) PVOID OutputBuffer,
+    _In_ PVOID UserAddress,
+    _Out_ PULONG ReturnOutputBufferLength)
 {
-  PLIST_ENTRY currentEntry;
-  KIRQL oldIrql;
-  PCHAR buffer = OutputBuffer;
-  PIM_KRECORD_LIST recordList;
-  ULONG copiedLen = 0;
-
-  PKSPIN_LOCK listLock = &RecordsHead->ElementListLock;
-  PLIST_ENTRY listEntry = &RecordsHead->ElementList;
-  ULONG sizeOfRecord = RecordsHead->ElementStructSize;
-
-  IF_FALSE_RETURN_RESULT(RecordsHead != NULL, STATUS_INVALID_PARAMETER_1);
-  IF_FALSE_RETURN_RESULT(OutputBuffer != NULL, STATUS_INVALID_PARAMETER_2);
-  IF_FALSE_RETURN_RESULT(OutputBufferSize != 0, STATUS_INVALID_PARAMETER_3);
-  IF_FALSE_RETURN_RESULT(ReturnOutputBufferLength != NULL, STATUS_INVALID_PARAMETER_4);
-  IF_FALSE_RETURN_RESULT(KeGetCurrentIrql() == PASSIVE_LEVEL, STATUS_INVALID_LEVEL);
+  PIM_SHARED_RECORDS_MAPPING mapping = (PIM_SHARED_RECORDS_MAPPING)OutputBuffer;
 
-  //LOG(("[IM] Records copy start\n"));
-
-  KeAcquireSpinLock(listLock, &oldIrql);
+  PAGED_CODE();
 
-  while (!IsListEmpty(listEntry))
+  __try
   {
-    currentEntry = RemoveHeadList(listEntry);
-
-    KeReleaseSpinLock(listLock, oldIrql);
-
-    recordList = CONTAINING_RECORD(currentEntry, IM_KRECORD_LIST, List);
-
-    if ((ULONG)OutputBufferSize < copiedLen + recordList->Record.TotalLength)
-    {
-      //need to put last record back and break because of overflow
-      KeAcquireSpinLock(listLock, &oldIrql);
-      InsertHeadList(listEntry, currentEntry);
-      break;
-    }
-
-    copiedLen += recordList->Record.TotalLength;
+    mapping->Address = (ULONGLONG)(ULONG_PTR)UserAddress;
+    mapping->Size = IM_SHARED_RECORDS_SIZE;
+    mapping->Reserved = 0;
+  }
+  __except (IMExceptionFilter(GetExceptionInformation(), TRUE))
+  {
+    return GetExceptionCode();
+  }
 
-    // extract record itself and copy to buffer
+  *ReturnOutputBufferLength = sizeof(IM_SHARED_RECORDS_MAPPING);
 
-    __try
-    {
-      RtlCopyMemory(buffer, &recordList->Record, sizeOfRecord);
-      buffer += sizeOfRecord;
+  return STATUS_SUCCESS;
+}
 
-      for (ULONG i = 0; i < IM_AMOUNT_OF_DATA; i++)
-      {
-        if (recordList->Record.Data[i].Size == 0)
-          continue;
-        RtlCopyMemory(buffer, recordList->Record.Data[i].Buffer, recordList->Record.Data[i].Size);
-        buffer += recordList->Record.Data[i].Size;
-      }
-    }
-    __except (EXCEPTION_EXECUTE_HANDLER)
-    {
-      KeAcquireSpinLock(listLock, &oldIrql);
-      InsertHeadList(listEntry, currentEntry);
-      KeReleaseSpinLock(listLock, oldIrql);
-      ASSERT(FALSE);
-      return GetExceptionCode();
-    }
+NTSTATUS
+IMReplyStatistics(
+    _Out_writes_bytes_(sizeof(IM_RECORDS_STATISTICS)) PVOID OutputBuffer,
+    _Out_ PULONG ReturnOutputBufferLength)
+{
+  IM_RECORDS_STATISTICS statistics;
 
-    IMFreeRecord(recordList);
+  PAGED_CODE();
 
-    InterlockedDecrement64(&RecordsHead->ElementsPushed);
-    FLT_ASSERT(RecordsHead->ElementsPushed >= 0);
+  IMGetStatistics(&statistics);
 
-    KeAcquireSpinLock(listLock, &oldIrql);
+  __try
+  {
+    RtlCopyMemory(OutputBuffer, &statistics, sizeof(IM_RECORDS_STATISTICS));
   }
-
-  KeReleaseSpinLock(listLock, oldIrql);
-
-  // if at least one record was copied, return success
-  if (copiedLen > 0)
+  __except (IMExceptionFilter(GetExceptionInformation(), TRUE))
   {
-    LOG(("[IM] Copied bytes to user space = %d\n", copiedLen));
-
-    *ReturnOutputBufferLength = copiedLen;
-
-    return STATUS_SUCCESS;
+    return GetExceptionCode();
   }
 
-  //LOG(("[IM] No records were copied\n"));
+  *ReturnOutputBufferLength = sizeof(IM_RECORDS_STATISTICS);
 
-  return STATUS_NO_MORE_ENTRIES;
-}
\ No newline at end of file
+  return STATUS_SUCCESS;
+}
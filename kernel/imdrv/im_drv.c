@@ -28,24 +28,15 @@ Kernel mode
 #include "im_list.h"
 #include "im_rec.h"
 #include "im_proc.h"
+#include "im_vcache.h"
+#include "im_glob.h"
 
-//------------------------------------------------------------------------
-//  Defines.
-//------------------------------------------------------------------------
-
-#define IM_DEFAULT_MAX_RECORDS 100
-
-//------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 //  Local function prototypes.
-//------------------------------------------------------------------------
-
-static _Check_return_
-    NTSTATUS
-    IMInitializeGlobals(
-        _In_ PDRIVER_OBJECT DriverObject);
+//---------------------------------------------------------------------------
 
-static VOID
-IMDeinitializeGlobals();
+static ULONG IMReadRecordsBudget(
+    _In_ PUNICODE_STRING RegistryPath);
 
 //---------------------------------------------------------------------------
 //  Assign text sections for each routine.
@@ -54,20 +45,12 @@ IMDeinitializeGlobals();
 #ifdef ALLOC_PRAGMA
 // Functions that handle driver load/unload and instance setup/cleanup.
 #pragma alloc_text(INIT, DriverEntry)
+#pragma alloc_text(INIT, IMReadRecordsBudget)
 #pragma alloc_text(PAGE, DriverUnload)
 #pragma alloc_text(PAGE, IMInstanceQueryTeardown)
-
-// local funcstions
-#pragma alloc_text(PAGE, IMInitializeGlobals)
-#pragma alloc_text(PAGE, IMDeinitializeGlobals)
+#pragma alloc_text(PAGE, IMInstanceTeardownComplete)
 #endif
 
-//
-//  Global variable
-//
-
-IM_GLOBALS Globals;
-
 //---------------------------------------------------------------------------
 //  Main driver routines
 //---------------------------------------------------------------------------
@@ -97,8 +80,7 @@ Status of the operation.
 --*/
 {
   NTSTATUS status = STATUS_SUCCESS;
-
-  UNREFERENCED_PARAMETER(RegistryPath);
+  ULONG budget = 0;
 
   FLT_ASSERT(DriverObject != NULL);
 
@@ -111,6 +93,17 @@ Status of the operation.
     //
     NT_IF_FAIL_LEAVE(IMInitializeGlobals(DriverObject));
 
+    //
+    // Budget of the queued records, the default one stays if there is
+    // none or it is out of range
+    //
+    budget = IMReadRecordsBudget(RegistryPath);
+
+    if (0 != budget && !NT_SUCCESS(IMSetRecordsBudget(budget)))
+    {
+      LOG_B(("[IM] RecordsBudget %u is ignored\n", budget));
+    }
+
     //
     //  Now that our global configuration is complete, register with FltMgr.
     //
@@ -186,9 +179,6 @@ Always success
 {
   UNREFERENCED_PARAMETER(Flags);
 
-  ULONG i = 0;
-  PIM_PROCESS_INFO target = NULL;
-
   PAGED_CODE();
 
   LOG(("[IM] Driver unloading\n"));
@@ -206,24 +196,14 @@ Always success
   //
   // Delete registered process
   //
-  for (; i < IM_AMOUNT_OF_TARGET_PROCESSES; i++)
-  {
-    target = &Globals.TargetProcessInfo[i];
-    if (target->isActive)
-    {
-      IMReleaseNameInformation(target->NameInfo);
-      target->isActive = FALSE;
-      target->isDuplicate = FALSE;
-      target->ProcessId = NULL;
-    }
-  }
+  IMReleaseTargetProcesses();
 
   if (NULL != Globals.Filter)
   {
     FltUnregisterFilter(Globals.Filter);
   }
 
-  IMFreeList(&Globals.RecordsHead.ElementListLock, &Globals.RecordsHead.ElementList, Globals.RecordsHead.ElementFreeCallback);
+  IMFreeList(&Globals.RecordsHead);
 
   IMDeinitializeGlobals();
 
@@ -244,67 +224,52 @@ IMInstanceQueryTeardown(
   return STATUS_SUCCESS;
 }
 
-//
-// -----------------------------------------------
-//
-
-static _Check_return_
-    NTSTATUS
-    IMInitializeGlobals(
-        _In_ PDRIVER_OBJECT DriverObject)
+VOID
+FLTAPI
+IMInstanceTeardownComplete(
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ FLT_INSTANCE_TEARDOWN_FLAGS Reason)
 {
-  NTSTATUS status = STATUS_SUCCESS;
-
+  UNREFERENCED_PARAMETER(FltObjects);
+  UNREFERENCED_PARAMETER(Reason);
   PAGED_CODE();
 
-  IF_TRUE_RETURN_RESULT(DriverObject == NULL, STATUS_INVALID_PARAMETER);
+  // cached verdicts are keyed by the volume, which may go with the instance
+  IMInvalidateVerdicts();
+}
 
-  LOG(("[IM] Globals initializing\n"));
+//---------------------------------------------------------------------------
+//  Local functions
+//---------------------------------------------------------------------------
 
-  UNICODE_STRING strHl = CONSTANT_STRING(IM_HL_PROCESS_NAME);
-  UNICODE_STRING strCs = CONSTANT_STRING(IM_CS_PROCESS_NAME);
+//
+// RecordsBudget of the Parameters key of the service, 0 if it is not there
+//
+static ULONG IMReadRecordsBudget(
+    _In_ PUNICODE_STRING RegistryPath)
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  RTL_QUERY_REGISTRY_TABLE query[3];
+  ULONG budget = 0;
 
-  RtlZeroMemory(&Globals, sizeof(IM_GLOBALS));
+  RtlZeroMemory(query, sizeof(query));
 
-  Globals.DriverObject = DriverObject;
+  query[0].Flags = RTL_QUERY_REGISTRY_SUBKEY;
+  query[0].Name = L"Parameters";
 
-  __try
-  {
-    NT_IF_FAIL_LEAVE(IMInitList(&Globals.RecordsHead, sizeof(IM_KRECORD), IM_DEFAULT_MAX_RECORDS, IMFreeRecordList));
+  query[1].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+  query[1].Name = L"RecordsBudget";
+  query[1].EntryContext = &budget;
+  query[1].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE;
 
-    NT_IF_FAIL_LEAVE(IMCopyUnicodeString(&Globals.TargetProcessInfo[IM_HL_PROCESS_INFO_INDEX].TargetName, &strHl));
-    NT_IF_FAIL_LEAVE(IMCopyUnicodeString(&Globals.TargetProcessInfo[IM_CS_PROCESS_INFO_INDEX].TargetName, &strCs));
-    
+  // path given to DriverEntry is terminated
+  status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE | RTL_REGISTRY_OPTIONAL, RegistryPath->Buffer, query, NULL, NULL);
 
-  }
-  __finally
+  if (!NT_SUCCESS(status))
   {
-    if (NT_ERROR(status))
-    {
-      LOG_B(("[IM] Globals initialization error\n"));
-
-      IMDeinitializeGlobals();
-    }
-    else
-    {
-      LOG(("[IM] Globals initialized\n"));
-    }
+    LOG(("[IM] No parameters 0x%x\n", status));
+    return 0;
   }
 
-  return status;
+  return budget;
 }
-
-static VOID
-IMDeinitializeGlobals()
-{
-  PAGED_CODE();
-
-  LOG(("[IM] Globals deinitializing\n"));
-
-  ExFreePool(Globals.TargetProcessInfo[IM_HL_PROCESS_INFO_INDEX].TargetName.Buffer);
-  ExFreePool(Globals.TargetProcessInfo[IM_CS_PROCESS_INFO_INDEX].TargetName.Buffer);
-
-  IMDeinitList(&Globals.RecordsHead);
-
-  LOG(("[IM] Globals deinitialized\n"));
-}
\ No newline at end of file
@@ -56,4 +56,10 @@ NTSTATUS
 FLTAPI
 IMInstanceQueryTeardown(
     _In_ PCFLT_RELATED_OBJECTS FltObjects,
-    _In_ FLT_INSTANCE_QUERY_TEARDOWN_FLAGS Flags);
\ No newline at end of file
+    _In_ FLT_INSTANCE_QUERY_TEARDOWN_FLAGS Flags);
+
+VOID
+FLTAPI
+IMInstanceTeardownComplete(
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ FLT_INSTANCE_TEARDOWN_FLAGS Reason);
\ No newline at end of file
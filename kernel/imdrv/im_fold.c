@@ -0,0 +1,447 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_fold.c
+
+Abstract:
+Scalar, SSE2 and AVX2 case insensitive UTF-16 routines
+
+Environment:
+
+Kernel mode
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_fold.h"
+#include "im_utils.h"
+
+//
+// x86 kernel has to save the floating point state even for SSE2, so only
+// x64 gets vector routines
+//
+#if defined(_M_X64) || defined(__x86_64__)
+#define IM_FOLD_X64
+#include <immintrin.h>
+#endif
+
+//------------------------------------------------------------------------
+//  Defines.
+//------------------------------------------------------------------------
+
+// not defined by the older SDKs, older systems just report FALSE
+#ifndef PF_AVX2_INSTRUCTIONS_AVAILABLE
+#define PF_AVX2_INSTRUCTIONS_AVAILABLE 40
+#endif
+
+#if defined(__GNUC__)
+#define IM_FOLD_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define IM_FOLD_TARGET_AVX2
+#endif
+
+//
+// saving of the AVX state costs more than it gains on short strings
+//
+#define IM_FOLD_AVX2_MIN_COUNT 64
+
+//------------------------------------------------------------------------
+//  Callback definitions.
+//------------------------------------------------------------------------
+
+typedef BOOLEAN (*IM_FOLD_EQUAL_ROUTINE)(PCWCH A, PCWCH B, ULONG Count);
+
+typedef LONG (*IM_FOLD_FIND_ROUTINE)(PCWCH String, ULONG Count, PCWCH SubString, ULONG SubCount);
+
+//------------------------------------------------------------------------
+//  Local function prototypes.
+//------------------------------------------------------------------------
+
+static BOOLEAN
+IMFoldEqualScalar(
+    _In_reads_(Count) PCWCH A,
+    _In_reads_(Count) PCWCH B,
+    _In_ ULONG Count);
+
+static LONG
+IMFoldFindScalar(
+    _In_reads_(Count) PCWCH String,
+    _In_ ULONG Count,
+    _In_reads_(SubCount) PCWCH SubString,
+    _In_ ULONG SubCount);
+
+//------------------------------------------------------------------------
+//  Local globals.
+//------------------------------------------------------------------------
+
+static IM_FOLD_EQUAL_ROUTINE IMFoldEqualRoutine = IMFoldEqualScalar;
+static IM_FOLD_FIND_ROUTINE IMFoldFindRoutine = IMFoldFindScalar;
+
+//------------------------------------------------------------------------
+//  Scalar routines.
+//------------------------------------------------------------------------
+
+static BOOLEAN
+IMFoldEqualScalar(
+    _In_reads_(Count) PCWCH A,
+    _In_reads_(Count) PCWCH B,
+    _In_ ULONG Count)
+{
+  ULONG i = 0;
+
+  for (; i < Count; i++)
+  {
+    if (IM_FOLD_WCHAR(A[i]) != IM_FOLD_WCHAR(B[i]))
+    {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static LONG
+IMFoldFindScalar(
+    _In_reads_(Count) PCWCH String,
+    _In_ ULONG Count,
+    _In_reads_(SubCount) PCWCH SubString,
+    _In_ ULONG SubCount)
+{
+  WCHAR first = IM_FOLD_WCHAR(SubString[0]);
+  ULONG i = 0;
+
+  for (; i + SubCount <= Count; i++)
+  {
+    if (IM_FOLD_WCHAR(String[i]) == first && IMFoldEqualScalar(String + i + 1, SubString + 1, SubCount - 1))
+    {
+      return (LONG)i;
+    }
+  }
+
+  return -1;
+}
+
+#ifdef IM_FOLD_X64
+
+//------------------------------------------------------------------------
+//  Vector helpers.
+//------------------------------------------------------------------------
+
+static __inline ULONG
+IMFoldLowestBit(
+    _In_ ULONG Mask)
+{
+#if defined(_MSC_VER)
+  unsigned long index = 0;
+
+  _BitScanForward(&index, Mask);
+
+  return index;
+#else
+  return (ULONG)__builtin_ctz(Mask);
+#endif
+}
+
+//
+// Symbols above 0x7fff are negative for the signed compare, so they are
+// out of the 'A'..'Z' range as they have to be
+//
+static __inline __m128i
+IMFold128(
+    _In_ __m128i Value)
+{
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi16(Value, _mm_set1_epi16(L'A' - 1)), _mm_cmplt_epi16(Value, _mm_set1_epi16(L'Z' + 1)));
+
+  return _mm_or_si128(Value, _mm_and_si128(upper, _mm_set1_epi16(L'a' - L'A')));
+}
+
+IM_FOLD_TARGET_AVX2
+static __inline __m256i
+IMFold256(
+    _In_ __m256i Value)
+{
+  __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi16(Value, _mm256_set1_epi16(L'A' - 1)), _mm256_cmpgt_epi16(_mm256_set1_epi16(L'Z' + 1), Value));
+
+  return _mm256_or_si256(Value, _mm256_and_si256(upper, _mm256_set1_epi16(L'a' - L'A')));
+}
+
+//------------------------------------------------------------------------
+//  SSE2 routines.
+//------------------------------------------------------------------------
+
+static BOOLEAN
+IMFoldEqualSse2(
+    _In_reads_(Count) PCWCH A,
+    _In_reads_(Count) PCWCH B,
+    _In_ ULONG Count)
+{
+  __m128i a;
+  __m128i b;
+  ULONG i = 0;
+
+  for (; i + 8 <= Count; i += 8)
+  {
+    a = _mm_loadu_si128((const __m128i *)(A + i));
+    b = _mm_loadu_si128((const __m128i *)(B + i));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(IMFold128(a), IMFold128(b))) != 0xFFFF)
+    {
+      return FALSE;
+    }
+  }
+
+  return IMFoldEqualScalar(A + i, B + i, Count - i);
+}
+
+//
+// Candidates are positions where both the first and the last symbol of the
+// substring match, only they are compared completely
+//
+static LONG
+IMFoldFindSse2(
+    _In_reads_(Count) PCWCH String,
+    _In_ ULONG Count,
+    _In_reads_(SubCount) PCWCH SubString,
+    _In_ ULONG SubCount)
+{
+  __m128i first = _mm_set1_epi16((SHORT)IM_FOLD_WCHAR(SubString[0]));
+  __m128i last = _mm_set1_epi16((SHORT)IM_FOLD_WCHAR(SubString[SubCount - 1]));
+  ULONG middle = SubCount > 2 ? SubCount - 2 : 0;
+  LONG found = -1;
+  ULONG mask = 0;
+  ULONG lane = 0;
+  ULONG i = 0;
+
+  for (; i + SubCount - 1 + 8 <= Count; i += 8)
+  {
+    mask = (ULONG)_mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi16(IMFold128(_mm_loadu_si128((const __m128i *)(String + i))), first),
+        _mm_cmpeq_epi16(IMFold128(_mm_loadu_si128((const __m128i *)(String + i + SubCount - 1))), last)));
+
+    while (mask != 0)
+    {
+      // two mask bits per symbol
+      lane = IMFoldLowestBit(mask) / 2;
+
+      if (IMFoldEqualSse2(String + i + lane + 1, SubString + 1, middle))
+      {
+        return (LONG)(i + lane);
+      }
+
+      mask &= ~(3u << (lane * 2));
+    }
+  }
+
+  // the rest is shorter than a vector
+  if (i + SubCount <= Count)
+  {
+    found = IMFoldFindScalar(String + i, Count - i, SubString, SubCount);
+  }
+
+  return found < 0 ? -1 : (LONG)i + found;
+}
+
+//------------------------------------------------------------------------
+//  AVX2 routines.
+//------------------------------------------------------------------------
+
+IM_FOLD_TARGET_AVX2
+static BOOLEAN
+IMFoldEqualAvx2Unsaved(
+    _In_reads_(Count) PCWCH A,
+    _In_reads_(Count) PCWCH B,
+    _In_ ULONG Count)
+{
+  __m256i a;
+  __m256i b;
+  ULONG i = 0;
+
+  for (; i + 16 <= Count; i += 16)
+  {
+    a = _mm256_loadu_si256((const __m256i *)(A + i));
+    b = _mm256_loadu_si256((const __m256i *)(B + i));
+
+    if ((ULONG)_mm256_movemask_epi8(_mm256_cmpeq_epi16(IMFold256(a), IMFold256(b))) != 0xFFFFFFFF)
+    {
+      return FALSE;
+    }
+  }
+
+  return IMFoldEqualScalar(A + i, B + i, Count - i);
+}
+
+IM_FOLD_TARGET_AVX2
+static LONG
+IMFoldFindAvx2Unsaved(
+    _In_reads_(Count) PCWCH String,
+    _In_ ULONG Count,
+    _In_reads_(SubCount) PCWCH SubString,
+    _In_ ULONG SubCount)
+{
+  __m256i first = _mm256_set1_epi16((SHORT)IM_FOLD_WCHAR(SubString[0]));
+  __m256i last = _mm256_set1_epi16((SHORT)IM_FOLD_WCHAR(SubString[SubCount - 1]));
+  ULONG middle = SubCount > 2 ? SubCount - 2 : 0;
+  LONG found = -1;
+  ULONG mask = 0;
+  ULONG lane = 0;
+  ULONG i = 0;
+
+  for (; i + SubCount - 1 + 16 <= Count; i += 16)
+  {
+    mask = (ULONG)_mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi16(IMFold256(_mm256_loadu_si256((const __m256i *)(String + i))), first),
+        _mm256_cmpeq_epi16(IMFold256(_mm256_loadu_si256((const __m256i *)(String + i + SubCount - 1))), last)));
+
+    while (mask != 0)
+    {
+      lane = IMFoldLowestBit(mask) / 2;
+
+      if (IMFoldEqualAvx2Unsaved(String + i + lane + 1, SubString + 1, middle))
+      {
+        return (LONG)(i + lane);
+      }
+
+      mask &= ~(3u << (lane * 2));
+    }
+  }
+
+  // the rest is shorter than a vector
+  if (i + SubCount <= Count)
+  {
+    found = IMFoldFindScalar(String + i, Count - i, SubString, SubCount);
+  }
+
+  return found < 0 ? -1 : (LONG)i + found;
+}
+
+//
+// Kernel code has to save the AVX state of the interrupted thread first
+//
+
+static BOOLEAN
+IMFoldEqualAvx2(
+    _In_reads_(Count) PCWCH A,
+    _In_reads_(Count) PCWCH B,
+    _In_ ULONG Count)
+{
+  XSTATE_SAVE save;
+  BOOLEAN result = FALSE;
+
+  if (Count < IM_FOLD_AVX2_MIN_COUNT || !NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_AVX, &save)))
+  {
+    return IMFoldEqualSse2(A, B, Count);
+  }
+
+  result = IMFoldEqualAvx2Unsaved(A, B, Count);
+
+  KeRestoreExtendedProcessorState(&save);
+
+  return result;
+}
+
+static LONG
+IMFoldFindAvx2(
+    _In_reads_(Count) PCWCH String,
+    _In_ ULONG Count,
+    _In_reads_(SubCount) PCWCH SubString,
+    _In_ ULONG SubCount)
+{
+  XSTATE_SAVE save;
+  LONG result = -1;
+
+  if (Count < IM_FOLD_AVX2_MIN_COUNT || !NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_AVX, &save)))
+  {
+    return IMFoldFindSse2(String, Count, SubString, SubCount);
+  }
+
+  result = IMFoldFindAvx2Unsaved(String, Count, SubString, SubCount);
+
+  KeRestoreExtendedProcessorState(&save);
+
+  return result;
+}
+
+#endif // IM_FOLD_X64
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+IM_FOLD_LEVEL
+IMSelectFoldRoutines(
+    _In_ IM_FOLD_LEVEL MaxLevel)
+{
+  IM_FOLD_LEVEL level = IM_FOLD_SCALAR;
+
+#ifdef IM_FOLD_X64
+  if (MaxLevel >= IM_FOLD_SSE2 && ExIsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE))
+  {
+    level = IM_FOLD_SSE2;
+  }
+
+  if (MaxLevel >= IM_FOLD_AVX2 && ExIsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE))
+  {
+    level = IM_FOLD_AVX2;
+  }
+#else
+  UNREFERENCED_PARAMETER(MaxLevel);
+#endif
+
+  switch (level)
+  {
+#ifdef IM_FOLD_X64
+  case IM_FOLD_AVX2:
+    IMFoldEqualRoutine = IMFoldEqualAvx2;
+    IMFoldFindRoutine = IMFoldFindAvx2;
+    break;
+  case IM_FOLD_SSE2:
+    IMFoldEqualRoutine = IMFoldEqualSse2;
+    IMFoldFindRoutine = IMFoldFindSse2;
+    break;
+#endif
+  default:
+    IMFoldEqualRoutine = IMFoldEqualScalar;
+    IMFoldFindRoutine = IMFoldFindScalar;
+    break;
+  }
+
+  LOG(("[IM] String routines level %d\n", level));
+
+  return level;
+}
+
+BOOLEAN
+IMFoldEqual(
+    _In_reads_(Count) PCWCH A,
+    _In_reads_(Count) PCWCH B,
+    _In_ ULONG Count)
+{
+  return IMFoldEqualRoutine(A, B, Count);
+}
+
+LONG IMFoldFind(
+    _In_reads_(Count) PCWCH String,
+    _In_ ULONG Count,
+    _In_reads_(SubCount) PCWCH SubString,
+    _In_ ULONG SubCount)
+{
+  if (0 == SubCount)
+  {
+    return 0;
+  }
+
+  if (SubCount > Count)
+  {
+    return -1;
+  }
+
+  return IMFoldFindRoutine(String, Count, SubString, SubCount);
+}
@@ -0,0 +1,70 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_fold.h
+
+Abstract:
+
+Case insensitive UTF-16 equality and substring search. Latin letters are
+folded the same way as IM_FOLD_WCHAR does, so every level returns the
+same results as the scalar one. SSE2 and AVX2 routines are selected at
+runtime by the processor features.
+
+Environment:
+
+Kernel mode
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+typedef enum _IM_FOLD_LEVEL
+{
+  IM_FOLD_SCALAR = 0,
+  IM_FOLD_SSE2,
+  IM_FOLD_AVX2
+
+} IM_FOLD_LEVEL,
+    *PIM_FOLD_LEVEL;
+
+//------------------------------------------------------------------------
+//  Function prototypes.
+//------------------------------------------------------------------------
+
+//
+// Selects the best routines supported by the processor up to MaxLevel.
+// Scalar routines are used until it is called.
+//
+IM_FOLD_LEVEL
+IMSelectFoldRoutines(
+    _In_ IM_FOLD_LEVEL MaxLevel);
+
+BOOLEAN
+IMFoldEqual(
+    _In_reads_(Count) PCWCH A,
+    _In_reads_(Count) PCWCH B,
+    _In_ ULONG Count);
+
+//
+// Returns index of the first occurrence of SubString or -1
+//
+LONG IMFoldFind(
+    _In_reads_(Count) PCWCH String,
+    _In_ ULONG Count,
+    _In_reads_(SubCount) PCWCH SubString,
+    _In_ ULONG SubCount);
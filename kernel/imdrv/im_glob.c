@@ -0,0 +1,140 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_glob.c
+
+Abstract:
+
+Initialization and deinitialization of the driver globals. Kept apart
+from im_drv.c so it has no FltMgr registration dependencies and can be
+built into im_core.
+
+Environment:
+
+Kernel mode
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_glob.h"
+#include "im_utils.h"
+#include "im_list.h"
+#include "im_rec.h"
+#include "im_ops.h"
+#include "im_match.h"
+#include "im_fold.h"
+#include "im_ptab.h"
+#include "im_shm.h"
+#include "im_ntab.h"
+#include "im_coal.h"
+
+//------------------------------------------------------------------------
+//  Text sections.
+//------------------------------------------------------------------------
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, IMInitializeGlobals)
+#pragma alloc_text(PAGE, IMDeinitializeGlobals)
+#endif // ALLOC_PRAGMA
+
+//
+//  Global variable
+//
+
+IM_GLOBALS Globals;
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+_Check_return_
+    NTSTATUS
+    IMInitializeGlobals(
+        _In_ PDRIVER_OBJECT DriverObject)
+{
+  NTSTATUS status = STATUS_SUCCESS;
+
+  PAGED_CODE();
+
+  IF_TRUE_RETURN_RESULT(DriverObject == NULL, STATUS_INVALID_PARAMETER);
+
+  LOG(("[IM] Globals initializing\n"));
+
+  RtlZeroMemory(&Globals, sizeof(IM_GLOBALS));
+
+  Globals.DriverObject = DriverObject;
+
+  // vector string routines if the processor has them
+  IMSelectFoldRoutines(IM_FOLD_AVX2);
+
+  IMProcessTableInit(&Globals.TargetProcesses);
+
+  IMInitSharedRecords(&Globals.SharedRecords);
+
+  // off until the client sets the window
+  IMCoalescerInit(&Globals.Coalescer);
+
+  // the new record is dropped until the client asks for another policy
+  Globals.Overflow.Policy = IMOverflowDropNewest;
+  Globals.Overflow.Milliseconds = IM_OVERFLOW_WAIT;
+
+  __try
+  {
+    NT_IF_FAIL_LEAVE(IMNameTableInit(&Globals.Names));
+
+    // records come from the lookaside of the list, the budget may be
+    // changed by the Parameters key and SetBudgetCommand
+    NT_IF_FAIL_LEAVE(IMInitList(&Globals.RecordsHead, sizeof(IM_KRECORD_LIST) - sizeof(LIST_ENTRY), IM_DEFAULT_RECORDS_BUDGET / sizeof(IM_KRECORD_LIST), IMFreeRecordList));
+    NT_IF_FAIL_LEAVE(IMSetRecordsBudget(IM_DEFAULT_RECORDS_BUDGET));
+
+    NT_IF_FAIL_LEAVE(IMCreateRestrictedFiles(&Globals.RestrictedFiles));
+  }
+  __finally
+  {
+    if (NT_ERROR(status))
+    {
+      LOG_B(("[IM] Globals initialization error\n"));
+
+      IMDeinitializeGlobals();
+    }
+    else
+    {
+      LOG(("[IM] Globals initialized\n"));
+    }
+  }
+
+  return status;
+}
+
+VOID IMDeinitializeGlobals()
+{
+  PAGED_CODE();
+
+  LOG(("[IM] Globals deinitializing\n"));
+
+  if (NULL != Globals.RestrictedFiles)
+  {
+    IMMatcherFree(Globals.RestrictedFiles);
+    Globals.RestrictedFiles = NULL;
+  }
+
+  IMUnmapSharedRecords(&Globals.SharedRecords);
+
+  // its records come from the lookaside of the list
+  IMCoalescerDeinit(&Globals.Coalescer);
+
+  IMDeinitList(&Globals.RecordsHead);
+
+  // after the list and the processes, they hold the names
+  IMNameTableDeinit(&Globals.Names);
+
+  LOG(("[IM] Globals deinitialized\n"));
+}
@@ -0,0 +1,38 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_glob.h
+
+Abstract:
+
+Initialization and deinitialization of the driver globals
+
+Environment:
+
+Kernel mode
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im.h"
+
+//------------------------------------------------------------------------
+//  Function prototypes.
+//------------------------------------------------------------------------
+
+_Check_return_
+    NTSTATUS
+    IMInitializeGlobals(
+        _In_ PDRIVER_OBJECT DriverObject);
+
+VOID IMDeinitializeGlobals();
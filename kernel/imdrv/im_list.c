@@ -25,15 +25,88 @@ Kernel mode
 #include "im_list.h"
 #include "im_utils.h"
 
+//------------------------------------------------------------------------
+//  Defines.
+//------------------------------------------------------------------------
+
+//
+// states of the lane lock
+//
+#define IM_KLANE_FREE 0
+#define IM_KLANE_BUSY 1
+#define IM_KLANE_RESIZING 2
+
+//------------------------------------------------------------------------
+//  Local function prototypes.
+//------------------------------------------------------------------------
+
+static ULONG IMRingSize(
+    _In_ LONG MaxElementsToPush);
+
+static VOID IMSetLaneLimits(
+    _Inout_ PIM_KLIST_HEAD ListHead,
+    _In_ LONG MaxElementsToPush,
+    _In_ LONG MaxBytesToPush);
+
+_IRQL_requires_(DISPATCH_LEVEL)
+static NTSTATUS
+IMLockLane(
+    _Inout_ PIM_KLIST_LANE Lane);
+
+static VOID IMUnlockLane(
+    _Inout_ PIM_KLIST_LANE Lane);
+
+static NTSTATUS
+IMPushToLanes(
+    _Inout_ PIM_KLIST_HEAD ListHead,
+    _In_ PLIST_ENTRY ListEntry,
+    _In_ ULONG Bytes,
+    _Out_opt_ PULONGLONG SequenceNumber);
+
+static NTSTATUS
+IMPushToPriorityLane(
+    _Inout_ PIM_KLIST_HEAD ListHead,
+    _In_ PLIST_ENTRY ListEntry,
+    _In_ ULONG Bytes,
+    _Out_opt_ PULONGLONG SequenceNumber);
+
+static VOID IMMergeLanes(
+    _Inout_ PIM_KLIST_HEAD ListHead);
+
+static LONG IMCountLaneElements(
+    _In_ PIM_KLIST_HEAD ListHead);
+
+static VOID IMSignalNewElement(
+    _Inout_ PIM_KLIST_HEAD ListHead,
+    _In_ BOOLEAN IsPriority);
+
+static VOID IMMergeInsert(
+    _Inout_ PIM_KLIST_HEAD ListHead,
+    _In_ ULONG Lane,
+    _In_ ULONGLONG SequenceNumber);
+
+static VOID IMMergeSiftDown(
+    _Inout_ PIM_KLIST_HEAD ListHead);
+
+static VOID IMUpdateMaxBytes(
+    _Inout_ PIM_KLIST_HEAD ListHead,
+    _In_ LONGLONG Bytes);
+
 //------------------------------------------------------------------------
 //  Text sections.
 //------------------------------------------------------------------------
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, IMInitList)
+#pragma alloc_text(PAGE, IMResizeList)
 #pragma alloc_text(PAGE, IMDeinitList)
 #pragma alloc_text(PAGE, IMFreeList)
 #pragma alloc_text(PAGE, IMPush)
+#pragma alloc_text(PAGE, IMPushPriority)
+#pragma alloc_text(PAGE, IMWaitForElements)
+#pragma alloc_text(PAGE, IMWaitForRoom)
+#pragma alloc_text(PAGE, IMRingSize)
+#pragma alloc_text(PAGE, IMSetLaneLimits)
 #endif // ALLOC_PRAGMA
 
 //------------------------------------------------------------------------
@@ -43,6 +116,41 @@ Kernel mode
 //
 // List manipulation
 //
+// Elements are kept in lanes, one per processor. Producer raises to
+// DISPATCH_LEVEL, takes the lock of the lane of its processor, which no
+// other processor holds as a rule, and puts the element to the ring of
+// the lane. Sequence numbers are taken from the list IM_KLIST_SEQUENCE_BLOCK
+// at a time, so a push writes only the cache line of its lane. Lane which
+// is full is left for the next one.
+//
+// Within a lane elements go in order of their numbers. Consumer merges the
+// heads of the lanes in a heap, but only the ones below the frontier: the
+// lowest number a lane may still give to its next element. Every number
+// below the frontier is pushed already, so nothing which comes later goes
+// ahead of what was taken, the order of the list is the order of numbers.
+// Empty lane keeps its block from holding the frontier back: consumer
+// closes the block and the lane takes a new one on its next push. Numbers
+// of a closed block are not given to anybody, the order has gaps then.
+//
+// Waiting consumer clears NewElementEvent and counts elements once more,
+// producer counts elements after it has moved Tail and sets the event if
+// there are LowWatermark of them. Both count after a full barrier, so one
+// of them sees the other and the wakeup is not lost.
+//
+// Producers waiting for room pair with the consumer the same way: waiter
+// counts itself in RoomWaiters before it looks at the lanes, the consumer
+// looks at RoomWaiters after it moved Head.
+//
+// Rings are resized with ConsumerLock and the lock of every lane held,
+// elements are copied to the new slots of the same positions, Head and
+// Tail are not moved. A producer which finds the lane resized waits for
+// ResizedEvent.
+//
+// Priority lane is one ring for all processors with a fixed size, it is
+// not resized and not in the budget. Its elements take numbers one at a
+// time from the global counter and go to the consumer before the ones of
+// the other lanes. They wake the consumer whatever LowWatermark is.
+//
 
 _Check_return_
     NTSTATUS
@@ -53,6 +161,9 @@ _Check_return_
         _In_ IM_KELEMENT_FREE_CALLBACK ElementFreeCallback)
 {
     NTSTATUS status = STATUS_SUCCESS;
+    PIM_KLIST_LANE lane = NULL;
+    ULONG slots = 0;
+    ULONG i = 0;
 
     PAGED_CODE();
 
@@ -63,19 +174,62 @@ _Check_return_
 
     __try
     {
-        ListHead->MaxElementsToPush = MaxElementsToPush;
-        ListHead->ElementsPushed = 0;
+        RtlZeroMemory(ListHead->Lanes, sizeof(ListHead->Lanes));
+        RtlZeroMemory(&ListHead->PriorityLane, sizeof(ListHead->PriorityLane));
+        ListHead->LaneCount = 0;
+        ListHead->PeekedLane = NULL;
+
         ListHead->ElementStructSize = (ULONG)Size;
         ListHead->ElementFreeCallback = ElementFreeCallback;
-        NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer(&ListHead->NewElementEvent, sizeof(KEVENT)));
+        ListHead->LowWatermark = 1;
+        NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&ListHead->NewElementEvent, sizeof(KEVENT)));
 
         KeInitializeEvent(
             ListHead->NewElementEvent,
             NotificationEvent,
             FALSE);
 
-        InitializeListHead(&ListHead->ElementList);
-        KeInitializeSpinLock(&ListHead->ElementListLock);
+        NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&ListHead->RoomEvent, sizeof(KEVENT)));
+
+        KeInitializeEvent(
+            ListHead->RoomEvent,
+            NotificationEvent,
+            FALSE);
+
+        ListHead->RoomWaiters = 0;
+
+        NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&ListHead->ResizedEvent, sizeof(KEVENT)));
+
+        KeInitializeEvent(
+            ListHead->ResizedEvent,
+            NotificationEvent,
+            TRUE);
+
+        ListHead->MaxBytesPushed = 0;
+        ListHead->MergeCount = 0;
+        ListHead->MergeLimit = 0;
+
+        // processors added later share the lanes
+        ListHead->LaneCount = min(KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS), IM_KLIST_MAX_LANES);
+        ListHead->LaneCount = max(ListHead->LaneCount, 1);
+
+        IMSetLaneLimits(ListHead, MaxElementsToPush, 0);
+        slots = IMRingSize(ListHead->LaneElements);
+
+        for (i = 0; i < ListHead->LaneCount; i++)
+        {
+            lane = &ListHead->Lanes[i];
+
+            NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&lane->Slots, slots * sizeof(IM_KRING_SLOT)));
+
+            lane->SlotMask = slots - 1;
+        }
+
+        NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&ListHead->PriorityLane.Slots, IM_KLIST_PRIORITY_SLOTS * sizeof(IM_KRING_SLOT)));
+
+        ListHead->PriorityLane.SlotMask = IM_KLIST_PRIORITY_SLOTS - 1;
+
+        ExInitializeFastMutex(&ListHead->ConsumerLock);
 
         ExInitializeNPagedLookasideList(&ListHead->ElementsLookaside,
                                         NULL,
@@ -95,121 +249,1026 @@ _Check_return_
         }
         else
         {
-            LOG(("[IM] List initialized\n"));
+            LOG(("[IM] List initialized with %u lanes of %u slots\n", ListHead->LaneCount, slots));
+        }
+    }
+
+    return status;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMResizeList(
+        _Inout_ PIM_KLIST_HEAD ListHead,
+        _In_ LONG MaxElementsToPush,
+        _In_ LONG MaxBytesToPush)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PIM_KRING_SLOT slots[IM_KLIST_MAX_LANES];
+    PIM_KRING_SLOT oldSlots = NULL;
+    PIM_KLIST_LANE lane = NULL;
+    ULONG sizes[IM_KLIST_MAX_LANES];
+    ULONG position = 0;
+    ULONG size = 0;
+    ULONG i = 0;
+
+    PAGED_CODE();
+
+    IF_FALSE_RETURN_RESULT(ListHead != NULL, STATUS_INVALID_PARAMETER_1);
+    IF_FALSE_RETURN_RESULT(ListHead->Lanes[0].Slots != NULL, STATUS_INVALID_PARAMETER_1);
+    IF_FALSE_RETURN_RESULT(MaxElementsToPush > 0, STATUS_INVALID_PARAMETER_2);
+    IF_FALSE_RETURN_RESULT(MaxBytesToPush >= 0, STATUS_INVALID_PARAMETER_3);
+
+    RtlZeroMemory(slots, sizeof(slots));
+
+    ExAcquireFastMutex(&ListHead->ConsumerLock);
+
+    KeClearEvent(ListHead->ResizedEvent);
+
+    // producers which come meanwhile find the lane resized and wait for the
+    // event, the ones in a lane are let out first
+    for (i = 0; i < ListHead->LaneCount; i++)
+    {
+        while (IM_KLANE_FREE != InterlockedCompareExchange(&ListHead->Lanes[i].State, IM_KLANE_RESIZING, IM_KLANE_FREE))
+        {
+            YieldProcessor();
+        }
+    }
+
+    __try
+    {
+        // nobody pushes or pops, rings of all lanes are allocated before
+        // any of them is replaced
+        size = IMRingSize((MaxElementsToPush + (LONG)ListHead->LaneCount - 1) / (LONG)ListHead->LaneCount);
+
+        for (i = 0; i < ListHead->LaneCount; i++)
+        {
+            lane = &ListHead->Lanes[i];
+
+            sizes[i] = max(size, IMRingSize((LONG)((ULONG)lane->Tail - (ULONG)lane->Head)));
+
+            if (sizes[i] != lane->SlotMask + 1)
+            {
+                NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&slots[i], sizes[i] * sizeof(IM_KRING_SLOT)));
+            }
+        }
+
+        for (i = 0; i < ListHead->LaneCount; i++)
+        {
+            lane = &ListHead->Lanes[i];
+
+            if (NULL == slots[i])
+            {
+                continue;
+            }
+
+            for (position = (ULONG)lane->Head; position != (ULONG)lane->Tail; position++)
+            {
+                slots[i][position & (sizes[i] - 1)] = lane->Slots[position & lane->SlotMask];
+            }
+
+            // old ring is freed below
+            oldSlots = lane->Slots;
+            lane->Slots = slots[i];
+            lane->SlotMask = sizes[i] - 1;
+            slots[i] = oldSlots;
+        }
+
+        IMSetLaneLimits(ListHead, MaxElementsToPush, MaxBytesToPush);
+    }
+    __finally
+    {
+        // released with a full barrier, producers see the new rings
+        for (i = 0; i < ListHead->LaneCount; i++)
+        {
+            InterlockedExchange(&ListHead->Lanes[i].State, IM_KLANE_FREE);
+        }
+
+        KeSetEvent(ListHead->ResizedEvent, IO_NO_INCREMENT, FALSE);
+
+        ExReleaseFastMutex(&ListHead->ConsumerLock);
+
+        if (NT_ERROR(status))
+        {
+            LOG_B(("[IM] List resizing error\n"));
+        }
+        else
+        {
+            LOG(("[IM] List resized to %u lanes of %u slots, %d elements, %d bytes\n", ListHead->LaneCount, size, MaxElementsToPush, MaxBytesToPush));
+
+            // larger budget is room for the waiting producers
+            IMSignalRoom(ListHead);
+        }
+
+        // old rings after success, the new ones after failure
+        for (i = 0; i < ListHead->LaneCount; i++)
+        {
+            if (NULL != slots[i])
+            {
+                IMFreeNonPagedBuffer(slots[i]);
+            }
         }
     }
 
-    return STATUS_SUCCESS;
+    return status;
 }
 
 VOID IMDeinitList(
     _Inout_ PIM_KLIST_HEAD ListHead)
 {
+    ULONG i = 0;
+
     PAGED_CODE();
 
     IF_FALSE_RETURN(ListHead != NULL);
-    IF_FALSE_RETURN(ListHead->NewElementEvent != NULL);
 
     LOG(("[IM] List deinitializing\n"));
 
-    IMFreeList(&ListHead->ElementListLock, &ListHead->ElementList, ListHead->ElementFreeCallback);
+    // lookaside is initialized right after the rings
+    if (NULL != ListHead->PriorityLane.Slots)
+    {
+        IMFreeList(ListHead);
+
+        ExDeleteNPagedLookasideList(&ListHead->ElementsLookaside);
+    }
+
+    for (i = 0; i < IM_KLIST_MAX_LANES; i++)
+    {
+        if (NULL != ListHead->Lanes[i].Slots)
+        {
+            IMFreeNonPagedBuffer(ListHead->Lanes[i].Slots);
+            ListHead->Lanes[i].Slots = NULL;
+        }
+    }
 
-    ExFreePool(ListHead->NewElementEvent);
+    if (NULL != ListHead->PriorityLane.Slots)
+    {
+        IMFreeNonPagedBuffer(ListHead->PriorityLane.Slots);
+        ListHead->PriorityLane.Slots = NULL;
+    }
 
-    ExDeleteNPagedLookasideList(&ListHead->ElementsLookaside);
+    if (NULL != ListHead->NewElementEvent)
+    {
+        ExFreePool(ListHead->NewElementEvent);
+        ListHead->NewElementEvent = NULL;
+    }
+
+    if (NULL != ListHead->RoomEvent)
+    {
+        ExFreePool(ListHead->RoomEvent);
+        ListHead->RoomEvent = NULL;
+    }
+
+    if (NULL != ListHead->ResizedEvent)
+    {
+        ExFreePool(ListHead->ResizedEvent);
+        ListHead->ResizedEvent = NULL;
+    }
 
     LOG(("[IM] List deinitialized\n"));
 }
 
 VOID IMFreeList(
-    _In_ PKSPIN_LOCK Lock,
-    _In_ PLIST_ENTRY ListHead,
-    _In_ IM_KELEMENT_FREE_CALLBACK ElementFreeCallback)
+    _Inout_ PIM_KLIST_HEAD ListHead)
 {
     PLIST_ENTRY recordListEntry = NULL;
 
     PAGED_CODE();
 
     IF_FALSE_RETURN(ListHead != NULL);
-    IF_FALSE_RETURN(Lock != NULL);
+    IF_FALSE_RETURN(ListHead->Lanes[0].Slots != NULL);
 
     LOG(("[IM] List freeing\n"));
 
-    IMPop(Lock, ListHead, &recordListEntry);
+    ExAcquireFastMutex(&ListHead->ConsumerLock);
+
+    IMPop(ListHead, &recordListEntry);
 
     //  iterate over list
     while (recordListEntry != NULL)
     {
-        ElementFreeCallback(recordListEntry);
+        ListHead->ElementFreeCallback(recordListEntry);
 
-        IMPop(Lock, ListHead, &recordListEntry);
+        IMPop(ListHead, &recordListEntry);
     }
 
+    ExReleaseFastMutex(&ListHead->ConsumerLock);
+
+    IMSignalRoom(ListHead);
+
     LOG(("[IM] List freed\n"));
 }
 
-VOID IMPush(
+BOOLEAN
+IMPush(
     _In_ PLIST_ENTRY ListEntry,
+    _In_ PIM_KLIST_HEAD ListHead,
+    _In_ ULONG Bytes,
+    _Out_opt_ PULONGLONG SequenceNumber)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    IF_FALSE_RETURN_RESULT(ListEntry != NULL, FALSE);
+    IF_FALSE_RETURN_RESULT(ListHead != NULL, FALSE);
+
+    // rings are being resized, the push goes to the new ones
+    while (STATUS_LOCK_NOT_GRANTED == (status = IMPushToLanes(ListHead, ListEntry, Bytes, SequenceNumber)))
+    {
+        (VOID) KeWaitForSingleObject(ListHead->ResizedEvent, Executive, KernelMode, FALSE, NULL);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        // lanes have room for twice the limit, only a burst of racing
+        // producers gets here
+        LOG_B(("[IM] List is full, element dropped\n"));
+
+        ListHead->ElementFreeCallback(ListEntry);
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOLEAN
+IMPushPriority(
+    _In_ PLIST_ENTRY ListEntry,
+    _In_ PIM_KLIST_HEAD ListHead,
+    _In_ ULONG Bytes,
+    _Out_opt_ PULONGLONG SequenceNumber)
+{
+    PAGED_CODE();
+
+    IF_FALSE_RETURN_RESULT(ListEntry != NULL, FALSE);
+    IF_FALSE_RETURN_RESULT(ListHead != NULL, FALSE);
+
+    if (!NT_SUCCESS(IMPushToPriorityLane(ListHead, ListEntry, Bytes, SequenceNumber)))
+    {
+        LOG_B(("[IM] Priority lane is full, element dropped\n"));
+
+        ListHead->ElementFreeCallback(ListEntry);
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+_Check_return_
+    BOOLEAN
+    IMTryPush(
+        _Inout_ PIM_KLIST_HEAD ListHead,
+        _In_ PLIST_ENTRY ListEntry,
+        _In_ ULONG Bytes,
+        _Out_opt_ PULONGLONG SequenceNumber)
+{
+    IF_FALSE_RETURN_RESULT(ListHead != NULL, FALSE);
+    IF_FALSE_RETURN_RESULT(ListEntry != NULL, FALSE);
+
+    return NT_SUCCESS(IMPushToLanes(ListHead, ListEntry, Bytes, SequenceNumber));
+}
+
+_Check_return_
+    PLIST_ENTRY
+    IMPeek(
+        _In_ PIM_KLIST_HEAD ListHead)
+{
+    PIM_KLIST_LANE lane = NULL;
+
+    IF_FALSE_RETURN_RESULT(ListHead != NULL, NULL);
+
+    lane = &ListHead->PriorityLane;
+
+    if (lane->Head != ReadAcquire(&lane->Tail))
+    {
+        ListHead->PeekedLane = lane;
+
+        return lane->Slots[(ULONG)lane->Head & lane->SlotMask].Element;
+    }
+
+    return IMPeekShared(ListHead);
+}
+
+_Check_return_
+    PLIST_ENTRY
+    IMPeekShared(
+        _In_ PIM_KLIST_HEAD ListHead)
+{
+    PIM_KLIST_LANE lane = NULL;
+
+    IF_FALSE_RETURN_RESULT(ListHead != NULL, NULL);
+
+    ListHead->PeekedLane = NULL;
+
+    if (0 == ListHead->MergeCount)
+    {
+        IMMergeLanes(ListHead);
+
+        if (0 == ListHead->MergeCount)
+        {
+            return NULL;
+        }
+    }
+
+    lane = &ListHead->Lanes[ListHead->Merge[0].Lane];
+    ListHead->PeekedLane = lane;
+
+    return lane->Slots[(ULONG)lane->Head & lane->SlotMask].Element;
+}
+
+VOID IMPop(
+    _Inout_ PIM_KLIST_HEAD ListHead,
+    _Outptr_result_maybenull_ PLIST_ENTRY *ListEntry)
+{
+    PIM_KLIST_LANE lane = NULL;
+    PIM_KRING_SLOT slot = NULL;
+    ULONG head = 0;
+
+    *ListEntry = NULL;
+
+    IF_FALSE_RETURN(ListHead != NULL);
+
+    // element of the last peek, a priority one pushed since waits for the
+    // next peek
+    if (NULL == ListHead->PeekedLane)
+    {
+        (VOID) IMPeek(ListHead);
+    }
+
+    lane = ListHead->PeekedLane;
+    ListHead->PeekedLane = NULL;
+
+    IF_FALSE_RETURN(lane != NULL);
+
+    head = (ULONG)lane->Head;
+    slot = &lane->Slots[head & lane->SlotMask];
+    *ListEntry = slot->Element;
+
+    WriteNoFence(&lane->PoppedBytes, lane->PoppedBytes + slot->Bytes);
+
+    // slot belongs to the producers from here on
+    WriteRelease(&lane->Head, (LONG)(head + 1));
+
+    if (lane == &ListHead->PriorityLane)
+    {
+        return;
+    }
+
+    // next element of the lane stays in the heap if it is below the frontier
+    if ((LONG)(head + 1) != ReadAcquire(&lane->Tail) &&
+        lane->Slots[(head + 1) & lane->SlotMask].SequenceNumber < ListHead->MergeLimit)
+    {
+        ListHead->Merge[0].SequenceNumber = lane->Slots[(head + 1) & lane->SlotMask].SequenceNumber;
+    }
+    else
+    {
+        ListHead->Merge[0] = ListHead->Merge[--ListHead->MergeCount];
+    }
+
+    IMMergeSiftDown(ListHead);
+}
+
+BOOLEAN
+IMHasRoom(
+    _In_ PIM_KLIST_HEAD ListHead,
+    _In_ ULONG Bytes)
+{
+    PIM_KLIST_LANE lane = NULL;
+    LONGLONG bytesPushed = 0;
+
+    IF_FALSE_RETURN_RESULT(ListHead != NULL, FALSE);
+
+    // lane within its share says nothing of the others, which are not read
+    lane = &ListHead->Lanes[KeGetCurrentProcessorNumberEx(NULL) % ListHead->LaneCount];
+    bytesPushed = ReadNoFence(&lane->PushedBytes) - ReadNoFence(&lane->PoppedBytes);
+
+    if ((LONG)((ULONG)ReadNoFence(&lane->Tail) - (ULONG)ReadNoFence(&lane->Head)) < ListHead->LaneElements &&
+        (0 == ListHead->MaxBytesToPush || bytesPushed + Bytes <= ListHead->LaneBytes))
+    {
+        return TRUE;
+    }
+
+    if (IMCountLaneElements(ListHead) >= ListHead->MaxElementsToPush)
+    {
+        return FALSE;
+    }
+
+    bytesPushed = IMCountBytes(ListHead);
+    IMUpdateMaxBytes(ListHead, bytesPushed);
+
+    return 0 == ListHead->MaxBytesToPush ||
+           0 == bytesPushed ||
+           bytesPushed + Bytes <= ListHead->MaxBytesToPush;
+}
+
+LONG IMCountElements(
+    _In_ PIM_KLIST_HEAD ListHead)
+{
+    IF_FALSE_RETURN_RESULT(ListHead != NULL, 0);
+
+    return IMCountLaneElements(ListHead) +
+           (LONG)((ULONG)ReadNoFence(&ListHead->PriorityLane.Tail) - (ULONG)ReadNoFence(&ListHead->PriorityLane.Head));
+}
+
+LONGLONG
+IMCountBytes(
     _In_ PIM_KLIST_HEAD ListHead)
 {
+    LONGLONG bytes = 0;
+    ULONG i = 0;
+
+    IF_FALSE_RETURN_RESULT(ListHead != NULL, 0);
+
+    for (; i < ListHead->LaneCount; i++)
+    {
+        bytes += ReadNoFence(&ListHead->Lanes[i].PushedBytes) - ReadNoFence(&ListHead->Lanes[i].PoppedBytes);
+    }
+
+    return max(bytes, 0);
+}
+
+ULONGLONG
+IMNextSequenceNumber(
+    _Inout_ PIM_KLIST_HEAD ListHead)
+{
+    IF_FALSE_RETURN_RESULT(ListHead != NULL, 0);
+
+    return (ULONGLONG)InterlockedIncrement64(&ListHead->SequenceNumber);
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+    NTSTATUS
+    IMWaitForElements(
+        _Inout_ PIM_KLIST_HEAD ListHead,
+        _In_ LONG LowWatermark,
+        _In_ ULONG Milliseconds)
+{
+    LARGE_INTEGER timeout;
+    LONG lowWatermark = 0;
+
     PAGED_CODE();
 
-    IF_FALSE_RETURN(ListEntry != NULL);
+    IF_FALSE_RETURN_RESULT(ListHead != NULL, STATUS_INVALID_PARAMETER_1);
+    IF_FALSE_RETURN_RESULT(ListHead->NewElementEvent != NULL, STATUS_INVALID_PARAMETER_1);
+
+    // watermark above the limit would never be reached
+    lowWatermark = max(1, min(LowWatermark, ListHead->MaxElementsToPush));
+    WriteNoFence(&ListHead->LowWatermark, lowWatermark);
+
+    // priority element does not wait for the watermark
+    if (IMCountElements(ListHead) >= lowWatermark ||
+        ListHead->PriorityLane.Head != ReadNoFence(&ListHead->PriorityLane.Tail))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    KeClearEvent(ListHead->NewElementEvent);
+
+    // clear is visible before the tails are read, see the producer side
+    KeMemoryBarrier();
+
+    if (IMCountElements(ListHead) >= lowWatermark ||
+        ListHead->PriorityLane.Head != ReadNoFence(&ListHead->PriorityLane.Tail))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    timeout.QuadPart = -10000LL * Milliseconds;
+
+    return KeWaitForSingleObject(ListHead->NewElementEvent, Executive, KernelMode, FALSE, &timeout);
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+    NTSTATUS
+    IMWaitForRoom(
+        _Inout_ PIM_KLIST_HEAD ListHead,
+        _In_ ULONG Bytes,
+        _In_ ULONG Milliseconds)
+{
+    NTSTATUS status = STATUS_TIMEOUT;
+    LARGE_INTEGER timeout;
+    ULONGLONG deadline = 0;
+    ULONGLONG now = 0;
+
+    PAGED_CODE();
+
+    IF_FALSE_RETURN_RESULT(ListHead != NULL, STATUS_INVALID_PARAMETER_1);
+    IF_FALSE_RETURN_RESULT(ListHead->RoomEvent != NULL, STATUS_INVALID_PARAMETER_1);
+
+    if (IMHasRoom(ListHead, Bytes))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    deadline = KeQueryInterruptTime() + 10000ULL * Milliseconds;
+
+    // full barrier, the consumer sees the waiter or the waiter sees room
+    InterlockedIncrement(&ListHead->RoomWaiters);
+
+    for (;;)
+    {
+        KeClearEvent(ListHead->RoomEvent);
+
+        KeMemoryBarrier();
+
+        if (IMHasRoom(ListHead, Bytes))
+        {
+            status = STATUS_SUCCESS;
+            break;
+        }
+
+        now = KeQueryInterruptTime();
+
+        if (now >= deadline)
+        {
+            break;
+        }
+
+        // another waiter may clear the event set for this one, then it
+        // sleeps until the deadline and looks at the room once more
+        timeout.QuadPart = -(LONGLONG)(deadline - now);
+
+        (VOID) KeWaitForSingleObject(ListHead->RoomEvent, Executive, KernelMode, FALSE, &timeout);
+    }
+
+    InterlockedDecrement(&ListHead->RoomWaiters);
+
+    return status;
+}
+
+VOID IMSignalRoom(
+    _Inout_ PIM_KLIST_HEAD ListHead)
+{
     IF_FALSE_RETURN(ListHead != NULL);
 
-    InterlockedIncrement64(&ListHead->ElementsPushed);
+    // heads were moved before, the barrier pairs with the one of the waiter
+    KeMemoryBarrier();
+
+    if (0 != ReadNoFence(&ListHead->RoomWaiters))
+    {
+        KeSetEvent(ListHead->RoomEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+//
+// twice the limit of elements rounded up to power of 2: limit is checked
+// before the push, so producers racing on the last free element still find
+// a slot
+//
+static ULONG IMRingSize(
+    _In_ LONG MaxElementsToPush)
+{
+    ULONG size = 2;
+
+    PAGED_CODE();
+
+    while (size < (ULONG)max(MaxElementsToPush, 1) * 2 && size < 0x40000000)
+    {
+        size <<= 1;
+    }
+
+    return size;
+}
+
+//
+// share of a lane is the limit split evenly, rounded up
+//
+static VOID IMSetLaneLimits(
+    _Inout_ PIM_KLIST_HEAD ListHead,
+    _In_ LONG MaxElementsToPush,
+    _In_ LONG MaxBytesToPush)
+{
+    LONG lanes = (LONG)ListHead->LaneCount;
+
+    PAGED_CODE();
+
+    ListHead->MaxElementsToPush = MaxElementsToPush;
+    ListHead->MaxBytesToPush = MaxBytesToPush;
+    ListHead->LaneElements = (max(MaxElementsToPush, 1) + lanes - 1) / lanes;
+    ListHead->LaneBytes = MaxBytesToPush / lanes;
+}
+
+//
+// Lane is held at DISPATCH_LEVEL, so the holder is not preempted and the
+// others spin for a moment only. STATUS_LOCK_NOT_GRANTED while resizing.
+//
+_IRQL_requires_(DISPATCH_LEVEL)
+static NTSTATUS
+IMLockLane(
+    _Inout_ PIM_KLIST_LANE Lane)
+{
+    LONG state = 0;
 
-    IMPushToList(
-        &ListHead->ElementListLock,
-        &ListHead->ElementList,
-        ListEntry,
-        ListHead->NewElementEvent);
+    for (;;)
+    {
+        state = InterlockedCompareExchange(&Lane->State, IM_KLANE_BUSY, IM_KLANE_FREE);
+
+        if (IM_KLANE_FREE == state)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        if (IM_KLANE_RESIZING == state)
+        {
+            return STATUS_LOCK_NOT_GRANTED;
+        }
+
+        // plain reads until the holder is out
+        while (IM_KLANE_BUSY == ReadNoFence(&Lane->State))
+        {
+            YieldProcessor();
+        }
+    }
+}
+
+//
+// full barrier, see the wakeup of the consumer
+//
+static VOID IMUnlockLane(
+    _Inout_ PIM_KLIST_LANE Lane)
+{
+    InterlockedExchange(&Lane->State, IM_KLANE_FREE);
 }
 
-VOID IMPushToList(
-    _In_ PKSPIN_LOCK SpinLock,
-    _In_ PLIST_ENTRY ListHead,
+//
+// Element goes to the lane of the processor, or to the next one with a
+// free slot. STATUS_BUFFER_OVERFLOW if there is none.
+//
+static NTSTATUS
+IMPushToLanes(
+    _Inout_ PIM_KLIST_HEAD ListHead,
     _In_ PLIST_ENTRY ListEntry,
-    _In_opt_ PKEVENT Event)
+    _In_ ULONG Bytes,
+    _Out_opt_ PULONGLONG SequenceNumber)
 {
+    NTSTATUS status = STATUS_BUFFER_OVERFLOW;
+    PIM_KLIST_LANE own = NULL;
+    PIM_KLIST_LANE lane = NULL;
+    PIM_KRING_SLOT slot = NULL;
+    ULONGLONG sequenceNumber = 0;
+    ULONGLONG floor = 0;
+    LONGLONG observed = 0;
+    LONGLONG previous = 0;
+    ULONG first = 0;
+    ULONG i = 0;
     KIRQL oldIrql;
 
-    IF_FALSE_RETURN(SpinLock != NULL);
-    IF_FALSE_RETURN(ListHead != NULL);
-    IF_FALSE_RETURN(ListEntry != NULL);
-    IF_FALSE_RETURN(Event != NULL);
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    first = KeGetCurrentProcessorNumberEx(NULL) % ListHead->LaneCount;
+    own = &ListHead->Lanes[first];
+
+    for (; i < ListHead->LaneCount && STATUS_BUFFER_OVERFLOW == status; i++)
+    {
+        lane = &ListHead->Lanes[(first + i) % ListHead->LaneCount];
+
+        if (STATUS_LOCK_NOT_GRANTED == IMLockLane(lane))
+        {
+            status = STATUS_LOCK_NOT_GRANTED;
+            break;
+        }
+
+        // the last number the processor gave, elements which go to other
+        // lanes take numbers above it and keep the order of the processor
+        if (0 == i)
+        {
+            floor = max((ULONGLONG)ReadNoFence(&own->SequenceFloor), own->NextSequenceNumber - (0 != own->NextSequenceNumber));
+        }
+
+        // consumer has not taken the slot of the previous lap
+        if ((ULONG)lane->Tail - (ULONG)lane->HeadCache > lane->SlotMask)
+        {
+            lane->HeadCache = ReadAcquire(&lane->Head);
+        }
+
+        if ((ULONG)lane->Tail - (ULONG)lane->HeadCache <= lane->SlotMask)
+        {
+            if (lane->NextSequenceNumber == lane->SequenceLimit || lane->NextSequenceNumber <= floor)
+            {
+                lane->NextSequenceNumber = (ULONGLONG)InterlockedExchangeAdd64(&ListHead->SequenceNumber, IM_KLIST_SEQUENCE_BLOCK) + 1;
+                lane->SequenceLimit = lane->NextSequenceNumber + IM_KLIST_SEQUENCE_BLOCK;
+            }
+
+            sequenceNumber = lane->NextSequenceNumber++;
+
+            slot = &lane->Slots[(ULONG)lane->Tail & lane->SlotMask];
+            slot->Element = ListEntry;
+            slot->SequenceNumber = sequenceNumber;
+            slot->Bytes = Bytes;
+
+            // element is the consumer's once Tail is moved
+            if (NULL != SequenceNumber)
+            {
+                *SequenceNumber = sequenceNumber;
+            }
+
+            WriteNoFence(&lane->PushedBytes, lane->PushedBytes + Bytes);
+            WriteRelease(&lane->Tail, (LONG)((ULONG)lane->Tail + 1));
+
+            status = STATUS_SUCCESS;
+        }
+
+        IMUnlockLane(lane);
+    }
+
+    // other processors of the lane may raise it too, it only goes up
+    observed = ReadNoFence(&own->SequenceFloor);
+
+    while (NT_SUCCESS(status) && lane != own && (ULONGLONG)observed < sequenceNumber)
+    {
+        previous = InterlockedCompareExchange64(&own->SequenceFloor, (LONGLONG)sequenceNumber, observed);
+
+        if (previous == observed)
+        {
+            break;
+        }
+
+        observed = previous;
+    }
+
+    KeLowerIrql(oldIrql);
+
+    if (NT_SUCCESS(status))
+    {
+        IMSignalNewElement(ListHead, FALSE);
+    }
+
+    return status;
+}
+
+//
+// Element goes to the priority lane, numbered from the list counter under
+// the lock of the lane. STATUS_BUFFER_OVERFLOW if the lane is full.
+//
+static NTSTATUS
+IMPushToPriorityLane(
+    _Inout_ PIM_KLIST_HEAD ListHead,
+    _In_ PLIST_ENTRY ListEntry,
+    _In_ ULONG Bytes,
+    _Out_opt_ PULONGLONG SequenceNumber)
+{
+    NTSTATUS status = STATUS_BUFFER_OVERFLOW;
+    PIM_KLIST_LANE lane = &ListHead->PriorityLane;
+    PIM_KRING_SLOT slot = NULL;
+    ULONGLONG sequenceNumber = 0;
+    KIRQL oldIrql;
 
-    KeAcquireSpinLock(SpinLock, &oldIrql);
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
 
-    InsertTailList(ListHead, ListEntry);
+    // never resized, the lock is always granted
+    (VOID) IMLockLane(lane);
 
-    KeSetEvent(Event, IO_NO_INCREMENT, FALSE);
+    if ((ULONG)lane->Tail - (ULONG)ReadAcquire(&lane->Head) <= lane->SlotMask)
+    {
+        // numbered under the lock, so the lane stays in order
+        sequenceNumber = (ULONGLONG)InterlockedIncrement64(&ListHead->SequenceNumber);
 
-    KeReleaseSpinLock(SpinLock, oldIrql);
+        slot = &lane->Slots[(ULONG)lane->Tail & lane->SlotMask];
+        slot->Element = ListEntry;
+        slot->SequenceNumber = sequenceNumber;
+        slot->Bytes = Bytes;
 
-    LOG(("[IM] Element pushed to list\n"));
+        if (NULL != SequenceNumber)
+        {
+            *SequenceNumber = sequenceNumber;
+        }
+
+        WriteNoFence(&lane->PushedBytes, lane->PushedBytes + Bytes);
+        WriteRelease(&lane->Tail, (LONG)((ULONG)lane->Tail + 1));
+
+        status = STATUS_SUCCESS;
+    }
+
+    IMUnlockLane(lane);
+
+    KeLowerIrql(oldIrql);
+
+    if (NT_SUCCESS(status))
+    {
+        IMSignalNewElement(ListHead, TRUE);
+    }
+
+    return status;
 }
 
-VOID IMPop(
-    _In_ PKSPIN_LOCK Lock,
-    _In_ PLIST_ENTRY ListHead,
-    _Outptr_ PLIST_ENTRY *ListEntry)
+//
+// Elements of the lanes in the budget. Head read by a producer may be
+// behind, so elements are rather overcounted.
+//
+static LONG IMCountLaneElements(
+    _In_ PIM_KLIST_HEAD ListHead)
 {
+    LONG elements = 0;
+    ULONG i = 0;
+
+    for (; i < ListHead->LaneCount; i++)
+    {
+        elements += (LONG)((ULONG)ReadNoFence(&ListHead->Lanes[i].Tail) - (ULONG)ReadNoFence(&ListHead->Lanes[i].Head));
+    }
+
+    return elements;
+}
+
+//
+// Event stays signaled until the consumer clears it, so a storm of
+// records reads the event state instead of signaling it every time
+//
+static VOID IMSignalNewElement(
+    _Inout_ PIM_KLIST_HEAD ListHead,
+    _In_ BOOLEAN IsPriority)
+{
+    LONG lowWatermark = 0;
+
+    if (0 != KeReadStateEvent(ListHead->NewElementEvent))
+    {
+        return;
+    }
+
+    lowWatermark = ReadNoFence(&ListHead->LowWatermark);
+
+    if (IsPriority || lowWatermark <= 1 || IMCountElements(ListHead) >= lowWatermark)
+    {
+        KeSetEvent(ListHead->NewElementEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+//
+// Heap of the consumer is built once it is empty. Numbers below the limit
+// are given before the global counter is read, lane which gives more of
+// its block meanwhile moves the frontier down to them.
+//
+static VOID IMMergeLanes(
+    _Inout_ PIM_KLIST_HEAD ListHead)
+{
+    PIM_KLIST_LANE lane = NULL;
+    ULONGLONG minHead = MAXULONG64;
+    ULONGLONG limit = 0;
+    LONGLONG bytes = 0;
+    ULONG head = 0;
+    ULONG i = 0;
     KIRQL oldIrql;
 
-    *ListEntry = NULL;
+    ListHead->MergeCount = 0;
 
-    IF_FALSE_RETURN(ListHead != NULL);
-    IF_FALSE_RETURN(Lock != NULL);
+    // lowest head so far, its block is taken before the counter is read
+    for (i = 0; i < ListHead->LaneCount; i++)
+    {
+        lane = &ListHead->Lanes[i];
+        head = (ULONG)lane->Head;
+
+        if ((LONG)head != ReadAcquire(&lane->Tail))
+        {
+            minHead = min(minHead, lane->Slots[head & lane->SlotMask].SequenceNumber);
+        }
+
+        bytes += ReadNoFence(&lane->PushedBytes) - lane->PoppedBytes;
+    }
 
-    KeAcquireSpinLock(Lock, &oldIrql);
+    IMUpdateMaxBytes(ListHead, bytes);
 
-    if (!IsListEmpty(ListHead))
+    if (MAXULONG64 == minHead)
     {
-        *ListEntry = RemoveHeadList(ListHead);
+        return;
     }
 
-    KeReleaseSpinLock(Lock, oldIrql);
+    limit = (ULONGLONG)ReadAcquire(&ListHead->SequenceNumber) + 1;
 
-    LOG(("[IM] Element poped\n"));
-}
\ No newline at end of file
+    for (i = 0; i < ListHead->LaneCount; i++)
+    {
+        lane = &ListHead->Lanes[i];
+
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+        // no resize without ConsumerLock
+        (VOID) IMLockLane(lane);
+
+        if (lane->NextSequenceNumber != lane->SequenceLimit)
+        {
+            if (lane->NextSequenceNumber <= minHead && lane->Head == ReadNoFence(&lane->Tail))
+            {
+                // idle lane would hold the others back until it pushes
+                lane->NextSequenceNumber = lane->SequenceLimit;
+            }
+            else
+            {
+                limit = min(limit, lane->NextSequenceNumber);
+            }
+        }
+
+        IMUnlockLane(lane);
+
+        KeLowerIrql(oldIrql);
+    }
+
+    ListHead->MergeLimit = limit;
+
+    for (i = 0; i < ListHead->LaneCount; i++)
+    {
+        lane = &ListHead->Lanes[i];
+        head = (ULONG)lane->Head;
+
+        if ((LONG)head != ReadAcquire(&lane->Tail) &&
+            lane->Slots[head & lane->SlotMask].SequenceNumber < limit)
+        {
+            IMMergeInsert(ListHead, i, lane->Slots[head & lane->SlotMask].SequenceNumber);
+        }
+    }
+}
+
+static VOID IMMergeInsert(
+    _Inout_ PIM_KLIST_HEAD ListHead,
+    _In_ ULONG Lane,
+    _In_ ULONGLONG SequenceNumber)
+{
+    IM_KLIST_MERGE_ENTRY entry;
+    ULONG position = ListHead->MergeCount++;
+    ULONG parent = 0;
+
+    entry.SequenceNumber = SequenceNumber;
+    entry.Lane = Lane;
+
+    while (0 != position)
+    {
+        parent = (position - 1) / 2;
+
+        if (ListHead->Merge[parent].SequenceNumber <= SequenceNumber)
+        {
+            break;
+        }
+
+        ListHead->Merge[position] = ListHead->Merge[parent];
+        position = parent;
+    }
+
+    ListHead->Merge[position] = entry;
+}
+
+//
+// top of the heap was replaced, it goes down to its place
+//
+static VOID IMMergeSiftDown(
+    _Inout_ PIM_KLIST_HEAD ListHead)
+{
+    IM_KLIST_MERGE_ENTRY entry;
+    ULONG position = 0;
+    ULONG child = 0;
+
+    if (ListHead->MergeCount < 2)
+    {
+        return;
+    }
+
+    entry = ListHead->Merge[0];
+
+    while ((child = 2 * position + 1) < ListHead->MergeCount)
+    {
+        if (child + 1 < ListHead->MergeCount &&
+            ListHead->Merge[child + 1].SequenceNumber < ListHead->Merge[child].SequenceNumber)
+        {
+            child++;
+        }
+
+        if (entry.SequenceNumber <= ListHead->Merge[child].SequenceNumber)
+        {
+            break;
+        }
+
+        ListHead->Merge[position] = ListHead->Merge[child];
+        position = child;
+    }
+
+    ListHead->Merge[position] = entry;
+}
+
+//
+// mark moves only up, the plain read keeps most of the callers from
+// writing its cache line
+//
+static VOID IMUpdateMaxBytes(
+    _Inout_ PIM_KLIST_HEAD ListHead,
+    _In_ LONGLONG Bytes)
+{
+    LONG bytes = (LONG)min(Bytes, MAXLONG);
+    LONG maxBytesPushed = ReadNoFence(&ListHead->MaxBytesPushed);
+    LONG observed = 0;
+
+    while (bytes > maxBytesPushed)
+    {
+        observed = InterlockedCompareExchange(&ListHead->MaxBytesPushed, bytes, maxBytesPushed);
+
+        if (observed == maxBytesPushed)
+        {
+            break;
+        }
+
+        maxBytesPushed = observed;
+    }
+}
@@ -31,7 +31,9 @@ Kernel mode
 //------------------------------------------------------------------------
 
 //
-// List manipulations
+// List manipulations. Any number of threads may push, elements are taken
+// by one consumer at a time: IMPeek and IMPop are called with
+// ConsumerLock held.
 //
 
 _Check_return_
@@ -42,25 +44,137 @@ _Check_return_
         _In_ LONG MaxElementsToPush,
         _In_ IM_KELEMENT_FREE_CALLBACK ElementFreeCallback);
 
+//
+// Moves the elements to rings for MaxElementsToPush and sets the budget
+// of bytes, 0 for none. Elements stay in order and none is lost, also if
+// there are more of them than the new limits: producers get room after
+// the consumer took enough of them. Pushes wait while the rings are moved.
+//
+_IRQL_requires_(PASSIVE_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMResizeList(
+        _Inout_ PIM_KLIST_HEAD ListHead,
+        _In_ LONG MaxElementsToPush,
+        _In_ LONG MaxBytesToPush);
+
 VOID IMDeinitList(
     _Inout_ PIM_KLIST_HEAD ListHead);
 
 VOID IMFreeList(
-    _In_ PKSPIN_LOCK Lock,
-    _In_ PLIST_ENTRY ListHead,
-    _In_ IM_KELEMENT_FREE_CALLBACK ElementFreeCallback);
+    _Inout_ PIM_KLIST_HEAD ListHead);
 
-VOID IMPush(
+//
+// Element takes its sequence number in the lane of the processor and the
+// list counts its Bytes until it is popped. FALSE if the lanes had no
+// free slot, the element is freed then.
+//
+BOOLEAN
+IMPush(
     _In_ PLIST_ENTRY ListEntry,
-    _In_ PIM_KLIST_HEAD ListHead);
+    _In_ PIM_KLIST_HEAD ListHead,
+    _In_ ULONG Bytes,
+    _Out_opt_ PULONGLONG SequenceNumber);
 
-VOID IMPushToList(
-    _In_ PKSPIN_LOCK SpinLock,
-    _In_ PLIST_ENTRY ListHead,
+//
+// Element goes to the priority lane and to the consumer before the
+// elements of IMPush. The lane has IM_KLIST_PRIORITY_SLOTS slots of its
+// own and is out of the budget, IMHasRoom does not count it. FALSE if the
+// lane is full, the element is freed then.
+//
+BOOLEAN
+IMPushPriority(
     _In_ PLIST_ENTRY ListEntry,
-    _In_opt_ PKEVENT Event);
+    _In_ PIM_KLIST_HEAD ListHead,
+    _In_ ULONG Bytes,
+    _Out_opt_ PULONGLONG SequenceNumber);
+
+//
+// FALSE if the lanes are full or being resized
+//
+_Check_return_
+    BOOLEAN
+    IMTryPush(
+        _Inout_ PIM_KLIST_HEAD ListHead,
+        _In_ PLIST_ENTRY ListEntry,
+        _In_ ULONG Bytes,
+        _Out_opt_ PULONGLONG SequenceNumber);
 
+//
+// Head of the priority lane, otherwise the element with the lowest
+// sequence number of the other lanes
+//
+_Check_return_
+    PLIST_ENTRY
+    IMPeek(
+        _In_ PIM_KLIST_HEAD ListHead);
+
+//
+// Element with the lowest sequence number of the lanes in the budget, the
+// priority lane is left out
+//
+_Check_return_
+    PLIST_ENTRY
+    IMPeekShared(
+        _In_ PIM_KLIST_HEAD ListHead);
+
+//
+// Takes the element of the last IMPeek or IMPeekShared, or peeks itself
+//
 VOID IMPop(
-    _In_ PKSPIN_LOCK Lock,
-    _In_ PLIST_ENTRY ListHead,
-    _Outptr_ PLIST_ENTRY *ListEntry);
+    _Inout_ PIM_KLIST_HEAD ListHead,
+    _Outptr_result_maybenull_ PLIST_ENTRY *ListEntry);
+
+//
+// TRUE if one more element of Bytes is within the limits. Element is
+// always let into the empty list, however large it is.
+//
+BOOLEAN
+IMHasRoom(
+    _In_ PIM_KLIST_HEAD ListHead,
+    _In_ ULONG Bytes);
+
+//
+// Elements of all lanes and bytes of the ones in the budget, a moment ago
+//
+LONG IMCountElements(
+    _In_ PIM_KLIST_HEAD ListHead);
+
+LONGLONG
+IMCountBytes(
+    _In_ PIM_KLIST_HEAD ListHead);
+
+//
+// Sequence number for an element which does not go to the list
+//
+ULONGLONG
+IMNextSequenceNumber(
+    _Inout_ PIM_KLIST_HEAD ListHead);
+
+//
+// Sleeps until LowWatermark elements are pushed (STATUS_SUCCESS) or for
+// Milliseconds (STATUS_TIMEOUT, elements may be there). One consumer
+// waits at a time.
+//
+_IRQL_requires_(PASSIVE_LEVEL)
+    NTSTATUS
+    IMWaitForElements(
+        _Inout_ PIM_KLIST_HEAD ListHead,
+        _In_ LONG LowWatermark,
+        _In_ ULONG Milliseconds);
+
+//
+// Producer side of the bounded list: sleeps until there is room for an
+// element of Bytes (STATUS_SUCCESS, see IMHasRoom) or for Milliseconds
+// (STATUS_TIMEOUT). Any number of producers may wait, the
+// consumer wakes them with IMSignalRoom after it took elements.
+//
+_IRQL_requires_max_(APC_LEVEL)
+    NTSTATUS
+    IMWaitForRoom(
+        _Inout_ PIM_KLIST_HEAD ListHead,
+        _In_ ULONG Bytes,
+        _In_ ULONG Milliseconds);
+
+VOID IMSignalRoom(
+    _Inout_ PIM_KLIST_HEAD ListHead);
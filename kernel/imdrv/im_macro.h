@@ -137,4 +137,4 @@ Kernel mode
 #define CONSTANT_STRING(x)                             \
     {                                                  \
         sizeof((x)) - sizeof((x)[0]), sizeof((x)), (x) \
-    }
\ No newline at end of file
+    }
@@ -0,0 +1,358 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_match.c
+
+Abstract:
+Case insensitive Aho-Corasick automaton over UTF-16
+
+Environment:
+
+Kernel mode
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_match.h"
+#include "im_utils.h"
+
+//------------------------------------------------------------------------
+//  Defines.
+//------------------------------------------------------------------------
+
+#define IM_MATCHER_ROOT 0
+
+//------------------------------------------------------------------------
+//  Structures.
+//------------------------------------------------------------------------
+
+//
+// State of the automaton while it is built, compiled into IM_MATCHER_NODE
+//
+typedef struct _IM_MATCHER_BUILD_NODE
+{
+  struct _IM_MATCHER_BUILD_NODE *FirstChild;
+  struct _IM_MATCHER_BUILD_NODE *NextSibling;
+
+  //
+  // all allocated nodes, to free them without recursion
+  //
+  struct _IM_MATCHER_BUILD_NODE *NextAllocated;
+
+  WCHAR Symbol;
+  ULONG ChildCount;
+  ULONG Match;
+
+} IM_MATCHER_BUILD_NODE, *PIM_MATCHER_BUILD_NODE;
+
+//------------------------------------------------------------------------
+//  Local function prototypes.
+//------------------------------------------------------------------------
+
+static ULONG
+IMMatcherFindChild(
+    _In_ PIM_MATCHER Matcher,
+    _In_ ULONG State,
+    _In_ WCHAR Symbol);
+
+//------------------------------------------------------------------------
+//  Text sections.
+//------------------------------------------------------------------------
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, IMMatcherBuild)
+#pragma alloc_text(PAGE, IMMatcherFree)
+#pragma alloc_text(PAGE, IMMatcherSearch)
+#pragma alloc_text(PAGE, IMMatcherFindChild)
+#endif // ALLOC_PRAGMA
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+_Check_return_
+    NTSTATUS
+    IMMatcherBuild(
+        _In_reads_(PatternCount) PCUNICODE_STRING Patterns,
+        _In_ ULONG PatternCount,
+        _Outptr_ PIM_MATCHER *Matcher)
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  PIM_MATCHER_BUILD_NODE root = NULL;
+  PIM_MATCHER_BUILD_NODE allocated = NULL;
+  PIM_MATCHER_BUILD_NODE node = NULL;
+  PIM_MATCHER_BUILD_NODE child = NULL;
+  PIM_MATCHER_BUILD_NODE *order = NULL;
+  PIM_MATCHER matcher = NULL;
+  PIM_MATCHER_NODE nodes = NULL;
+  WCHAR symbol = 0;
+  ULONG nodeCount = 1;
+  ULONG next = 1;
+  ULONG fail = 0;
+  ULONG state = 0;
+  ULONG i = 0;
+  ULONG j = 0;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(Patterns != NULL || PatternCount == 0, STATUS_INVALID_PARAMETER_1);
+  IF_FALSE_RETURN_RESULT(Matcher != NULL, STATUS_INVALID_PARAMETER_3);
+
+  *Matcher = NULL;
+
+  __try
+  {
+    NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&root, sizeof(IM_MATCHER_BUILD_NODE)));
+    allocated = root;
+
+    //
+    // trie of the folded patterns
+    //
+    for (i = 0; i < PatternCount; i++)
+    {
+      NT_IF_FALSE_LEAVE(Patterns[i].Buffer != NULL && Patterns[i].Length >= sizeof(WCHAR), STATUS_INVALID_PARAMETER_1);
+
+      node = root;
+
+      for (j = 0; j < Patterns[i].Length / sizeof(WCHAR); j++)
+      {
+        symbol = IM_FOLD_WCHAR(Patterns[i].Buffer[j]);
+
+        for (child = node->FirstChild; child != NULL && child->Symbol != symbol; child = child->NextSibling)
+          ;
+
+        if (NULL == child)
+        {
+          NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&child, sizeof(IM_MATCHER_BUILD_NODE)));
+          child->NextAllocated = allocated;
+          allocated = child;
+
+          child->Symbol = symbol;
+          child->NextSibling = node->FirstChild;
+          node->FirstChild = child;
+          node->ChildCount++;
+
+          nodeCount++;
+        }
+
+        node = child;
+      }
+
+      // the first of equal patterns is reported
+      if (0 == node->Match)
+      {
+        node->Match = i + 1;
+      }
+    }
+
+    //
+    // compile breadth first, children sorted by symbol
+    //
+    NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&order, nodeCount * sizeof(PIM_MATCHER_BUILD_NODE)));
+    NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&matcher, sizeof(IM_MATCHER) + nodeCount * sizeof(IM_MATCHER_NODE)));
+
+    matcher->NodeCount = nodeCount;
+    matcher->PatternCount = PatternCount;
+    matcher->Nodes = (PIM_MATCHER_NODE)(matcher + 1);
+    nodes = matcher->Nodes;
+
+    order[IM_MATCHER_ROOT] = root;
+
+    for (i = 0; i < next; i++)
+    {
+      nodes[i].FirstChild = next;
+      nodes[i].ChildCount = order[i]->ChildCount;
+
+      for (child = order[i]->FirstChild; child != NULL; child = child->NextSibling)
+      {
+        for (j = next; j > nodes[i].FirstChild && nodes[j - 1].Symbol > child->Symbol; j--)
+        {
+          nodes[j] = nodes[j - 1];
+          order[j] = order[j - 1];
+        }
+
+        order[j] = child;
+        nodes[j].Symbol = child->Symbol;
+        next++;
+      }
+    }
+
+    FLT_ASSERT(next == nodeCount);
+
+    for (j = nodes[IM_MATCHER_ROOT].FirstChild; j < nodes[IM_MATCHER_ROOT].FirstChild + nodes[IM_MATCHER_ROOT].ChildCount; j++)
+    {
+      if (nodes[j].Symbol < IM_MATCHER_ROOT_SYMBOLS)
+      {
+        matcher->RootNext[nodes[j].Symbol] = j;
+      }
+    }
+
+    //
+    // failure links, breadth first order guarantees the links and matches of
+    // shallower states are ready
+    //
+    for (i = 0; i < nodeCount; i++)
+    {
+      for (j = nodes[i].FirstChild; j < nodes[i].FirstChild + nodes[i].ChildCount; j++)
+      {
+        fail = IM_MATCHER_ROOT;
+
+        if (i != IM_MATCHER_ROOT)
+        {
+          for (state = nodes[i].Fail;; state = nodes[state].Fail)
+          {
+            fail = IMMatcherFindChild(matcher, state, nodes[j].Symbol);
+            if (fail != IM_MATCHER_ROOT || state == IM_MATCHER_ROOT)
+            {
+              break;
+            }
+          }
+        }
+
+        nodes[j].Fail = fail;
+        nodes[j].Match = order[j]->Match ? order[j]->Match : nodes[fail].Match;
+      }
+    }
+
+    *Matcher = matcher;
+    matcher = NULL;
+
+    LOG(("[IM] Matcher of %u states built from %u patterns\n", nodeCount, PatternCount));
+  }
+  __finally
+  {
+    while (NULL != allocated)
+    {
+      node = allocated;
+      allocated = allocated->NextAllocated;
+      IMFreeNonPagedBuffer(node);
+    }
+
+    if (NULL != order)
+    {
+      IMFreeNonPagedBuffer(order);
+    }
+
+    if (NULL != matcher)
+    {
+      IMFreeNonPagedBuffer(matcher);
+    }
+  }
+
+  return status;
+}
+
+VOID IMMatcherFree(
+    _In_ PIM_MATCHER Matcher)
+{
+  PAGED_CODE();
+
+  IMFreeNonPagedBuffer(Matcher);
+}
+
+BOOLEAN
+IMMatcherSearch(
+    _In_ PIM_MATCHER Matcher,
+    _In_ PCUNICODE_STRING String,
+    _Out_opt_ PULONG PatternIndex)
+{
+  PIM_MATCHER_NODE nodes = NULL;
+  ULONG state = IM_MATCHER_ROOT;
+  ULONG next = IM_MATCHER_ROOT;
+  WCHAR symbol = 0;
+  ULONG i = 0;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(Matcher != NULL, FALSE);
+  IF_FALSE_RETURN_RESULT(String != NULL, FALSE);
+  IF_FALSE_RETURN_RESULT(String->Buffer != NULL || String->Length == 0, FALSE);
+
+  nodes = Matcher->Nodes;
+
+  for (; i < String->Length / sizeof(WCHAR); i++)
+  {
+    symbol = IM_FOLD_WCHAR(String->Buffer[i]);
+
+    if (state == IM_MATCHER_ROOT && symbol < IM_MATCHER_ROOT_SYMBOLS)
+    {
+      next = Matcher->RootNext[symbol];
+    }
+    else
+    {
+      for (;;)
+      {
+        next = IMMatcherFindChild(Matcher, state, symbol);
+        if (next != IM_MATCHER_ROOT || state == IM_MATCHER_ROOT)
+        {
+          break;
+        }
+
+        state = nodes[state].Fail;
+      }
+    }
+
+    state = next;
+
+    if (nodes[state].Match != 0)
+    {
+      if (NULL != PatternIndex)
+      {
+        *PatternIndex = nodes[state].Match - 1;
+      }
+
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+//
+// returns IM_MATCHER_ROOT if there is no such child, root is nobody's child
+//
+static ULONG
+IMMatcherFindChild(
+    _In_ PIM_MATCHER Matcher,
+    _In_ ULONG State,
+    _In_ WCHAR Symbol)
+{
+  PIM_MATCHER_NODE nodes = Matcher->Nodes;
+  ULONG low = nodes[State].FirstChild;
+  ULONG high = nodes[State].FirstChild + nodes[State].ChildCount;
+  ULONG middle = 0;
+
+  PAGED_CODE();
+
+  while (low < high)
+  {
+    middle = low + (high - low) / 2;
+    if (nodes[middle].Symbol == Symbol)
+    {
+      return middle;
+    }
+
+    if (nodes[middle].Symbol < Symbol)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+
+  return IM_MATCHER_ROOT;
+}
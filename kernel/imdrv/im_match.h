@@ -0,0 +1,113 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_match.h
+
+Abstract:
+
+Case insensitive Aho-Corasick automaton over UTF-16. Finds whether any of
+the patterns occurs in a string in one pass over the string, whatever the
+amount of patterns is.
+
+Environment:
+
+Kernel mode
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+//
+// transitions of the root on these symbols are looked up directly
+//
+#define IM_MATCHER_ROOT_SYMBOLS 128
+
+//------------------------------------------------------------------------
+//  Structures.
+//------------------------------------------------------------------------
+
+//
+// State of the compiled automaton. States are numbered breadth first, so
+// children of a state are contiguous and sorted by symbol
+//
+typedef struct _IM_MATCHER_NODE
+{
+  //
+  // folded symbol of the edge leading to the state
+  //
+  WCHAR Symbol;
+
+  USHORT Reserved;
+
+  //
+  // children range in nodes array
+  //
+  ULONG FirstChild;
+  ULONG ChildCount;
+
+  //
+  // longest proper suffix of the state which is also a state
+  //
+  ULONG Fail;
+
+  //
+  // index + 1 of a pattern ending at the state or at one of its suffixes,
+  // 0 if there is none
+  //
+  ULONG Match;
+
+} IM_MATCHER_NODE, *PIM_MATCHER_NODE;
+
+//
+// Compiled automaton, nodes follow the header in one allocation
+//
+typedef struct _IM_MATCHER
+{
+  ULONG NodeCount;
+
+  ULONG PatternCount;
+
+  PIM_MATCHER_NODE Nodes;
+
+  //
+  // most of the symbols of a path do not continue any pattern and the
+  // automaton is back in the root, so its transitions are a table
+  //
+  ULONG RootNext[IM_MATCHER_ROOT_SYMBOLS];
+
+} IM_MATCHER, *PIM_MATCHER;
+
+//------------------------------------------------------------------------
+//  Function prototypes.
+//------------------------------------------------------------------------
+
+_Check_return_
+    NTSTATUS
+    IMMatcherBuild(
+        _In_reads_(PatternCount) PCUNICODE_STRING Patterns,
+        _In_ ULONG PatternCount,
+        _Outptr_ PIM_MATCHER *Matcher);
+
+VOID IMMatcherFree(
+    _In_ PIM_MATCHER Matcher);
+
+BOOLEAN
+IMMatcherSearch(
+    _In_ PIM_MATCHER Matcher,
+    _In_ PCUNICODE_STRING String,
+    _Out_opt_ PULONG PatternIndex);
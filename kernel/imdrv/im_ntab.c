@@ -0,0 +1,406 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_ntab.c
+
+Abstract:
+Table of the interned process and file names hashed by the string
+
+Environment:
+
+Kernel mode
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_ntab.h"
+#include "im_utils.h"
+
+//------------------------------------------------------------------------
+//  Defines.
+//------------------------------------------------------------------------
+
+#define IM_NAME_HASH_BASIS 14695981039346656037ull
+#define IM_NAME_HASH_PRIME 1099511628211ull
+
+//
+// high bit of SentIn, generations take the others
+//
+#define IM_NAME_SENDING ((LONG)0x80000000)
+
+//------------------------------------------------------------------------
+//  Local function prototypes.
+//------------------------------------------------------------------------
+
+static ULONG
+IMNameTableHash(
+    _In_ PCUNICODE_STRING Name);
+
+static PIM_NAME_ENTRY
+IMNameTableFind(
+    _In_ PLIST_ENTRY Bucket,
+    _In_ ULONG Hash,
+    _In_ PCUNICODE_STRING Name);
+
+static PIM_NAME_ENTRY
+IMNameTableEvict(
+    _Inout_ PIM_NAME_TABLE Table);
+
+//------------------------------------------------------------------------
+//  Text sections.
+//------------------------------------------------------------------------
+
+//
+// Lookups and sends run under the spin lock or at DISPATCH_LEVEL and are
+// not paged
+//
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, IMNameTableInit)
+#pragma alloc_text(PAGE, IMNameTableDeinit)
+#pragma alloc_text(PAGE, IMNameTableNewClient)
+#endif // ALLOC_PRAGMA
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+_Check_return_
+    NTSTATUS
+    IMNameTableInit(
+        _Out_ PIM_NAME_TABLE Table)
+{
+  ULONG i = 0;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(Table != NULL, STATUS_INVALID_PARAMETER_1);
+
+  RtlZeroMemory(Table, sizeof(IM_NAME_TABLE));
+
+  // 0 is the generation no name was sent in
+  Table->Generation = 1;
+
+  for (; i < IM_NAME_TABLE_BUCKETS; i++)
+  {
+    InitializeListHead(&Table->Buckets[i]);
+  }
+
+  return IMAllocateNonPagedBuffer((PVOID *)&Table->Slots, IM_MAX_INTERNED_NAMES * sizeof(PIM_NAME_ENTRY));
+}
+
+VOID IMNameTableDeinit(
+    _Inout_ PIM_NAME_TABLE Table)
+{
+  ULONG i = 0;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN(Table != NULL);
+  IF_FALSE_RETURN(Table->Slots != NULL);
+
+  for (; i < Table->Count; i++)
+  {
+    FLT_ASSERT(0 == Table->Slots[i]->References);
+    ExFreePoolWithTag(Table->Slots[i], IM_NAME_TAG);
+  }
+
+  IMFreeNonPagedBuffer(Table->Slots);
+  Table->Slots = NULL;
+  Table->Count = 0;
+
+  for (i = 0; i < IM_NAME_TABLE_BUCKETS; i++)
+  {
+    InitializeListHead(&Table->Buckets[i]);
+  }
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMNameTableIntern(
+        _Inout_ PIM_NAME_TABLE Table,
+        _In_ PCUNICODE_STRING Name,
+        _Outptr_ PIM_NAME_ENTRY *Entry)
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  PIM_NAME_ENTRY entry = NULL;
+  PIM_NAME_ENTRY newEntry = NULL;
+  PIM_NAME_ENTRY evicted = NULL;
+  PLIST_ENTRY bucket = NULL;
+  ULONG hash = 0;
+  KIRQL oldIrql = PASSIVE_LEVEL;
+
+  IF_FALSE_RETURN_RESULT(Table != NULL, STATUS_INVALID_PARAMETER_1);
+  IF_FALSE_RETURN_RESULT(Name != NULL && Name->Length != 0, STATUS_INVALID_PARAMETER_2);
+  IF_FALSE_RETURN_RESULT(Entry != NULL, STATUS_INVALID_PARAMETER_3);
+
+  *Entry = NULL;
+
+  hash = IMNameTableHash(Name);
+  bucket = &Table->Buckets[hash & (IM_NAME_TABLE_BUCKETS - 1)];
+
+  // usual case: the name was seen in this session
+  oldIrql = ExAcquireSpinLockShared(&Table->Lock);
+
+  entry = IMNameTableFind(bucket, hash, Name);
+  if (NULL != entry)
+  {
+    InterlockedIncrement(&entry->References);
+  }
+
+  ExReleaseSpinLockShared(&Table->Lock, oldIrql);
+
+  if (NULL != entry)
+  {
+    *Entry = entry;
+    return STATUS_SUCCESS;
+  }
+
+  // allocated outside of the lock and freed if another thread was faster
+  newEntry = (PIM_NAME_ENTRY)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(IM_NAME_ENTRY) + Name->Length + sizeof(WCHAR), IM_NAME_TAG);
+  IF_FALSE_RETURN_RESULT(newEntry != NULL, STATUS_INSUFFICIENT_RESOURCES);
+
+  RtlZeroMemory(newEntry, sizeof(IM_NAME_ENTRY));
+  newEntry->References = 1;
+  newEntry->Hash = hash;
+  newEntry->Name.Buffer = (PWCH)(newEntry + 1);
+  newEntry->Name.Length = Name->Length;
+  newEntry->Name.MaximumLength = Name->Length + sizeof(WCHAR);
+  RtlCopyMemory(newEntry->Name.Buffer, Name->Buffer, Name->Length);
+  newEntry->Name.Buffer[Name->Length / sizeof(WCHAR)] = L'\0';
+
+  oldIrql = ExAcquireSpinLockExclusive(&Table->Lock);
+
+  entry = IMNameTableFind(bucket, hash, Name);
+
+  if (NULL != entry)
+  {
+    InterlockedIncrement(&entry->References);
+  }
+  else if (Table->Count < IM_MAX_INTERNED_NAMES)
+  {
+    newEntry->Id = ++Table->Count;
+  }
+  else if (NULL != (evicted = IMNameTableEvict(Table)))
+  {
+    // client gets the new string with the first record of the id
+    newEntry->Id = evicted->Id;
+    RemoveEntryList(&evicted->Link);
+  }
+  else
+  {
+    status = STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+  if (NULL == entry && NT_SUCCESS(status))
+  {
+    Table->Slots[newEntry->Id - 1] = newEntry;
+    InsertHeadList(bucket, &newEntry->Link);
+
+    entry = newEntry;
+    newEntry = NULL;
+  }
+
+  ExReleaseSpinLockExclusive(&Table->Lock, oldIrql);
+
+  if (NULL != newEntry)
+  {
+    ExFreePoolWithTag(newEntry, IM_NAME_TAG);
+  }
+
+  if (NULL != evicted)
+  {
+    ExFreePoolWithTag(evicted, IM_NAME_TAG);
+  }
+
+  *Entry = entry;
+
+  return status;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID IMNameTableReference(
+    _Inout_ PIM_NAME_ENTRY Entry)
+{
+  FLT_ASSERT(Entry->References > 0);
+
+  InterlockedIncrement(&Entry->References);
+}
+
+//
+// Name stays in the table, only eviction frees it, under the exclusive
+// lock where nobody can take the reference back
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID IMNameTableRelease(
+    _Inout_ PIM_NAME_ENTRY Entry)
+{
+  FLT_ASSERT(Entry->References > 0);
+
+  InterlockedDecrement(&Entry->References);
+}
+
+VOID IMNameTableNewClient(
+    _Inout_ PIM_NAME_TABLE Table)
+{
+  LONG generation = 0;
+  LONG next = 0;
+
+  PAGED_CODE();
+
+  do
+  {
+    generation = ReadNoFence(&Table->Generation);
+
+    // 0 and the sending bit are not generations
+    next = (LONG)(((ULONG)generation + 1) & ~(ULONG)IM_NAME_SENDING);
+    next = next ? next : 1;
+
+  } while (generation != InterlockedCompareExchange(&Table->Generation, next, generation));
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+BOOLEAN
+IMNameTableBeginSend(
+    _In_ PIM_NAME_TABLE Table,
+    _Inout_ PIM_NAME_ENTRY Entry)
+{
+  LONG generation = ReadAcquire(&Table->Generation);
+  LONG sentIn = 0;
+
+  for (;;)
+  {
+    sentIn = ReadAcquire(&Entry->SentIn);
+
+    if (sentIn == generation)
+    {
+      return FALSE;
+    }
+
+    // the sender is at DISPATCH_LEVEL on another processor and about to
+    // reserve the place of its record
+    if (0 != (sentIn & IM_NAME_SENDING))
+    {
+      YieldProcessor();
+      continue;
+    }
+
+    if (sentIn == InterlockedCompareExchange(&Entry->SentIn, generation | IM_NAME_SENDING, sentIn))
+    {
+      return TRUE;
+    }
+  }
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+VOID IMNameTableEndSend(
+    _Inout_ PIM_NAME_ENTRY Entry,
+    _In_ BOOLEAN IsSent)
+{
+  LONG sentIn = ReadNoFence(&Entry->SentIn);
+
+  FLT_ASSERT(0 != (sentIn & IM_NAME_SENDING));
+
+  // writers waiting for it reserve their places after this one
+  WriteRelease(&Entry->SentIn, IsSent ? sentIn & ~IM_NAME_SENDING : 0);
+}
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static ULONG
+IMNameTableHash(
+    _In_ PCUNICODE_STRING Name)
+{
+  ULONGLONG hash = IM_NAME_HASH_BASIS;
+  ULONGLONG word = 0;
+  ULONG i = 0;
+
+  // names are not folded, other case of the same name is another name.
+  // Paths are long, four characters are taken at once.
+  for (; i + sizeof(ULONGLONG) <= Name->Length; i += sizeof(ULONGLONG))
+  {
+    RtlCopyMemory(&word, (PUCHAR)Name->Buffer + i, sizeof(ULONGLONG));
+    hash = (hash ^ word) * IM_NAME_HASH_PRIME;
+  }
+
+  for (; i < Name->Length; i += sizeof(WCHAR))
+  {
+    hash = (hash ^ Name->Buffer[i / sizeof(WCHAR)]) * IM_NAME_HASH_PRIME;
+  }
+
+  // multiplication carries only upwards, high half goes to the buckets too
+  hash ^= hash >> 29;
+  hash *= IM_NAME_HASH_PRIME;
+
+  return (ULONG)(hash ^ (hash >> 32));
+}
+
+static PIM_NAME_ENTRY
+IMNameTableFind(
+    _In_ PLIST_ENTRY Bucket,
+    _In_ ULONG Hash,
+    _In_ PCUNICODE_STRING Name)
+{
+  PLIST_ENTRY link = Bucket->Flink;
+  PIM_NAME_ENTRY entry = NULL;
+
+  for (; link != Bucket; link = link->Flink)
+  {
+    entry = CONTAINING_RECORD(link, IM_NAME_ENTRY, Link);
+
+    if (entry->Hash == Hash &&
+        entry->Name.Length == Name->Length &&
+        RtlEqualMemory(entry->Name.Buffer, Name->Buffer, Name->Length))
+    {
+      // racy under the shared lock, every lookup writes the same
+      entry->IsRecent = TRUE;
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+//
+// Second chance clock over the full table, called under the exclusive
+// lock. Referenced names are skipped, nobody can reference an
+// unreferenced one without the lock.
+//
+static PIM_NAME_ENTRY
+IMNameTableEvict(
+    _Inout_ PIM_NAME_TABLE Table)
+{
+  PIM_NAME_ENTRY entry = NULL;
+  ULONG i = 0;
+
+  for (; i < 2 * IM_MAX_INTERNED_NAMES; i++)
+  {
+    entry = Table->Slots[Table->Clock];
+    Table->Clock = (Table->Clock + 1) % IM_MAX_INTERNED_NAMES;
+
+    if (0 != ReadNoFence(&entry->References))
+    {
+      continue;
+    }
+
+    if (entry->IsRecent)
+    {
+      entry->IsRecent = FALSE;
+      continue;
+    }
+
+    return entry;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,89 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_ntab.h
+
+Abstract:
+
+Table of the interned process and file names. A game session loads a few
+hundred distinct files, so records keep a reference to the name instead
+of its copy, and the client gets the string of an id only once.
+
+Environment:
+
+Kernel mode
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im.h"
+
+//------------------------------------------------------------------------
+//  Function prototypes.
+//------------------------------------------------------------------------
+
+_Check_return_
+    NTSTATUS
+    IMNameTableInit(
+        _Out_ PIM_NAME_TABLE Table);
+
+//
+// Frees every name, none of them may be referenced anymore
+//
+VOID IMNameTableDeinit(
+    _Inout_ PIM_NAME_TABLE Table);
+
+//
+// Returns the referenced entry of the name, inserting it if it is not
+// there. When the table is full the name takes the slot of an
+// unreferenced one which was not looked up lately.
+//
+_IRQL_requires_max_(APC_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMNameTableIntern(
+        _Inout_ PIM_NAME_TABLE Table,
+        _In_ PCUNICODE_STRING Name,
+        _Outptr_ PIM_NAME_ENTRY *Entry);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID IMNameTableReference(
+    _Inout_ PIM_NAME_ENTRY Entry);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID IMNameTableRelease(
+    _Inout_ PIM_NAME_ENTRY Entry);
+
+//
+// New client has none of the names, each is sent to it again
+//
+VOID IMNameTableNewClient(
+    _Inout_ PIM_NAME_TABLE Table);
+
+//
+// Returns TRUE if the caller is the one to send the name to the client,
+// then IMNameTableEndSend must follow once it is known whether the name
+// goes out. Writers which get FALSE meanwhile wait for it, so a record
+// written after the call never comes to the client before the name does.
+// Claims of several names are taken in order of their ids.
+//
+_IRQL_requires_(DISPATCH_LEVEL)
+BOOLEAN
+IMNameTableBeginSend(
+    _In_ PIM_NAME_TABLE Table,
+    _Inout_ PIM_NAME_ENTRY Entry);
+
+_IRQL_requires_(DISPATCH_LEVEL)
+VOID IMNameTableEndSend(
+    _Inout_ PIM_NAME_ENTRY Entry,
+    _In_ BOOLEAN IsSent);
@@ -26,6 +26,8 @@ Kernel mode
 #include "im_utils.h"
 #include "im_rec.h"
 #include "im_list.h"
+#include "im_proc.h"
+#include "im_vcache.h"
 
 //------------------------------------------------------------------------
 //  Defines.
@@ -37,27 +39,23 @@ Kernel mode
 
 #define IM_ALLOWED_DIR_1 L"\\Device\\HarddiskVolume3\\Windows\\" // todo look for right device harddisk
 
+// trusted roots, target process dir and steam folder
+#define IM_POLICY_MAX_ROOTS 3
+
 #define IM_SW_DLL L"sw.dll"
 #define IM_HW_DLL L"hw.dll"
 
 //------------------------------------------------------------------------
-//  Local functions
+//  Globals.
 //------------------------------------------------------------------------
 
-_Check_return_
-    NTSTATUS
-    IMDecideVideoMode(
-        _In_ PFILE_OBJECT FileObject,
-        _In_ PIM_NAME_INFORMATION ProcessNameInfo,
-        _In_ PIM_NAME_INFORMATION FileNameInfo,
-        _Out_ PIM_VIDEO_MODE_STATUS VideoMode);
-
-_Check_return_
-    NTSTATUS
-    IMDecideBlock(
-        _In_ PUNICODE_STRING ParentDirProcessName,
-        _In_ PIM_NAME_INFORMATION FileNameInfo,
-        _Out_ PBOOLEAN IsBlocked);
+//
+// fragments of file names which are never allowed to be loaded, all of them
+// are looked for in one pass by Globals.RestrictedFiles
+//
+static UNICODE_STRING IMRestrictedFiles[] = {
+    CONSTANT_STRING(IM_RESTRICTED_FILE),
+};
 
 //------------------------------------------------------------------------
 //  Text sections.
@@ -67,6 +65,8 @@ _Check_return_
 #pragma alloc_text(PAGE, IMPreCreate)
 #pragma alloc_text(PAGE, IMPostCreate)
 #pragma alloc_text(PAGE, IMDecideVideoMode)
+#pragma alloc_text(PAGE, IMCreatePolicy)
+#pragma alloc_text(PAGE, IMCreateRestrictedFiles)
 #pragma alloc_text(PAGE, IMDecideBlock)
 #endif // ALLOC_PRAGMA
 
@@ -84,19 +84,21 @@ IMPreCreate(
   ACCESS_MASK desiredAccess;
   FLT_PREOP_CALLBACK_STATUS cbStatus = FLT_PREOP_SUCCESS_NO_CALLBACK;
   NTSTATUS status = STATUS_SUCCESS;
-  ULONG i = 0;
   HANDLE processId = NULL;
+  PIM_PROCESS_INFO target = NULL;
   PIM_NAME_INFORMATION processNameInfo = NULL;
   PIM_NAME_INFORMATION fileNameInfo = NULL;
+  PFLT_FILE_NAME_INFORMATION openedNameInfo = NULL;
+  IM_NAME_INFORMATION cachedNameInfo;
   PIM_KRECORD_LIST recordList = NULL;
   IM_VIDEO_MODE_STATUS videoMode = IM_NOT_APPLICABLE;
+  BOOLEAN isCached = FALSE;
+  BOOLEAN isBlocked = FALSE;
 
   *CompletionContext = NULL;
 
   PAGED_CODE();
 
-  UNREFERENCED_PARAMETER(FltObjects);
-
   // We are only registered for the IRP_MJ_CREATE.
   FLT_ASSERT(Data != NULL);
   FLT_ASSERT(Data->Iopb != NULL);
@@ -116,26 +118,48 @@ IMPreCreate(
     }
 
     // is current process id is our process?
-    for (; i < IM_AMOUNT_OF_TARGET_PROCESSES; i++)
-    {
-      if (processId == Globals.TargetProcessInfo[i].ProcessId && Globals.TargetProcessInfo[i].isActive)
-      {
-        processNameInfo = Globals.TargetProcessInfo[i].NameInfo;
-      }
-    }
+    target = IMFindTargetProcess(processId);
 
     // it is not our target process
-    if (NULL == processNameInfo)
+    if (NULL == target)
     {
       __leave;
     }
     else
     {
+      processNameInfo = target->NameInfo;
       LOG(("[IM] We are working now with %wZ\n", &processNameInfo->Name));
     }
 
+    // get opened name of the file witch are opening by the process
+    NT_IF_FAIL_LEAVE(IMQueryFileNameInformation(Data, &openedNameInfo));
+
+    // the file was already decided for: no split, no decision and no post
+    // operation. Video mode files are never cached.
+    if (IMVerdictCacheLookup(target->Verdicts, FltObjects->Volume, &openedNameInfo->Name, &isBlocked))
+    {
+      isCached = TRUE;
+
+      // verdict is only applied to loads, others are not logged as well
+      if (!FlagOn(desiredAccess, FILE_EXECUTE))
+      {
+        isBlocked = FALSE;
+        __leave;
+      }
+
+      // record only takes the full name, it is interned
+      RtlZeroMemory(&cachedNameInfo, sizeof(IM_NAME_INFORMATION));
+      cachedNameInfo.FullName = openedNameInfo->Name;
+
+      NT_IF_FAIL_LEAVE(IMCreateRecord(&recordList, Data, &cachedNameInfo, target->InternedName, IM_NOT_APPLICABLE, isBlocked));
+
+      // it is on the stack and the record is pushed right here
+      recordList->Record.FileNameInformation = NULL;
+      __leave;
+    }
+
     // get file info of the file witch are opening by the process
-    NT_IF_FAIL_LEAVE(IMGetFileNameInformation(Data, &fileNameInfo));
+    NT_IF_FAIL_LEAVE(IMSplitNameInformation(&openedNameInfo->Name, &fileNameInfo));
 
     // now we make decision about video mode
     NT_IF_FAIL_LEAVE(IMDecideVideoMode(Data->Iopb->TargetFileObject, processNameInfo, fileNameInfo, &videoMode));
@@ -148,10 +172,15 @@ IMPreCreate(
     }
 
     // now we create record for log
-    NT_IF_FAIL_LEAVE(IMCreateRecord(&recordList, Data, fileNameInfo, &processNameInfo->FullName, videoMode));
+    NT_IF_FAIL_LEAVE(IMCreateRecord(&recordList, Data, fileNameInfo, target->InternedName, videoMode, FALSE));
   }
   __finally
   {
+    if (openedNameInfo != NULL)
+    {
+      FltReleaseFileNameInformation(openedNameInfo);
+    }
+
     if (fileNameInfo != NULL && (recordList == NULL || IM_VIDEO_HW_TO_SW == videoMode || IM_VIDEO_SW_TO_HW == videoMode))
     {
       IMReleaseNameInformation(fileNameInfo);
@@ -166,7 +195,29 @@ IMPreCreate(
         Data->IoStatus.Information = IO_REPARSE;
         cbStatus = FLT_PREOP_COMPLETE;
         recordList->Record.IsSucceded = TRUE;
-        IMPush(&recordList->List, &Globals.RecordsHead);
+        IMPushRecord(recordList);
+      }
+      else if (isCached)
+      {
+        if (NULL != recordList)
+        {
+          recordList->Record.IsBlocked = isBlocked;
+          recordList->Record.IsSucceded = TRUE;
+          IMPushRecord(recordList);
+        }
+
+        // blocked before the file is opened, nothing to cancel
+        if (isBlocked)
+        {
+          Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+          Data->IoStatus.Information = 0;
+          cbStatus = FLT_PREOP_COMPLETE;
+          LOG(("[IM] Loading blocked by cached verdict\n"));
+        }
+        else
+        {
+          cbStatus = FLT_PREOP_SUCCESS_NO_CALLBACK;
+        }
       }
       else
       {
@@ -204,9 +255,8 @@ IMPostCreate(
   NTSTATUS status = STATUS_SUCCESS;
   PIM_KRECORD_LIST recordList = NULL;
   PIM_NAME_INFORMATION fileNameInfo = NULL;
+  PIM_PROCESS_INFO target = NULL;
   BOOLEAN isBlocked = FALSE;
-  UNICODE_STRING fullProcessName;
-  UNICODE_STRING parentDir;
 
   UNREFERENCED_PARAMETER(Flags);
   UNREFERENCED_PARAMETER(CompletionContext);
@@ -217,8 +267,6 @@ IMPostCreate(
   FLT_ASSERT(Data->Iopb->MajorFunction == IRP_MJ_CREATE);
   FLT_ASSERT(CompletionContext != NULL);
 
-  RtlZeroMemory(&fullProcessName, sizeof(UNICODE_STRING));
-  RtlZeroMemory(&parentDir, sizeof(UNICODE_STRING));
   recordList = (PIM_KRECORD_LIST)CompletionContext;
 
   LOG(("[IM] Post create start\n"));
@@ -233,13 +281,22 @@ IMPostCreate(
       __leave;
     }
 
-    NT_IF_FAIL_LEAVE(IMToString((PWCHAR)recordList->Record.Data[IM_PROCESS_NAME_INDEX].Buffer, recordList->Record.Data[IM_PROCESS_NAME_INDEX].Size, &fullProcessName));
+    // post create of IRP_MJ_CREATE runs in the context of the opening thread
+    target = IMFindTargetProcess(PsGetCurrentProcessId());
+    NT_IF_FALSE_LEAVE(target != NULL && target->Policy != NULL, STATUS_NOT_FOUND);
 
-    NT_IF_FAIL_LEAVE(IMSplitString(&fullProcessName, &parentDir, NULL, L'\\', -1)); // todo refactor
     //
     // now we deciding to block load or not
     //
-    NT_IF_FAIL_LEAVE(IMDecideBlock(&parentDir, fileNameInfo, &isBlocked));
+    NT_IF_FAIL_LEAVE(IMDecideBlock(target->Policy, fileNameInfo, &isBlocked));
+
+    // remember the verdict if the open was not reparsed elsewhere, video
+    // mode files have to go the whole way every time
+    if (IM_NOT_APPLICABLE == recordList->Record.VideoModeStatus &&
+        STATUS_SUCCESS == Data->IoStatus.Status)
+    {
+      IMVerdictCacheInsert(target->Verdicts, FltObjects->Volume, &fileNameInfo->FullName, isBlocked);
+    }
   }
   __finally
   {
@@ -248,16 +305,6 @@ IMPostCreate(
       LOG_B(("[IM] Operatin failed\n"));
     }
 
-    if (NULL != fullProcessName.Buffer)
-    {
-      ExFreePool(fullProcessName.Buffer);
-    }
-
-    if (NULL != parentDir.Buffer)
-    {
-      ExFreePool(parentDir.Buffer);
-    }
-
     if (NULL != fileNameInfo)
     {
       IMReleaseNameInformation(fileNameInfo);
@@ -279,7 +326,7 @@ IMPostCreate(
         LOG(("[IM] Operation succeeded\n"));
         recordList->Record.IsSucceded = TRUE;
       }
-      IMPush(&recordList->List, &Globals.RecordsHead);
+      IMPushRecord(recordList);
     }
   }
 
@@ -298,6 +345,7 @@ _Check_return_
   IM_VIDEO_MODE_STATUS videoMode = IM_NOT_APPLICABLE;
   UNICODE_STRING strSw = CONSTANT_STRING(IM_SW_DLL);
   UNICODE_STRING strHw = CONSTANT_STRING(IM_HW_DLL);
+  UNICODE_STRING strHl = CONSTANT_STRING(IM_HL_PROCESS_NAME);
   UNICODE_STRING replacement;
 
   PAGED_CODE();
@@ -308,26 +356,27 @@ _Check_return_
   __try
   {
     // it is only works with hl
-    if (RtlCompareUnicodeString(&ProcessNameInfo->Name, &Globals.TargetProcessInfo[IM_HL_PROCESS_INFO_INDEX].TargetName, TRUE) != 0)
+    if (!IMIsEqualString(&ProcessNameInfo->Name, &strHl))
     {
       __leave;
     }
 
-    // it is only works with files from game folder
-    if (RtlCompareUnicodeString(&ProcessNameInfo->ParentDir, &FileNameInfo->ParentDir, TRUE) != 0)
+    // it is only works with files from game folder, folders may have non latin names
+    // so they are compared with full case folding
+    if (!RtlEqualUnicodeString(&ProcessNameInfo->ParentDir, &FileNameInfo->ParentDir, TRUE))
     {
       __leave;
     }
 
     // is it already hw?
-    if (RtlCompareUnicodeString(&FileNameInfo->Name, &strHw, TRUE) == 0)
+    if (IMIsEqualString(&FileNameInfo->Name, &strHw))
     {
       videoMode = IM_VIDEO_HW;
       __leave;
     }
 
     // may be it is sw
-    if (RtlCompareUnicodeString(&FileNameInfo->Name, &strSw, TRUE) == 0)
+    if (IMIsEqualString(&FileNameInfo->Name, &strSw))
     {
       // concat
       NT_IF_FAIL_LEAVE(IMConcatStrings(&replacement, &FileNameInfo->ParentDir, &strHw));
@@ -362,62 +411,110 @@ _Check_return_
 
 _Check_return_
     NTSTATUS
-    IMDecideBlock(
-        _In_ PUNICODE_STRING ParentDirProcessName,
-        _In_ PIM_NAME_INFORMATION FileNameInfo,
-        _Out_ PBOOLEAN IsBlocked)
+    IMCreatePolicy(
+        _In_ PIM_NAME_INFORMATION ProcessNameInfo,
+        _Outptr_ PIM_TRIE *Policy)
 {
-  UNICODE_STRING strAllowedExt = CONSTANT_STRING(IM_ALLOWED_EXTENTION);
-  UNICODE_STRING strResticted = CONSTANT_STRING(IM_RESTRICTED_FILE);
-  UNICODE_STRING strAllowedDir1 = CONSTANT_STRING(IM_ALLOWED_DIR_1);
-  BOOLEAN isBlocked = FALSE;
-  UNICODE_STRING steamFolder;
   NTSTATUS status = STATUS_SUCCESS;
+  IM_TRIE_RULE rules[IM_POLICY_MAX_ROOTS];
+  ULONG ruleCount = 0;
+  UNICODE_STRING steamFolder;
 
   PAGED_CODE();
 
+  IF_FALSE_RETURN_RESULT(ProcessNameInfo != NULL, STATUS_INVALID_PARAMETER_1);
+  IF_FALSE_RETURN_RESULT(Policy != NULL, STATUS_INVALID_PARAMETER_2);
+
   RtlZeroMemory(&steamFolder, sizeof(UNICODE_STRING));
+  RtlZeroMemory(rules, sizeof(rules));
 
   __try
   {
     // we allow everything from windows folder because it contains fonts for example
-    if (IMIsStartWithString(&FileNameInfo->ParentDir, &strAllowedDir1))
-    {
-      isBlocked = FALSE;
-      LOG(("[IM] Allowed paths %wZ and we have %wZ\n", &strAllowedDir1, &FileNameInfo->ParentDir));
-      __leave;
-    }
+    RtlInitUnicodeString(&rules[ruleCount].Root, IM_ALLOWED_DIR_1);
+    rules[ruleCount++].Verdict = IM_TRIE_TRUSTED;
 
-    // we are only allow .dll files
-    if (RtlCompareUnicodeString(&FileNameInfo->Extension, &strAllowedExt, TRUE) != 0)
+    // we only target process root folder and steam folder
+    rules[ruleCount].Root = ProcessNameInfo->ParentDir;
+    rules[ruleCount++].Verdict = IM_TRIE_ALLOWED;
+
+    if (NT_SUCCESS(IMSplitString(&ProcessNameInfo->ParentDir, &steamFolder, NULL, L'\\', -4))) // todo game may be not in steam folder
     {
-      isBlocked = TRUE;
-      LOG(("[IM] Extention not a %wZ but %wZ\n", &strAllowedExt, &FileNameInfo->Extension));
-      __leave;
+      rules[ruleCount].Root = steamFolder;
+      rules[ruleCount++].Verdict = IM_TRIE_ALLOWED;
     }
 
-    // we restrict certain .dll files by checking is path contains
-    if (IMIsContainsString(&FileNameInfo->FullName, &strResticted))
+    NT_IF_FAIL_LEAVE(IMTrieBuild(rules, ruleCount, Policy));
+  }
+  __finally
+  {
+    if (NULL != steamFolder.Buffer)
     {
-      isBlocked = TRUE;
-      LOG(("[IM] Restricted dll, %wZ\n", &strResticted));
-      __leave;
+      ExFreePool(steamFolder.Buffer);
     }
+  }
 
-    NT_IF_FAIL_LEAVE(IMSplitString(ParentDirProcessName, &steamFolder, NULL, L'\\', -4)); // todo game may be not in steam folder
+  return status;
+}
 
-    // we only target process root folder and steam folder
-    if (!IMIsStartWithString(&FileNameInfo->ParentDir, ParentDirProcessName) && !IMIsStartWithString(&FileNameInfo->ParentDir, &steamFolder))
-    {
-      isBlocked = TRUE;
-      LOG(("[IM] Allowed paths %wZ and %wZ, but we have %wZ\n", &steamFolder, ParentDirProcessName, &FileNameInfo->ParentDir));
-      __leave;
-    }
+_Check_return_
+    NTSTATUS
+    IMCreateRestrictedFiles(
+        _Outptr_ PIM_MATCHER *RestrictedFiles)
+{
+  PAGED_CODE();
+
+  return IMMatcherBuild(IMRestrictedFiles, ARRAYSIZE(IMRestrictedFiles), RestrictedFiles);
+}
+
+_Check_return_
+    NTSTATUS
+    IMDecideBlock(
+        _In_ PIM_TRIE Policy,
+        _In_ PIM_NAME_INFORMATION FileNameInfo,
+        _Out_ PBOOLEAN IsBlocked)
+{
+  UNICODE_STRING strAllowedExt = CONSTANT_STRING(IM_ALLOWED_EXTENTION);
+  IM_TRIE_VERDICT verdict = IM_TRIE_NONE;
+  ULONG restricted = 0;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(Policy != NULL, STATUS_INVALID_PARAMETER_1);
+  IF_FALSE_RETURN_RESULT(FileNameInfo != NULL, STATUS_INVALID_PARAMETER_2);
+  IF_FALSE_RETURN_RESULT(IsBlocked != NULL, STATUS_INVALID_PARAMETER_3);
+
+  // the deepest root of the policy containing the file decides
+  verdict = IMTrieLookup(Policy, &FileNameInfo->ParentDir);
+
+  if (IM_TRIE_TRUSTED == verdict)
+  {
+    *IsBlocked = FALSE;
+    LOG(("[IM] Trusted path %wZ\n", &FileNameInfo->ParentDir));
+    return STATUS_SUCCESS;
   }
-  __finally
+
+  // we are only allow .dll files
+  if (!IMIsEqualString(&FileNameInfo->Extension, &strAllowedExt))
   {
-    *IsBlocked = isBlocked;
+    *IsBlocked = TRUE;
+    LOG(("[IM] Extention not a %wZ but %wZ\n", &strAllowedExt, &FileNameInfo->Extension));
+    return STATUS_SUCCESS;
+  }
+
+  // we restrict certain .dll files by checking is path contains any of the fragments
+  if (NULL != Globals.RestrictedFiles && IMMatcherSearch(Globals.RestrictedFiles, &FileNameInfo->FullName, &restricted))
+  {
+    *IsBlocked = TRUE;
+    LOG(("[IM] Restricted dll, %wZ\n", &IMRestrictedFiles[restricted]));
+    return STATUS_SUCCESS;
+  }
+
+  *IsBlocked = (IM_TRIE_ALLOWED != verdict);
+  if (*IsBlocked)
+  {
+    LOG(("[IM] Path %wZ is not allowed\n", &FileNameInfo->ParentDir));
   }
 
   return STATUS_SUCCESS;
-}
\ No newline at end of file
+}
@@ -25,6 +25,8 @@ Kernel mode
 //------------------------------------------------------------------------
 
 #include "im.h"
+#include "im_trie.h"
+#include "im_match.h"
 
 //------------------------------------------------------------------------
 //  Function prototypes
@@ -44,3 +46,33 @@ IMPostCreate(
     _In_ PCFLT_RELATED_OBJECTS FltObjects,
     _In_opt_ PVOID CompletionContext,
     _In_ FLT_POST_OPERATION_FLAGS Flags);
+
+//
+// Decisions
+//
+
+_Check_return_
+    NTSTATUS
+    IMCreatePolicy(
+        _In_ PIM_NAME_INFORMATION ProcessNameInfo,
+        _Outptr_ PIM_TRIE *Policy);
+
+_Check_return_
+    NTSTATUS
+    IMCreateRestrictedFiles(
+        _Outptr_ PIM_MATCHER *RestrictedFiles);
+
+_Check_return_
+    NTSTATUS
+    IMDecideVideoMode(
+        _In_ PFILE_OBJECT FileObject,
+        _In_ PIM_NAME_INFORMATION ProcessNameInfo,
+        _In_ PIM_NAME_INFORMATION FileNameInfo,
+        _Out_ PIM_VIDEO_MODE_STATUS VideoMode);
+
+_Check_return_
+    NTSTATUS
+    IMDecideBlock(
+        _In_ PIM_TRIE Policy,
+        _In_ PIM_NAME_INFORMATION FileNameInfo,
+        _Out_ PBOOLEAN IsBlocked);
@@ -24,17 +24,46 @@ Kernel mode
 #include "im_proc.h"
 #include "im_req.h"
 #include "im_utils.h"
+#include "im_ops.h"
+#include "im_trie.h"
+#include "im_ptab.h"
+#include "im_vcache.h"
+#include "im_ntab.h"
 
 //------------------------------------------------------------------------
-//  Defines.
+//  Globals.
 //------------------------------------------------------------------------
 
+//
+// names of the processes we are monitoring, every instance of them gets
+// its own entry in Globals.TargetProcesses
+//
+static UNICODE_STRING IMTargetProcessNames[] = {
+    CONSTANT_STRING(IM_HL_PROCESS_NAME),
+    CONSTANT_STRING(IM_CS_PROCESS_NAME),
+};
+
+//------------------------------------------------------------------------
+//  Local function prototypes
+//------------------------------------------------------------------------
+
+static BOOLEAN
+IMIsTargetProcessName(
+    _In_ PCUNICODE_STRING Name);
+
+static VOID IMReleaseTargetProcess(
+    _In_ PIM_PROCESS_INFO Target);
+
 //------------------------------------------------------------------------
 //  Text sections.
 //------------------------------------------------------------------------
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, IMCreateProcessNotifyRoutine)
+#pragma alloc_text(PAGE, IMReleaseTargetProcesses)
+#pragma alloc_text(PAGE, IMFindTargetProcess)
+#pragma alloc_text(PAGE, IMIsTargetProcessName)
+#pragma alloc_text(PAGE, IMReleaseTargetProcess)
 #endif // ALLOC_PRAGMA
 
 //------------------------------------------------------------------------
@@ -50,9 +79,11 @@ VOID IMCreateProcessNotifyRoutine(
 
   NTSTATUS status = STATUS_SUCCESS;
   PIM_NAME_INFORMATION processNameInfo = NULL;
-  ULONG i = 0;
+  PIM_NAME_ENTRY internedName = NULL;
+  PIM_TRIE policy = NULL;
+  PIM_VERDICT_CACHE verdicts = NULL;
   PIM_PROCESS_INFO target = NULL;
-  BOOLEAN isFound = FALSE;
+  PIM_PROCESS_INFO replaced = NULL;
 
   PAGED_CODE();
 
@@ -64,47 +95,148 @@ VOID IMCreateProcessNotifyRoutine(
     {
       NT_IF_FAIL_LEAVE(IMGetProcessNameInformation(ProcessId, &processNameInfo));
 
-      for (; i < IM_AMOUNT_OF_TARGET_PROCESSES; i++)
+      if (!IMIsTargetProcessName(&processNameInfo->Name))
+      {
+        __leave;
+      }
+
+      // policy is built once for the whole life of the process
+      NT_IF_FAIL_LEAVE(IMCreatePolicy(processNameInfo, &policy));
+
+      NT_IF_FAIL_LEAVE(IMVerdictCacheCreate(&verdicts));
+
+      // every record of the process refers to it
+      NT_IF_FAIL_LEAVE(IMNameTableIntern(&Globals.Names, &processNameInfo->FullName, &internedName));
+
+      NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&target, sizeof(IM_PROCESS_INFO)));
+
+      target->ProcessId = ProcessId;
+      target->NameInfo = processNameInfo;
+      target->InternedName = internedName;
+      target->Policy = policy;
+      target->Verdicts = verdicts;
+
+      replaced = IMProcessTableInsert(&Globals.TargetProcesses, target);
+      if (NULL != replaced)
       {
-        target = &Globals.TargetProcessInfo[i];
-        if (RtlCompareUnicodeString(&processNameInfo->Name, &target->TargetName, TRUE) == 0)
-        {
-          isFound = TRUE;
-          if (target->isActive)
-          {
-            LOG_B(("[IM] PROCESS DUPLICATION\n")); // TODO
-            target->isDuplicate = TRUE;
-            IMReleaseNameInformation(target->NameInfo);
-          }
-          target->NameInfo = processNameInfo;
-          target->isActive = TRUE;
-          target->ProcessId = ProcessId;
-
-          LOG(("[IM] Found process creation: %wZ\n", &processNameInfo->Name));
-        }
+        LOG_B(("[IM] Exit of the process %p was missed\n", ProcessId));
+        IMReleaseTargetProcess(replaced);
       }
+
+      LOG(("[IM] Found process creation: %wZ\n", &processNameInfo->Name));
+
+      // owned by the table now
+      processNameInfo = NULL;
+      internedName = NULL;
+      policy = NULL;
+      verdicts = NULL;
+      target = NULL;
     }
     else
     {
-      for (; i < IM_AMOUNT_OF_TARGET_PROCESSES; i++)
+      target = IMProcessTableRemove(&Globals.TargetProcesses, ProcessId);
+      if (NULL != target)
       {
-        target = &Globals.TargetProcessInfo[i];
-        if (target->isActive && ProcessId == target->ProcessId)
-        {
-          LOG(("[IM] Found process termination: %wZ\n", &target->TargetName));
-          IMReleaseNameInformation(target->NameInfo);
-          target->isActive = FALSE;
-          target->isDuplicate = FALSE;
-          target->ProcessId = NULL;
-        }
+        LOG(("[IM] Found process termination: %wZ\n", &target->NameInfo->Name));
+        IMReleaseTargetProcess(target);
+        target = NULL;
       }
     }
   }
   __finally
   {
-    if (!isFound && processNameInfo != NULL)
+    if (NULL != target)
+    {
+      ExFreePool(target);
+    }
+
+    if (NULL != policy)
+    {
+      IMTrieFree(policy);
+    }
+
+    if (NULL != verdicts)
+    {
+      IMVerdictCacheFree(verdicts);
+    }
+
+    if (NULL != internedName)
+    {
+      IMNameTableRelease(internedName);
+    }
+
+    if (NULL != processNameInfo)
     {
       IMReleaseNameInformation(processNameInfo);
     }
   }
-}
\ No newline at end of file
+}
+
+VOID IMReleaseTargetProcesses()
+{
+  PIM_PROCESS_INFO target = NULL;
+
+  PAGED_CODE();
+
+  while (NULL != (target = IMProcessTableRemoveAny(&Globals.TargetProcesses)))
+  {
+    IMReleaseTargetProcess(target);
+  }
+}
+
+PIM_PROCESS_INFO
+IMFindTargetProcess(
+    _In_ HANDLE ProcessId)
+{
+  PAGED_CODE();
+
+  return IMProcessTableLookup(&Globals.TargetProcesses, ProcessId);
+}
+
+//------------------------------------------------------------------------
+//  Local functions
+//------------------------------------------------------------------------
+
+static BOOLEAN
+IMIsTargetProcessName(
+    _In_ PCUNICODE_STRING Name)
+{
+  ULONG i = 0;
+
+  PAGED_CODE();
+
+  for (; i < ARRAYSIZE(IMTargetProcessNames); i++)
+  {
+    if (IMIsEqualString(Name, &IMTargetProcessNames[i]))
+    {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static VOID IMReleaseTargetProcess(
+    _In_ PIM_PROCESS_INFO Target)
+{
+  PAGED_CODE();
+
+  IMReleaseNameInformation(Target->NameInfo);
+
+  if (NULL != Target->InternedName)
+  {
+    IMNameTableRelease(Target->InternedName);
+  }
+
+  if (NULL != Target->Policy)
+  {
+    IMTrieFree(Target->Policy);
+  }
+
+  if (NULL != Target->Verdicts)
+  {
+    IMVerdictCacheFree(Target->Verdicts);
+  }
+
+  ExFreePool(Target);
+}
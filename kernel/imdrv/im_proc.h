@@ -31,4 +31,10 @@ Kernel mode
 VOID IMCreateProcessNotifyRoutine(
     HANDLE ParentId,
     HANDLE ProcessId,
-    BOOLEAN Create);
\ No newline at end of file
+    BOOLEAN Create);
+
+VOID IMReleaseTargetProcesses();
+
+PIM_PROCESS_INFO
+IMFindTargetProcess(
+    _In_ HANDLE ProcessId);
\ No newline at end of file
@@ -0,0 +1,217 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_ptab.c
+
+Abstract:
+Table of the running target processes hashed by process id
+
+Environment:
+
+Kernel mode
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_ptab.h"
+
+//------------------------------------------------------------------------
+//  Defines.
+//------------------------------------------------------------------------
+
+// 2^32 divided by the golden ratio
+#define IM_PROCESS_TABLE_HASH 2654435769u
+
+//------------------------------------------------------------------------
+//  Local function prototypes.
+//------------------------------------------------------------------------
+
+static PLIST_ENTRY
+IMProcessTableBucket(
+    _In_ PIM_PROCESS_TABLE Table,
+    _In_ HANDLE ProcessId);
+
+static PIM_PROCESS_INFO
+IMProcessTableFind(
+    _In_ PLIST_ENTRY Bucket,
+    _In_ HANDLE ProcessId);
+
+//------------------------------------------------------------------------
+//  Text sections.
+//------------------------------------------------------------------------
+
+//
+// Nothing is paged here, the table is walked under a spin lock
+//
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+VOID IMProcessTableInit(
+    _Out_ PIM_PROCESS_TABLE Table)
+{
+  ULONG i = 0;
+
+  Table->Lock = 0;
+  Table->Count = 0;
+
+  for (; i < IM_PROCESS_TABLE_BUCKETS; i++)
+  {
+    InitializeListHead(&Table->Buckets[i]);
+  }
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PIM_PROCESS_INFO
+IMProcessTableInsert(
+    _Inout_ PIM_PROCESS_TABLE Table,
+    _In_ PIM_PROCESS_INFO Process)
+{
+  PLIST_ENTRY bucket = IMProcessTableBucket(Table, Process->ProcessId);
+  PIM_PROCESS_INFO replaced = NULL;
+  KIRQL oldIrql = ExAcquireSpinLockExclusive(&Table->Lock);
+
+  // process id is reused only after the exit notification, so this means
+  // the notification was missed
+  replaced = IMProcessTableFind(bucket, Process->ProcessId);
+  if (NULL != replaced)
+  {
+    RemoveEntryList(&replaced->Link);
+  }
+  else
+  {
+    InterlockedIncrement(&Table->Count);
+  }
+
+  InsertHeadList(bucket, &Process->Link);
+
+  ExReleaseSpinLockExclusive(&Table->Lock, oldIrql);
+
+  return replaced;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PIM_PROCESS_INFO
+IMProcessTableLookup(
+    _In_ PIM_PROCESS_TABLE Table,
+    _In_ HANDLE ProcessId)
+{
+  PLIST_ENTRY bucket = IMProcessTableBucket(Table, ProcessId);
+  PIM_PROCESS_INFO process = NULL;
+  KIRQL oldIrql = PASSIVE_LEVEL;
+
+  // usual case on every create in the system: the bucket is empty. Entry
+  // of a process is linked before its first thread starts and unlinked
+  // after the last one exits, so for the calling process the bucket can
+  // not look empty while the entry is there, and no lock is needed
+  if (IsListEmpty(bucket))
+  {
+    return NULL;
+  }
+
+  oldIrql = ExAcquireSpinLockShared(&Table->Lock);
+
+  process = IMProcessTableFind(bucket, ProcessId);
+
+  ExReleaseSpinLockShared(&Table->Lock, oldIrql);
+
+  return process;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PIM_PROCESS_INFO
+IMProcessTableRemove(
+    _Inout_ PIM_PROCESS_TABLE Table,
+    _In_ HANDLE ProcessId)
+{
+  PIM_PROCESS_INFO process = NULL;
+  KIRQL oldIrql = PASSIVE_LEVEL;
+
+  // every process in the system exits through here
+  if (0 == Table->Count)
+  {
+    return NULL;
+  }
+
+  oldIrql = ExAcquireSpinLockExclusive(&Table->Lock);
+
+  process = IMProcessTableFind(IMProcessTableBucket(Table, ProcessId), ProcessId);
+  if (NULL != process)
+  {
+    RemoveEntryList(&process->Link);
+    InterlockedDecrement(&Table->Count);
+  }
+
+  ExReleaseSpinLockExclusive(&Table->Lock, oldIrql);
+
+  return process;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PIM_PROCESS_INFO
+IMProcessTableRemoveAny(
+    _Inout_ PIM_PROCESS_TABLE Table)
+{
+  PIM_PROCESS_INFO process = NULL;
+  KIRQL oldIrql = ExAcquireSpinLockExclusive(&Table->Lock);
+  ULONG i = 0;
+
+  for (; i < IM_PROCESS_TABLE_BUCKETS; i++)
+  {
+    if (!IsListEmpty(&Table->Buckets[i]))
+    {
+      process = CONTAINING_RECORD(RemoveHeadList(&Table->Buckets[i]), IM_PROCESS_INFO, Link);
+      InterlockedDecrement(&Table->Count);
+      break;
+    }
+  }
+
+  ExReleaseSpinLockExclusive(&Table->Lock, oldIrql);
+
+  return process;
+}
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static PLIST_ENTRY
+IMProcessTableBucket(
+    _In_ PIM_PROCESS_TABLE Table,
+    _In_ HANDLE ProcessId)
+{
+  // process ids are multiples of 4, the high bits of the Fibonacci hash
+  // spread them over the buckets whatever their stride is
+  ULONG id = (ULONG)((ULONG_PTR)ProcessId >> 2);
+
+  return &Table->Buckets[(id * IM_PROCESS_TABLE_HASH) >> (32 - IM_PROCESS_TABLE_BITS)];
+}
+
+static PIM_PROCESS_INFO
+IMProcessTableFind(
+    _In_ PLIST_ENTRY Bucket,
+    _In_ HANDLE ProcessId)
+{
+  PLIST_ENTRY entry = Bucket->Flink;
+  PIM_PROCESS_INFO process = NULL;
+
+  for (; entry != Bucket; entry = entry->Flink)
+  {
+    process = CONTAINING_RECORD(entry, IM_PROCESS_INFO, Link);
+    if (process->ProcessId == ProcessId)
+    {
+      return process;
+    }
+  }
+
+  return NULL;
+}
@@ -0,0 +1,74 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_ptab.h
+
+Abstract:
+
+Table of the running target processes hashed by process id. Every
+instance of a target gets its own entry, lookup cost does not depend on
+the amount of targets, and a process which is not a target is usually
+rejected by its empty bucket without taking the lock.
+
+Environment:
+
+Kernel mode
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im.h"
+
+//------------------------------------------------------------------------
+//  Function prototypes.
+//------------------------------------------------------------------------
+
+VOID IMProcessTableInit(
+    _Out_ PIM_PROCESS_TABLE Table);
+
+//
+// Inserts the process and returns the entry it replaced because of the same
+// process id, or NULL. Returned entry is owned by the caller.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PIM_PROCESS_INFO
+IMProcessTableInsert(
+    _Inout_ PIM_PROCESS_TABLE Table,
+    _In_ PIM_PROCESS_INFO Process);
+
+//
+// Returned entry stays valid as long as the process is not removed, that
+// is while the process itself is running when called in its context
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PIM_PROCESS_INFO
+IMProcessTableLookup(
+    _In_ PIM_PROCESS_TABLE Table,
+    _In_ HANDLE ProcessId);
+
+//
+// Removes the process and returns it to the caller, or NULL
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PIM_PROCESS_INFO
+IMProcessTableRemove(
+    _Inout_ PIM_PROCESS_TABLE Table,
+    _In_ HANDLE ProcessId);
+
+//
+// Removes any process, used to empty the table
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PIM_PROCESS_INFO
+IMProcessTableRemoveAny(
+    _Inout_ PIM_PROCESS_TABLE Table);
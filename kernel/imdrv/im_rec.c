@@ -23,16 +23,56 @@ Kernel mode
 //------------------------------------------------------------------------
 
 #include "im_rec.h"
+#include "im_coal.h"
+#include "im_list.h"
+#include "im_ntab.h"
+#include "im_shm.h"
 #include "im_utils.h"
 
+//------------------------------------------------------------------------
+//  Local function prototypes.
+//------------------------------------------------------------------------
+
+static ULONG IMRecordBytes(
+    _In_ PIM_NAME_INFORMATION FileNameInfo,
+    _In_ PIM_NAME_ENTRY ProcessName);
+
+static NTSTATUS
+IMAdmitRecord(
+    _Inout_ PIM_KLIST_HEAD RecordsHead,
+    _In_ ULONG Bytes);
+
+static BOOLEAN IMDropOldestRecord(
+    _Inout_ PIM_KLIST_HEAD RecordsHead);
+
+static VOID IMSendRecord(
+    _In_ PIM_KRECORD_LIST RecordList);
+
+static VOID IMPushClosedRecords(
+    _Inout_ PLIST_ENTRY Closed);
+
 //------------------------------------------------------------------------
 //  Text sections.
 //------------------------------------------------------------------------
 
+//
+// Names are claimed and records written at DISPATCH_LEVEL, not paged
+//
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, IMCreateRecord)
 #pragma alloc_text(PAGE, IMFreeRecord)
 #pragma alloc_text(PAGE, IMFreeRecordList)
+#pragma alloc_text(PAGE, IMPushRecord)
+#pragma alloc_text(PAGE, IMCloseCoalescedRecords)
+#pragma alloc_text(PAGE, IMSetCoalesceWindow)
+#pragma alloc_text(PAGE, IMMoveRecordsToShared)
+#pragma alloc_text(PAGE, IMSetOverflow)
+#pragma alloc_text(PAGE, IMSetRecordsBudget)
+#pragma alloc_text(PAGE, IMRecordBytes)
+#pragma alloc_text(PAGE, IMAdmitRecord)
+#pragma alloc_text(PAGE, IMDropOldestRecord)
+#pragma alloc_text(PAGE, IMSendRecord)
+#pragma alloc_text(PAGE, IMPushClosedRecords)
 #endif // ALLOC_PRAGMA
 
 //------------------------------------------------------------------------
@@ -46,8 +86,9 @@ _Check_return_
         _Outptr_ PIM_KRECORD_LIST *RecordList,
         _In_ PFLT_CALLBACK_DATA Data,
         _In_ PIM_NAME_INFORMATION FileNameInfo,
-        _In_ PUNICODE_STRING ProcessName,
-        _In_ IM_VIDEO_MODE_STATUS VideoMode)
+        _In_ PIM_NAME_ENTRY ProcessName,
+        _In_ IM_VIDEO_MODE_STATUS VideoMode,
+        _In_ BOOLEAN IsBlocked)
 {
   NTSTATUS status = STATUS_SUCCESS;
   PIM_KRECORD_LIST newRecord = NULL;
@@ -56,14 +97,14 @@ _Check_return_
 
   IF_FALSE_RETURN_RESULT(Data != NULL, STATUS_INVALID_PARAMETER_2);
   IF_FALSE_RETURN_RESULT(FileNameInfo != NULL, STATUS_INVALID_PARAMETER_3);
+  IF_FALSE_RETURN_RESULT(FileNameInfo->FullName.Length != 0, STATUS_INVALID_PARAMETER_3);
+  IF_FALSE_RETURN_RESULT(ProcessName != NULL, STATUS_INVALID_PARAMETER_4);
   IF_FALSE_RETURN_RESULT(KeGetCurrentIrql() <= APC_LEVEL, STATUS_UNSUCCESSFUL);
-  IF_FALSE_RETURN_RESULT(Globals.RecordsHead.ElementsPushed < Globals.RecordsHead.MaxElementsToPush, STATUS_MAX_REFERRALS_EXCEEDED);
 
   LOG(("[IM] Record creation start\n"));
 
   __try
   {
-
     newRecord = (PIM_KRECORD_LIST)ExAllocateFromNPagedLookasideList(&Globals.RecordsHead.ElementsLookaside);
 
     if (NULL == newRecord)
@@ -73,24 +114,29 @@ _Check_return_
       __leave;
     }
 
-    RtlZeroMemory(&newRecord->Record, sizeof(IM_KRECORD));
+    RtlZeroMemory(newRecord, sizeof(IM_KRECORD_LIST));
 
     //  setting data
     newRecord->Record.Debug = 0xCEFAADDE;
-    newRecord->Record.TotalLength = sizeof(IM_KRECORD);
     newRecord->Record.VideoModeStatus = VideoMode;
+    newRecord->Record.IsBlocked = IsBlocked;
+    newRecord->Record.Bytes = IMRecordBytes(FileNameInfo, ProcessName);
     newRecord->Record.FileNameInformation = FileNameInfo;
     KeQuerySystemTime(&newRecord->Record.Time);
 
-    NT_IF_FAIL_LEAVE(IMCopyString(&FileNameInfo->FullName, &newRecord->Record.Data[IM_FILE_NAME_INDEX].Size, &newRecord->Record.Data[IM_FILE_NAME_INDEX].Buffer, &newRecord->Record.TotalLength));
+    IMNameTableReference(ProcessName);
+    newRecord->Names[IM_PROCESS_NAME_INDEX] = ProcessName;
 
-    NT_IF_FAIL_LEAVE(IMCopyString(ProcessName, &newRecord->Record.Data[IM_PROCESS_NAME_INDEX].Size, &newRecord->Record.Data[IM_PROCESS_NAME_INDEX].Buffer, &newRecord->Record.TotalLength));
+    NT_IF_FAIL_LEAVE(IMNameTableIntern(&Globals.Names, &FileNameInfo->FullName, &newRecord->Names[IM_FILE_NAME_INDEX]));
   }
   __finally
   {
     if (NT_ERROR(status))
     {
       LOG_B(("[IM] record creation failed\n"));
+
+      IMCountDroppedRecord(IMDropNoMemory, 0);
+
       if (NULL != newRecord)
       {
         IMFreeRecord(newRecord);
@@ -98,9 +144,9 @@ _Check_return_
     }
     else
     {
-      newRecord->Record.SequenceNumber = InterlockedIncrement64(&Globals.RecordsHead.SequenceNumber); // todo may overrun
+      // numbered when it is pushed, see IMSendRecord
       *RecordList = newRecord;
-      LOG(("[IM] Record created with %wZ and %wZ\n", ProcessName, &FileNameInfo->FullName));
+      LOG(("[IM] Record created with %wZ and %wZ\n", &ProcessName->Name, &FileNameInfo->FullName));
     }
   }
 
@@ -110,13 +156,18 @@ _Check_return_
 VOID IMFreeRecord(
     _In_ PIM_KRECORD_LIST RecordList)
 {
+  ULONG i = 0;
+
   PAGED_CODE();
 
   IF_FALSE_RETURN(RecordList != NULL);
 
-  for (ULONG i = 0; i < IM_AMOUNT_OF_DATA; i++)
+  for (; i < IM_AMOUNT_OF_DATA; i++)
   {
-    IMFreeNonPagedBuffer((PVOID)RecordList->Record.Data[i].Buffer);
+    if (NULL != RecordList->Names[i])
+    {
+      IMNameTableRelease(RecordList->Names[i]);
+    }
   }
 
   ExFreeToNPagedLookasideList(&Globals.RecordsHead.ElementsLookaside, RecordList);
@@ -136,4 +187,750 @@ VOID IMFreeRecordList(
   recordList = CONTAINING_RECORD(ListEntry, IM_KRECORD_LIST, List);
 
   IMFreeRecord(recordList);
-}
\ No newline at end of file
+}
+
+VOID IMPushRecord(
+    _In_ PIM_KRECORD_LIST RecordList)
+{
+  LIST_ENTRY closed;
+  BOOLEAN isCoalesced = FALSE;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN(RecordList != NULL);
+
+  // name information is released by now
+  RecordList->Record.FileNameInformation = NULL;
+
+  // the verdict is known by now, priority records have room of their own.
+  // Record which is not admitted is counted as dropped, the load goes on.
+  if (!RecordList->Record.IsBlocked && IM_NOT_APPLICABLE == RecordList->Record.VideoModeStatus &&
+      !NT_SUCCESS(IMAdmitRecord(&Globals.RecordsHead, RecordList->Record.Bytes)))
+  {
+    IMFreeRecord(RecordList);
+    return;
+  }
+
+  isCoalesced = IMCoalesceRecord(&Globals.Coalescer, RecordList, &closed);
+
+  // windows closed meanwhile are older than the record
+  IMPushClosedRecords(&closed);
+
+  if (!isCoalesced)
+  {
+    IMSendRecord(RecordList);
+  }
+}
+
+VOID IMCloseCoalescedRecords(
+    _In_ BOOLEAN IsAll)
+{
+  LIST_ENTRY closed;
+
+  PAGED_CODE();
+
+  IMCoalescerClose(&Globals.Coalescer, IsAll, &closed);
+  IMPushClosedRecords(&closed);
+}
+
+_Check_return_
+    NTSTATUS
+    IMSetCoalesceWindow(
+        _In_ ULONG Milliseconds)
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  LIST_ENTRY closed;
+
+  PAGED_CODE();
+
+  status = IMCoalescerSetWindow(&Globals.Coalescer, Milliseconds, &closed);
+
+  if (NT_SUCCESS(status))
+  {
+    IMPushClosedRecords(&closed);
+  }
+
+  return status;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID IMMoveRecordsToShared(
+    _Inout_ PIM_KLIST_HEAD RecordsHead,
+    _Inout_ PIM_SHARED_RECORDS Shared)
+{
+  PLIST_ENTRY currentEntry = NULL;
+  PIM_KRECORD_LIST recordList = NULL;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN(RecordsHead != NULL);
+  IF_FALSE_RETURN(Shared != NULL);
+
+  ExAcquireFastMutex(&RecordsHead->ConsumerLock);
+
+  IMPop(RecordsHead, &currentEntry);
+
+  while (NULL != currentEntry)
+  {
+    recordList = CONTAINING_RECORD(currentEntry, IM_KRECORD_LIST, List);
+
+    (VOID) IMWriteSharedRecord(Shared, recordList);
+
+    IMFreeRecord(recordList);
+
+    IMPop(RecordsHead, &currentEntry);
+  }
+
+  ExReleaseFastMutex(&RecordsHead->ConsumerLock);
+
+  IMSignalRoom(RecordsHead);
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMGetRecords(
+        _In_ PIM_KLIST_HEAD RecordsHead,
+        _In_ ULONG Flags,
+        _Out_ PVOID OutputBuffer,
+        _In_ ULONG OutputBufferSize,
+        _Out_ PULONG ReturnOutputBufferLength)
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  LIST_ENTRY detached;
+  PLIST_ENTRY currentEntry;
+  PCHAR buffer = OutputBuffer;
+  PIM_KRECORD_LIST recordList;
+  IM_WIRE_BATCH_ENCODER encoder;
+  IM_WIRE_BATCH_ENCODER plan;
+  IM_WIRE_RECORD record;
+  IM_WIRE_RECORD gap;
+  const VOID *strings[IM_AMOUNT_OF_DATA];
+  const VOID *noStrings[IM_AMOUNT_OF_DATA] = {NULL, NULL};
+  IM_WIRE_REPLY reply;
+  BOOLEAN isBatch = FlagOn(Flags, IM_RECORDS_BATCH);
+  BOOLEAN isReport = FlagOn(Flags, IM_RECORDS_REPORT);
+  BOOLEAN isFit = FALSE;
+  ULONG bufferSize = OutputBufferSize;
+  ULONG copiedLen = 0;
+  ULONG length = 0;
+  ULONG gapLength = 0;
+  ULONG lost = 0;
+  KIRQL oldIrql;
+
+  IF_FALSE_RETURN_RESULT(RecordsHead != NULL, STATUS_INVALID_PARAMETER_1);
+  IF_FALSE_RETURN_RESULT(OutputBuffer != NULL, STATUS_INVALID_PARAMETER_3);
+  IF_FALSE_RETURN_RESULT(OutputBufferSize != 0, STATUS_INVALID_PARAMETER_4);
+  IF_FALSE_RETURN_RESULT(ReturnOutputBufferLength != NULL, STATUS_INVALID_PARAMETER_5);
+  IF_FALSE_RETURN_RESULT(KeGetCurrentIrql() == PASSIVE_LEVEL, STATUS_INVALID_LEVEL);
+
+  //LOG(("[IM] Records copy start\n"));
+
+  RtlZeroMemory(&reply, sizeof(reply));
+  RtlZeroMemory(&encoder, sizeof(encoder));
+
+  // reply is written ahead of the records once they are taken
+  if (isReport)
+  {
+    if (OutputBufferSize < IM_WIRE_REPLY_SIZE)
+    {
+      return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    buffer += IM_WIRE_REPLY_SIZE;
+    bufferSize -= IM_WIRE_REPLY_SIZE;
+  }
+
+  // header of the batch is written once its length is known
+  if (isBatch && !IMWireBeginBatch(&encoder, (PUCHAR)buffer, bufferSize))
+  {
+    return isReport ? STATUS_BUFFER_TOO_SMALL : STATUS_NO_MORE_ENTRIES;
+  }
+
+  // lengths in the batch are planned while the records are taken, they
+  // are the same when the records are written
+  plan = encoder;
+
+  InitializeListHead(&detached);
+
+  // producers never wait for it, the lock only keeps drains one at a time.
+  // Records which fit are taken off the lanes under it, the buffer of the
+  // client is written and the records are freed after it.
+  ExAcquireFastMutex(&RecordsHead->ConsumerLock);
+
+  // record stays in the lanes until it is known to fit, so the one which
+  // does not is left for the next call
+  while (NULL != (currentEntry = IMPeek(RecordsHead)))
+  {
+    recordList = CONTAINING_RECORD(currentEntry, IM_KRECORD_LIST, List);
+
+    // records dropped before this one, the gap marker goes ahead of it
+    IMWireMakeGap(&gap, recordList->Record.Lost);
+    gapLength = 0;
+
+    if (0 != gap.Lost)
+    {
+      gapLength = isBatch ? IMWireBatchRecordLength(&plan, &gap, noStrings) : IM_WIRE_RECORD_SIZE;
+    }
+
+    // the client drains records in order, so names it has not got are
+    // sent from here on if the record fits
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    length = IMBeginRecordNames(recordList, recordList->IsSending);
+
+    if (isBatch)
+    {
+      IMMakeWireRecord(recordList, recordList->IsSending, &record, strings);
+      length = IMWireBatchRecordLength(&plan, &record, strings);
+      isFit = bufferSize - plan.Length >= gapLength + length;
+    }
+    else
+    {
+      isFit = bufferSize >= copiedLen + gapLength + length;
+    }
+
+    IMEndRecordNames(recordList, recordList->IsSending, isFit);
+
+    KeLowerIrql(oldIrql);
+
+    if (!isFit)
+    {
+      // the record would wait at the head forever, the client is told
+      // how large a buffer it needs
+      if (0 == copiedLen)
+      {
+        reply.Required = (isReport ? IM_WIRE_REPLY_SIZE : 0) + (isBatch ? IM_WIRE_BATCH_HEADER_SIZE : 0) +
+                         gapLength + length;
+      }
+      break;
+    }
+
+    // the next strings of the batch are planned against these ones, the
+    // record keeps them until it is written
+    if (isBatch)
+    {
+      if (0 != gapLength)
+      {
+        (VOID) IMWireReserveBatchRecord(&plan, &gap, noStrings);
+      }
+
+      (VOID) IMWireReserveBatchRecord(&plan, &record, strings);
+    }
+
+    copiedLen += gapLength + length;
+
+    IMPop(RecordsHead, &currentEntry);
+
+    InsertTailList(&detached, currentEntry);
+  }
+
+  // records dropped after the last queued one are reported now, not
+  // with the next record which may never come
+  if (NULL == currentEntry && 0 != (lost = IMTakeLostRecords()))
+  {
+    IMWireMakeGap(&gap, lost);
+
+    if (isBatch)
+    {
+      gapLength = IMWireBatchRecordLength(&plan, &gap, noStrings);
+      isFit = bufferSize - plan.Length >= gapLength;
+    }
+    else
+    {
+      gapLength = IM_WIRE_RECORD_SIZE;
+      isFit = bufferSize >= copiedLen + gapLength;
+    }
+
+    if (isFit)
+    {
+      copiedLen += gapLength;
+    }
+    else
+    {
+      IMPutBackLostRecords(lost);
+      lost = 0;
+    }
+  }
+
+  ExReleaseFastMutex(&RecordsHead->ConsumerLock);
+
+  IMSignalRoom(RecordsHead);
+
+  __try
+  {
+    for (currentEntry = detached.Flink; currentEntry != &detached; currentEntry = currentEntry->Flink)
+    {
+      recordList = CONTAINING_RECORD(currentEntry, IM_KRECORD_LIST, List);
+
+      IMWireMakeGap(&gap, recordList->Record.Lost);
+      IMMakeWireRecord(recordList, recordList->IsSending, &record, strings);
+
+      if (isBatch)
+      {
+        if (0 != gap.Lost)
+        {
+          (VOID) IMWireEncodeBatchRecord(&encoder, &gap, noStrings);
+        }
+
+        (VOID) IMWireEncodeBatchRecord(&encoder, &record, strings);
+      }
+      else
+      {
+        if (0 != gap.Lost)
+        {
+          buffer += IMWireEncodeRecord((PUCHAR)buffer, IM_WIRE_RECORD_SIZE, &gap, noStrings);
+        }
+
+        buffer += IMWireEncodeRecord((PUCHAR)buffer, IMWireRecordLength(&record), &record, strings);
+      }
+    }
+
+    if (0 != lost)
+    {
+      IMWireMakeGap(&gap, lost);
+
+      if (isBatch)
+      {
+        (VOID) IMWireEncodeBatchRecord(&encoder, &gap, noStrings);
+      }
+      else
+      {
+        (VOID) IMWireEncodeRecord((PUCHAR)buffer, IM_WIRE_RECORD_SIZE, &gap, noStrings);
+      }
+    }
+
+    if (isBatch && copiedLen > 0)
+    {
+      copiedLen = IMWireEndBatch(&encoder);
+    }
+  }
+  __except (EXCEPTION_EXECUTE_HANDLER)
+  {
+    status = GetExceptionCode();
+  }
+
+  // records the client did not get are counted as lost, it gets a gap
+  // marker for them with the next ones
+  while (!IsListEmpty(&detached))
+  {
+    currentEntry = RemoveHeadList(&detached);
+    recordList = CONTAINING_RECORD(currentEntry, IM_KRECORD_LIST, List);
+
+    if (!NT_SUCCESS(status))
+    {
+      lost += recordList->Record.Lost + 1;
+    }
+
+    IMFreeRecord(recordList);
+  }
+
+  if (!NT_SUCCESS(status))
+  {
+    IMPutBackLostRecords(lost);
+    return status;
+  }
+
+  // what is left is counted after the drain, producers go on meanwhile
+  if (isReport && (copiedLen > 0 || 0 != reply.Required))
+  {
+    reply.Queued = (ULONG)max(IMCountElements(RecordsHead), 0);
+    reply.QueuedBytes = (ULONG)min(max(IMCountBytes(RecordsHead), 0), (LONGLONG)MAXULONG);
+
+    __try
+    {
+      copiedLen += IMWireEncodeReply((PUCHAR)OutputBuffer, IM_WIRE_REPLY_SIZE, &reply);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+      return GetExceptionCode();
+    }
+  }
+
+  // if at least one record was copied, or the reply tells why none was,
+  // return success
+  if (copiedLen > 0)
+  {
+    LOG(("[IM] Copied bytes to user space = %d\n", copiedLen));
+
+    *ReturnOutputBufferLength = copiedLen;
+
+    return STATUS_SUCCESS;
+  }
+
+  //LOG(("[IM] No records were copied\n"));
+
+  return STATUS_NO_MORE_ENTRIES;
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+ULONG IMBeginRecordNames(
+    _In_ PIM_KRECORD_LIST RecordList,
+    _Out_writes_(IM_AMOUNT_OF_DATA) PBOOLEAN IsSending)
+{
+  ULONG length = RecordList->Record.Count > 1 ? IM_WIRE_RECORD_SIZE + IM_WIRE_COALESCED_SIZE : IM_WIRE_RECORD_SIZE;
+  ULONG first = IM_PROCESS_NAME_INDEX;
+  ULONG index = 0;
+  ULONG i = 0;
+
+  // two names are claimed in order of their ids, so two writers never
+  // wait for each other
+  if (RecordList->Names[IM_FILE_NAME_INDEX]->Id < RecordList->Names[IM_PROCESS_NAME_INDEX]->Id)
+  {
+    first = IM_FILE_NAME_INDEX;
+  }
+
+  for (; i < IM_AMOUNT_OF_DATA; i++)
+  {
+    index = (first + i) % IM_AMOUNT_OF_DATA;
+
+    // the same name twice is sent once
+    IsSending[index] = (index == first || RecordList->Names[index] != RecordList->Names[first]) &&
+                       IMNameTableBeginSend(&Globals.Names, RecordList->Names[index]);
+
+    if (IsSending[index])
+    {
+      length += RecordList->Names[index]->Name.MaximumLength;
+    }
+  }
+
+  return length;
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+VOID IMEndRecordNames(
+    _In_ PIM_KRECORD_LIST RecordList,
+    _In_reads_(IM_AMOUNT_OF_DATA) PBOOLEAN IsSending,
+    _In_ BOOLEAN IsSent)
+{
+  ULONG i = 0;
+
+  for (; i < IM_AMOUNT_OF_DATA; i++)
+  {
+    if (IsSending[i])
+    {
+      IMNameTableEndSend(RecordList->Names[i], IsSent);
+    }
+  }
+}
+
+VOID IMMakeWireRecord(
+    _In_ PIM_KRECORD_LIST RecordList,
+    _In_reads_(IM_AMOUNT_OF_DATA) PBOOLEAN IsSending,
+    _Out_ PIM_WIRE_RECORD Record,
+    _Out_writes_(IM_AMOUNT_OF_DATA) const VOID **Strings)
+{
+  ULONG i = 0;
+
+  RtlZeroMemory(Record, sizeof(IM_WIRE_RECORD));
+
+  Record->Flags = (RecordList->Record.IsBlocked ? IM_WIRE_BLOCKED : 0) |
+                  (RecordList->Record.IsSucceded ? IM_WIRE_SUCCEEDED : 0);
+  Record->SequenceNumber = RecordList->Record.SequenceNumber;
+  Record->Time = RecordList->Record.Time.QuadPart;
+  Record->VideoMode = (ULONG)RecordList->Record.VideoModeStatus;
+  Record->LastTime = Record->Time;
+  Record->Count = 1;
+
+  if (RecordList->Record.Count > 1)
+  {
+    Record->Flags |= IM_WIRE_COALESCED;
+    Record->LastTime = RecordList->Record.LastTime.QuadPart;
+    Record->Count = RecordList->Record.Count;
+  }
+
+  for (; i < IM_AMOUNT_OF_DATA; i++)
+  {
+    Record->Names[i].Id = RecordList->Names[i]->Id;
+    Record->Names[i].Size = IsSending[i] ? RecordList->Names[i]->Name.MaximumLength : 0;
+    Strings[i] = RecordList->Names[i]->Name.Buffer;
+  }
+}
+
+VOID IMWriteRecord(
+    _In_ PIM_KRECORD_LIST RecordList,
+    _In_reads_(IM_AMOUNT_OF_DATA) PBOOLEAN IsSending,
+    _Out_writes_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length)
+{
+  IM_WIRE_RECORD record;
+  const VOID *strings[IM_AMOUNT_OF_DATA];
+  ULONG written = 0;
+
+  IMMakeWireRecord(RecordList, IsSending, &record, strings);
+
+  // the length was counted from the same sizes, so it fits
+  written = IMWireEncodeRecord((PUCHAR)Buffer, Length, &record, strings);
+
+  FLT_ASSERT(written == Length);
+  UNREFERENCED_PARAMETER(written);
+}
+
+VOID IMCountDroppedRecord(
+    _In_ IM_DROP_REASON Reason,
+    _In_ ULONG Lost)
+{
+  InterlockedIncrement64(&Globals.Overflow.Dropped[Reason]);
+
+  // the ones dropped before it are reported together with it
+  IMPutBackLostRecords(Lost + 1);
+}
+
+ULONG
+IMTakeLostRecords(VOID)
+{
+  // plain read first, most of the records come without drops
+  if (0 == ReadNoFence(&Globals.Overflow.Lost))
+  {
+    return 0;
+  }
+
+  return (ULONG)InterlockedExchange(&Globals.Overflow.Lost, 0);
+}
+
+VOID IMPutBackLostRecords(
+    _In_ ULONG Lost)
+{
+  if (0 != Lost)
+  {
+    InterlockedExchangeAdd(&Globals.Overflow.Lost, (LONG)Lost);
+  }
+}
+
+_Check_return_
+    NTSTATUS
+    IMSetOverflow(
+        _In_ PIM_OVERFLOW Overflow)
+{
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(Overflow != NULL, STATUS_INVALID_PARAMETER_1);
+  IF_FALSE_RETURN_RESULT(Overflow->Policy < IMOverflowPolicies, STATUS_INVALID_PARAMETER_1);
+
+  // the image load waits for the consumer, so not for long
+  WriteNoFence(&Globals.Overflow.Milliseconds, (LONG)min(Overflow->Milliseconds, IM_OVERFLOW_MAX_WAIT));
+  WriteNoFence(&Globals.Overflow.Policy, (LONG)Overflow->Policy);
+
+  LOG(("[IM] Overflow policy %u, wait %u ms\n", Overflow->Policy, Globals.Overflow.Milliseconds));
+
+  return STATUS_SUCCESS;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMSetRecordsBudget(
+        _In_ ULONG Bytes)
+{
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(Bytes >= IM_MIN_RECORDS_BUDGET && Bytes <= IM_MAX_RECORDS_BUDGET, STATUS_INVALID_PARAMETER_1);
+
+  LOG(("[IM] Records budget %u bytes\n", Bytes));
+
+  // every record takes its fixed part at least, so the ring has a slot
+  // for each one within the budget
+  return IMResizeList(&Globals.RecordsHead, (LONG)(Bytes / sizeof(IM_KRECORD_LIST)), (LONG)Bytes);
+}
+
+VOID IMGetStatistics(
+    _Out_ PIM_RECORDS_STATISTICS Statistics)
+{
+  ULONG i = 0;
+
+  RtlZeroMemory(Statistics, sizeof(IM_RECORDS_STATISTICS));
+
+  Statistics->Overflow.Policy = (ULONG)ReadNoFence(&Globals.Overflow.Policy);
+  Statistics->Overflow.Milliseconds = (ULONG)ReadNoFence(&Globals.Overflow.Milliseconds);
+  Statistics->Queued = (ULONGLONG)max(IMCountElements(&Globals.RecordsHead), 0);
+
+  for (; i < IMDropReasons; i++)
+  {
+    Statistics->Dropped[i] = (ULONGLONG)Globals.Overflow.Dropped[i];
+  }
+
+  Statistics->Budget = (ULONGLONG)Globals.RecordsHead.MaxBytesToPush;
+  Statistics->QueuedBytes = (ULONGLONG)IMCountBytes(&Globals.RecordsHead);
+  Statistics->MaxQueuedBytes = (ULONGLONG)ReadNoFence(&Globals.RecordsHead.MaxBytesPushed);
+  Statistics->Coalesced = (ULONGLONG)Globals.Coalescer.Coalesced;
+  Statistics->VerdictHits = (ULONGLONG)Globals.VerdictHits;
+  Statistics->VerdictMisses = (ULONGLONG)Globals.VerdictMisses;
+}
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+//
+// What the queued record takes from the budget: the record and the
+// strings of its names, which the name table keeps while it is queued.
+// Names shared by records are counted for each of them.
+//
+static ULONG IMRecordBytes(
+    _In_ PIM_NAME_INFORMATION FileNameInfo,
+    _In_ PIM_NAME_ENTRY ProcessName)
+{
+  PAGED_CODE();
+
+  return sizeof(IM_KRECORD_LIST) + ProcessName->Name.Length + FileNameInfo->FullName.Length;
+}
+
+//
+// Record is admitted if the queue has room for it or the policy makes it
+//
+static NTSTATUS
+IMAdmitRecord(
+    _Inout_ PIM_KLIST_HEAD RecordsHead,
+    _In_ ULONG Bytes)
+{
+  PAGED_CODE();
+
+  if (IMHasRoom(RecordsHead, Bytes))
+  {
+    return STATUS_SUCCESS;
+  }
+
+  switch (ReadNoFence(&Globals.Overflow.Policy))
+  {
+  case IMOverflowDropOldest:
+    // long name may take the room of a few records
+    while (!IMHasRoom(RecordsHead, Bytes) && IMDropOldestRecord(RecordsHead))
+    {
+    }
+
+    return STATUS_SUCCESS;
+
+  case IMOverflowBlock:
+    if (STATUS_SUCCESS == IMWaitForRoom(RecordsHead, Bytes, (ULONG)ReadNoFence(&Globals.Overflow.Milliseconds)))
+    {
+      return STATUS_SUCCESS;
+    }
+
+    IMCountDroppedRecord(IMDropWaitTimeout, 0);
+    break;
+
+  default:
+    IMCountDroppedRecord(IMDropQueueFull, 0);
+    break;
+  }
+
+  return STATUS_MAX_REFERRALS_EXCEEDED;
+}
+
+//
+// Frees the oldest queued record, the next one takes the gap marker. A
+// drain in progress makes room anyway, so the record is admitted without
+// waiting for it: the ring has slots for twice the limit. FALSE if there
+// was nothing to drop or a drain is in progress.
+//
+static BOOLEAN IMDropOldestRecord(
+    _Inout_ PIM_KLIST_HEAD RecordsHead)
+{
+  PLIST_ENTRY currentEntry = NULL;
+  PLIST_ENTRY nextEntry = NULL;
+  PIM_KRECORD_LIST recordList = NULL;
+  ULONG lost = 0;
+
+  PAGED_CODE();
+
+  if (!ExTryToAcquireFastMutex(&RecordsHead->ConsumerLock))
+  {
+    return FALSE;
+  }
+
+  // records of the priority lane are not dropped
+  if (NULL != IMPeekShared(RecordsHead))
+  {
+    IMPop(RecordsHead, &currentEntry);
+  }
+
+  if (NULL != currentEntry)
+  {
+    recordList = CONTAINING_RECORD(currentEntry, IM_KRECORD_LIST, List);
+
+    lost = recordList->Record.Lost + 1;
+
+    IMFreeRecord(recordList);
+
+    InterlockedIncrement64(&Globals.Overflow.Dropped[IMDropOldest]);
+
+    // only the owner of the lock reads the record at the head
+    nextEntry = IMPeek(RecordsHead);
+
+    if (NULL != nextEntry)
+    {
+      CONTAINING_RECORD(nextEntry, IM_KRECORD_LIST, List)->Record.Lost += lost;
+    }
+    else
+    {
+      IMPutBackLostRecords(lost);
+    }
+  }
+
+  ExReleaseFastMutex(&RecordsHead->ConsumerLock);
+
+  return NULL != currentEntry;
+}
+
+//
+// Writes the record to the shared ring if the client mapped one, queues it
+// otherwise
+//
+static VOID IMSendRecord(
+    _In_ PIM_KRECORD_LIST RecordList)
+{
+  ULONG lost = 0;
+
+  PAGED_CODE();
+
+  // records dropped since the last one are reported ahead of it
+  RecordList->Record.Lost += IMTakeLostRecords();
+
+  if (STATUS_DEVICE_NOT_CONNECTED == IMWriteSharedRecord(&Globals.SharedRecords, RecordList))
+  {
+    lost = RecordList->Record.Lost;
+
+    // blocked loads and video mode switches go ahead of the flood of the
+    // others
+    if (RecordList->Record.IsBlocked || IM_NOT_APPLICABLE != RecordList->Record.VideoModeStatus)
+    {
+      if (!IMPushPriority(&RecordList->List, &Globals.RecordsHead, RecordList->Record.Bytes, &RecordList->Record.SequenceNumber))
+      {
+        IMCountDroppedRecord(IMDropQueueFull, lost);
+      }
+
+      return;
+    }
+
+    // the lane of the processor numbers the record, the list counts its
+    // bytes until it is popped
+    if (!IMPush(&RecordList->List, &Globals.RecordsHead, RecordList->Record.Bytes, &RecordList->Record.SequenceNumber))
+    {
+      IMCountDroppedRecord(IMDropQueueFull, lost);
+    }
+
+    return;
+  }
+
+  // client has its copy, or the ring was full and it is dropped
+  IMFreeRecord(RecordList);
+}
+
+//
+// Record of the closed window takes its place in the order now, it is
+// numbered when it is pushed
+//
+static VOID IMPushClosedRecords(
+    _Inout_ PLIST_ENTRY Closed)
+{
+  PIM_KRECORD_LIST recordList = NULL;
+
+  PAGED_CODE();
+
+  while (!IsListEmpty(Closed))
+  {
+    recordList = CONTAINING_RECORD(RemoveHeadList(Closed), IM_KRECORD_LIST, List);
+
+    IMSendRecord(recordList);
+  }
+}
@@ -30,6 +30,11 @@ Kernel mode
 //  Function prototypes.
 //------------------------------------------------------------------------
 
+//
+// Record is of fixed size and refers to the interned names, the process
+// name is interned once for the process, see im_ntab.h. It is admitted to
+// the queue when it is pushed, once its verdict is known.
+//
 _Check_return_
     _IRQL_requires_max_(APC_LEVEL)
         NTSTATUS
@@ -37,11 +42,139 @@ _Check_return_
         _Outptr_ PIM_KRECORD_LIST *RecordList,
         _In_ PFLT_CALLBACK_DATA Data,
         _In_ PIM_NAME_INFORMATION FileNameInformation,
-        _In_ PUNICODE_STRING ProcessName,
-        _In_ IM_VIDEO_MODE_STATUS VideoMode);
+        _In_ PIM_NAME_ENTRY ProcessName,
+        _In_ IM_VIDEO_MODE_STATUS VideoMode,
+        _In_ BOOLEAN IsBlocked);
 
 VOID IMFreeRecord(
     _In_ PIM_KRECORD_LIST RecordList);
 
 VOID IMFreeRecordList(
     _In_ PLIST_ENTRY ListEntry);
+
+//
+// Gives the record to the client: writes it to the shared ring if the
+// client mapped one, otherwise queues it for IMGetRecords. Allowed record
+// is admitted by the overflow policy first and is freed and counted as
+// dropped if it is not, the load never fails for it. Blocked and video
+// mode records go to the priority lane of the queue, which is drained
+// first and is never dropped from for room.
+//
+VOID IMPushRecord(
+    _In_ PIM_KRECORD_LIST RecordList);
+
+//
+// Pushes the records of the due coalescing windows, or of every window if
+// IsAll, see im_coal.h
+//
+VOID IMCloseCoalescedRecords(
+    _In_ BOOLEAN IsAll);
+
+//
+// Identical records within Milliseconds are coalesced from now on, 0
+// turns it off. Records of the open windows are pushed.
+//
+_Check_return_
+    NTSTATUS
+    IMSetCoalesceWindow(
+        _In_ ULONG Milliseconds);
+
+//
+// Writes records queued before the client mapped the shared ring to it
+//
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID IMMoveRecordsToShared(
+    _Inout_ PIM_KLIST_HEAD RecordsHead,
+    _Inout_ PIM_SHARED_RECORDS Shared);
+
+//
+// Claims the names of the record the client has not got yet and returns
+// the length of the record with them behind it. Stays at DISPATCH_LEVEL
+// until IMEndRecordNames, which is called once it is known if the record
+// goes out, before it is written.
+//
+_IRQL_requires_(DISPATCH_LEVEL)
+ULONG IMBeginRecordNames(
+    _In_ PIM_KRECORD_LIST RecordList,
+    _Out_writes_(IM_AMOUNT_OF_DATA) PBOOLEAN IsSending);
+
+_IRQL_requires_(DISPATCH_LEVEL)
+VOID IMEndRecordNames(
+    _In_ PIM_KRECORD_LIST RecordList,
+    _In_reads_(IM_AMOUNT_OF_DATA) PBOOLEAN IsSending,
+    _In_ BOOLEAN IsSent);
+
+//
+// Fields of the record in the wire format, strings of the claimed names
+// have Size
+//
+VOID IMMakeWireRecord(
+    _In_ PIM_KRECORD_LIST RecordList,
+    _In_reads_(IM_AMOUNT_OF_DATA) PBOOLEAN IsSending,
+    _Out_ PIM_WIRE_RECORD Record,
+    _Out_writes_(IM_AMOUNT_OF_DATA) const VOID **Strings);
+
+//
+// Encodes the record in the wire format, the claimed names follow it.
+// Length is the one IMBeginRecordNames returned.
+//
+VOID IMWriteRecord(
+    _In_ PIM_KRECORD_LIST RecordList,
+    _In_reads_(IM_AMOUNT_OF_DATA) PBOOLEAN IsSending,
+    _Out_writes_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length);
+
+//
+// Copies queued records which fit, Flags are IM_RECORDS_* of
+// GetRecordsCommand. With IM_RECORDS_REPORT the reply goes first, it is
+// all there is when the first record does not fit the buffer. Records are
+// taken under ConsumerLock and written to the buffer after it.
+//
+_IRQL_requires_(PASSIVE_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMGetRecords(
+        _In_ PIM_KLIST_HEAD RecordsHead,
+        _In_ ULONG Flags,
+        _Out_ PVOID OutputBuffer,
+        _In_ ULONG OutputBufferSize,
+        _Out_ PULONG ReturnOutputBufferLength);
+
+//
+// Drop accounting. A dropped record is counted by its reason and added to
+// the lost ones, together with Lost ones dropped before it. The next
+// record given to the client takes them and carries the gap marker.
+//
+VOID IMCountDroppedRecord(
+    _In_ IM_DROP_REASON Reason,
+    _In_ ULONG Lost);
+
+ULONG
+IMTakeLostRecords(VOID);
+
+//
+// Lost records taken for a gap marker which did not go out
+//
+VOID IMPutBackLostRecords(
+    _In_ ULONG Lost);
+
+//
+// Overflow policy of SetOverflowCommand
+//
+_Check_return_
+    NTSTATUS
+    IMSetOverflow(
+        _In_ PIM_OVERFLOW Overflow);
+
+//
+// Budget of the queued records in bytes, see SetBudgetCommand. Queued
+// records are moved to the ring of the new size and none is lost.
+//
+_IRQL_requires_(PASSIVE_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMSetRecordsBudget(
+        _In_ ULONG Bytes);
+
+VOID IMGetStatistics(
+    _Out_ PIM_RECORDS_STATISTICS Statistics);
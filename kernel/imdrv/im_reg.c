@@ -70,10 +70,10 @@ CONST FLT_REGISTRATION FilterRegistration = {
 
     DriverUnload, //  FilterUnload
 
-    NULL,                    //  InstanceSetup
-    IMInstanceQueryTeardown, //  InstanceQueryTeardown
-    NULL,                    //  InstanceTeardownStart
-    NULL,                    //  InstanceTeardownComplete
+    NULL,                       //  InstanceSetup
+    IMInstanceQueryTeardown,    //  InstanceQueryTeardown
+    NULL,                       //  InstanceTeardownStart
+    IMInstanceTeardownComplete, //  InstanceTeardownComplete
 
     NULL, //  GenerateFileName
     NULL, //  GenerateDestinationFileName
@@ -24,27 +24,34 @@ Kernel mode
 #include "im_req.h"
 #include "im_utils.h"
 
-//------------------------------------------------------------------------
-//  Local functions.
-//------------------------------------------------------------------------
-
-_Check_return_
-    NTSTATUS
-    IMSplitNameInformation(
-        _In_ PUNICODE_STRING FullName,
-        _Outptr_ PIM_NAME_INFORMATION *NameInformation);
-
 //------------------------------------------------------------------------
 //  Text sections.
 //------------------------------------------------------------------------
 
 #ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, IMQueryFileNameInformation)
 #pragma alloc_text(PAGE, IMGetFileNameInformation)
 #pragma alloc_text(PAGE, IMGetProcessNameInformation)
 #pragma alloc_text(PAGE, IMReleaseNameInformation)
 #pragma alloc_text(PAGE, IMSplitNameInformation)
+#pragma alloc_text(PAGE, IMInitNameInformation)
+#pragma alloc_text(PAGE, IMFindSplitIndex)
 #endif // ALLOC_PRAGMA
 
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static ULONG
+IMFindSplitIndex(
+    _In_reads_(Count) PCWCH Buffer,
+    _In_ ULONG Count,
+    _In_ WCHAR Delimeter);
+
+static VOID IMInitNameInformation(
+    _Out_ PIM_NAME_INFORMATION NameInformation,
+    _In_ PCUNICODE_STRING FullName);
+
 //------------------------------------------------------------------------
 // Undocumented funstions not found in the headers
 //------------------------------------------------------------------------
@@ -60,6 +67,61 @@ NTSTATUS ZwQueryInformationProcess(
 //  Functions.
 //------------------------------------------------------------------------
 
+_Check_return_
+    NTSTATUS
+    IMQueryFileNameInformation(
+        _Inout_ PFLT_CALLBACK_DATA Data,
+        _Outptr_ PFLT_FILE_NAME_INFORMATION *FileNameInformation)
+{
+  NTSTATUS status = STATUS_SUCCESS;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(Data != NULL, STATUS_INVALID_PARAMETER_1);
+  IF_FALSE_RETURN_RESULT(FileNameInformation != NULL, STATUS_INVALID_PARAMETER_2);
+
+  *FileNameInformation = NULL;
+
+  LOG(("[IM] Querying file name information\n"));
+
+  if (FlagOn(Data->Iopb->OperationFlags, SL_OPEN_TARGET_DIRECTORY))
+  {
+    // The SL_OPEN_TARGET_DIRECTORY flag indicates the caller is attempting
+    // to open the target of a rename or hard link creation operation. We
+    // must clear this flag when asking fltmgr for the name or the result
+    // will not include the final component.
+    ClearFlag(Data->Iopb->OperationFlags, SL_OPEN_TARGET_DIRECTORY);
+
+    // Get the filename as it appears below this filter. Note that we use
+    // FLT_FILE_NAME_QUERY_FILESYSTEM_ONLY when querying the filename
+    // so that the filename as it appears below this filter does not end up
+    // in filter manager's name cache.
+    status = FltGetFileNameInformation(Data, FLT_FILE_NAME_OPENED | FLT_FILE_NAME_QUERY_FILESYSTEM_ONLY | FLT_FILE_NAME_ALLOW_QUERY_ON_REPARSE, FileNameInformation);
+
+    // Restore the SL_OPEN_TARGET_DIRECTORY flag so the create will proceed
+    // for the target. The file systems depend on this flag being set in
+    // the target create in order for the subsequent SET_INFORMATION
+    // operation to proceed correctly.
+    SetFlag(Data->Iopb->OperationFlags, SL_OPEN_TARGET_DIRECTORY);
+  }
+  else
+  {
+    // In some cases it is not safe for filter manager to generate a
+    // file name, and FLT_FILE_NAME_QUERY_DEFAULT will detect those cases
+    // and fail without looking in the cache.
+    // FLT_FILE_NAME_QUERY_ALWAYS_ALLOW_CACHE_LOOKUP always checks the cache,
+    // and then queries the file system if its safe.
+    status = FltGetFileNameInformation(Data, FLT_FILE_NAME_OPENED | FLT_FILE_NAME_QUERY_ALWAYS_ALLOW_CACHE_LOOKUP | FLT_FILE_NAME_ALLOW_QUERY_ON_REPARSE, FileNameInformation);
+  }
+
+  if (NT_SUCCESS(status))
+  {
+    LOG(("[IM] file name information: %wZ\n", &(*FileNameInformation)->Name));
+  }
+
+  return status;
+}
+
 _Check_return_
     NTSTATUS
     IMGetFileNameInformation(
@@ -101,39 +163,7 @@ Return value:
 
   __try
   {
-    if (FlagOn(Data->Iopb->OperationFlags, SL_OPEN_TARGET_DIRECTORY))
-    {
-      // The SL_OPEN_TARGET_DIRECTORY flag indicates the caller is attempting
-      // to open the target of a rename or hard link creation operation. We
-      // must clear this flag when asking fltmgr for the name or the result
-      // will not include the final component.
-      ClearFlag(Data->Iopb->OperationFlags, SL_OPEN_TARGET_DIRECTORY);
-
-      // Get the filename as it appears below this filter. Note that we use
-      // FLT_FILE_NAME_QUERY_FILESYSTEM_ONLY when querying the filename
-      // so that the filename as it appears below this filter does not end up
-      // in filter manager's name cache.
-      status = FltGetFileNameInformation(Data, FLT_FILE_NAME_OPENED | FLT_FILE_NAME_QUERY_FILESYSTEM_ONLY | FLT_FILE_NAME_ALLOW_QUERY_ON_REPARSE, &fileNameInfo);
-
-      // Restore the SL_OPEN_TARGET_DIRECTORY flag so the create will proceed
-      // for the target. The file systems depend on this flag being set in
-      // the target create in order for the subsequent SET_INFORMATION
-      // operation to proceed correctly.
-      SetFlag(Data->Iopb->OperationFlags, SL_OPEN_TARGET_DIRECTORY);
-    }
-    else
-    {
-      // In some cases it is not safe for filter manager to generate a
-      // file name, and FLT_FILE_NAME_QUERY_DEFAULT will detect those cases
-      // and fail without looking in the cache.
-      // FLT_FILE_NAME_QUERY_ALWAYS_ALLOW_CACHE_LOOKUP always checks the cache,
-      // and then queries the file system if its safe.
-      status = FltGetFileNameInformation(Data, FLT_FILE_NAME_OPENED | FLT_FILE_NAME_QUERY_ALWAYS_ALLOW_CACHE_LOOKUP | FLT_FILE_NAME_ALLOW_QUERY_ON_REPARSE, &fileNameInfo);
-    }
-
-    NT_IF_FAIL_LEAVE(status);
-
-    LOG(("[IM] file name information: %wZ\n", &fileNameInfo->Name));
+    NT_IF_FAIL_LEAVE(IMQueryFileNameInformation(Data, &fileNameInfo));
 
     NT_IF_FAIL_LEAVE(IMSplitNameInformation(&fileNameInfo->Name, NameInformation));
   }
@@ -170,7 +200,8 @@ _Check_return_
   NTSTATUS status = STATUS_SUCCESS;
   ULONG returnedLength = 0;
   HANDLE hProcess = NULL;
-  PVOID buffer = NULL;
+  PIM_NAME_INFORMATION nameInfo = NULL;
+  PUNICODE_STRING imageName = NULL;
   PEPROCESS eProcess = NULL;
 
   PAGED_CODE();
@@ -198,23 +229,34 @@ _Check_return_
       __leave;
     }
 
-    NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer(&buffer, returnedLength));
+    // image name is queried right behind the name information, so the
+    // views point into the same allocation and nothing is copied
+    nameInfo = (PIM_NAME_INFORMATION)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(IM_NAME_INFORMATION) + returnedLength, IM_BUFFER_TAG);
+    if (NULL == nameInfo)
+    {
+      status = STATUS_INSUFFICIENT_RESOURCES;
+      __leave;
+    }
+
+    imageName = (PUNICODE_STRING)(nameInfo + 1);
 
     NT_IF_FAIL_LEAVE(ZwQueryInformationProcess(hProcess,
                                                ProcessImageFileName,
-                                               buffer,
+                                               imageName,
                                                returnedLength,
                                                &returnedLength));
 
-    NT_IF_FAIL_LEAVE(IMSplitNameInformation((PUNICODE_STRING)buffer, NameInformation));
-  }
-  __finally
-  {
-    if (NULL != buffer)
+    if (NULL == imageName->Buffer || 0 == imageName->Length)
     {
-      ExFreePool(buffer);
+      // system processes have no image
+      status = STATUS_OBJECT_NAME_NOT_FOUND;
+      __leave;
     }
 
+    IMInitNameInformation(nameInfo, imageName);
+  }
+  __finally
+  {
     if (NULL != hProcess)
     {
       ZwClose(hProcess);
@@ -223,12 +265,12 @@ _Check_return_
     if (NT_ERROR(status))
     {
       LOG_B(("[IM] Get process name information failed\n"));
-      IMReleaseNameInformation(*NameInformation);
-      (*NameInformation) = NULL;
+      IMReleaseNameInformation(nameInfo);
     }
     else
     {
-      LOG(("[IM] Got process with name %wZ\n", &(*NameInformation)->FullName));
+      LOG(("[IM] Got process with name %wZ\n", &nameInfo->FullName));
+      *NameInformation = nameInfo;
     }
   }
 
@@ -242,23 +284,7 @@ VOID IMReleaseNameInformation(
 
   IF_FALSE_RETURN(NameInformation != NULL);
 
-  if (NULL != NameInformation->ParentDir.Buffer)
-  {
-    ExFreePool(NameInformation->ParentDir.Buffer);
-  }
-  if (NULL != NameInformation->Name.Buffer)
-  {
-    ExFreePool(NameInformation->Name.Buffer);
-  }
-  if (NULL != NameInformation->FullName.Buffer)
-  {
-    ExFreePool(NameInformation->FullName.Buffer);
-  }
-  if (NULL != NameInformation->Extension.Buffer)
-  {
-    ExFreePool(NameInformation->Extension.Buffer);
-  }
-
+  // strings are views into the same allocation
   ExFreePool(NameInformation);
 
   LOG(("[IM] Name information released\n"));
@@ -270,8 +296,8 @@ _Check_return_
         _In_ PUNICODE_STRING FullName,
         _Outptr_ PIM_NAME_INFORMATION *NameInformation)
 {
-  NTSTATUS status = STATUS_SUCCESS;
   PIM_NAME_INFORMATION nameInfo = NULL;
+  UNICODE_STRING fullName;
 
   PAGED_CODE();
 
@@ -284,29 +310,108 @@ _Check_return_
 
   LOG(("[IM] Splitting name information\n"));
 
-  __try
+  // one allocation: name information followed by the null terminated copy
+  // of the full name, everything is written so nothing has to be zeroed
+  nameInfo = (PIM_NAME_INFORMATION)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(IM_NAME_INFORMATION) + FullName->Length + sizeof(WCHAR), IM_BUFFER_TAG);
+  if (NULL == nameInfo)
   {
-    NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer(&nameInfo, sizeof(IM_NAME_INFORMATION)));
+    LOG_B(("[IM] Split name information failed\n"));
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
 
-    NT_IF_FAIL_LEAVE(IMCopyUnicodeString(&nameInfo->FullName, FullName));
+  fullName.Buffer = (PWCH)(nameInfo + 1);
+  fullName.Length = FullName->Length;
+  fullName.MaximumLength = FullName->Length + sizeof(WCHAR);
 
-    NT_IF_FAIL_LEAVE(IMSplitString(&nameInfo->FullName, &nameInfo->ParentDir, &nameInfo->Name, L'\\', -1));
+  RtlCopyMemory(fullName.Buffer, FullName->Buffer, FullName->Length);
+  fullName.Buffer[fullName.Length / sizeof(WCHAR)] = L'\0';
 
-    NT_IF_FAIL_LEAVE(IMSplitString(&nameInfo->Name, NULL, &nameInfo->Extension, L'.', -1));
-  }
-  __finally
+  IMInitNameInformation(nameInfo, &fullName);
+
+  LOG(("[IM] Name splitted. ParentDir: %wZ, Name: %wZ, Ext: %wZ\n", &nameInfo->ParentDir, &nameInfo->Name, &nameInfo->Extension));
+
+  *NameInformation = nameInfo;
+
+  return STATUS_SUCCESS;
+}
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static ULONG
+IMFindSplitIndex(
+    _In_reads_(Count) PCWCH Buffer,
+    _In_ ULONG Count,
+    _In_ WCHAR Delimeter)
+/*++
+
+Summary:
+
+    Finds the symbol right after the last delimeter, the same split point
+    IMSplitString uses with occurrence -1: the first symbol is never
+    taken as a delimeter.
+
+Return value:
+
+    Index of the first symbol of the ending or 0 if there is no delimeter.
+
+--*/
+{
+  ULONG i = Count;
+
+  PAGED_CODE();
+
+  for (; i > 1; i--)
   {
-    if (NT_ERROR(status))
-    {
-      LOG_B(("[IM] Split name information failed\n"));
-      IMReleaseNameInformation(nameInfo);
-    }
-    else
+    if (Buffer[i - 1] == Delimeter)
     {
-      LOG(("[IM] Name splitted. ParentDir: %wZ, Name: %wZ, Ext: %wZ\n", &nameInfo->ParentDir, &nameInfo->Name, &nameInfo->Extension));
-      *NameInformation = nameInfo;
+      return i;
     }
   }
 
-  return status;
-}
\ No newline at end of file
+  return 0;
+}
+
+static VOID IMInitNameInformation(
+    _Out_ PIM_NAME_INFORMATION NameInformation,
+    _In_ PCUNICODE_STRING FullName)
+/*++
+
+Summary:
+
+    Fills ParentDir, Name and Extension as views into FullName. Empty
+    parts point to the end of FullName.
+
+--*/
+{
+  ULONG count = FullName->Length / sizeof(WCHAR);
+  ULONG nameStart = 0;
+  ULONG extensionStart = 0;
+
+  PAGED_CODE();
+
+  NameInformation->FullName = *FullName;
+
+  nameStart = IMFindSplitIndex(FullName->Buffer, count, L'\\');
+  if (0 == nameStart)
+  {
+    // no folder, the whole string is kept as parent dir like IMSplitString does
+    nameStart = count;
+  }
+
+  NameInformation->ParentDir.Buffer = FullName->Buffer;
+  NameInformation->ParentDir.Length = NameInformation->ParentDir.MaximumLength = (USHORT)(nameStart * sizeof(WCHAR));
+
+  NameInformation->Name.Buffer = FullName->Buffer + nameStart;
+  NameInformation->Name.Length = NameInformation->Name.MaximumLength = (USHORT)((count - nameStart) * sizeof(WCHAR));
+
+  extensionStart = IMFindSplitIndex(NameInformation->Name.Buffer, count - nameStart, L'.');
+  if (0 == extensionStart)
+  {
+    extensionStart = count - nameStart;
+  }
+
+  NameInformation->Extension.Buffer = NameInformation->Name.Buffer + extensionStart;
+  NameInformation->Extension.Length = NameInformation->Extension.MaximumLength = (USHORT)((count - nameStart - extensionStart) * sizeof(WCHAR));
+}
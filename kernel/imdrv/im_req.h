@@ -30,6 +30,19 @@ Kernel mode
 //  Function prototypes
 //------------------------------------------------------------------------
 
+//
+// Opened name of the file as filter manager gives it, before it is split.
+// Release it with FltReleaseFileNameInformation.
+//
+_Check_return_
+    NTSTATUS
+    IMQueryFileNameInformation(
+        _Inout_ PFLT_CALLBACK_DATA Data,
+        _Outptr_ PFLT_FILE_NAME_INFORMATION *FileNameInformation);
+
+//
+// Opened name of the file split to its parts, see IMSplitNameInformation
+//
 _Check_return_
     NTSTATUS
     IMGetFileNameInformation(
@@ -44,4 +57,10 @@ _Check_return_
         _Outptr_ PIM_NAME_INFORMATION *NameInformation);
 
 VOID IMReleaseNameInformation(
-    _In_ PIM_NAME_INFORMATION NameInformation);
\ No newline at end of file
+    _In_ PIM_NAME_INFORMATION NameInformation);
+
+_Check_return_
+    NTSTATUS
+    IMSplitNameInformation(
+        _In_ PUNICODE_STRING FullName,
+        _Outptr_ PIM_NAME_INFORMATION *NameInformation);
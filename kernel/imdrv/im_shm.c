@@ -0,0 +1,414 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_shm.c
+
+Abstract:
+Ring of records shared with the client. Pages are locked, the ring is
+mapped into system space for the writers and into the client process,
+the client reads records in place and only waits on the port.
+
+Environment:
+
+Kernel mode
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_shm.h"
+#include "im_list.h"
+#include "im_rec.h"
+
+//------------------------------------------------------------------------
+//  Local function prototypes.
+//------------------------------------------------------------------------
+
+static PVOID
+IMMapToUser(
+    _Inout_ PMDL Mdl);
+
+_IRQL_requires_(DISPATCH_LEVEL)
+static BOOLEAN
+IMWriteSharedGap(
+    _Inout_ PIM_SHARED_RECORDS Shared,
+    _In_ ULONG Lost,
+    _In_ ULONG Headroom,
+    _Inout_ PBOOLEAN IsWaiting);
+
+//------------------------------------------------------------------------
+//  Text sections.
+//------------------------------------------------------------------------
+
+//
+// Writing runs at DISPATCH_LEVEL and is not paged
+//
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, IMInitSharedRecords)
+#pragma alloc_text(PAGE, IMMapSharedRecords)
+#pragma alloc_text(PAGE, IMUnmapSharedRecords)
+#pragma alloc_text(PAGE, IMWaitSharedRecords)
+#pragma alloc_text(PAGE, IMMapToUser)
+#endif // ALLOC_PRAGMA
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+VOID IMInitSharedRecords(
+    _Out_ PIM_SHARED_RECORDS Shared)
+{
+  PAGED_CODE();
+
+  RtlZeroMemory(Shared, sizeof(IM_SHARED_RECORDS));
+
+  ExInitializeFastMutex(&Shared->Lock);
+  KeInitializeEvent(&Shared->Doorbell, SynchronizationEvent, FALSE);
+
+  // nothing is mapped, writers are not let in
+  ExInitializeRundownProtection(&Shared->Rundown);
+  ExWaitForRundownProtectionRelease(&Shared->Rundown);
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMMapSharedRecords(
+        _Inout_ PIM_SHARED_RECORDS Shared,
+        _In_ ULONG Size,
+        _Outptr_ PVOID *UserAddress)
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  PHYSICAL_ADDRESS lowAddress;
+  PHYSICAL_ADDRESS highAddress;
+  PHYSICAL_ADDRESS skipBytes;
+  PMDL mdl = NULL;
+  PIM_RING_HEADER header = NULL;
+  PVOID userAddress = NULL;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(Shared != NULL, STATUS_INVALID_PARAMETER_1);
+  IF_FALSE_RETURN_RESULT(UserAddress != NULL, STATUS_INVALID_PARAMETER_3);
+
+  *UserAddress = NULL;
+
+  LOG(("[IM] Shared records mapping\n"));
+
+  ExAcquireFastMutex(&Shared->Lock);
+
+  __try
+  {
+    NT_IF_FALSE_LEAVE(NULL == Shared->Mdl, STATUS_DEVICE_ALREADY_ATTACHED);
+
+    lowAddress.QuadPart = 0;
+    highAddress.QuadPart = -1;
+    skipBytes.QuadPart = 0;
+
+    // zeroed pages, locked for the writers at DISPATCH_LEVEL
+    mdl = MmAllocatePagesForMdlEx(lowAddress, highAddress, skipBytes, Size, MmCached, MM_ALLOCATE_FULLY_REQUIRED);
+    NT_IF_FALSE_LEAVE(NULL != mdl, STATUS_INSUFFICIENT_RESOURCES);
+
+    header = (PIM_RING_HEADER)MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+    NT_IF_FALSE_LEAVE(NULL != header, STATUS_INSUFFICIENT_RESOURCES);
+    NT_IF_FALSE_LEAVE(IMRingFormat(header, Size), STATUS_INVALID_PARAMETER_2);
+
+    userAddress = IMMapToUser(mdl);
+    NT_IF_FALSE_LEAVE(NULL != userAddress, STATUS_INSUFFICIENT_RESOURCES);
+
+    IMRingInitProducer(&Shared->Producer, header, Size);
+
+    Shared->Mdl = mdl;
+    Shared->Header = header;
+    Shared->UserAddress = userAddress;
+    Shared->Process = PsGetCurrentProcess();
+    ObReferenceObject(Shared->Process);
+
+    KeClearEvent(&Shared->Doorbell);
+
+    // writers are let in only now
+    ExReInitializeRundownProtection(&Shared->Rundown);
+
+    *UserAddress = userAddress;
+  }
+  __finally
+  {
+    if (NT_ERROR(status))
+    {
+      LOG_B(("[IM] Shared records mapping failed 0x%x\n", status));
+
+      if (NULL != mdl)
+      {
+        MmFreePagesFromMdl(mdl);
+        ExFreePool(mdl);
+      }
+    }
+    else
+    {
+      LOG(("[IM] Shared records mapped, %u bytes\n", Size));
+    }
+
+    ExReleaseFastMutex(&Shared->Lock);
+  }
+
+  return status;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID IMUnmapSharedRecords(
+    _Inout_ PIM_SHARED_RECORDS Shared)
+{
+  KAPC_STATE apcState;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN(Shared != NULL);
+
+  ExAcquireFastMutex(&Shared->Lock);
+
+  if (NULL != Shared->Mdl)
+  {
+    ExWaitForRundownProtectionRelease(&Shared->Rundown);
+
+    // user mapping belongs to the client address space
+    if (PsGetCurrentProcess() == Shared->Process)
+    {
+      MmUnmapLockedPages(Shared->UserAddress, Shared->Mdl);
+    }
+    else
+    {
+      KeStackAttachProcess(Shared->Process, &apcState);
+      MmUnmapLockedPages(Shared->UserAddress, Shared->Mdl);
+      KeUnstackDetachProcess(&apcState);
+    }
+
+    ObDereferenceObject(Shared->Process);
+
+    MmFreePagesFromMdl(Shared->Mdl);
+    ExFreePool(Shared->Mdl);
+
+    Shared->Mdl = NULL;
+    Shared->Header = NULL;
+    Shared->UserAddress = NULL;
+    Shared->Process = NULL;
+
+    // waiter has nothing to wait for
+    KeSetEvent(&Shared->Doorbell, IO_NO_INCREMENT, FALSE);
+
+    LOG(("[IM] Shared records unmapped\n"));
+  }
+
+  ExReleaseFastMutex(&Shared->Lock);
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMWriteSharedRecord(
+        _Inout_ PIM_SHARED_RECORDS Shared,
+        _In_ PIM_KRECORD_LIST RecordList)
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  PUCHAR buffer = NULL;
+  BOOLEAN isSending[IM_AMOUNT_OF_DATA];
+  ULONG lost = 0;
+  ULONG length = 0;
+  ULONG position = 0;
+  ULONG total = 0;
+  ULONG headroom = 0;
+  BOOLEAN isWaiting = FALSE;
+  KIRQL oldIrql;
+
+  IF_FALSE_RETURN_RESULT(Shared != NULL, STATUS_INVALID_PARAMETER_1);
+  IF_FALSE_RETURN_RESULT(RecordList != NULL, STATUS_INVALID_PARAMETER_2);
+
+  if (!ExAcquireRundownProtection(&Shared->Rundown))
+  {
+    return STATUS_DEVICE_NOT_CONNECTED;
+  }
+
+  // records moved from the list are numbered by its lanes already, the
+  // ring is one for all processors and so is the counter
+  if (0 == RecordList->Record.SequenceNumber)
+  {
+    RecordList->Record.SequenceNumber = IMNextSequenceNumber(&Globals.RecordsHead);
+  }
+
+  // a flood of allowed records leaves the end of the ring to blocked and
+  // video mode ones, as the priority lane does in the list
+  if (!RecordList->Record.IsBlocked && IM_NOT_APPLICABLE == RecordList->Record.VideoModeStatus)
+  {
+    headroom = (Shared->Producer.DataMask + 1) >> IM_SHARED_PRIORITY_SHIFT;
+  }
+
+  // writers after this one wait for its commit, so it is not preempted
+  KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+  // the record is not written after the gap marker did not fit, the
+  // client would get it ahead of the ones lost before it
+  lost = RecordList->Record.Lost;
+
+  if (0 != lost && IMWriteSharedGap(Shared, lost, headroom, &isWaiting))
+  {
+    lost = 0;
+  }
+
+  if (0 == lost)
+  {
+    // a name goes with the first record of it in the ring, the ones
+    // reserved after this see it sent
+    length = IMBeginRecordNames(RecordList, isSending);
+
+    buffer = (PUCHAR)IMRingReserve(&Shared->Producer, length, headroom, &position, &total);
+
+    IMEndRecordNames(RecordList, isSending, NULL != buffer);
+  }
+
+  if (NULL == buffer)
+  {
+    InterlockedIncrement(&Shared->Header->Dropped);
+    IMCountDroppedRecord(IMDropRingFull, lost);
+    status = STATUS_MAX_REFERRALS_EXCEEDED;
+  }
+  else
+  {
+    // same layout as GetRecordsCommand output
+    IMWriteRecord(RecordList, isSending, buffer, length);
+
+    isWaiting |= IMRingCommit(&Shared->Producer, position, total);
+  }
+
+  KeLowerIrql(oldIrql);
+
+  if (isWaiting)
+  {
+    KeSetEvent(&Shared->Doorbell, IO_NO_INCREMENT, FALSE);
+  }
+
+  ExReleaseRundownProtection(&Shared->Rundown);
+
+  return status;
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID IMWriteSharedLost(
+    _Inout_ PIM_SHARED_RECORDS Shared)
+{
+  BOOLEAN isWaiting = FALSE;
+  ULONG lost = 0;
+  KIRQL oldIrql;
+
+  IF_FALSE_RETURN(Shared != NULL);
+
+  if (!ExAcquireRundownProtection(&Shared->Rundown))
+  {
+    return;
+  }
+
+  lost = IMTakeLostRecords();
+
+  if (0 != lost)
+  {
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    if (!IMWriteSharedGap(Shared, lost, (Shared->Producer.DataMask + 1) >> IM_SHARED_PRIORITY_SHIFT, &isWaiting))
+    {
+      IMPutBackLostRecords(lost);
+    }
+
+    KeLowerIrql(oldIrql);
+  }
+
+  if (isWaiting)
+  {
+    KeSetEvent(&Shared->Doorbell, IO_NO_INCREMENT, FALSE);
+  }
+
+  ExReleaseRundownProtection(&Shared->Rundown);
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+    NTSTATUS
+    IMWaitSharedRecords(
+        _Inout_ PIM_SHARED_RECORDS Shared,
+        _In_ ULONG Milliseconds)
+{
+  LARGE_INTEGER timeout;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(Shared != NULL, STATUS_INVALID_PARAMETER_1);
+  IF_FALSE_RETURN_RESULT(Shared->Mdl != NULL, STATUS_DEVICE_NOT_CONNECTED);
+
+  timeout.QuadPart = -10000LL * Milliseconds;
+
+  return KeWaitForSingleObject(&Shared->Doorbell, Executive, KernelMode, FALSE, &timeout);
+}
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+//
+// Gap marker is an entry of its own, FALSE if the ring has no room for it
+// with Headroom left
+//
+_IRQL_requires_(DISPATCH_LEVEL)
+static BOOLEAN
+IMWriteSharedGap(
+    _Inout_ PIM_SHARED_RECORDS Shared,
+    _In_ ULONG Lost,
+    _In_ ULONG Headroom,
+    _Inout_ PBOOLEAN IsWaiting)
+{
+  const VOID *noStrings[IM_AMOUNT_OF_DATA] = {NULL, NULL};
+  IM_WIRE_RECORD gap;
+  PUCHAR buffer = NULL;
+  ULONG position = 0;
+  ULONG total = 0;
+
+  buffer = (PUCHAR)IMRingReserve(&Shared->Producer, IM_WIRE_RECORD_SIZE, Headroom, &position, &total);
+
+  if (NULL == buffer)
+  {
+    return FALSE;
+  }
+
+  IMWireMakeGap(&gap, Lost);
+
+  (VOID) IMWireEncodeRecord(buffer, IM_WIRE_RECORD_SIZE, &gap, noStrings);
+
+  *IsWaiting |= IMRingCommit(&Shared->Producer, position, total);
+
+  return TRUE;
+}
+
+//
+// Mapping into user space raises on failure instead of returning NULL
+//
+static PVOID
+IMMapToUser(
+    _Inout_ PMDL Mdl)
+{
+  PVOID address = NULL;
+
+  PAGED_CODE();
+
+  __try
+  {
+    address = MmMapLockedPagesSpecifyCache(Mdl, UserMode, MmCached, NULL, FALSE, NormalPagePriority);
+  }
+  __except (EXCEPTION_EXECUTE_HANDLER)
+  {
+    address = NULL;
+  }
+
+  return address;
+}
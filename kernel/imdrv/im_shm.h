@@ -0,0 +1,83 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_shm.h
+
+Abstract:
+Ring of records shared with the client, see InjectorMonitorRing.h
+
+Environment:
+
+Kernel mode
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im.h"
+
+//------------------------------------------------------------------------
+//  Function prototypes.
+//------------------------------------------------------------------------
+
+VOID IMInitSharedRecords(
+    _Out_ PIM_SHARED_RECORDS Shared);
+
+//
+// Allocates the ring and maps it into the current process, which has to
+// be the client. Size is the header plus power of 2 bytes of entries.
+//
+_IRQL_requires_(PASSIVE_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMMapSharedRecords(
+        _Inout_ PIM_SHARED_RECORDS Shared,
+        _In_ ULONG Size,
+        _Outptr_ PVOID *UserAddress);
+
+//
+// Waits for the writers in flight and frees the ring
+//
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID IMUnmapSharedRecords(
+    _Inout_ PIM_SHARED_RECORDS Shared);
+
+//
+// Writes the record with the names the client has not got to the ring,
+// the only copy of it the client gets. STATUS_DEVICE_NOT_CONNECTED if the
+// ring is not mapped, STATUS_MAX_REFERRALS_EXCEEDED if the ring is full
+// and record is dropped. The gap marker for the records lost before it
+// is written ahead of it.
+//
+_IRQL_requires_max_(APC_LEVEL)
+    _Check_return_
+    NTSTATUS
+    IMWriteSharedRecord(
+        _Inout_ PIM_SHARED_RECORDS Shared,
+        _In_ PIM_KRECORD_LIST RecordList);
+
+//
+// Writes the gap marker for the records lost since the last record, the
+// client which waits may not get another one soon
+//
+_IRQL_requires_max_(APC_LEVEL)
+VOID IMWriteSharedLost(
+    _Inout_ PIM_SHARED_RECORDS Shared);
+
+//
+// Doorbell for the client which found the ring empty
+//
+_IRQL_requires_(PASSIVE_LEVEL)
+    NTSTATUS
+    IMWaitSharedRecords(
+        _Inout_ PIM_SHARED_RECORDS Shared,
+        _In_ ULONG Milliseconds);
@@ -0,0 +1,423 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_trie.c
+
+Abstract:
+Compiled path component trie of directory roots
+
+Environment:
+
+Kernel mode
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_trie.h"
+#include "im_utils.h"
+
+//------------------------------------------------------------------------
+//  Defines.
+//------------------------------------------------------------------------
+
+#define IM_TRIE_DELIMETER L'\\'
+
+#define IM_TRIE_HASH_BASIS 2166136261u
+#define IM_TRIE_HASH_PRIME 16777619u
+
+//------------------------------------------------------------------------
+//  Structures.
+//------------------------------------------------------------------------
+
+//
+// Node of the trie while it is built, compiled into IM_TRIE_NODE
+//
+typedef struct _IM_TRIE_BUILD_NODE
+{
+  struct _IM_TRIE_BUILD_NODE *FirstChild;
+  struct _IM_TRIE_BUILD_NODE *NextSibling;
+
+  //
+  // all allocated nodes, to free them without recursion
+  //
+  struct _IM_TRIE_BUILD_NODE *NextAllocated;
+
+  //
+  // component in the rule root, not folded
+  //
+  PCWCH Component;
+  USHORT Length;
+
+  ULONG Hash;
+  UCHAR Verdict;
+  ULONG ChildCount;
+
+} IM_TRIE_BUILD_NODE, *PIM_TRIE_BUILD_NODE;
+
+//------------------------------------------------------------------------
+//  Local function prototypes.
+//------------------------------------------------------------------------
+
+static BOOLEAN
+IMTrieNextComponent(
+    _In_ PCUNICODE_STRING Path,
+    _Inout_ PULONG Position,
+    _Out_ PCWCH *Component,
+    _Out_ PUSHORT Length);
+
+static ULONG
+IMTrieHash(
+    _In_reads_(Length) PCWCH Component,
+    _In_ USHORT Length);
+
+static PIM_TRIE_NODE
+IMTrieFindChild(
+    _In_ PIM_TRIE Trie,
+    _In_ PIM_TRIE_NODE Node,
+    _In_ ULONG Hash,
+    _In_reads_(Length) PCWCH Component,
+    _In_ USHORT Length);
+
+//------------------------------------------------------------------------
+//  Text sections.
+//------------------------------------------------------------------------
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, IMTrieBuild)
+#pragma alloc_text(PAGE, IMTrieFree)
+#pragma alloc_text(PAGE, IMTrieLookup)
+#pragma alloc_text(PAGE, IMTrieNextComponent)
+#pragma alloc_text(PAGE, IMTrieHash)
+#pragma alloc_text(PAGE, IMTrieFindChild)
+#endif // ALLOC_PRAGMA
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+_Check_return_
+    NTSTATUS
+    IMTrieBuild(
+        _In_reads_(RuleCount) PIM_TRIE_RULE Rules,
+        _In_ ULONG RuleCount,
+        _Outptr_ PIM_TRIE *Trie)
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  PIM_TRIE_BUILD_NODE root = NULL;
+  PIM_TRIE_BUILD_NODE allocated = NULL;
+  PIM_TRIE_BUILD_NODE node = NULL;
+  PIM_TRIE_BUILD_NODE child = NULL;
+  PIM_TRIE_BUILD_NODE *order = NULL;
+  PIM_TRIE trie = NULL;
+  PIM_TRIE_NODE compiled = NULL;
+  PCWCH component = NULL;
+  USHORT length = 0;
+  ULONG hash = 0;
+  ULONG nodeCount = 1;
+  ULONG symbolCount = 0;
+  ULONG position = 0;
+  ULONG next = 1;
+  ULONG i = 0;
+  ULONG j = 0;
+  ULONG k = 0;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(Rules != NULL || RuleCount == 0, STATUS_INVALID_PARAMETER_1);
+  IF_FALSE_RETURN_RESULT(Trie != NULL, STATUS_INVALID_PARAMETER_3);
+
+  *Trie = NULL;
+
+  __try
+  {
+    NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&root, sizeof(IM_TRIE_BUILD_NODE)));
+    allocated = root;
+
+    //
+    // insert every root component by component
+    //
+    for (i = 0; i < RuleCount; i++)
+    {
+      NT_IF_FALSE_LEAVE(Rules[i].Root.Buffer != NULL || Rules[i].Root.Length == 0, STATUS_INVALID_PARAMETER_1);
+
+      node = root;
+      position = 0;
+
+      while (IMTrieNextComponent(&Rules[i].Root, &position, &component, &length))
+      {
+        hash = IMTrieHash(component, length);
+
+        for (child = node->FirstChild; child != NULL; child = child->NextSibling)
+        {
+          if (child->Hash != hash || child->Length != length)
+          {
+            continue;
+          }
+
+          for (k = 0; k < length && IM_FOLD_WCHAR(child->Component[k]) == IM_FOLD_WCHAR(component[k]); k++)
+            ;
+
+          if (k == length)
+          {
+            break;
+          }
+        }
+
+        if (NULL == child)
+        {
+          NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&child, sizeof(IM_TRIE_BUILD_NODE)));
+          child->NextAllocated = allocated;
+          allocated = child;
+
+          child->Component = component;
+          child->Length = length;
+          child->Hash = hash;
+          child->NextSibling = node->FirstChild;
+          node->FirstChild = child;
+          node->ChildCount++;
+
+          nodeCount++;
+          symbolCount += length;
+        }
+
+        node = child;
+      }
+
+      // the most restrictive verdict wins for the same root
+      node->Verdict = (UCHAR)max(node->Verdict, (UCHAR)Rules[i].Verdict);
+    }
+
+    //
+    // compile, nodes are laid out breadth first so children of a node are contiguous
+    //
+    NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&order, nodeCount * sizeof(PIM_TRIE_BUILD_NODE)));
+    NT_IF_FAIL_LEAVE(IMAllocateNonPagedBuffer((PVOID *)&trie, sizeof(IM_TRIE) + nodeCount * sizeof(IM_TRIE_NODE) + symbolCount * sizeof(WCHAR)));
+
+    trie->NodeCount = nodeCount;
+    trie->SymbolCount = 0;
+    trie->Nodes = (PIM_TRIE_NODE)(trie + 1);
+    trie->Symbols = (PWCHAR)(trie->Nodes + nodeCount);
+
+    order[0] = root;
+    trie->Nodes[0].Verdict = root->Verdict;
+
+    for (i = 0; i < next; i++)
+    {
+      compiled = &trie->Nodes[i];
+      compiled->FirstChild = next;
+      compiled->ChildCount = order[i]->ChildCount;
+
+      for (child = order[i]->FirstChild; child != NULL; child = child->NextSibling)
+      {
+        // insertion by hash, fan out is small
+        for (j = next; j > compiled->FirstChild && trie->Nodes[j - 1].Hash > child->Hash; j--)
+        {
+          trie->Nodes[j] = trie->Nodes[j - 1];
+          order[j] = order[j - 1];
+        }
+
+        order[j] = child;
+        trie->Nodes[j].Hash = child->Hash;
+        trie->Nodes[j].Length = child->Length;
+        trie->Nodes[j].Verdict = child->Verdict;
+        trie->Nodes[j].Component = trie->SymbolCount;
+
+        for (k = 0; k < child->Length; k++)
+        {
+          trie->Symbols[trie->SymbolCount++] = IM_FOLD_WCHAR(child->Component[k]);
+        }
+
+        next++;
+      }
+    }
+
+    FLT_ASSERT(next == nodeCount);
+    FLT_ASSERT(trie->SymbolCount == symbolCount);
+
+    *Trie = trie;
+    trie = NULL;
+
+    LOG(("[IM] Trie of %u nodes built from %u roots\n", nodeCount, RuleCount));
+  }
+  __finally
+  {
+    while (NULL != allocated)
+    {
+      node = allocated;
+      allocated = allocated->NextAllocated;
+      IMFreeNonPagedBuffer(node);
+    }
+
+    if (NULL != order)
+    {
+      IMFreeNonPagedBuffer(order);
+    }
+
+    if (NULL != trie)
+    {
+      IMFreeNonPagedBuffer(trie);
+    }
+  }
+
+  return status;
+}
+
+VOID IMTrieFree(
+    _In_ PIM_TRIE Trie)
+{
+  PAGED_CODE();
+
+  IMFreeNonPagedBuffer(Trie);
+}
+
+IM_TRIE_VERDICT
+IMTrieLookup(
+    _In_ PIM_TRIE Trie,
+    _In_ PCUNICODE_STRING Path)
+{
+  PIM_TRIE_NODE node = NULL;
+  IM_TRIE_VERDICT verdict = IM_TRIE_NONE;
+  PCWCH component = NULL;
+  USHORT length = 0;
+  ULONG position = 0;
+
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(Trie != NULL, IM_TRIE_NONE);
+  IF_FALSE_RETURN_RESULT(Path != NULL, IM_TRIE_NONE);
+
+  node = &Trie->Nodes[0];
+  verdict = (IM_TRIE_VERDICT)node->Verdict;
+
+  // longest root which is a prefix of the path wins
+  while (IMTrieNextComponent(Path, &position, &component, &length))
+  {
+    node = IMTrieFindChild(Trie, node, IMTrieHash(component, length), component, length);
+    if (NULL == node)
+    {
+      break;
+    }
+
+    if (node->Verdict != IM_TRIE_NONE)
+    {
+      verdict = (IM_TRIE_VERDICT)node->Verdict;
+    }
+  }
+
+  return verdict;
+}
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static BOOLEAN
+IMTrieNextComponent(
+    _In_ PCUNICODE_STRING Path,
+    _Inout_ PULONG Position,
+    _Out_ PCWCH *Component,
+    _Out_ PUSHORT Length)
+{
+  ULONG count = Path->Length / sizeof(WCHAR);
+  ULONG i = *Position;
+  ULONG start = 0;
+
+  PAGED_CODE();
+
+  // empty components are skipped, so "\\a\\\\b\\" is the same as "\\a\\b"
+  while (i < count && Path->Buffer[i] == IM_TRIE_DELIMETER)
+  {
+    i++;
+  }
+
+  start = i;
+
+  while (i < count && Path->Buffer[i] != IM_TRIE_DELIMETER)
+  {
+    i++;
+  }
+
+  *Position = i;
+  *Component = Path->Buffer + start;
+  *Length = (USHORT)(i - start);
+
+  return i != start;
+}
+
+static ULONG
+IMTrieHash(
+    _In_reads_(Length) PCWCH Component,
+    _In_ USHORT Length)
+{
+  ULONG hash = IM_TRIE_HASH_BASIS;
+  USHORT i = 0;
+
+  PAGED_CODE();
+
+  for (; i < Length; i++)
+  {
+    hash = (hash ^ IM_FOLD_WCHAR(Component[i])) * IM_TRIE_HASH_PRIME;
+  }
+
+  return hash;
+}
+
+static PIM_TRIE_NODE
+IMTrieFindChild(
+    _In_ PIM_TRIE Trie,
+    _In_ PIM_TRIE_NODE Node,
+    _In_ ULONG Hash,
+    _In_reads_(Length) PCWCH Component,
+    _In_ USHORT Length)
+{
+  ULONG low = Node->FirstChild;
+  ULONG high = Node->FirstChild + Node->ChildCount;
+  ULONG middle = 0;
+  PIM_TRIE_NODE child = NULL;
+  PWCHAR symbols = NULL;
+  USHORT i = 0;
+
+  PAGED_CODE();
+
+  // first child with the hash
+  while (low < high)
+  {
+    middle = low + (high - low) / 2;
+    if (Trie->Nodes[middle].Hash < Hash)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+
+  for (; low < Node->FirstChild + Node->ChildCount && Trie->Nodes[low].Hash == Hash; low++)
+  {
+    child = &Trie->Nodes[low];
+    if (child->Length != Length)
+    {
+      continue;
+    }
+
+    symbols = Trie->Symbols + child->Component;
+    for (i = 0; i < Length && symbols[i] == IM_FOLD_WCHAR(Component[i]); i++)
+      ;
+
+    if (i == Length)
+    {
+      return child;
+    }
+  }
+
+  return NULL;
+}
@@ -0,0 +1,135 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_trie.h
+
+Abstract:
+
+Compiled path component trie of directory roots with a verdict per root.
+Lookup returns the verdict of the longest root which is a directory
+prefix of the path, its cost depends on the path depth only.
+
+Environment:
+
+Kernel mode
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+//
+// Verdict of the root, when the same root is inserted twice the most
+// restrictive (largest) verdict is kept
+//
+typedef enum _IM_TRIE_VERDICT
+{
+  IM_TRIE_NONE = 0, // no root is a prefix of the path
+  IM_TRIE_TRUSTED,  // everything is allowed below the root
+  IM_TRIE_ALLOWED,  // allowed below the root unless other rules restrict it
+  IM_TRIE_DENIED    // everything is denied below the root
+
+} IM_TRIE_VERDICT,
+    *PIM_TRIE_VERDICT;
+
+//------------------------------------------------------------------------
+//  Structures.
+//------------------------------------------------------------------------
+
+//
+// Root to build trie from
+//
+typedef struct _IM_TRIE_RULE
+{
+  //
+  // directory, components are separated by backslash
+  //
+  UNICODE_STRING Root;
+
+  IM_TRIE_VERDICT Verdict;
+
+} IM_TRIE_RULE, *PIM_TRIE_RULE;
+
+//
+// Node of the compiled trie. Children of a node are stored contiguously
+// and sorted by hash, so they are looked up with binary search
+//
+typedef struct _IM_TRIE_NODE
+{
+  //
+  // hash of the folded component
+  //
+  ULONG Hash;
+
+  //
+  // component length in symbols
+  //
+  USHORT Length;
+
+  //
+  // IM_TRIE_VERDICT of the root ending at this node
+  //
+  UCHAR Verdict;
+
+  UCHAR Reserved;
+
+  //
+  // offset of the folded component in symbols
+  //
+  ULONG Component;
+
+  //
+  // children range in nodes array
+  //
+  ULONG FirstChild;
+  ULONG ChildCount;
+
+} IM_TRIE_NODE, *PIM_TRIE_NODE;
+
+//
+// Compiled trie, nodes and components follow the header in one allocation
+//
+typedef struct _IM_TRIE
+{
+  ULONG NodeCount;
+
+  ULONG SymbolCount;
+
+  PIM_TRIE_NODE Nodes;
+
+  PWCHAR Symbols;
+
+} IM_TRIE, *PIM_TRIE;
+
+//------------------------------------------------------------------------
+//  Function prototypes.
+//------------------------------------------------------------------------
+
+_Check_return_
+    NTSTATUS
+    IMTrieBuild(
+        _In_reads_(RuleCount) PIM_TRIE_RULE Rules,
+        _In_ ULONG RuleCount,
+        _Outptr_ PIM_TRIE *Trie);
+
+VOID IMTrieFree(
+    _In_ PIM_TRIE Trie);
+
+IM_TRIE_VERDICT
+IMTrieLookup(
+    _In_ PIM_TRIE Trie,
+    _In_ PCUNICODE_STRING Path);
@@ -24,6 +24,7 @@ Kernel mode
 
 #include "im_utils.h"
 #include "ntstrsafe.h"
+#include "im_fold.h"
 
 //------------------------------------------------------------------------
 //  Text sections.
@@ -38,6 +39,7 @@ Kernel mode
 #pragma alloc_text(PAGE, IMCopyUnicodeStringEx)
 #pragma alloc_text(PAGE, IMIsContainsString)
 #pragma alloc_text(PAGE, IMIsStartWithString)
+#pragma alloc_text(PAGE, IMIsEqualString)
 #pragma alloc_text(PAGE, IMSplitString)
 #pragma alloc_text(PAGE, IMConcatStrings)
 #pragma alloc_text(PAGE, IMToString)
@@ -232,11 +234,6 @@ IMIsContainsString(
     _In_ PUNICODE_STRING String,
     _In_ PUNICODE_STRING SubString)
 {
-  ULONG i = 0;
-  ULONG j = 0;
-  WCHAR a;
-  WCHAR b; // todo refactor
-
   PAGED_CODE();
 
   IF_FALSE_RETURN_RESULT(String != NULL, FALSE);
@@ -249,27 +246,10 @@ IMIsContainsString(
   IF_FALSE_RETURN_RESULT(SubString->Length != 0, FALSE);
   IF_FALSE_RETURN_RESULT(SubString->Length % sizeof(WCHAR) == 0, FALSE);
 
-  for (; i < String->Length / sizeof(WCHAR); i++)
+  if (IMFoldFind(String->Buffer, String->Length / sizeof(WCHAR), SubString->Buffer, SubString->Length / sizeof(WCHAR)) >= 0)
   {
-    a = String->Buffer[i];
-    b = SubString->Buffer[j];
-
-    if (a >= L'A' && a <= L'Z') a = a + (L'a' - L'A'); 
-    if (b >= L'A' && b <= L'Z') b = b + (L'a' - L'A');
-
-    if (a == b)
-    {
-      j++;
-      if (SubString->Length / sizeof(WCHAR) == j)
-      {
-        LOG(("[IM] String contains string\n"));
-        return TRUE;
-      }
-    }
-    else
-    {
-      j = 0;
-    }
+    LOG(("[IM] String contains string\n"));
+    return TRUE;
   }
 
   LOG(("[IM] String not contains string\n"));
@@ -282,11 +262,6 @@ IMIsStartWithString(
     _In_ PUNICODE_STRING String,
     _In_ PUNICODE_STRING SubString)
 {
-  ULONG i = 0;
-  ULONG j = 0;
-  WCHAR a; // todo refactor
-  WCHAR b;
-
   PAGED_CODE();
 
   IF_FALSE_RETURN_RESULT(String != NULL, FALSE);
@@ -299,34 +274,34 @@ IMIsStartWithString(
   IF_FALSE_RETURN_RESULT(SubString->Length != 0, FALSE);
   IF_FALSE_RETURN_RESULT(SubString->Length % sizeof(WCHAR) == 0, FALSE);
 
-  for (; i < String->Length / sizeof(WCHAR); i++)
+  if (SubString->Length <= String->Length && IMFoldEqual(String->Buffer, SubString->Buffer, SubString->Length / sizeof(WCHAR)))
   {
-    a = String->Buffer[i];
-    b = SubString->Buffer[j];
-
-    if (a >= L'A' && a <= L'Z') a = a + (L'a' - L'A'); 
-    if (b >= L'A' && b <= L'Z') b = b + (L'a' - L'A');
-
-    if (a == b)
-    {
-      j++;
-      if (SubString->Length / sizeof(WCHAR) == j)
-      {
-        LOG(("[IM] String starts with string\n"));
-        return TRUE;
-      }
-    }
-    else
-    {
-      LOG(("[IM] String does not start with string\n"));
-      return FALSE;
-    }
+    LOG(("[IM] String starts with string\n"));
+    return TRUE;
   }
 
   LOG(("[IM] String does not start with string\n"));
   return FALSE;
 }
 
+BOOLEAN
+IMIsEqualString(
+    _In_ PCUNICODE_STRING String1,
+    _In_ PCUNICODE_STRING String2)
+{
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(String1 != NULL, FALSE);
+  IF_FALSE_RETURN_RESULT(String2 != NULL, FALSE);
+
+  if (String1->Length != String2->Length)
+  {
+    return FALSE;
+  }
+
+  return IMFoldEqual(String1->Buffer, String2->Buffer, String1->Length / sizeof(WCHAR));
+}
+
 // TODO refactor this function too many akward staff
 _Check_return_
     NTSTATUS
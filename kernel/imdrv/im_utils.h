@@ -26,6 +26,15 @@ Kernel mode
 
 #include "im.h"
 
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+//
+// case folding used by the string comparisons, only latin letters are folded
+//
+#define IM_FOLD_WCHAR(c) (((c) >= L'A' && (c) <= L'Z') ? (WCHAR)((c) + (L'a' - L'A')) : (WCHAR)(c))
+
 //------------------------------------------------------------------------
 //  Function prototypes.
 //------------------------------------------------------------------------
@@ -85,6 +94,14 @@ IMIsStartWithString(
     _In_ PUNICODE_STRING String,
     _In_ PUNICODE_STRING SubString);
 
+//
+// case insensitive for latin letters only, unlike RtlEqualUnicodeString
+//
+BOOLEAN
+IMIsEqualString(
+    _In_ PCUNICODE_STRING String1,
+    _In_ PCUNICODE_STRING String2);
+
 _Check_return_
     NTSTATUS
     IMSplitString(
@@ -0,0 +1,226 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_vcache.c
+
+Abstract:
+Bounded cache of block verdicts of a target process
+
+Environment:
+
+Kernel mode
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_vcache.h"
+#include "im_utils.h"
+
+//------------------------------------------------------------------------
+//  Defines.
+//------------------------------------------------------------------------
+
+#define IM_VERDICT_CACHE_WAYS 2
+#define IM_VERDICT_CACHE_SETS (IM_VERDICT_CACHE_ENTRIES / IM_VERDICT_CACHE_WAYS)
+
+#define IM_VERDICT_HASH_BASIS 2166136261u
+#define IM_VERDICT_HASH_PRIME 16777619u
+
+//------------------------------------------------------------------------
+//  Local function prototypes.
+//------------------------------------------------------------------------
+
+static ULONG
+IMVerdictCacheHash(
+    _In_opt_ PVOID Volume,
+    _In_ PCUNICODE_STRING Name);
+
+static BOOLEAN
+IMVerdictEntryEquals(
+    _In_ PIM_VERDICT_ENTRY Entry,
+    _In_ ULONG Hash,
+    _In_opt_ PVOID Volume,
+    _In_ PCUNICODE_STRING Name);
+
+//------------------------------------------------------------------------
+//  Text sections.
+//------------------------------------------------------------------------
+
+//
+// Lookup and insert run under the spin lock and are not paged
+//
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, IMVerdictCacheCreate)
+#pragma alloc_text(PAGE, IMVerdictCacheFree)
+#pragma alloc_text(PAGE, IMInvalidateVerdicts)
+#endif // ALLOC_PRAGMA
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+_Check_return_
+    NTSTATUS
+    IMVerdictCacheCreate(
+        _Outptr_ PIM_VERDICT_CACHE *Cache)
+{
+  PAGED_CODE();
+
+  IF_FALSE_RETURN_RESULT(Cache != NULL, STATUS_INVALID_PARAMETER_1);
+
+  // zeroed, so every entry is empty
+  return IMAllocateNonPagedBuffer((PVOID *)Cache, sizeof(IM_VERDICT_CACHE));
+}
+
+VOID IMVerdictCacheFree(
+    _In_ PIM_VERDICT_CACHE Cache)
+{
+  PAGED_CODE();
+
+  IF_FALSE_RETURN(Cache != NULL);
+
+  ExFreePool(Cache);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+IMVerdictCacheLookup(
+    _In_ PIM_VERDICT_CACHE Cache,
+    _In_opt_ PVOID Volume,
+    _In_ PCUNICODE_STRING Name,
+    _Out_ PBOOLEAN IsBlocked)
+{
+  PIM_VERDICT_ENTRY entry = NULL;
+  BOOLEAN isFound = FALSE;
+  KIRQL oldIrql = PASSIVE_LEVEL;
+  ULONG hash = 0;
+  ULONG i = 0;
+
+  *IsBlocked = FALSE;
+
+  if (0 == Name->Length || Name->Length > IM_VERDICT_CACHE_MAX_NAME * sizeof(WCHAR))
+  {
+    InterlockedIncrement64(&Globals.VerdictMisses);
+    return FALSE;
+  }
+
+  hash = IMVerdictCacheHash(Volume, Name);
+  entry = &Cache->Entries[(hash % IM_VERDICT_CACHE_SETS) * IM_VERDICT_CACHE_WAYS];
+
+  oldIrql = ExAcquireSpinLockShared(&Cache->Lock);
+
+  for (; i < IM_VERDICT_CACHE_WAYS; i++, entry++)
+  {
+    if (entry->Generation == Globals.PolicyGeneration && IMVerdictEntryEquals(entry, hash, Volume, Name))
+    {
+      *IsBlocked = entry->IsBlocked;
+      isFound = TRUE;
+      break;
+    }
+  }
+
+  ExReleaseSpinLockShared(&Cache->Lock, oldIrql);
+
+  InterlockedIncrement64(isFound ? &Globals.VerdictHits : &Globals.VerdictMisses);
+
+  return isFound;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID IMVerdictCacheInsert(
+    _Inout_ PIM_VERDICT_CACHE Cache,
+    _In_opt_ PVOID Volume,
+    _In_ PCUNICODE_STRING Name,
+    _In_ BOOLEAN IsBlocked)
+{
+  PIM_VERDICT_ENTRY set = NULL;
+  PIM_VERDICT_ENTRY entry = NULL;
+  KIRQL oldIrql = PASSIVE_LEVEL;
+  ULONG hash = 0;
+  ULONG i = 0;
+
+  IF_FALSE_RETURN(Name->Length != 0 && Name->Length <= IM_VERDICT_CACHE_MAX_NAME * sizeof(WCHAR));
+
+  hash = IMVerdictCacheHash(Volume, Name);
+  set = &Cache->Entries[(hash % IM_VERDICT_CACHE_SETS) * IM_VERDICT_CACHE_WAYS];
+
+  oldIrql = ExAcquireSpinLockExclusive(&Cache->Lock);
+
+  // the same name is updated in place, otherwise the newest entry goes
+  // first and the older one is pushed out of the set
+  for (; i < IM_VERDICT_CACHE_WAYS; i++)
+  {
+    if (IMVerdictEntryEquals(&set[i], hash, Volume, Name))
+    {
+      entry = &set[i];
+      break;
+    }
+  }
+
+  if (NULL == entry)
+  {
+    RtlMoveMemory(&set[1], &set[0], (IM_VERDICT_CACHE_WAYS - 1) * sizeof(IM_VERDICT_ENTRY));
+    entry = &set[0];
+  }
+
+  entry->Hash = hash;
+  entry->Generation = Globals.PolicyGeneration;
+  entry->Volume = Volume;
+  entry->Length = Name->Length;
+  entry->IsBlocked = IsBlocked;
+  RtlCopyMemory(entry->Name, Name->Buffer, Name->Length);
+
+  ExReleaseSpinLockExclusive(&Cache->Lock, oldIrql);
+}
+
+VOID IMInvalidateVerdicts()
+{
+  PAGED_CODE();
+
+  InterlockedIncrement(&Globals.PolicyGeneration);
+
+  LOG(("[IM] Cached verdicts invalidated\n"));
+}
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static ULONG
+IMVerdictCacheHash(
+    _In_opt_ PVOID Volume,
+    _In_ PCUNICODE_STRING Name)
+{
+  ULONG hash = IM_VERDICT_HASH_BASIS ^ (ULONG)((ULONG_PTR)Volume >> 4);
+  ULONG i = 0;
+
+  // the name is not folded, other case of the same name is just a miss
+  for (; i < Name->Length / sizeof(WCHAR); i++)
+  {
+    hash = (hash ^ Name->Buffer[i]) * IM_VERDICT_HASH_PRIME;
+  }
+
+  // 0 marks an empty entry
+  return hash ? hash : 1;
+}
+
+static BOOLEAN
+IMVerdictEntryEquals(
+    _In_ PIM_VERDICT_ENTRY Entry,
+    _In_ ULONG Hash,
+    _In_opt_ PVOID Volume,
+    _In_ PCUNICODE_STRING Name)
+{
+  return Entry->Hash == Hash &&
+         Entry->Volume == Volume &&
+         Entry->Length == Name->Length &&
+         RtlEqualMemory(Entry->Name, Name->Buffer, Name->Length);
+}
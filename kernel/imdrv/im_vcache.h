@@ -0,0 +1,133 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_vcache.h
+
+Abstract:
+
+Bounded cache of block verdicts of a target process. Games open the same
+binaries over and over, a hit lets the create skip the name split, the
+decision and the post operation. Entries are keyed by the volume and the
+full opened name filter manager gives before it is split. Policy of a
+process is built once when it starts and the cache lives and dies with it,
+restricted files do not change while the driver is loaded, so verdicts are
+never stale because of the policy. Lookups are counted in
+GetStatisticsCommand.
+
+Environment:
+
+Kernel mode
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+//
+// entries in the cache, two way set associative
+//
+#define IM_VERDICT_CACHE_ENTRIES 64
+
+//
+// longer opened names are not cached
+//
+#define IM_VERDICT_CACHE_MAX_NAME 260
+
+//------------------------------------------------------------------------
+//  Structures.
+//------------------------------------------------------------------------
+
+typedef struct _IM_VERDICT_ENTRY
+{
+  //
+  // hash of the volume and the name, 0 if entry is empty
+  //
+  ULONG Hash;
+
+  //
+  // Globals.PolicyGeneration the verdict was made under
+  //
+  LONG Generation;
+
+  //
+  // verdicts are dropped when an instance is torn down, so a volume
+  // created at the address of a gone one never finds its verdicts
+  //
+  PVOID Volume;
+
+  //
+  // in bytes
+  //
+  USHORT Length;
+
+  BOOLEAN IsBlocked;
+
+  //
+  // opened name the verdict was made for
+  //
+  WCHAR Name[IM_VERDICT_CACHE_MAX_NAME];
+
+} IM_VERDICT_ENTRY, *PIM_VERDICT_ENTRY;
+
+typedef struct _IM_VERDICT_CACHE
+{
+  //
+  // shared for lookups, exclusive for inserts
+  //
+  EX_SPIN_LOCK Lock;
+
+  IM_VERDICT_ENTRY Entries[IM_VERDICT_CACHE_ENTRIES];
+
+} IM_VERDICT_CACHE, *PIM_VERDICT_CACHE;
+
+//------------------------------------------------------------------------
+//  Function prototypes.
+//------------------------------------------------------------------------
+
+_Check_return_
+    NTSTATUS
+    IMVerdictCacheCreate(
+        _Outptr_ PIM_VERDICT_CACHE *Cache);
+
+VOID IMVerdictCacheFree(
+    _In_ PIM_VERDICT_CACHE Cache);
+
+//
+// Looks up the verdict of the opened name on the volume
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+IMVerdictCacheLookup(
+    _In_ PIM_VERDICT_CACHE Cache,
+    _In_opt_ PVOID Volume,
+    _In_ PCUNICODE_STRING Name,
+    _Out_ PBOOLEAN IsBlocked);
+
+//
+// Remembers the verdict made for the opened name on the volume
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID IMVerdictCacheInsert(
+    _Inout_ PIM_VERDICT_CACHE Cache,
+    _In_opt_ PVOID Volume,
+    _In_ PCUNICODE_STRING Name,
+    _In_ BOOLEAN IsBlocked);
+
+//
+// Drops verdicts of every process, whatever they were keyed by
+//
+VOID IMInvalidateVerdicts();
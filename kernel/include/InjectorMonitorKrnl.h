@@ -20,6 +20,8 @@ Kernel mode & User mode
 #pragma once
 
 #include "InjectorMonitorCommon.h"
+#include "InjectorMonitorRing.h"
+#include "InjectorMonitorWire.h"
 
 //------------------------------------------------------------------------
 //  Definitions.
@@ -31,101 +33,165 @@ Kernel mode & User mode
 #define IM_PROCESS_NAME_INDEX 0
 #define IM_FILE_NAME_INDEX 1
 
-//------------------------------------------------------------------------
-//  Structures.
-//------------------------------------------------------------------------
+C_ASSERT(IM_AMOUNT_OF_DATA == IM_WIRE_NAMES);
 
 //
-// Data of variable length in record
+// ids of the names in records are 1 to IM_MAX_INTERNED_NAMES, the driver
+// gives the id of a name evicted from its table to another one
 //
-typedef struct _IM_KRECORD_DATA
-{
-  ULONG Size; // zero size in case if data was not retrieved
-  PVOID Buffer;
-} IM_KRECORD_DATA, *PIM_KRECORD_DATA;
+#define IM_MAX_INTERNED_NAMES 4096
 
 //
-//  What information we actually log.
+// shared ring of records, header plus power of 2 bytes of entries
 //
-typedef struct _IM_KRECORD
-{
-  //
-  // Just marker for the debug to navigate in memory
-  // equals 0xCEFAADDE which will be in memory shown as FACEDEAD due to little indean
-  //
-  ULONG Debug;
-
-  //
-  // Length of the structure (it is variable because of string inside)
-  //
-  ULONG TotalLength;
+#define IM_SHARED_RECORDS_SIZE (IM_RING_HEADER_SIZE + 256 * 1024)
 
-  //
-  // Order number of the record for logging
-  //
-  ULONGLONG SequenceNumber;
+//
+// how long WaitRecordsCommand sleeps without the doorbell by default and
+// at most, ms
+//
+#define IM_RECORDS_WAIT 1000
+#define IM_RECORDS_MAX_WAIT 10000
 
-  //
-  // Time when record was created, also for logging
-  //
-  LARGE_INTEGER Time;
+//
+// flags of IM_GET_RECORDS
+//
+#define IM_RECORDS_BATCH 0x00000001  // one batch instead of records, see InjectorMonitorWire.h
+#define IM_RECORDS_REPORT 0x00000002 // IM_WIRE_REPLY ahead of the records, see InjectorMonitorWire.h
 
-  //
-  // Is loading of the binary is blocked or not
-  //
-  BOOLEAN IsBlocked;
+//
+// how long a producer waits for room with IMOverflowBlock by default and
+// at most, ms. The producer is the thread loading the image.
+//
+#define IM_OVERFLOW_WAIT 10
+#define IM_OVERFLOW_MAX_WAIT 100
 
-  //
-  // is pre operation callback succeded (just for log)
-  //
-  BOOLEAN IsSucceded;
+//------------------------------------------------------------------------
+//  Structures.
+//------------------------------------------------------------------------
 
-  UCHAR Reserved[2];      // Alignment on IA64
+//
+//  Defines the commands between the utility and the filter
+//
+typedef enum _IM_INTERFACE_COMMAND
+{
+  NothingCommand = 0,
+  //  fist 10 values are dedicated to driver working mode
 
-  //
-  // status of loading game in certain video mode
-  //
-  IM_VIDEO_MODE_STATUS VideoModeStatus;
+  //  copies as many records as fit, one after another in the wire
+  //  format (InjectorMonitorWire.h), the buffer needs no alignment.
+  //  IM_GET_RECORDS may follow the command, with IM_RECORDS_BATCH the
+  //  records come as one batch. Driver which does not know the flag
+  //  sends records, the version tells one from the other. With
+  //  IM_RECORDS_REPORT the reply goes ahead of them: a record which does
+  //  not fit even the empty buffer is only reported by its size then,
+  //  without the flag it waits for a larger buffer.
+  GetRecordsCommand = 11,
+
+  //  maps the shared ring of records into the caller, records are not
+  //  queued for GetRecordsCommand anymore while it is mapped
+  MapRecordsCommand = 12,
+
+  //  doorbell: returns when something was written to the shared ring
+  //  after IMRingPrepareWait, or without the ring when LowWatermark
+  //  records are queued for GetRecordsCommand, or in Milliseconds.
+  //  IM_WAIT_RECORDS may follow the command, defaults are 1 record and
+  //  IM_RECORDS_WAIT
+  WaitRecordsCommand = 13,
+
+  //  IM_OVERFLOW follows the command: what is done with a record when
+  //  the queue of GetRecordsCommand is full. The policy is the one of
+  //  the connected client, it is back to IMOverflowDropNewest after it
+  //  disconnects.
+  SetOverflowCommand = 14,
+
+  //  returns IM_RECORDS_STATISTICS
+  GetStatisticsCommand = 15,
+
+  //  IM_RECORDS_BUDGET follows the command: bytes the queue of
+  //  GetRecordsCommand keeps at most. Records queued over a smaller
+  //  budget are kept until the client takes them, the budget stays after
+  //  the client disconnects.
+  SetBudgetCommand = 16,
+
+  //  IM_COALESCE follows the command: identical records within the
+  //  window come as one with IM_WIRE_COALESCED. The window is the one of
+  //  the connected client, coalescing is off after it disconnects.
+  SetCoalesceCommand = 17
 
-  //
-  // file information (must be freed before push)
-  //
-  PVOID FileNameInformation;
+} IM_INTERFACE_COMMAND;
 
-  //
-  // contains data of variable length (such as strings)
-  //
-  IM_KRECORD_DATA Data[IM_AMOUNT_OF_DATA];
+//
+// Output of MapRecordsCommand. Every entry of the ring is one record in
+// the wire format, like the output of GetRecordsCommand.
+//
+typedef struct _IM_SHARED_RECORDS_MAPPING
+{
+  ULONGLONG Address;
+  ULONG Size;
+  ULONG Reserved;
+} IM_SHARED_RECORDS_MAPPING, *PIM_SHARED_RECORDS_MAPPING;
 
-} IM_KRECORD, *PIM_KRECORD;
+//
+// Input of GetRecordsCommand after the command
+//
+typedef struct _IM_GET_RECORDS
+{
+  ULONG Flags; // IM_RECORDS_*
+  ULONG Reserved;
+} IM_GET_RECORDS, *PIM_GET_RECORDS;
 
 //
-//  How the mini-filter manages the log records.
+// Input of WaitRecordsCommand after the command
 //
-typedef struct _IM_KRECORD_LIST
+typedef struct _IM_WAIT_RECORDS
 {
-  //
-  // List element
-  //
-  LIST_ENTRY List;
+  ULONG LowWatermark;
+  ULONG Milliseconds;
+} IM_WAIT_RECORDS, *PIM_WAIT_RECORDS;
 
-  //
-  // Data itself
-  //
-  IM_KRECORD Record;
+//
+// Input of SetOverflowCommand after the command
+//
+typedef struct _IM_OVERFLOW
+{
+  ULONG Policy;       // IM_OVERFLOW_POLICY
+  ULONG Milliseconds; // wait of IMOverflowBlock, at most IM_OVERFLOW_MAX_WAIT
+} IM_OVERFLOW, *PIM_OVERFLOW;
 
-} IM_KRECORD_LIST, *PIM_KRECORD_LIST;
+//
+// Input of SetBudgetCommand after the command
+//
+typedef struct _IM_RECORDS_BUDGET
+{
+  ULONG Bytes; // IM_MIN_RECORDS_BUDGET to IM_MAX_RECORDS_BUDGET
+  ULONG Reserved;
+} IM_RECORDS_BUDGET, *PIM_RECORDS_BUDGET;
 
 //
-//  Defines the commands between the utility and the filter
+// Input of SetCoalesceCommand after the command
 //
-typedef enum _IM_INTERFACE_COMMAND
+typedef struct _IM_COALESCE
 {
-  NothingCommand = 0,
-  //  fist 10 values are dedicated to driver working mode
-  GetRecordsCommand = 11
+  ULONG Milliseconds; // up to IM_MAX_COALESCE_WINDOW, 0 if records are not coalesced
+  ULONG Reserved;
+} IM_COALESCE, *PIM_COALESCE;
 
-} IM_INTERFACE_COMMAND;
+//
+// Output of GetStatisticsCommand, counters are since the driver started
+//
+typedef struct _IM_RECORDS_STATISTICS
+{
+  IM_OVERFLOW Overflow;
+  ULONGLONG Queued;
+  ULONGLONG Dropped[IMDropReasons]; // by IM_DROP_REASON
+  ULONGLONG Budget;                 // bytes, see SetBudgetCommand
+  ULONGLONG QueuedBytes;
+  ULONGLONG MaxQueuedBytes; // high-water mark of QueuedBytes
+  ULONGLONG Coalesced;      // records counted into an earlier one, see SetCoalesceCommand
+  ULONGLONG VerdictHits;    // loads decided by the cached verdict of an earlier one
+  ULONGLONG VerdictMisses;  // loads the cache had no verdict for
+} IM_RECORDS_STATISTICS, *PIM_RECORDS_STATISTICS;
 
 #pragma warning(push)
 #pragma warning(disable : 4200) // disable warnings for structures with zero length arrays.
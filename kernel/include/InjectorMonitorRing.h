@@ -0,0 +1,402 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+InjectorMonitorRing.h
+
+Abstract:
+Ring of records shared between driver and user lib. Memory starts with
+IM_RING_HEADER followed by power of 2 bytes of entries. Producers (driver)
+reserve space, write the entry and publish it in order of reservation by
+moving WriteIndex, one consumer (lib) reads entries in place and gives the
+space back by moving ReadIndex. Entries never wrap, the tail of the memory
+which is too small for an entry is skipped with a padding entry.
+
+Indexes are free running byte counters, their difference is the amount of
+bytes in use. Everything in the header may be written by the other side, so
+producer keeps its own indexes and never reads entries back, consumer checks
+every entry against the published index.
+
+Consumer which found ring empty sets ConsumerWaiting and checks once more
+before it sleeps, producer which publishes an entry takes the flag and rings
+the doorbell, so there is one wakeup per sleep and none is lost.
+
+Only interlocked and acquire/release routines are used, so the header
+compiles in kernel, in user mode and on host.
+
+Environment:
+
+Kernel mode & User mode
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_RING_MAGIC 0x474E5249 // IRNG
+#define IM_RING_VERSION 3 // entries are records of IM_WIRE_VERSION
+
+#define IM_RING_HEADER_SIZE 256
+#define IM_RING_ALIGNMENT 8
+#define IM_RING_MIN_DATA_SIZE 4096
+
+#define IM_RING_ENTRY_RECORD 1
+#define IM_RING_ENTRY_PADDING 2
+
+#define IM_RING_ALIGN(Length) \
+  (((Length) + IM_RING_ALIGNMENT - 1) & ~((ULONG)IM_RING_ALIGNMENT - 1))
+
+//------------------------------------------------------------------------
+//  Structures.
+//------------------------------------------------------------------------
+
+//
+// Start of the shared memory, every index is on its own cache line
+//
+typedef struct _IM_RING_HEADER
+{
+  ULONG Magic;
+  ULONG Version;
+
+  //
+  // bytes of entries behind the header, power of 2
+  //
+  ULONG DataSize;
+
+  ULONG Reserved0[13];
+
+  //
+  // end of the published entries, moved by producer
+  //
+  volatile LONG WriteIndex;
+
+  ULONG Reserved1[15];
+
+  //
+  // end of the consumed entries, moved by consumer
+  //
+  volatile LONG ReadIndex;
+
+  ULONG Reserved2[15];
+
+  //
+  // consumer is going to sleep and wants the doorbell
+  //
+  volatile LONG ConsumerWaiting;
+
+  //
+  // entries producer had no room for
+  //
+  volatile LONG Dropped;
+
+  ULONG Reserved3[14];
+
+} IM_RING_HEADER, *PIM_RING_HEADER;
+
+C_ASSERT(sizeof(IM_RING_HEADER) == IM_RING_HEADER_SIZE);
+
+//
+// Every entry starts with it, Length includes the entry header and padding
+//
+typedef struct _IM_RING_ENTRY
+{
+  ULONG Length;
+  ULONG Type;
+} IM_RING_ENTRY, *PIM_RING_ENTRY;
+
+C_ASSERT(sizeof(IM_RING_ENTRY) == IM_RING_ALIGNMENT);
+
+//
+// Private state of producers, kept out of the shared memory
+//
+typedef struct _IM_RING_PRODUCER
+{
+  PIM_RING_HEADER Header;
+  PUCHAR Data;
+  ULONG DataMask;
+
+  //
+  // end of the reserved space, moved by compare exchange
+  //
+  volatile LONG Reserved;
+
+  //
+  // end of the published space, producers publish in order of reservation
+  //
+  volatile LONG Committed;
+
+} IM_RING_PRODUCER, *PIM_RING_PRODUCER;
+
+//
+// Private state of the consumer
+//
+typedef struct _IM_RING_CONSUMER
+{
+  PIM_RING_HEADER Header;
+  PUCHAR Data;
+  ULONG DataMask;
+  ULONG ReadIndex;
+
+  //
+  // length of the entry returned by the last peek
+  //
+  ULONG EntryLength;
+
+} IM_RING_CONSUMER, *PIM_RING_CONSUMER;
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+//
+// Lays out the header in Size bytes of memory, Size is header plus power of 2
+//
+FORCEINLINE
+BOOLEAN
+IMRingFormat(
+    _Out_writes_bytes_(Size) PIM_RING_HEADER Header,
+    _In_ ULONG Size)
+{
+  ULONG dataSize = Size - IM_RING_HEADER_SIZE;
+
+  if (Size <= IM_RING_HEADER_SIZE || dataSize < IM_RING_MIN_DATA_SIZE || 0 != (dataSize & (dataSize - 1)))
+  {
+    return FALSE;
+  }
+
+  RtlZeroMemory(Header, IM_RING_HEADER_SIZE);
+
+  Header->Magic = IM_RING_MAGIC;
+  Header->Version = IM_RING_VERSION;
+  Header->DataSize = dataSize;
+
+  return TRUE;
+}
+
+FORCEINLINE
+VOID IMRingInitProducer(
+    _Out_ PIM_RING_PRODUCER Producer,
+    _In_ PIM_RING_HEADER Header,
+    _In_ ULONG Size)
+{
+  Producer->Header = Header;
+  Producer->Data = (PUCHAR)Header + IM_RING_HEADER_SIZE;
+  Producer->DataMask = Size - IM_RING_HEADER_SIZE - 1;
+  Producer->Reserved = 0;
+  Producer->Committed = 0;
+}
+
+//
+// Checks the header laid out by the other side against the mapped Size
+//
+FORCEINLINE
+BOOLEAN
+IMRingInitConsumer(
+    _Out_ PIM_RING_CONSUMER Consumer,
+    _In_ PIM_RING_HEADER Header,
+    _In_ ULONG Size)
+{
+  if (Size <= IM_RING_HEADER_SIZE ||
+      IM_RING_MAGIC != Header->Magic ||
+      IM_RING_VERSION != Header->Version ||
+      Header->DataSize != Size - IM_RING_HEADER_SIZE)
+  {
+    return FALSE;
+  }
+
+  Consumer->Header = Header;
+  Consumer->Data = (PUCHAR)Header + IM_RING_HEADER_SIZE;
+  Consumer->DataMask = Header->DataSize - 1;
+  Consumer->ReadIndex = (ULONG)ReadAcquire(&Header->ReadIndex);
+  Consumer->EntryLength = 0;
+
+  return TRUE;
+}
+
+//
+// Returns room for Length bytes of the entry or NULL if ring has no room,
+// IMRingCommit publishes it. Headroom bytes are left free after the entry
+// for the ones reserved with less of it. Producer must not be preempted
+// in between, the following producers wait for it.
+//
+FORCEINLINE
+PVOID
+IMRingReserve(
+    _Inout_ PIM_RING_PRODUCER Producer,
+    _In_ ULONG Length,
+    _In_ ULONG Headroom,
+    _Out_ PULONG Position,
+    _Out_ PULONG Total)
+{
+  ULONG size = Producer->DataMask + 1;
+  ULONG need = IM_RING_ALIGN(sizeof(IM_RING_ENTRY) + Length);
+  ULONG position = 0;
+  ULONG offset = 0;
+  ULONG room = 0;
+  ULONG total = 0;
+  ULONG used = 0;
+  PIM_RING_ENTRY entry = NULL;
+
+  if (Length > size || need > size)
+  {
+    return NULL;
+  }
+
+  for (;;)
+  {
+    position = (ULONG)ReadNoFence(&Producer->Reserved);
+    offset = position & Producer->DataMask;
+    room = size - offset;
+    total = need <= room ? need : room + need;
+
+    // consumer index is not trusted, anything out of range means no room
+    used = position - (ULONG)ReadAcquire(&Producer->Header->ReadIndex);
+
+    if (used > size || total > size - used || Headroom > size - used - total)
+    {
+      return NULL;
+    }
+
+    if ((LONG)position == InterlockedCompareExchange(&Producer->Reserved, (LONG)(position + total), (LONG)position))
+    {
+      break;
+    }
+  }
+
+  entry = (PIM_RING_ENTRY)(Producer->Data + offset);
+
+  if (total != need)
+  {
+    entry->Length = room;
+    entry->Type = IM_RING_ENTRY_PADDING;
+    entry = (PIM_RING_ENTRY)Producer->Data;
+  }
+
+  entry->Length = need;
+  entry->Type = IM_RING_ENTRY_RECORD;
+
+  *Position = position;
+  *Total = total;
+
+  return entry + 1;
+}
+
+//
+// Publishes the reserved entry after all reserved before it,
+// returns TRUE if consumer sleeps and has to be woken up
+//
+FORCEINLINE
+BOOLEAN
+IMRingCommit(
+    _Inout_ PIM_RING_PRODUCER Producer,
+    _In_ ULONG Position,
+    _In_ ULONG Total)
+{
+  while ((ULONG)ReadAcquire(&Producer->Committed) != Position)
+  {
+    YieldProcessor();
+  }
+
+  // full barrier: entry is visible before the index, index before the flag is read
+  InterlockedExchange(&Producer->Header->WriteIndex, (LONG)(Position + Total));
+  WriteRelease(&Producer->Committed, (LONG)(Position + Total));
+
+  return 0 != ReadNoFence(&Producer->Header->ConsumerWaiting) &&
+         0 != InterlockedExchange(&Producer->Header->ConsumerWaiting, 0);
+}
+
+//
+// Returns the next entry in place or NULL if there is none. Entry which
+// does not fit the published space means the producer side is broken,
+// everything published is skipped then.
+//
+FORCEINLINE
+PVOID
+IMRingPeek(
+    _Inout_ PIM_RING_CONSUMER Consumer,
+    _Out_ PULONG Length)
+{
+  ULONG size = Consumer->DataMask + 1;
+  ULONG write = 0;
+  ULONG offset = 0;
+  PIM_RING_ENTRY entry = NULL;
+
+  *Length = 0;
+
+  for (;;)
+  {
+    write = (ULONG)ReadAcquire(&Consumer->Header->WriteIndex);
+
+    if (write == Consumer->ReadIndex)
+    {
+      return NULL;
+    }
+
+    offset = Consumer->ReadIndex & Consumer->DataMask;
+    entry = (PIM_RING_ENTRY)(Consumer->Data + offset);
+
+    if (write - Consumer->ReadIndex > size ||
+        entry->Length < sizeof(IM_RING_ENTRY) ||
+        entry->Length > size - offset ||
+        entry->Length > write - Consumer->ReadIndex ||
+        0 != (entry->Length & (IM_RING_ALIGNMENT - 1)))
+    {
+      Consumer->ReadIndex = write;
+      WriteRelease(&Consumer->Header->ReadIndex, (LONG)write);
+      return NULL;
+    }
+
+    if (IM_RING_ENTRY_RECORD == entry->Type)
+    {
+      break;
+    }
+
+    Consumer->ReadIndex += entry->Length;
+    WriteRelease(&Consumer->Header->ReadIndex, (LONG)Consumer->ReadIndex);
+  }
+
+  Consumer->EntryLength = entry->Length;
+  *Length = entry->Length - sizeof(IM_RING_ENTRY);
+
+  return entry + 1;
+}
+
+//
+// Gives the space of the entry returned by the last peek back to producers
+//
+FORCEINLINE
+VOID IMRingRelease(
+    _Inout_ PIM_RING_CONSUMER Consumer)
+{
+  Consumer->ReadIndex += Consumer->EntryLength;
+  Consumer->EntryLength = 0;
+
+  WriteRelease(&Consumer->Header->ReadIndex, (LONG)Consumer->ReadIndex);
+}
+
+//
+// Asks for the doorbell, returns FALSE if something was published
+// meanwhile and consumer should not sleep
+//
+FORCEINLINE
+BOOLEAN
+IMRingPrepareWait(
+    _Inout_ PIM_RING_CONSUMER Consumer)
+{
+  InterlockedExchange(&Consumer->Header->ConsumerWaiting, 1);
+
+  if ((ULONG)ReadAcquire(&Consumer->Header->WriteIndex) != Consumer->ReadIndex)
+  {
+    InterlockedExchange(&Consumer->Header->ConsumerWaiting, 0);
+    return FALSE;
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,1064 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+InjectorMonitorWire.h
+
+Abstract:
+Format of records going from driver to user lib, through the shared ring
+and through GetRecordsCommand. Record is IM_WIRE_RECORD_SIZE bytes of
+fixed fields followed by the strings of its names. Every field is little
+endian at a fixed offset, there are no pointers and no padding, so 32 and
+64 bit clients read the same bytes and records need no alignment.
+
+Length covers the record and its strings. Strings are UTF-16LE and null
+terminated, Size of a name counts the terminator.
+
+GetRecordsCommand may instead return one batch of records (version
+IM_WIRE_BATCH_VERSION at the same offset as the version of a record).
+Every record of the batch is written as varints: SequenceNumber and Time
+as the difference to the previous record, and every string as the number
+of symbols it shares with the previous string of the same index plus the
+rest of it. Batch is decoded from its first record only.
+
+Records the driver had to drop are reported by a gap marker in their
+place: record with IM_WIRE_GAP, no names and the number of them in Lost.
+
+Asked for it, GetRecordsCommand puts a reply (version IM_WIRE_REPLY_VERSION
+at the same offset) ahead of the records or the batch: how large a buffer
+the first record left queued needs and how many records are left, so the
+client can grow its buffer.
+
+Identical records the driver coalesced come as one with IM_WIRE_COALESCED,
+Time of the first of them, and LastTime and Count behind the strings, in
+a batch as two more varints after the differences.
+
+Encoder and decoder only touch bytes, so the header compiles in kernel,
+in user mode and on host.
+
+Environment:
+
+Kernel mode & User mode
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_WIRE_VERSION 2 // 1 was the raw IM_KRECORD with kernel pointers
+
+#define IM_WIRE_RECORD_SIZE 48
+
+//
+// process and file name, in order of IM_*_NAME_INDEX
+//
+#define IM_WIRE_NAMES 2
+
+#define IM_WIRE_BLOCKED 0x0001
+#define IM_WIRE_SUCCEEDED 0x0002
+#define IM_WIRE_GAP 0x0004 // not an event, Lost records were dropped here
+#define IM_WIRE_COALESCED 0x0008 // Count records from Time to LastTime
+
+//
+// LastTime and Count of the coalesced record follow its strings
+//
+#define IM_WIRE_COALESCED_SIZE 12
+
+#define IM_WIRE_BATCH_VERSION 3
+#define IM_WIRE_BATCH_HEADER_SIZE 8
+
+#define IM_WIRE_REPLY_VERSION 4
+#define IM_WIRE_REPLY_SIZE 24
+
+//
+// first varint of the record in batch is Flags shifted by IM_WIRE_NAMES
+// and the bits of names which have the string
+//
+#define IM_WIRE_BATCH_STRING(Index) (1u << (Index))
+#define IM_WIRE_BATCH_FLAGS_SHIFT IM_WIRE_NAMES
+
+//
+// names are UNICODE_STRING in the driver, decoder keeps one of every index
+//
+#define IM_WIRE_MAX_NAME_CHARS (MAXUSHORT / sizeof(WCHAR))
+
+#define IM_WIRE_MAX_VARINT 10
+
+//
+// Windows runs little endian only, other hosts are checked by the compiler
+//
+#if !defined(IM_WIRE_NATIVE_ORDER)
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define IM_WIRE_NATIVE_ORDER 1
+#else
+#define IM_WIRE_NATIVE_ORDER 0
+#endif
+#endif
+
+//------------------------------------------------------------------------
+//  Structures.
+//------------------------------------------------------------------------
+
+//
+// Name in record. The string of an id follows the first record the client
+// gets it in, after the record in order of the index. Later records only
+// carry the id and zero size, the client keeps the string until the same
+// id comes with another one.
+//
+typedef struct _IM_WIRE_NAME
+{
+  ULONG Id;   // zero in case if name was not retrieved
+  ULONG Size; // bytes of the string behind the record, zero if already sent
+} IM_WIRE_NAME, *PIM_WIRE_NAME;
+
+//
+// Record as it is on the wire, and as the decoder gives it back. Fields
+// from LastTime on are the ones behind the strings of a coalesced record,
+// the decoder sets them for every record.
+//
+typedef struct _IM_WIRE_RECORD
+{
+  ULONG Length;
+  USHORT Version;
+  USHORT Flags; // IM_WIRE_*
+  ULONGLONG SequenceNumber;
+  LONGLONG Time; // system time when the record was created
+  ULONG VideoMode; // IM_VIDEO_MODE_STATUS
+  ULONG Lost;      // records dropped in place of the gap marker
+  IM_WIRE_NAME Names[IM_WIRE_NAMES];
+  LONGLONG LastTime; // of the last record coalesced, Time if it is one
+  ULONG Count;       // records coalesced, 1 if it is one
+} IM_WIRE_RECORD, *PIM_WIRE_RECORD;
+
+C_ASSERT(sizeof(IM_WIRE_NAME) == 8);
+C_ASSERT(FIELD_OFFSET(IM_WIRE_RECORD, LastTime) == IM_WIRE_RECORD_SIZE);
+C_ASSERT(FIELD_OFFSET(IM_WIRE_RECORD, Length) == 0);
+C_ASSERT(FIELD_OFFSET(IM_WIRE_RECORD, Version) == 4);
+C_ASSERT(FIELD_OFFSET(IM_WIRE_RECORD, Flags) == 6);
+C_ASSERT(FIELD_OFFSET(IM_WIRE_RECORD, SequenceNumber) == 8);
+C_ASSERT(FIELD_OFFSET(IM_WIRE_RECORD, Time) == 16);
+C_ASSERT(FIELD_OFFSET(IM_WIRE_RECORD, VideoMode) == 24);
+C_ASSERT(FIELD_OFFSET(IM_WIRE_RECORD, Lost) == 28);
+C_ASSERT(FIELD_OFFSET(IM_WIRE_RECORD, Names) == 32);
+
+//
+// Header of the batch, Length covers the header and the records
+//
+typedef struct _IM_WIRE_BATCH
+{
+  ULONG Length;
+  USHORT Version; // IM_WIRE_BATCH_VERSION
+  USHORT Reserved;
+} IM_WIRE_BATCH, *PIM_WIRE_BATCH;
+
+C_ASSERT(sizeof(IM_WIRE_BATCH) == IM_WIRE_BATCH_HEADER_SIZE);
+C_ASSERT(FIELD_OFFSET(IM_WIRE_BATCH, Version) == FIELD_OFFSET(IM_WIRE_RECORD, Version));
+
+//
+// Reply ahead of the records of GetRecordsCommand, Length covers the reply
+// only. Required is not 0 when the first record left queued did not fit
+// the buffer, even the empty one.
+//
+typedef struct _IM_WIRE_REPLY
+{
+  ULONG Length;
+  USHORT Version; // IM_WIRE_REPLY_VERSION
+  USHORT Reserved;
+  ULONG Required;    // bytes of the buffer, with the reply, the record needs
+  ULONG Queued;      // records left queued
+  ULONG QueuedBytes; // bytes the driver keeps for them, up to MAXULONG
+  ULONG Reserved2;
+} IM_WIRE_REPLY, *PIM_WIRE_REPLY;
+
+C_ASSERT(sizeof(IM_WIRE_REPLY) == IM_WIRE_REPLY_SIZE);
+C_ASSERT(FIELD_OFFSET(IM_WIRE_REPLY, Version) == FIELD_OFFSET(IM_WIRE_RECORD, Version));
+
+//
+// Writer of a batch. Strings of the last record which had them are
+// compared with the next ones, so they have to live until the batch ends.
+//
+typedef struct _IM_WIRE_BATCH_ENCODER
+{
+  PUCHAR Buffer;
+  ULONG Size;
+  ULONG Length;
+  ULONGLONG SequenceNumber;
+  LONGLONG Time;
+  const UCHAR *Names[IM_WIRE_NAMES];
+  ULONG NameChars[IM_WIRE_NAMES];
+} IM_WIRE_BATCH_ENCODER, *PIM_WIRE_BATCH_ENCODER;
+
+//
+// Reader of a batch, it keeps the last string of every index to build
+// the next one from, so it is big and better not on the stack
+//
+typedef struct _IM_WIRE_BATCH_DECODER
+{
+  const UCHAR *Buffer;
+  ULONG Length;
+  ULONG Offset;
+  ULONGLONG SequenceNumber;
+  LONGLONG Time;
+  ULONG NameChars[IM_WIRE_NAMES];
+  WCHAR Names[IM_WIRE_NAMES][IM_WIRE_MAX_NAME_CHARS];
+} IM_WIRE_BATCH_DECODER, *PIM_WIRE_BATCH_DECODER;
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+FORCEINLINE
+VOID IMWirePut(
+    _Out_writes_bytes_(Size) PUCHAR Buffer,
+    _In_ ULONGLONG Value,
+    _In_ ULONG Size)
+{
+#if IM_WIRE_NATIVE_ORDER
+  RtlCopyMemory(Buffer, &Value, Size);
+#else
+  ULONG i = 0;
+
+  for (; i < Size; i++)
+  {
+    Buffer[i] = (UCHAR)(Value >> (8 * i));
+  }
+#endif
+}
+
+FORCEINLINE
+ULONGLONG
+IMWireGet(
+    _In_reads_bytes_(Size) const UCHAR *Buffer,
+    _In_ ULONG Size)
+{
+  ULONGLONG value = 0;
+
+#if IM_WIRE_NATIVE_ORDER
+  RtlCopyMemory(&value, Buffer, Size);
+#else
+  ULONG i = 0;
+
+  for (; i < Size; i++)
+  {
+    value |= (ULONGLONG)Buffer[i] << (8 * i);
+  }
+#endif
+
+  return value;
+}
+
+//
+// Gap marker for Lost dropped records. It has no sequence number and
+// time, in a batch they are not taken as the previous ones.
+//
+FORCEINLINE
+VOID IMWireMakeGap(
+    _Out_ PIM_WIRE_RECORD Record,
+    _In_ ULONG Lost)
+{
+  RtlZeroMemory(Record, sizeof(IM_WIRE_RECORD));
+
+  Record->Flags = IM_WIRE_GAP;
+  Record->Lost = Lost;
+}
+
+//
+// Length the record takes with the strings of its names
+//
+FORCEINLINE
+ULONG
+IMWireRecordLength(
+    _In_ const IM_WIRE_RECORD *Record)
+{
+  ULONG length = IM_WIRE_RECORD_SIZE + Record->Names[0].Size + Record->Names[1].Size;
+
+  return 0 != (Record->Flags & IM_WIRE_COALESCED) ? length + IM_WIRE_COALESCED_SIZE : length;
+}
+
+//
+// Writes the record and Strings of the names which have Size, Length and
+// Version are set here. Returns bytes written or 0 if Size is not enough.
+//
+FORCEINLINE
+ULONG
+IMWireEncodeRecord(
+    _Out_writes_bytes_(Size) PUCHAR Buffer,
+    _In_ ULONG Size,
+    _In_ const IM_WIRE_RECORD *Record,
+    _In_reads_(IM_WIRE_NAMES) const VOID *const *Strings)
+{
+  ULONG length = IMWireRecordLength(Record);
+  PUCHAR strings = Buffer + IM_WIRE_RECORD_SIZE;
+  PUCHAR name = NULL;
+  ULONG i = 0;
+
+  if (length > Size)
+  {
+    return 0;
+  }
+
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, Length), length, sizeof(ULONG));
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, Version), IM_WIRE_VERSION, sizeof(USHORT));
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, Flags), Record->Flags, sizeof(USHORT));
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, SequenceNumber), Record->SequenceNumber, sizeof(ULONGLONG));
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, Time), (ULONGLONG)Record->Time, sizeof(LONGLONG));
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, VideoMode), Record->VideoMode, sizeof(ULONG));
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, Lost), Record->Lost, sizeof(ULONG));
+
+  for (; i < IM_WIRE_NAMES; i++)
+  {
+    name = Buffer + FIELD_OFFSET(IM_WIRE_RECORD, Names) + i * sizeof(IM_WIRE_NAME);
+
+    IMWirePut(name + FIELD_OFFSET(IM_WIRE_NAME, Id), Record->Names[i].Id, sizeof(ULONG));
+    IMWirePut(name + FIELD_OFFSET(IM_WIRE_NAME, Size), Record->Names[i].Size, sizeof(ULONG));
+
+    if (0 != Record->Names[i].Size)
+    {
+      RtlCopyMemory(strings, Strings[i], Record->Names[i].Size);
+      strings += Record->Names[i].Size;
+    }
+  }
+
+  if (0 != (Record->Flags & IM_WIRE_COALESCED))
+  {
+    IMWirePut(strings, (ULONGLONG)Record->LastTime, sizeof(LONGLONG));
+    IMWirePut(strings + sizeof(LONGLONG), Record->Count, sizeof(ULONG));
+  }
+
+  return length;
+}
+
+//
+// Reads the record from Length bytes written by the other side, every
+// field is read once and checked before the strings are pointed to.
+// Strings of the names without Size are NULL.
+//
+FORCEINLINE
+BOOLEAN
+IMWireDecodeRecord(
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_ ULONG Length,
+    _Out_ PIM_WIRE_RECORD Record,
+    _Out_writes_(IM_WIRE_NAMES) const UCHAR **Strings)
+{
+  const UCHAR *strings = NULL;
+  const UCHAR *name = NULL;
+  ULONG available = 0;
+  ULONG i = 0;
+
+  if (Length < IM_WIRE_RECORD_SIZE)
+  {
+    return FALSE;
+  }
+
+  Record->Length = (ULONG)IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, Length), sizeof(ULONG));
+  Record->Version = (USHORT)IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, Version), sizeof(USHORT));
+
+  if (IM_WIRE_VERSION != Record->Version ||
+      Record->Length < IM_WIRE_RECORD_SIZE ||
+      Record->Length > Length)
+  {
+    return FALSE;
+  }
+
+  Record->Flags = (USHORT)IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, Flags), sizeof(USHORT));
+  Record->SequenceNumber = IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, SequenceNumber), sizeof(ULONGLONG));
+  Record->Time = (LONGLONG)IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, Time), sizeof(LONGLONG));
+  Record->VideoMode = (ULONG)IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, VideoMode), sizeof(ULONG));
+  Record->Lost = (ULONG)IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_RECORD, Lost), sizeof(ULONG));
+
+  strings = Buffer + IM_WIRE_RECORD_SIZE;
+  available = Record->Length - IM_WIRE_RECORD_SIZE;
+
+  // strings follow the record in order of the index
+  for (; i < IM_WIRE_NAMES; i++)
+  {
+    name = Buffer + FIELD_OFFSET(IM_WIRE_RECORD, Names) + i * sizeof(IM_WIRE_NAME);
+
+    Record->Names[i].Id = (ULONG)IMWireGet(name + FIELD_OFFSET(IM_WIRE_NAME, Id), sizeof(ULONG));
+    Record->Names[i].Size = (ULONG)IMWireGet(name + FIELD_OFFSET(IM_WIRE_NAME, Size), sizeof(ULONG));
+
+    if (Record->Names[i].Size > available ||
+        0 != Record->Names[i].Size % sizeof(WCHAR) ||
+        (0 == Record->Names[i].Id && 0 != Record->Names[i].Size))
+    {
+      return FALSE;
+    }
+
+    Strings[i] = 0 != Record->Names[i].Size ? strings : NULL;
+
+    strings += Record->Names[i].Size;
+    available -= Record->Names[i].Size;
+  }
+
+  Record->LastTime = Record->Time;
+  Record->Count = 1;
+
+  if (0 != (Record->Flags & IM_WIRE_COALESCED))
+  {
+    if (available < IM_WIRE_COALESCED_SIZE)
+    {
+      return FALSE;
+    }
+
+    Record->LastTime = (LONGLONG)IMWireGet(strings, sizeof(LONGLONG));
+    Record->Count = (ULONG)IMWireGet(strings + sizeof(LONGLONG), sizeof(ULONG));
+  }
+
+  return TRUE;
+}
+
+//------------------------------------------------------------------------
+//  Batch.
+//------------------------------------------------------------------------
+
+FORCEINLINE
+ULONG
+IMWireVarintLength(
+    _In_ ULONGLONG Value)
+{
+  ULONG length = 1;
+
+  for (; Value >= 0x80; Value >>= 7)
+  {
+    length++;
+  }
+
+  return length;
+}
+
+FORCEINLINE
+ULONG
+IMWirePutVarint(
+    _Out_writes_bytes_(IM_WIRE_MAX_VARINT) PUCHAR Buffer,
+    _In_ ULONGLONG Value)
+{
+  ULONG length = 0;
+
+  for (; Value >= 0x80; Value >>= 7)
+  {
+    Buffer[length++] = (UCHAR)(Value | 0x80);
+  }
+
+  Buffer[length++] = (UCHAR)Value;
+
+  return length;
+}
+
+//
+// Returns bytes read or 0 if the varint is cut or does not fit 64 bits
+//
+FORCEINLINE
+ULONG
+IMWireGetVarint(
+    _In_reads_bytes_(Available) const UCHAR *Buffer,
+    _In_ ULONG Available,
+    _Out_ PULONGLONG Value)
+{
+  ULONGLONG value = 0;
+  ULONG i = 0;
+
+  // most of them are differences of one byte
+  if (0 != Available && Buffer[0] < 0x80)
+  {
+    *Value = Buffer[0];
+    return 1;
+  }
+
+  *Value = 0;
+
+  for (; i < Available && i < IM_WIRE_MAX_VARINT; i++)
+  {
+    if (IM_WIRE_MAX_VARINT - 1 == i && Buffer[i] > 1)
+    {
+      return 0;
+    }
+
+    value |= (ULONGLONG)(Buffer[i] & 0x7F) << (7 * i);
+
+    if (0 == (Buffer[i] & 0x80))
+    {
+      *Value = value;
+      return i + 1;
+    }
+  }
+
+  return 0;
+}
+
+//
+// small differences of both signs are small varints
+//
+FORCEINLINE
+ULONGLONG
+IMWireZigZag(
+    _In_ ULONGLONG Difference)
+{
+  return (Difference << 1) ^ (0 - (Difference >> 63));
+}
+
+FORCEINLINE
+ULONGLONG
+IMWireUnZigZag(
+    _In_ ULONGLONG Value)
+{
+  return (Value >> 1) ^ (0 - (Value & 1));
+}
+
+//
+// Symbols the string shares with the previous one of its index
+//
+FORCEINLINE
+ULONG
+IMWireSharedChars(
+    _In_reads_bytes_(PreviousChars * sizeof(WCHAR)) const UCHAR *Previous,
+    _In_ ULONG PreviousChars,
+    _In_reads_bytes_(Chars * sizeof(WCHAR)) const UCHAR *String,
+    _In_ ULONG Chars)
+{
+  ULONG size = min(PreviousChars, Chars) * sizeof(WCHAR);
+  ULONG shared = 0;
+
+  for (; shared < size && Previous[shared] == String[shared]; shared++)
+  {
+  }
+
+  return shared / sizeof(WCHAR);
+}
+
+FORCEINLINE
+BOOLEAN
+IMWireBeginBatch(
+    _Out_ PIM_WIRE_BATCH_ENCODER Encoder,
+    _Out_writes_bytes_(Size) PUCHAR Buffer,
+    _In_ ULONG Size)
+{
+  RtlZeroMemory(Encoder, sizeof(IM_WIRE_BATCH_ENCODER));
+
+  Encoder->Buffer = Buffer;
+  Encoder->Size = Size;
+  Encoder->Length = IM_WIRE_BATCH_HEADER_SIZE;
+
+  return Size >= IM_WIRE_BATCH_HEADER_SIZE;
+}
+
+//
+// Length of the record in the batch as it is now, with the strings of the
+// names which have Size. Sizes are even, like the ones of UNICODE_STRING.
+//
+FORCEINLINE
+ULONG
+IMWireBatchRecordLength(
+    _In_ const IM_WIRE_BATCH_ENCODER *Encoder,
+    _In_ const IM_WIRE_RECORD *Record,
+    _In_reads_(IM_WIRE_NAMES) const VOID *const *Strings)
+{
+  ULONG head = (ULONG)Record->Flags << IM_WIRE_BATCH_FLAGS_SHIFT;
+  ULONG length = 0;
+  ULONG chars = 0;
+  ULONG shared = 0;
+  ULONG i = 0;
+
+  // gap marker is the head and the number of records lost
+  if (0 != (Record->Flags & IM_WIRE_GAP))
+  {
+    return IMWireVarintLength(head) + IMWireVarintLength(Record->Lost);
+  }
+
+  length += IMWireVarintLength(Record->VideoMode);
+  length += IMWireVarintLength(IMWireZigZag(Record->SequenceNumber - Encoder->SequenceNumber));
+  length += IMWireVarintLength(IMWireZigZag((ULONGLONG)Record->Time - (ULONGLONG)Encoder->Time));
+
+  if (0 != (Record->Flags & IM_WIRE_COALESCED))
+  {
+    length += IMWireVarintLength(Record->Count);
+    length += IMWireVarintLength((ULONGLONG)(Record->LastTime - Record->Time));
+  }
+
+  for (; i < IM_WIRE_NAMES; i++)
+  {
+    length += IMWireVarintLength(Record->Names[i].Id);
+
+    if (0 != Record->Names[i].Size)
+    {
+      head |= IM_WIRE_BATCH_STRING(i);
+
+      chars = Record->Names[i].Size / sizeof(WCHAR);
+      shared = IMWireSharedChars(Encoder->Names[i], Encoder->NameChars[i], (const UCHAR *)Strings[i], chars);
+
+      length += IMWireVarintLength(shared) + IMWireVarintLength(chars - shared) + (chars - shared) * sizeof(WCHAR);
+    }
+  }
+
+  return length + IMWireVarintLength(head);
+}
+
+//
+// Appends the record, returns its length in the batch or 0 if it does
+// not fit. Strings written are kept to compare with the next ones.
+//
+FORCEINLINE
+ULONG
+IMWireEncodeBatchRecord(
+    _Inout_ PIM_WIRE_BATCH_ENCODER Encoder,
+    _In_ const IM_WIRE_RECORD *Record,
+    _In_reads_(IM_WIRE_NAMES) const VOID *const *Strings)
+{
+  ULONG length = IMWireBatchRecordLength(Encoder, Record, Strings);
+  PUCHAR buffer = Encoder->Buffer + Encoder->Length;
+  const UCHAR *string = NULL;
+  ULONG head = (ULONG)Record->Flags << IM_WIRE_BATCH_FLAGS_SHIFT;
+  ULONG chars = 0;
+  ULONG shared = 0;
+  ULONG i = 0;
+
+  if (length > Encoder->Size - Encoder->Length)
+  {
+    return 0;
+  }
+
+  // names and differences of the next record are against the record
+  // before the gap
+  if (0 != (Record->Flags & IM_WIRE_GAP))
+  {
+    buffer += IMWirePutVarint(buffer, head);
+    (VOID) IMWirePutVarint(buffer, Record->Lost);
+
+    Encoder->Length += length;
+
+    return length;
+  }
+
+  for (; i < IM_WIRE_NAMES; i++)
+  {
+    if (0 != Record->Names[i].Size)
+    {
+      head |= IM_WIRE_BATCH_STRING(i);
+    }
+  }
+
+  buffer += IMWirePutVarint(buffer, head);
+  buffer += IMWirePutVarint(buffer, Record->VideoMode);
+  buffer += IMWirePutVarint(buffer, IMWireZigZag(Record->SequenceNumber - Encoder->SequenceNumber));
+  buffer += IMWirePutVarint(buffer, IMWireZigZag((ULONGLONG)Record->Time - (ULONGLONG)Encoder->Time));
+
+  // last of the coalesced records is never before the first one
+  if (0 != (Record->Flags & IM_WIRE_COALESCED))
+  {
+    buffer += IMWirePutVarint(buffer, Record->Count);
+    buffer += IMWirePutVarint(buffer, (ULONGLONG)(Record->LastTime - Record->Time));
+  }
+
+  for (i = 0; i < IM_WIRE_NAMES; i++)
+  {
+    buffer += IMWirePutVarint(buffer, Record->Names[i].Id);
+
+    if (0 == Record->Names[i].Size)
+    {
+      continue;
+    }
+
+    string = (const UCHAR *)Strings[i];
+    chars = Record->Names[i].Size / sizeof(WCHAR);
+    shared = IMWireSharedChars(Encoder->Names[i], Encoder->NameChars[i], string, chars);
+
+    buffer += IMWirePutVarint(buffer, shared);
+    buffer += IMWirePutVarint(buffer, chars - shared);
+
+    RtlCopyMemory(buffer, string + shared * sizeof(WCHAR), (chars - shared) * sizeof(WCHAR));
+    buffer += (chars - shared) * sizeof(WCHAR);
+
+    Encoder->Names[i] = string;
+    Encoder->NameChars[i] = chars;
+  }
+
+  Encoder->SequenceNumber = Record->SequenceNumber;
+  Encoder->Time = Record->Time;
+  Encoder->Length += length;
+
+  return length;
+}
+
+//
+// Takes the room of the record in the batch and keeps its strings as
+// IMWireEncodeBatchRecord does, without writing it. Returns its length or
+// 0 if it does not fit. The same records encoded after it in the same
+// order take the same lengths, while their strings are there.
+//
+FORCEINLINE
+ULONG
+IMWireReserveBatchRecord(
+    _Inout_ PIM_WIRE_BATCH_ENCODER Encoder,
+    _In_ const IM_WIRE_RECORD *Record,
+    _In_reads_(IM_WIRE_NAMES) const VOID *const *Strings)
+{
+  ULONG length = IMWireBatchRecordLength(Encoder, Record, Strings);
+  ULONG i = 0;
+
+  if (length > Encoder->Size - Encoder->Length)
+  {
+    return 0;
+  }
+
+  Encoder->Length += length;
+
+  if (0 != (Record->Flags & IM_WIRE_GAP))
+  {
+    return length;
+  }
+
+  for (; i < IM_WIRE_NAMES; i++)
+  {
+    if (0 != Record->Names[i].Size)
+    {
+      Encoder->Names[i] = (const UCHAR *)Strings[i];
+      Encoder->NameChars[i] = Record->Names[i].Size / sizeof(WCHAR);
+    }
+  }
+
+  Encoder->SequenceNumber = Record->SequenceNumber;
+  Encoder->Time = Record->Time;
+
+  return length;
+}
+
+//
+// Writes the header, returns the length of the batch
+//
+FORCEINLINE
+ULONG
+IMWireEndBatch(
+    _Inout_ PIM_WIRE_BATCH_ENCODER Encoder)
+{
+  IMWirePut(Encoder->Buffer + FIELD_OFFSET(IM_WIRE_BATCH, Length), Encoder->Length, sizeof(ULONG));
+  IMWirePut(Encoder->Buffer + FIELD_OFFSET(IM_WIRE_BATCH, Version), IM_WIRE_BATCH_VERSION, sizeof(USHORT));
+  IMWirePut(Encoder->Buffer + FIELD_OFFSET(IM_WIRE_BATCH, Reserved), 0, sizeof(USHORT));
+
+  return Encoder->Length;
+}
+
+//
+// TRUE if Length bytes the other side wrote start with a batch, not with
+// a record
+//
+FORCEINLINE
+BOOLEAN
+IMWireIsBatch(
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_ ULONG Length)
+{
+  return Length >= IM_WIRE_BATCH_HEADER_SIZE &&
+         IM_WIRE_BATCH_VERSION == IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_BATCH, Version), sizeof(USHORT));
+}
+
+FORCEINLINE
+BOOLEAN
+IMWireBeginBatchDecode(
+    _Out_ PIM_WIRE_BATCH_DECODER Decoder,
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_ ULONG Length)
+{
+  ULONG batchLength = 0;
+
+  Decoder->Buffer = Buffer;
+  Decoder->Length = 0;
+  Decoder->Offset = 0;
+  Decoder->SequenceNumber = 0;
+  Decoder->Time = 0;
+  Decoder->NameChars[0] = 0;
+  Decoder->NameChars[1] = 0;
+
+  if (!IMWireIsBatch(Buffer, Length))
+  {
+    return FALSE;
+  }
+
+  batchLength = (ULONG)IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_BATCH, Length), sizeof(ULONG));
+
+  if (batchLength < IM_WIRE_BATCH_HEADER_SIZE || batchLength > Length)
+  {
+    return FALSE;
+  }
+
+  Decoder->Length = batchLength;
+  Decoder->Offset = IM_WIRE_BATCH_HEADER_SIZE;
+
+  return TRUE;
+}
+
+FORCEINLINE
+BOOLEAN
+IMWireIsBatchEnd(
+    _In_ const IM_WIRE_BATCH_DECODER *Decoder)
+{
+  return Decoder->Offset >= Decoder->Length;
+}
+
+//
+// Reads the next record of the batch. Length of the record is the bytes it
+// took, strings are built in the decoder and live until the next record
+// with the string of the same index. FALSE if the record is malformed,
+// nothing after it can be read then.
+//
+FORCEINLINE
+BOOLEAN
+IMWireDecodeBatchRecord(
+    _Inout_ PIM_WIRE_BATCH_DECODER Decoder,
+    _Out_ PIM_WIRE_RECORD Record,
+    _Out_writes_(IM_WIRE_NAMES) const UCHAR **Strings)
+{
+  const UCHAR *buffer = Decoder->Buffer + Decoder->Offset;
+  ULONG available = Decoder->Length - Decoder->Offset;
+  ULONGLONG values[4];
+  ULONGLONG lost = 0;
+  ULONGLONG count = 0;
+  ULONGLONG span = 0;
+  ULONGLONG shared = 0;
+  ULONGLONG suffix = 0;
+  ULONGLONG id = 0;
+  ULONG read = 0;
+  ULONG i = 0;
+
+  RtlZeroMemory(Record, sizeof(IM_WIRE_RECORD));
+  Strings[0] = NULL;
+  Strings[1] = NULL;
+
+  if (Decoder->Offset >= Decoder->Length)
+  {
+    return FALSE;
+  }
+
+  // head, video mode and both differences
+  for (; i < 4; i++)
+  {
+    read = IMWireGetVarint(buffer, available, &values[i]);
+
+    if (0 == read)
+    {
+      return FALSE;
+    }
+
+    buffer += read;
+    available -= read;
+
+    // gap marker has the number of records lost after the head
+    if (0 == i && 0 != ((values[0] >> IM_WIRE_BATCH_FLAGS_SHIFT) & IM_WIRE_GAP))
+    {
+      break;
+    }
+  }
+
+  if ((values[0] >> IM_WIRE_BATCH_FLAGS_SHIFT) > MAXUSHORT)
+  {
+    return FALSE;
+  }
+
+  Record->Version = IM_WIRE_BATCH_VERSION;
+  Record->Flags = (USHORT)(values[0] >> IM_WIRE_BATCH_FLAGS_SHIFT);
+
+  if (0 != (Record->Flags & IM_WIRE_GAP))
+  {
+    read = IMWireGetVarint(buffer, available, &lost);
+
+    if (0 == read || lost > MAXULONG || 0 != (values[0] & (IM_WIRE_BATCH_STRING(0) | IM_WIRE_BATCH_STRING(1))))
+    {
+      return FALSE;
+    }
+
+    available -= read;
+
+    Record->Lost = (ULONG)lost;
+    Record->Length = Decoder->Length - Decoder->Offset - available;
+
+    Decoder->Offset = Decoder->Length - available;
+
+    return TRUE;
+  }
+
+  if (values[1] > MAXULONG)
+  {
+    return FALSE;
+  }
+  Record->VideoMode = (ULONG)values[1];
+  Record->SequenceNumber = Decoder->SequenceNumber + IMWireUnZigZag(values[2]);
+  Record->Time = (LONGLONG)((ULONGLONG)Decoder->Time + IMWireUnZigZag(values[3]));
+  Record->LastTime = Record->Time;
+  Record->Count = 1;
+
+  if (0 != (Record->Flags & IM_WIRE_COALESCED))
+  {
+    read = IMWireGetVarint(buffer, available, &count);
+
+    if (0 == read || count > MAXULONG)
+    {
+      return FALSE;
+    }
+
+    buffer += read;
+    available -= read;
+
+    read = IMWireGetVarint(buffer, available, &span);
+
+    if (0 == read)
+    {
+      return FALSE;
+    }
+
+    buffer += read;
+    available -= read;
+
+    Record->Count = (ULONG)count;
+    Record->LastTime = (LONGLONG)((ULONGLONG)Record->Time + span);
+  }
+
+  for (i = 0; i < IM_WIRE_NAMES; i++)
+  {
+    read = IMWireGetVarint(buffer, available, &id);
+
+    if (0 == read || id > MAXULONG)
+    {
+      return FALSE;
+    }
+
+    buffer += read;
+    available -= read;
+
+    Record->Names[i].Id = (ULONG)id;
+
+    if (0 == (values[0] & IM_WIRE_BATCH_STRING(i)))
+    {
+      continue;
+    }
+
+    if (0 == id)
+    {
+      return FALSE;
+    }
+
+    read = IMWireGetVarint(buffer, available, &shared);
+
+    if (0 == read || shared > Decoder->NameChars[i])
+    {
+      return FALSE;
+    }
+
+    buffer += read;
+    available -= read;
+
+    read = IMWireGetVarint(buffer, available, &suffix);
+
+    if (0 == read ||
+        suffix > IM_WIRE_MAX_NAME_CHARS - shared ||
+        0 == shared + suffix ||
+        suffix * sizeof(WCHAR) > available - read)
+    {
+      return FALSE;
+    }
+
+    buffer += read;
+    available -= read;
+
+    // the shared part is left of the previous string
+    RtlCopyMemory(&Decoder->Names[i][shared], buffer, (SIZE_T)suffix * sizeof(WCHAR));
+
+    buffer += suffix * sizeof(WCHAR);
+    available -= (ULONG)suffix * sizeof(WCHAR);
+
+    Decoder->NameChars[i] = (ULONG)(shared + suffix);
+
+    Record->Names[i].Size = Decoder->NameChars[i] * sizeof(WCHAR);
+    Strings[i] = (const UCHAR *)Decoder->Names[i];
+  }
+
+  Record->Length = Decoder->Length - Decoder->Offset - available;
+
+  Decoder->SequenceNumber = Record->SequenceNumber;
+  Decoder->Time = Record->Time;
+  Decoder->Offset = Decoder->Length - available;
+
+  return TRUE;
+}
+
+//------------------------------------------------------------------------
+//  Reply.
+//------------------------------------------------------------------------
+
+//
+// Writes the reply, Length and Version are set here. Returns bytes
+// written or 0 if Size is not enough.
+//
+FORCEINLINE
+ULONG
+IMWireEncodeReply(
+    _Out_writes_bytes_(Size) PUCHAR Buffer,
+    _In_ ULONG Size,
+    _In_ const IM_WIRE_REPLY *Reply)
+{
+  if (Size < IM_WIRE_REPLY_SIZE)
+  {
+    return 0;
+  }
+
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_REPLY, Length), IM_WIRE_REPLY_SIZE, sizeof(ULONG));
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_REPLY, Version), IM_WIRE_REPLY_VERSION, sizeof(USHORT));
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_REPLY, Reserved), 0, sizeof(USHORT));
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_REPLY, Required), Reply->Required, sizeof(ULONG));
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_REPLY, Queued), Reply->Queued, sizeof(ULONG));
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_REPLY, QueuedBytes), Reply->QueuedBytes, sizeof(ULONG));
+  IMWirePut(Buffer + FIELD_OFFSET(IM_WIRE_REPLY, Reserved2), 0, sizeof(ULONG));
+
+  return IM_WIRE_REPLY_SIZE;
+}
+
+//
+// TRUE if Length bytes the other side wrote start with a reply
+//
+FORCEINLINE
+BOOLEAN
+IMWireIsReply(
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_ ULONG Length)
+{
+  return Length >= IM_WIRE_REPLY_SIZE &&
+         IM_WIRE_REPLY_VERSION == IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_REPLY, Version), sizeof(USHORT));
+}
+
+//
+// Reads the reply, the records follow it at Reply->Length. A longer reply
+// of a later driver is read up to the fields known here.
+//
+FORCEINLINE
+BOOLEAN
+IMWireDecodeReply(
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_ ULONG Length,
+    _Out_ PIM_WIRE_REPLY Reply)
+{
+  if (!IMWireIsReply(Buffer, Length))
+  {
+    return FALSE;
+  }
+
+  Reply->Length = (ULONG)IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_REPLY, Length), sizeof(ULONG));
+  Reply->Version = IM_WIRE_REPLY_VERSION;
+
+  if (Reply->Length < IM_WIRE_REPLY_SIZE || Reply->Length > Length)
+  {
+    return FALSE;
+  }
+
+  Reply->Reserved = 0;
+  Reply->Required = (ULONG)IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_REPLY, Required), sizeof(ULONG));
+  Reply->Queued = (ULONG)IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_REPLY, Queued), sizeof(ULONG));
+  Reply->QueuedBytes = (ULONG)IMWireGet(Buffer + FIELD_OFFSET(IM_WIRE_REPLY, QueuedBytes), sizeof(ULONG));
+  Reply->Reserved2 = 0;
+
+  return TRUE;
+}
@@ -0,0 +1,914 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+fltKernel.h
+
+Abstract:
+User mode stand-in for the WDK fltKernel.h. It provides just enough of the
+kernel and filter manager surface (types, Rtl/Ex/Ke/Flt routines, SAL and
+SEH keywords) to compile the platform neutral part of imdrv (im_core) on a
+host OS, so the decision path can be unit tested and benchmarked there.
+
+The shim is never used for the driver build: the WDK header is found
+instead because kernel\shim is only added to the include path by CMake.
+
+Environment:
+
+User mode (host)
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+
+//------------------------------------------------------------------------
+//  Basic types.
+//------------------------------------------------------------------------
+
+#define VOID void
+
+typedef void *PVOID;
+typedef char CHAR, *PCHAR;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef unsigned char BOOLEAN, *PBOOLEAN;
+typedef short SHORT, *PSHORT;
+typedef unsigned short USHORT, *PUSHORT;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG, *PLONGLONG;
+typedef uint64_t ULONGLONG, *PULONGLONG;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR;
+typedef uintptr_t SIZE_T, *PSIZE_T;
+typedef wchar_t WCHAR, *PWCHAR, *PWCH, *PWSTR;
+typedef const wchar_t *PCWCH, *PCWSTR;
+typedef LONG NTSTATUS;
+typedef PVOID HANDLE, *PHANDLE;
+typedef ULONG ACCESS_MASK;
+typedef UCHAR KIRQL, *PKIRQL;
+typedef CHAR KPROCESSOR_MODE;
+
+_Static_assert(sizeof(WCHAR) == 2, "im_core must be compiled with -fshort-wchar");
+
+typedef union _LARGE_INTEGER {
+  struct
+  {
+    ULONG LowPart;
+    LONG HighPart;
+  };
+  LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+#define TRUE 1
+#define FALSE 0
+
+#define CONST const
+#define NOTHING
+#define FLTAPI
+#define NTAPI
+
+//------------------------------------------------------------------------
+//  Status codes.
+//------------------------------------------------------------------------
+
+#define STATUS_SUCCESS ((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT ((NTSTATUS)0x00000102L)
+#define STATUS_REPARSE ((NTSTATUS)0x00000104L)
+#define STATUS_DATATYPE_MISALIGNMENT ((NTSTATUS)0x80000002L)
+#define STATUS_BUFFER_OVERFLOW ((NTSTATUS)0x80000005L)
+#define STATUS_NO_MORE_ENTRIES ((NTSTATUS)0x8000001AL)
+#define STATUS_UNSUCCESSFUL ((NTSTATUS)0xC0000001L)
+#define STATUS_INFO_LENGTH_MISMATCH ((NTSTATUS)0xC0000004L)
+#define STATUS_INVALID_PARAMETER ((NTSTATUS)0xC000000DL)
+#define STATUS_ACCESS_DENIED ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_NOT_FOUND ((NTSTATUS)0xC0000034L)
+#define STATUS_OBJECT_NAME_COLLISION ((NTSTATUS)0xC0000035L)
+#define STATUS_DEVICE_ALREADY_ATTACHED ((NTSTATUS)0xC0000038L)
+#define STATUS_LOCK_NOT_GRANTED ((NTSTATUS)0xC0000055L)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#define STATUS_DEVICE_NOT_CONNECTED ((NTSTATUS)0xC000009DL)
+#define STATUS_REQUEST_NOT_ACCEPTED ((NTSTATUS)0xC00000D0L)
+#define STATUS_INVALID_PARAMETER_1 ((NTSTATUS)0xC00000EFL)
+#define STATUS_INVALID_PARAMETER_2 ((NTSTATUS)0xC00000F0L)
+#define STATUS_INVALID_PARAMETER_3 ((NTSTATUS)0xC00000F1L)
+#define STATUS_INVALID_PARAMETER_4 ((NTSTATUS)0xC00000F2L)
+#define STATUS_INVALID_PARAMETER_5 ((NTSTATUS)0xC00000F3L)
+#define STATUS_INVALID_LEVEL ((NTSTATUS)0xC0000148L)
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225L)
+#define STATUS_MAX_REFERRALS_EXCEEDED ((NTSTATUS)0xC00002F4L)
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+#define NT_ERROR(Status) ((((ULONG)(Status)) >> 30) == 3)
+
+//------------------------------------------------------------------------
+//  SAL annotations (no-op on host).
+//------------------------------------------------------------------------
+
+#define _In_
+#define _In_opt_
+#define _In_z_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _Inout_updates_(size)
+#define _Outptr_
+#define _Outptr_opt_
+#define _Outptr_result_maybenull_
+#define _Outptr_result_buffer_(size)
+#define _In_reads_(size)
+#define _In_reads_bytes_(size)
+#define _In_reads_bytes_opt_(size)
+#define _Out_writes_(size)
+#define _Out_writes_bytes_(size)
+#define _Out_writes_bytes_to_opt_(size, count)
+#define _Check_return_
+#define _Must_inspect_result_
+#define _IRQL_requires_(irql)
+#define _IRQL_requires_max_(irql)
+#define _Flt_CompletionContext_Outptr_
+#define _Flt_ConnectionCookie_Outptr_
+
+//------------------------------------------------------------------------
+//  Structured exception handling.
+//
+//  Every im_core routine has at most one __try/__finally, so __leave is
+//  a jump to the single finally label of the function. __except blocks
+//  are compiled out: there is no user buffer to fault on in the host.
+//------------------------------------------------------------------------
+
+#define __try if (1)
+#define __finally \
+  __im_finally:   \
+  __attribute__((unused));
+#define __leave goto __im_finally
+#define __except(Filter) else if (0)
+
+#define GetExceptionCode() STATUS_UNSUCCESSFUL
+#define GetExceptionInformation() NULL
+#define EXCEPTION_EXECUTE_HANDLER 1
+#define EXCEPTION_CONTINUE_SEARCH 0
+
+//------------------------------------------------------------------------
+//  Helper macros.
+//------------------------------------------------------------------------
+
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+#define FORCEINLINE static inline __attribute__((always_inline))
+#define C_ASSERT(Expression) _Static_assert((Expression), #Expression)
+#define PAGED_CODE() NOTHING
+#define ASSERT(Exp) ((void)0)
+#define FLT_ASSERT(Exp) ((void)0)
+#define FLT_ASSERTMSG(Msg, Exp) ((void)0)
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define MAXLONG 0x7fffffff
+#define MAXULONG 0xffffffff
+#define MAXULONG64 ((ULONGLONG)~((ULONGLONG)0))
+#define MAXUSHORT 0xffff
+
+#define FlagOn(_F, _SF) ((_F) & (_SF))
+#define BooleanFlagOn(F, SF) ((BOOLEAN)(((F) & (SF)) != 0))
+#define SetFlag(_F, _SF) ((_F) |= (_SF))
+#define ClearFlag(_F, _SF) ((_F) &= ~(_SF))
+
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+#define RTL_FIELD_SIZE(type, field) (sizeof(((type *)0)->field))
+#define RTL_NUMBER_OF(A) (sizeof(A) / sizeof((A)[0]))
+#define ARRAYSIZE(A) RTL_NUMBER_OF(A)
+#define CONTAINING_RECORD(address, type, field) \
+  ((type *)((PCHAR)(address) - (ULONG_PTR)(&((type *)0)->field)))
+#define PAGE_SIZE 0x1000
+#define IS_ALIGNED(_pointer, _alignment) \
+  ((((ULONG_PTR)(_pointer)) & ((_alignment)-1)) == 0)
+#define ALIGN_UP_BY(Length, Alignment) \
+  (((ULONG_PTR)(Length) + (Alignment)-1) & ~((ULONG_PTR)(Alignment)-1))
+
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(SYSTEM_CACHE_ALIGNMENT_SIZE)))
+
+#define DbgPrint printf
+#define DbgBreakPoint() NOTHING
+
+//------------------------------------------------------------------------
+//  Memory.
+//------------------------------------------------------------------------
+
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+#define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+#define RtlMoveMemory(Destination, Source, Length) memmove((Destination), (Source), (Length))
+#define RtlFillMemory(Destination, Length, Fill) memset((Destination), (Fill), (Length))
+#define RtlEqualMemory(Destination, Source, Length) (!memcmp((Destination), (Source), (Length)))
+
+typedef enum _POOL_TYPE
+{
+  NonPagedPool = 0,
+  PagedPool = 1,
+  NonPagedPoolNx = 512
+} POOL_TYPE;
+
+#define POOL_NX_ALLOCATION 512
+
+PVOID ExAllocatePoolWithTag(
+    _In_ POOL_TYPE PoolType,
+    _In_ SIZE_T NumberOfBytes,
+    _In_ ULONG Tag);
+
+VOID ExFreePoolWithTag(
+    _In_ PVOID P,
+    _In_ ULONG Tag);
+
+#define ExFreePool(P) ExFreePoolWithTag((P), 0)
+
+//
+// Lookaside lists are plain pool allocations on host
+//
+typedef struct _NPAGED_LOOKASIDE_LIST
+{
+  SIZE_T Size;
+  ULONG Tag;
+} NPAGED_LOOKASIDE_LIST, *PNPAGED_LOOKASIDE_LIST;
+
+VOID ExInitializeNPagedLookasideList(
+    _Out_ PNPAGED_LOOKASIDE_LIST Lookaside,
+    _In_opt_ PVOID Allocate,
+    _In_opt_ PVOID Free,
+    _In_ ULONG Flags,
+    _In_ SIZE_T Size,
+    _In_ ULONG Tag,
+    _In_ USHORT Depth);
+
+VOID ExDeleteNPagedLookasideList(
+    _Inout_ PNPAGED_LOOKASIDE_LIST Lookaside);
+
+PVOID ExAllocateFromNPagedLookasideList(
+    _Inout_ PNPAGED_LOOKASIDE_LIST Lookaside);
+
+VOID ExFreeToNPagedLookasideList(
+    _Inout_ PNPAGED_LOOKASIDE_LIST Lookaside,
+    _In_ PVOID Entry);
+
+//------------------------------------------------------------------------
+//  Doubly linked lists.
+//------------------------------------------------------------------------
+
+typedef struct _LIST_ENTRY
+{
+  struct _LIST_ENTRY *Flink;
+  struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+static inline VOID InitializeListHead(PLIST_ENTRY ListHead)
+{
+  ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+static inline BOOLEAN IsListEmpty(const LIST_ENTRY *ListHead)
+{
+  return (BOOLEAN)(ListHead->Flink == ListHead);
+}
+
+static inline BOOLEAN RemoveEntryList(PLIST_ENTRY Entry)
+{
+  PLIST_ENTRY blink = Entry->Blink;
+  PLIST_ENTRY flink = Entry->Flink;
+  blink->Flink = flink;
+  flink->Blink = blink;
+  return (BOOLEAN)(flink == blink);
+}
+
+static inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead)
+{
+  PLIST_ENTRY entry = ListHead->Flink;
+  RemoveEntryList(entry);
+  return entry;
+}
+
+static inline PLIST_ENTRY RemoveTailList(PLIST_ENTRY ListHead)
+{
+  PLIST_ENTRY entry = ListHead->Blink;
+  RemoveEntryList(entry);
+  return entry;
+}
+
+static inline VOID InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+  PLIST_ENTRY blink = ListHead->Blink;
+  Entry->Flink = ListHead;
+  Entry->Blink = blink;
+  blink->Flink = Entry;
+  ListHead->Blink = Entry;
+}
+
+static inline VOID InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+  PLIST_ENTRY flink = ListHead->Flink;
+  Entry->Flink = flink;
+  Entry->Blink = ListHead;
+  flink->Blink = Entry;
+  ListHead->Flink = Entry;
+}
+
+static inline VOID AppendTailList(PLIST_ENTRY ListHead, PLIST_ENTRY ListToAppend)
+{
+  PLIST_ENTRY listEnd = ListHead->Blink;
+  ListHead->Blink->Flink = ListToAppend;
+  ListHead->Blink = ListToAppend->Blink;
+  ListToAppend->Blink->Flink = ListHead;
+  ListToAppend->Blink = listEnd;
+}
+
+//------------------------------------------------------------------------
+//  Interlocked operations.
+//------------------------------------------------------------------------
+
+#define InterlockedIncrement(Addend) __atomic_add_fetch((Addend), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(Addend) __atomic_sub_fetch((Addend), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(Addend) __atomic_add_fetch((Addend), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement64(Addend) __atomic_sub_fetch((Addend), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(Addend, Value) __atomic_fetch_add((Addend), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(Addend, Value) __atomic_fetch_add((Addend), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedAdd(Addend, Value) __atomic_add_fetch((Addend), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64(Addend, Value) __atomic_add_fetch((Addend), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange(Target, Value) __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(Target, Value) __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangePointer(Target, Value) __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedOr(Target, Value) __atomic_fetch_or((Target), (Value), __ATOMIC_SEQ_CST)
+
+static inline LONG InterlockedCompareExchange(LONG volatile *Destination, LONG Exchange, LONG Comperand)
+{
+  __atomic_compare_exchange_n(Destination, &Comperand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return Comperand;
+}
+
+static inline LONGLONG InterlockedCompareExchange64(LONGLONG volatile *Destination, LONGLONG Exchange, LONGLONG Comperand)
+{
+  __atomic_compare_exchange_n(Destination, &Comperand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return Comperand;
+}
+
+static inline PVOID InterlockedCompareExchangePointer(PVOID volatile *Destination, PVOID Exchange, PVOID Comperand)
+{
+  __atomic_compare_exchange_n(Destination, &Comperand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return Comperand;
+}
+
+#define ReadAcquire(Source) __atomic_load_n((Source), __ATOMIC_ACQUIRE)
+#define ReadNoFence(Source) __atomic_load_n((Source), __ATOMIC_RELAXED)
+#define WriteRelease(Destination, Value) __atomic_store_n((Destination), (Value), __ATOMIC_RELEASE)
+#define WriteNoFence(Destination, Value) __atomic_store_n((Destination), (Value), __ATOMIC_RELAXED)
+
+#define KeMemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+// spin waits in the driver rely on the awaited writer not being preempted
+// at DISPATCH_LEVEL, on host it may be, so the CPU is given to it
+#define YieldProcessor() sched_yield()
+
+//------------------------------------------------------------------------
+//  IRQL, spin locks, events, time.
+//------------------------------------------------------------------------
+
+#define PASSIVE_LEVEL 0
+#define APC_LEVEL 1
+#define DISPATCH_LEVEL 2
+
+#define KeGetCurrentIrql() ((KIRQL)PASSIVE_LEVEL)
+
+// threads are preempted on host whatever the IRQL is
+#define KeRaiseIrql(NewIrql, OldIrql) (*(OldIrql) = PASSIVE_LEVEL)
+#define KeLowerIrql(NewIrql) ((void)(NewIrql))
+
+//
+// Processors, the host is one processor unless a test says otherwise
+//
+
+#define ALL_PROCESSOR_GROUPS 0xffff
+
+typedef struct _PROCESSOR_NUMBER
+{
+  USHORT Group;
+  UCHAR Number;
+  UCHAR Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+ULONG
+KeQueryActiveProcessorCountEx(
+    _In_ USHORT GroupNumber);
+
+ULONG
+KeGetCurrentProcessorNumberEx(
+    _Out_opt_ PPROCESSOR_NUMBER ProcNumber);
+
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+
+VOID KeInitializeSpinLock(
+    _Out_ PKSPIN_LOCK SpinLock);
+
+VOID IMShimAcquireSpinLock(
+    _Inout_ PKSPIN_LOCK SpinLock);
+
+VOID IMShimReleaseSpinLock(
+    _Inout_ PKSPIN_LOCK SpinLock);
+
+#define KeAcquireSpinLock(SpinLock, OldIrql) \
+  (*(OldIrql) = PASSIVE_LEVEL, IMShimAcquireSpinLock(SpinLock))
+#define KeReleaseSpinLock(SpinLock, NewIrql) \
+  ((void)(NewIrql), IMShimReleaseSpinLock(SpinLock))
+
+//
+// Reader/writer spin lock, any number of shared owners or one exclusive
+//
+typedef LONG EX_SPIN_LOCK, *PEX_SPIN_LOCK;
+
+KIRQL ExAcquireSpinLockShared(
+    _Inout_ PEX_SPIN_LOCK SpinLock);
+
+VOID ExReleaseSpinLockShared(
+    _Inout_ PEX_SPIN_LOCK SpinLock,
+    _In_ KIRQL OldIrql);
+
+KIRQL ExAcquireSpinLockExclusive(
+    _Inout_ PEX_SPIN_LOCK SpinLock);
+
+VOID ExReleaseSpinLockExclusive(
+    _Inout_ PEX_SPIN_LOCK SpinLock,
+    _In_ KIRQL OldIrql);
+
+//
+// Fast mutex, raises to APC_LEVEL in kernel, a plain mutex on host
+//
+typedef struct _FAST_MUTEX
+{
+  pthread_mutex_t Mutex;
+} FAST_MUTEX, *PFAST_MUTEX;
+
+VOID ExInitializeFastMutex(
+    _Out_ PFAST_MUTEX FastMutex);
+
+VOID ExAcquireFastMutex(
+    _Inout_ PFAST_MUTEX FastMutex);
+
+BOOLEAN
+ExTryToAcquireFastMutex(
+    _Inout_ PFAST_MUTEX FastMutex);
+
+VOID ExReleaseFastMutex(
+    _Inout_ PFAST_MUTEX FastMutex);
+
+//
+// Rundown protection: bit 0 is set once the rundown started, every owner
+// adds 2
+//
+typedef struct _EX_RUNDOWN_REF
+{
+  __volatile LONG_PTR Count;
+} EX_RUNDOWN_REF, *PEX_RUNDOWN_REF;
+
+VOID ExInitializeRundownProtection(
+    _Out_ PEX_RUNDOWN_REF RunRef);
+
+VOID ExReInitializeRundownProtection(
+    _Inout_ PEX_RUNDOWN_REF RunRef);
+
+BOOLEAN
+ExAcquireRundownProtection(
+    _Inout_ PEX_RUNDOWN_REF RunRef);
+
+VOID ExReleaseRundownProtection(
+    _Inout_ PEX_RUNDOWN_REF RunRef);
+
+VOID ExWaitForRundownProtectionRelease(
+    _Inout_ PEX_RUNDOWN_REF RunRef);
+
+typedef enum _EVENT_TYPE
+{
+  NotificationEvent,
+  SynchronizationEvent
+} EVENT_TYPE;
+
+typedef enum _KWAIT_REASON
+{
+  Executive = 0
+} KWAIT_REASON;
+
+#define KernelMode ((KPROCESSOR_MODE)0)
+#define UserMode ((KPROCESSOR_MODE)1)
+#define IO_NO_INCREMENT 0
+
+typedef struct _KEVENT
+{
+  pthread_mutex_t Mutex;
+  pthread_cond_t Condition;
+  EVENT_TYPE Type;
+  LONG Signaled;
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+VOID KeInitializeEvent(
+    _Out_ PRKEVENT Event,
+    _In_ EVENT_TYPE Type,
+    _In_ BOOLEAN State);
+
+LONG KeSetEvent(
+    _Inout_ PRKEVENT Event,
+    _In_ LONG Increment,
+    _In_ BOOLEAN Wait);
+
+VOID KeClearEvent(
+    _Inout_ PRKEVENT Event);
+
+LONG KeReadStateEvent(
+    _In_ PRKEVENT Event);
+
+NTSTATUS
+KeWaitForSingleObject(
+    _In_ PVOID Object,
+    _In_ KWAIT_REASON WaitReason,
+    _In_ KPROCESSOR_MODE WaitMode,
+    _In_ BOOLEAN Alertable,
+    _In_opt_ PLARGE_INTEGER Timeout);
+
+VOID KeQuerySystemTime(
+    _Out_ PLARGE_INTEGER CurrentTime);
+
+// monotonic, 100 ns units
+ULONGLONG
+KeQueryInterruptTime(VOID);
+
+//------------------------------------------------------------------------
+//  Processor features and extended state.
+//------------------------------------------------------------------------
+
+#define PF_XMMI64_INSTRUCTIONS_AVAILABLE 10
+#define PF_AVX2_INSTRUCTIONS_AVAILABLE 40
+
+#define XSTATE_MASK_AVX (1ULL << 2)
+
+//
+// user mode threads own their extended state, nothing to save on host
+//
+typedef struct _XSTATE_SAVE
+{
+  ULONGLONG Mask;
+} XSTATE_SAVE, *PXSTATE_SAVE;
+
+BOOLEAN
+ExIsProcessorFeaturePresent(
+    _In_ ULONG ProcessorFeature);
+
+NTSTATUS
+KeSaveExtendedProcessorState(
+    _In_ ULONGLONG Mask,
+    _Out_ PXSTATE_SAVE XStateSave);
+
+VOID KeRestoreExtendedProcessorState(
+    _In_ PXSTATE_SAVE XStateSave);
+
+//------------------------------------------------------------------------
+//  Strings.
+//------------------------------------------------------------------------
+
+typedef struct _UNICODE_STRING
+{
+  USHORT Length;
+  USHORT MaximumLength;
+  PWCH Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+
+VOID RtlInitUnicodeString(
+    _Out_ PUNICODE_STRING DestinationString,
+    _In_opt_ PCWSTR SourceString);
+
+VOID RtlCopyUnicodeString(
+    _Inout_ PUNICODE_STRING DestinationString,
+    _In_opt_ PCUNICODE_STRING SourceString);
+
+LONG RtlCompareUnicodeString(
+    _In_ PCUNICODE_STRING String1,
+    _In_ PCUNICODE_STRING String2,
+    _In_ BOOLEAN CaseInSensitive);
+
+BOOLEAN
+RtlEqualUnicodeString(
+    _In_ PCUNICODE_STRING String1,
+    _In_ PCUNICODE_STRING String2,
+    _In_ BOOLEAN CaseInSensitive);
+
+WCHAR
+RtlUpcaseUnicodeChar(
+    _In_ WCHAR SourceCharacter);
+
+//
+// wcscmp of the C runtime works on 32 bit wchar_t on host
+//
+int IMShimWcscmp(
+    _In_ const WCHAR *String1,
+    _In_ const WCHAR *String2);
+
+#define wcscmp IMShimWcscmp
+
+//------------------------------------------------------------------------
+//  Objects and processes.
+//------------------------------------------------------------------------
+
+typedef struct _DRIVER_OBJECT
+{
+  PVOID DriverStart;
+} DRIVER_OBJECT, *PDRIVER_OBJECT;
+
+typedef struct _EPROCESS *PEPROCESS;
+
+typedef enum _PROCESSINFOCLASS
+{
+  ProcessBasicInformation = 0,
+  ProcessImageFileName = 27
+} PROCESSINFOCLASS;
+
+#define OBJ_CASE_INSENSITIVE 0x00000040L
+#define OBJ_KERNEL_HANDLE 0x00000200L
+
+HANDLE
+PsGetCurrentProcessId(VOID);
+
+NTSTATUS
+PsLookupProcessByProcessId(
+    _In_ HANDLE ProcessId,
+    _Outptr_ PEPROCESS *Process);
+
+NTSTATUS
+ObOpenObjectByPointer(
+    _In_ PVOID Object,
+    _In_ ULONG HandleAttributes,
+    _In_opt_ PVOID PassedAccessState,
+    _In_ ACCESS_MASK DesiredAccess,
+    _In_opt_ PVOID ObjectType,
+    _In_ KPROCESSOR_MODE AccessMode,
+    _Out_ PHANDLE Handle);
+
+VOID ObDereferenceObject(
+    _In_ PVOID Object);
+
+NTSTATUS
+ZwClose(
+    _In_ HANDLE Handle);
+
+//
+// one address space on host: attaching to a process does nothing
+//
+typedef struct _KAPC_STATE
+{
+  PVOID Process;
+} KAPC_STATE, *PKAPC_STATE, *PRKAPC_STATE;
+
+PEPROCESS
+PsGetCurrentProcess(VOID);
+
+VOID KeStackAttachProcess(
+    _Inout_ PEPROCESS Process,
+    _Out_ PRKAPC_STATE ApcState);
+
+VOID KeUnstackDetachProcess(
+    _In_ PRKAPC_STATE ApcState);
+
+#define ObReferenceObject(Object) ((void)(Object))
+
+//------------------------------------------------------------------------
+//  Memory descriptor lists.
+//
+//  Pages of an MDL are one allocation on host, system and user mappings
+//  are the same address of it.
+//------------------------------------------------------------------------
+
+typedef LARGE_INTEGER PHYSICAL_ADDRESS;
+
+typedef enum _MEMORY_CACHING_TYPE
+{
+  MmNonCached = 0,
+  MmCached = 1
+} MEMORY_CACHING_TYPE;
+
+typedef enum _MM_PAGE_PRIORITY
+{
+  LowPagePriority = 0,
+  NormalPagePriority = 16,
+  HighPagePriority = 32
+} MM_PAGE_PRIORITY;
+
+#define MM_ALLOCATE_FULLY_REQUIRED 0x00000004
+
+typedef struct _MDL
+{
+  PVOID MappedSystemVa;
+  ULONG ByteCount;
+} MDL, *PMDL;
+
+PMDL MmAllocatePagesForMdlEx(
+    _In_ PHYSICAL_ADDRESS LowAddress,
+    _In_ PHYSICAL_ADDRESS HighAddress,
+    _In_ PHYSICAL_ADDRESS SkipBytes,
+    _In_ SIZE_T TotalBytes,
+    _In_ MEMORY_CACHING_TYPE CacheType,
+    _In_ ULONG Flags);
+
+VOID MmFreePagesFromMdl(
+    _Inout_ PMDL MemoryDescriptorList);
+
+PVOID MmMapLockedPagesSpecifyCache(
+    _Inout_ PMDL MemoryDescriptorList,
+    _In_ KPROCESSOR_MODE AccessMode,
+    _In_ MEMORY_CACHING_TYPE CacheType,
+    _In_opt_ PVOID RequestedAddress,
+    _In_ ULONG BugCheckOnFailure,
+    _In_ ULONG Priority);
+
+VOID MmUnmapLockedPages(
+    _In_ PVOID BaseAddress,
+    _Inout_ PMDL MemoryDescriptorList);
+
+#define MmGetMdlByteCount(Mdl) ((Mdl)->ByteCount)
+#define MmGetSystemAddressForMdlSafe(Mdl, Priority) ((Mdl)->MappedSystemVa)
+
+//------------------------------------------------------------------------
+//  I/O and filter manager.
+//------------------------------------------------------------------------
+
+#define IRP_MJ_CREATE 0x00
+#define IRP_MJ_OPERATION_END ((UCHAR)0x80)
+
+#define SL_OPEN_PAGING_FILE 0x02
+#define SL_OPEN_TARGET_DIRECTORY 0x04
+
+#define FO_VOLUME_OPEN 0x00400000
+
+#define FILE_EXECUTE 0x0020
+#define FILE_READ_DATA 0x0001
+
+#define IO_REPARSE 0x0
+
+#define FLT_FILE_NAME_OPENED 0x01
+#define FLT_FILE_NAME_NORMALIZED 0x02
+#define FLT_FILE_NAME_QUERY_DEFAULT 0x0100
+#define FLT_FILE_NAME_QUERY_FILESYSTEM_ONLY 0x0300
+#define FLT_FILE_NAME_QUERY_ALWAYS_ALLOW_CACHE_LOOKUP 0x0400
+#define FLT_FILE_NAME_ALLOW_QUERY_ON_REPARSE 0x04000000
+
+typedef struct _FLT_FILTER *PFLT_FILTER;
+typedef struct _FLT_INSTANCE *PFLT_INSTANCE;
+typedef struct _FLT_VOLUME *PFLT_VOLUME;
+typedef struct _FLT_PORT *PFLT_PORT;
+
+typedef ULONG FLT_POST_OPERATION_FLAGS;
+typedef ULONG FLT_FILE_NAME_OPTIONS;
+
+typedef enum _FLT_PREOP_CALLBACK_STATUS
+{
+  FLT_PREOP_SUCCESS_WITH_CALLBACK,
+  FLT_PREOP_SUCCESS_NO_CALLBACK,
+  FLT_PREOP_PENDING,
+  FLT_PREOP_DISALLOW_FASTIO,
+  FLT_PREOP_COMPLETE,
+  FLT_PREOP_SYNCHRONIZE
+} FLT_PREOP_CALLBACK_STATUS;
+
+typedef enum _FLT_POSTOP_CALLBACK_STATUS
+{
+  FLT_POSTOP_FINISHED_PROCESSING,
+  FLT_POSTOP_MORE_PROCESSING_REQUIRED
+} FLT_POSTOP_CALLBACK_STATUS;
+
+typedef struct _FILE_OBJECT
+{
+  ULONG Flags;
+  UNICODE_STRING FileName;
+  struct _FILE_OBJECT *RelatedFileObject;
+
+  //
+  // host only: set by FltCancelFileOpen
+  //
+  BOOLEAN OpenCancelled;
+
+  //
+  // host only: FileName.Buffer was allocated by IoReplaceFileObjectName
+  //
+  BOOLEAN FileNameOwned;
+} FILE_OBJECT, *PFILE_OBJECT;
+
+typedef struct _IO_SECURITY_CONTEXT
+{
+  ACCESS_MASK DesiredAccess;
+} IO_SECURITY_CONTEXT, *PIO_SECURITY_CONTEXT;
+
+typedef struct _IO_STATUS_BLOCK
+{
+  NTSTATUS Status;
+  ULONG_PTR Information;
+} IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+typedef union _FLT_PARAMETERS {
+  struct
+  {
+    PIO_SECURITY_CONTEXT SecurityContext;
+    ULONG Options;
+    USHORT FileAttributes;
+    USHORT ShareAccess;
+    ULONG EaLength;
+    PVOID EaBuffer;
+    LARGE_INTEGER AllocationSize;
+  } Create;
+} FLT_PARAMETERS, *PFLT_PARAMETERS;
+
+typedef struct _FLT_IO_PARAMETER_BLOCK
+{
+  ULONG IrpFlags;
+  UCHAR MajorFunction;
+  UCHAR MinorFunction;
+  UCHAR OperationFlags;
+  UCHAR Reserved;
+  PFILE_OBJECT TargetFileObject;
+  PFLT_INSTANCE TargetInstance;
+  FLT_PARAMETERS Parameters;
+} FLT_IO_PARAMETER_BLOCK, *PFLT_IO_PARAMETER_BLOCK;
+
+typedef struct _FLT_CALLBACK_DATA
+{
+  ULONG Flags;
+  PVOID Thread;
+  PFLT_IO_PARAMETER_BLOCK Iopb;
+  IO_STATUS_BLOCK IoStatus;
+} FLT_CALLBACK_DATA, *PFLT_CALLBACK_DATA;
+
+typedef struct _FLT_RELATED_OBJECTS
+{
+  USHORT Size;
+  USHORT TransactionContext;
+  PFLT_FILTER Filter;
+  PFLT_VOLUME Volume;
+  PFLT_INSTANCE Instance;
+  PFILE_OBJECT FileObject;
+  PVOID Transaction;
+} FLT_RELATED_OBJECTS, *PFLT_RELATED_OBJECTS;
+
+typedef const FLT_RELATED_OBJECTS *PCFLT_RELATED_OBJECTS;
+
+typedef struct _FLT_FILE_NAME_INFORMATION
+{
+  USHORT Size;
+  USHORT NamesParsed;
+  FLT_FILE_NAME_OPTIONS Format;
+  UNICODE_STRING Name;
+  UNICODE_STRING Volume;
+  UNICODE_STRING Share;
+  UNICODE_STRING Extension;
+  UNICODE_STRING Stream;
+  UNICODE_STRING FinalComponent;
+  UNICODE_STRING ParentDir;
+} FLT_FILE_NAME_INFORMATION, *PFLT_FILE_NAME_INFORMATION;
+
+NTSTATUS
+FltGetFileNameInformation(
+    _In_ PFLT_CALLBACK_DATA CallbackData,
+    _In_ FLT_FILE_NAME_OPTIONS NameOptions,
+    _Outptr_ PFLT_FILE_NAME_INFORMATION *FileNameInformation);
+
+VOID FltReleaseFileNameInformation(
+    _In_ PFLT_FILE_NAME_INFORMATION FileNameInformation);
+
+VOID FltCancelFileOpen(
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject);
+
+NTSTATUS
+IoReplaceFileObjectName(
+    _In_ PFILE_OBJECT FileObject,
+    _In_reads_bytes_(FileNameLength) PWSTR NewFileName,
+    _In_ USHORT FileNameLength);
+
+//------------------------------------------------------------------------
+//  Host only controls.
+//------------------------------------------------------------------------
+
+#include "im_shim.h"
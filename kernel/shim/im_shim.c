@@ -0,0 +1,1070 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_shim.c
+
+Abstract:
+Host implementation of the kernel routines declared in fltKernel.h
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+
+#include "fltKernel.h"
+#include "ntstrsafe.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_SHIM_MAX_PROCESSES 256
+
+//
+// 100ns intervals between 1601-01-01 and 1970-01-01
+//
+#define IM_SHIM_EPOCH_DIFFERENCE 116444736000000000LL
+
+#define IM_SHIM_SPIN_COUNT 64
+
+// exclusive owner bit of EX_SPIN_LOCK, the rest counts shared owners
+#define IM_SHIM_EXCLUSIVE ((LONG)0x80000000)
+
+//------------------------------------------------------------------------
+//  Local structures.
+//------------------------------------------------------------------------
+
+//
+// Fake process object, PEPROCESS and process handle both point to it
+//
+typedef struct _IM_SHIM_PROCESS
+{
+  HANDLE ProcessId;
+  UNICODE_STRING ImageFileName;
+} IM_SHIM_PROCESS, *PIM_SHIM_PROCESS;
+
+//------------------------------------------------------------------------
+//  Local globals.
+//------------------------------------------------------------------------
+
+static __thread HANDLE ShimCurrentProcessId = NULL;
+
+static __thread ULONG ShimCurrentProcessor = 0;
+static __volatile LONG ShimProcessorCount = 1;
+
+static pthread_mutex_t ShimProcessLock = PTHREAD_MUTEX_INITIALIZER;
+static IM_SHIM_PROCESS ShimProcesses[IM_SHIM_MAX_PROCESSES];
+
+static __volatile LONGLONG ShimPoolAllocations = 0;
+static __volatile LONGLONG ShimPoolOutstanding = 0;
+
+//------------------------------------------------------------------------
+//  Pool.
+//------------------------------------------------------------------------
+
+PVOID ExAllocatePoolWithTag(
+    _In_ POOL_TYPE PoolType,
+    _In_ SIZE_T NumberOfBytes,
+    _In_ ULONG Tag)
+{
+  PVOID buffer = NULL;
+
+  UNREFERENCED_PARAMETER(PoolType);
+  UNREFERENCED_PARAMETER(Tag);
+
+  buffer = malloc(NumberOfBytes);
+
+  if (NULL != buffer)
+  {
+    InterlockedIncrement64(&ShimPoolAllocations);
+    InterlockedIncrement64(&ShimPoolOutstanding);
+  }
+
+  return buffer;
+}
+
+VOID ExFreePoolWithTag(
+    _In_ PVOID P,
+    _In_ ULONG Tag)
+{
+  UNREFERENCED_PARAMETER(Tag);
+
+  if (NULL == P)
+  {
+    return;
+  }
+
+  InterlockedDecrement64(&ShimPoolOutstanding);
+  free(P);
+}
+
+VOID ExInitializeNPagedLookasideList(
+    _Out_ PNPAGED_LOOKASIDE_LIST Lookaside,
+    _In_opt_ PVOID Allocate,
+    _In_opt_ PVOID Free,
+    _In_ ULONG Flags,
+    _In_ SIZE_T Size,
+    _In_ ULONG Tag,
+    _In_ USHORT Depth)
+{
+  UNREFERENCED_PARAMETER(Allocate);
+  UNREFERENCED_PARAMETER(Free);
+  UNREFERENCED_PARAMETER(Flags);
+  UNREFERENCED_PARAMETER(Depth);
+
+  Lookaside->Size = Size;
+  Lookaside->Tag = Tag;
+}
+
+VOID ExDeleteNPagedLookasideList(
+    _Inout_ PNPAGED_LOOKASIDE_LIST Lookaside)
+{
+  Lookaside->Size = 0;
+}
+
+PVOID ExAllocateFromNPagedLookasideList(
+    _Inout_ PNPAGED_LOOKASIDE_LIST Lookaside)
+{
+  return ExAllocatePoolWithTag(NonPagedPoolNx, Lookaside->Size, Lookaside->Tag);
+}
+
+VOID ExFreeToNPagedLookasideList(
+    _Inout_ PNPAGED_LOOKASIDE_LIST Lookaside,
+    _In_ PVOID Entry)
+{
+  ExFreePoolWithTag(Entry, Lookaside->Tag);
+}
+
+//
+// MDL is pool, so it shows up in the pool counters, pages are not
+//
+PMDL MmAllocatePagesForMdlEx(
+    _In_ PHYSICAL_ADDRESS LowAddress,
+    _In_ PHYSICAL_ADDRESS HighAddress,
+    _In_ PHYSICAL_ADDRESS SkipBytes,
+    _In_ SIZE_T TotalBytes,
+    _In_ MEMORY_CACHING_TYPE CacheType,
+    _In_ ULONG Flags)
+{
+  PMDL mdl = NULL;
+  SIZE_T size = ALIGN_UP_BY(TotalBytes, PAGE_SIZE);
+
+  UNREFERENCED_PARAMETER(LowAddress);
+  UNREFERENCED_PARAMETER(HighAddress);
+  UNREFERENCED_PARAMETER(SkipBytes);
+  UNREFERENCED_PARAMETER(CacheType);
+  UNREFERENCED_PARAMETER(Flags);
+
+  mdl = (PMDL)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(MDL), 0);
+
+  if (NULL == mdl)
+  {
+    return NULL;
+  }
+
+  // pages come zeroed
+  mdl->MappedSystemVa = aligned_alloc(PAGE_SIZE, size);
+  mdl->ByteCount = (ULONG)size;
+
+  if (NULL == mdl->MappedSystemVa)
+  {
+    ExFreePool(mdl);
+    return NULL;
+  }
+
+  RtlZeroMemory(mdl->MappedSystemVa, size);
+
+  return mdl;
+}
+
+VOID MmFreePagesFromMdl(
+    _Inout_ PMDL MemoryDescriptorList)
+{
+  free(MemoryDescriptorList->MappedSystemVa);
+  MemoryDescriptorList->MappedSystemVa = NULL;
+  MemoryDescriptorList->ByteCount = 0;
+}
+
+PVOID MmMapLockedPagesSpecifyCache(
+    _Inout_ PMDL MemoryDescriptorList,
+    _In_ KPROCESSOR_MODE AccessMode,
+    _In_ MEMORY_CACHING_TYPE CacheType,
+    _In_opt_ PVOID RequestedAddress,
+    _In_ ULONG BugCheckOnFailure,
+    _In_ ULONG Priority)
+{
+  UNREFERENCED_PARAMETER(AccessMode);
+  UNREFERENCED_PARAMETER(CacheType);
+  UNREFERENCED_PARAMETER(RequestedAddress);
+  UNREFERENCED_PARAMETER(BugCheckOnFailure);
+  UNREFERENCED_PARAMETER(Priority);
+
+  return MemoryDescriptorList->MappedSystemVa;
+}
+
+VOID MmUnmapLockedPages(
+    _In_ PVOID BaseAddress,
+    _Inout_ PMDL MemoryDescriptorList)
+{
+  UNREFERENCED_PARAMETER(BaseAddress);
+  UNREFERENCED_PARAMETER(MemoryDescriptorList);
+}
+
+LONGLONG
+IMShimGetPoolAllocations(VOID)
+{
+  return ShimPoolAllocations;
+}
+
+LONGLONG
+IMShimGetPoolOutstanding(VOID)
+{
+  return ShimPoolOutstanding;
+}
+
+VOID IMShimResetPoolCounters(VOID)
+{
+  ShimPoolAllocations = 0;
+  ShimPoolOutstanding = 0;
+}
+
+//------------------------------------------------------------------------
+//  Spin locks, events, time.
+//------------------------------------------------------------------------
+
+VOID KeInitializeSpinLock(
+    _Out_ PKSPIN_LOCK SpinLock)
+{
+  __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE);
+}
+
+//
+// there is no IRQL on host, so a preempted owner can hold the lock for a
+// whole time slice: give the CPU away instead of burning it
+//
+static inline VOID IMShimSpin(
+    _Inout_ PULONG Spins)
+{
+  if (++(*Spins) < IM_SHIM_SPIN_COUNT)
+  {
+    __builtin_ia32_pause();
+  }
+  else
+  {
+    sched_yield();
+  }
+}
+
+VOID IMShimAcquireSpinLock(
+    _Inout_ PKSPIN_LOCK SpinLock)
+{
+  ULONG spins = 0;
+
+  while (__atomic_exchange_n(SpinLock, 1, __ATOMIC_ACQUIRE) != 0)
+  {
+    while (__atomic_load_n(SpinLock, __ATOMIC_RELAXED) != 0)
+    {
+      IMShimSpin(&spins);
+    }
+  }
+}
+
+VOID IMShimReleaseSpinLock(
+    _Inout_ PKSPIN_LOCK SpinLock)
+{
+  __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE);
+}
+
+KIRQL ExAcquireSpinLockShared(
+    _Inout_ PEX_SPIN_LOCK SpinLock)
+{
+  LONG value = 0;
+  ULONG spins = 0;
+
+  for (;;)
+  {
+    value = __atomic_load_n(SpinLock, __ATOMIC_RELAXED);
+
+    if (0 == (value & IM_SHIM_EXCLUSIVE) &&
+        __atomic_compare_exchange_n(SpinLock, &value, value + 1, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+      return PASSIVE_LEVEL;
+    }
+
+    IMShimSpin(&spins);
+  }
+}
+
+VOID ExReleaseSpinLockShared(
+    _Inout_ PEX_SPIN_LOCK SpinLock,
+    _In_ KIRQL OldIrql)
+{
+  UNREFERENCED_PARAMETER(OldIrql);
+
+  __atomic_sub_fetch(SpinLock, 1, __ATOMIC_RELEASE);
+}
+
+KIRQL ExAcquireSpinLockExclusive(
+    _Inout_ PEX_SPIN_LOCK SpinLock)
+{
+  LONG value = 0;
+  ULONG spins = 0;
+
+  // take the exclusive bit first, so no new shared owner comes in
+  for (;;)
+  {
+    value = __atomic_load_n(SpinLock, __ATOMIC_RELAXED);
+
+    if (0 == (value & IM_SHIM_EXCLUSIVE) &&
+        __atomic_compare_exchange_n(SpinLock, &value, value | IM_SHIM_EXCLUSIVE, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+      break;
+    }
+
+    IMShimSpin(&spins);
+  }
+
+  // then wait for the shared owners to leave
+  while (__atomic_load_n(SpinLock, __ATOMIC_ACQUIRE) != IM_SHIM_EXCLUSIVE)
+  {
+    IMShimSpin(&spins);
+  }
+
+  return PASSIVE_LEVEL;
+}
+
+VOID ExReleaseSpinLockExclusive(
+    _Inout_ PEX_SPIN_LOCK SpinLock,
+    _In_ KIRQL OldIrql)
+{
+  UNREFERENCED_PARAMETER(OldIrql);
+
+  __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE);
+}
+
+VOID ExInitializeFastMutex(
+    _Out_ PFAST_MUTEX FastMutex)
+{
+  pthread_mutex_init(&FastMutex->Mutex, NULL);
+}
+
+VOID ExAcquireFastMutex(
+    _Inout_ PFAST_MUTEX FastMutex)
+{
+  pthread_mutex_lock(&FastMutex->Mutex);
+}
+
+BOOLEAN
+ExTryToAcquireFastMutex(
+    _Inout_ PFAST_MUTEX FastMutex)
+{
+  return 0 == pthread_mutex_trylock(&FastMutex->Mutex) ? TRUE : FALSE;
+}
+
+VOID ExReleaseFastMutex(
+    _Inout_ PFAST_MUTEX FastMutex)
+{
+  pthread_mutex_unlock(&FastMutex->Mutex);
+}
+
+VOID ExInitializeRundownProtection(
+    _Out_ PEX_RUNDOWN_REF RunRef)
+{
+  __atomic_store_n(&RunRef->Count, 0, __ATOMIC_RELEASE);
+}
+
+VOID ExReInitializeRundownProtection(
+    _Inout_ PEX_RUNDOWN_REF RunRef)
+{
+  __atomic_store_n(&RunRef->Count, 0, __ATOMIC_RELEASE);
+}
+
+BOOLEAN
+ExAcquireRundownProtection(
+    _Inout_ PEX_RUNDOWN_REF RunRef)
+{
+  LONG_PTR value = __atomic_load_n(&RunRef->Count, __ATOMIC_RELAXED);
+
+  while (0 == (value & 1))
+  {
+    if (__atomic_compare_exchange_n(&RunRef->Count, &value, value + 2, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+VOID ExReleaseRundownProtection(
+    _Inout_ PEX_RUNDOWN_REF RunRef)
+{
+  __atomic_sub_fetch(&RunRef->Count, 2, __ATOMIC_RELEASE);
+}
+
+VOID ExWaitForRundownProtectionRelease(
+    _Inout_ PEX_RUNDOWN_REF RunRef)
+{
+  ULONG spins = 0;
+
+  __atomic_or_fetch(&RunRef->Count, 1, __ATOMIC_ACQ_REL);
+
+  while (1 != __atomic_load_n(&RunRef->Count, __ATOMIC_ACQUIRE))
+  {
+    IMShimSpin(&spins);
+  }
+}
+
+VOID KeInitializeEvent(
+    _Out_ PRKEVENT Event,
+    _In_ EVENT_TYPE Type,
+    _In_ BOOLEAN State)
+{
+  pthread_condattr_t attributes;
+
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+
+  pthread_mutex_init(&Event->Mutex, NULL);
+  pthread_cond_init(&Event->Condition, &attributes);
+  pthread_condattr_destroy(&attributes);
+
+  Event->Type = Type;
+  Event->Signaled = State;
+}
+
+LONG KeSetEvent(
+    _Inout_ PRKEVENT Event,
+    _In_ LONG Increment,
+    _In_ BOOLEAN Wait)
+{
+  LONG previous;
+
+  UNREFERENCED_PARAMETER(Increment);
+  UNREFERENCED_PARAMETER(Wait);
+
+  pthread_mutex_lock(&Event->Mutex);
+  previous = Event->Signaled;
+  Event->Signaled = TRUE;
+  if (NotificationEvent == Event->Type)
+  {
+    pthread_cond_broadcast(&Event->Condition);
+  }
+  else
+  {
+    pthread_cond_signal(&Event->Condition);
+  }
+  pthread_mutex_unlock(&Event->Mutex);
+
+  return previous;
+}
+
+VOID KeClearEvent(
+    _Inout_ PRKEVENT Event)
+{
+  pthread_mutex_lock(&Event->Mutex);
+  __atomic_store_n(&Event->Signaled, FALSE, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&Event->Mutex);
+}
+
+LONG KeReadStateEvent(
+    _In_ PRKEVENT Event)
+{
+  // a plain read of the header like in kernel
+  return __atomic_load_n(&Event->Signaled, __ATOMIC_ACQUIRE);
+}
+
+NTSTATUS
+KeWaitForSingleObject(
+    _In_ PVOID Object,
+    _In_ KWAIT_REASON WaitReason,
+    _In_ KPROCESSOR_MODE WaitMode,
+    _In_ BOOLEAN Alertable,
+    _In_opt_ PLARGE_INTEGER Timeout)
+{
+  PRKEVENT event = (PRKEVENT)Object;
+  NTSTATUS status = STATUS_SUCCESS;
+  struct timespec deadline;
+  LONGLONG interval = 0;
+
+  UNREFERENCED_PARAMETER(WaitReason);
+  UNREFERENCED_PARAMETER(WaitMode);
+  UNREFERENCED_PARAMETER(Alertable);
+
+  if (NULL != Timeout)
+  {
+    //
+    // only relative (negative) timeouts are used by the driver
+    //
+    interval = Timeout->QuadPart < 0 ? -Timeout->QuadPart : 0;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += interval / 10000000;
+    deadline.tv_nsec += (interval % 10000000) * 100;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
+  pthread_mutex_lock(&event->Mutex);
+
+  while (!event->Signaled)
+  {
+    if (NULL == Timeout)
+    {
+      pthread_cond_wait(&event->Condition, &event->Mutex);
+    }
+    else if (ETIMEDOUT == pthread_cond_timedwait(&event->Condition, &event->Mutex, &deadline))
+    {
+      status = STATUS_TIMEOUT;
+      break;
+    }
+  }
+
+  if (STATUS_SUCCESS == status && SynchronizationEvent == event->Type)
+  {
+    event->Signaled = FALSE;
+  }
+
+  pthread_mutex_unlock(&event->Mutex);
+
+  return status;
+}
+
+VOID KeQuerySystemTime(
+    _Out_ PLARGE_INTEGER CurrentTime)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  CurrentTime->QuadPart = IM_SHIM_EPOCH_DIFFERENCE + (LONGLONG)now.tv_sec * 10000000 + now.tv_nsec / 100;
+}
+
+ULONGLONG
+KeQueryInterruptTime(VOID)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (ULONGLONG)now.tv_sec * 10000000 + (ULONGLONG)now.tv_nsec / 100;
+}
+
+//------------------------------------------------------------------------
+//  Processor features and extended state.
+//------------------------------------------------------------------------
+
+BOOLEAN
+ExIsProcessorFeaturePresent(
+    _In_ ULONG ProcessorFeature)
+{
+  switch (ProcessorFeature)
+  {
+  case PF_XMMI64_INSTRUCTIONS_AVAILABLE:
+    return __builtin_cpu_supports("sse2") ? TRUE : FALSE;
+  case PF_AVX2_INSTRUCTIONS_AVAILABLE:
+    return __builtin_cpu_supports("avx2") ? TRUE : FALSE;
+  default:
+    return FALSE;
+  }
+}
+
+NTSTATUS
+KeSaveExtendedProcessorState(
+    _In_ ULONGLONG Mask,
+    _Out_ PXSTATE_SAVE XStateSave)
+{
+  XStateSave->Mask = Mask;
+
+  return STATUS_SUCCESS;
+}
+
+VOID KeRestoreExtendedProcessorState(
+    _In_ PXSTATE_SAVE XStateSave)
+{
+  UNREFERENCED_PARAMETER(XStateSave);
+}
+
+//------------------------------------------------------------------------
+//  Strings.
+//------------------------------------------------------------------------
+
+VOID RtlInitUnicodeString(
+    _Out_ PUNICODE_STRING DestinationString,
+    _In_opt_ PCWSTR SourceString)
+{
+  USHORT length = 0;
+
+  DestinationString->Buffer = (PWCH)SourceString;
+
+  if (NULL == SourceString)
+  {
+    DestinationString->Length = 0;
+    DestinationString->MaximumLength = 0;
+    return;
+  }
+
+  while (SourceString[length] != L'\0')
+  {
+    length++;
+  }
+
+  DestinationString->Length = (USHORT)(length * sizeof(WCHAR));
+  DestinationString->MaximumLength = (USHORT)(DestinationString->Length + sizeof(WCHAR));
+}
+
+VOID RtlCopyUnicodeString(
+    _Inout_ PUNICODE_STRING DestinationString,
+    _In_opt_ PCUNICODE_STRING SourceString)
+{
+  USHORT length;
+
+  if (NULL == SourceString)
+  {
+    DestinationString->Length = 0;
+    return;
+  }
+
+  length = min(SourceString->Length, DestinationString->MaximumLength);
+
+  RtlMoveMemory(DestinationString->Buffer, SourceString->Buffer, length);
+  DestinationString->Length = length;
+
+  if (DestinationString->Length < DestinationString->MaximumLength)
+  {
+    DestinationString->Buffer[length / sizeof(WCHAR)] = L'\0';
+  }
+}
+
+WCHAR
+RtlUpcaseUnicodeChar(
+    _In_ WCHAR SourceCharacter)
+{
+  //
+  // only ASCII is folded on host, which covers every path in the tests
+  //
+  if (SourceCharacter >= L'a' && SourceCharacter <= L'z')
+  {
+    return (WCHAR)(SourceCharacter - (L'a' - L'A'));
+  }
+
+  return SourceCharacter;
+}
+
+LONG RtlCompareUnicodeString(
+    _In_ PCUNICODE_STRING String1,
+    _In_ PCUNICODE_STRING String2,
+    _In_ BOOLEAN CaseInSensitive)
+{
+  ULONG length1 = String1->Length / sizeof(WCHAR);
+  ULONG length2 = String2->Length / sizeof(WCHAR);
+  ULONG count = min(length1, length2);
+  ULONG i = 0;
+  WCHAR a;
+  WCHAR b;
+
+  for (; i < count; i++)
+  {
+    a = String1->Buffer[i];
+    b = String2->Buffer[i];
+
+    if (CaseInSensitive)
+    {
+      a = RtlUpcaseUnicodeChar(a);
+      b = RtlUpcaseUnicodeChar(b);
+    }
+
+    if (a != b)
+    {
+      return (LONG)a - (LONG)b;
+    }
+  }
+
+  return (LONG)length1 - (LONG)length2;
+}
+
+BOOLEAN
+RtlEqualUnicodeString(
+    _In_ PCUNICODE_STRING String1,
+    _In_ PCUNICODE_STRING String2,
+    _In_ BOOLEAN CaseInSensitive)
+{
+  if (String1->Length != String2->Length)
+  {
+    return FALSE;
+  }
+
+  return (BOOLEAN)(RtlCompareUnicodeString(String1, String2, CaseInSensitive) == 0);
+}
+
+NTSTATUS
+RtlUnicodeStringValidate(
+    _In_opt_ PCUNICODE_STRING SourceString)
+{
+  if (NULL == SourceString)
+  {
+    return STATUS_SUCCESS;
+  }
+
+  if ((SourceString->Length % sizeof(WCHAR)) != 0 ||
+      (SourceString->MaximumLength % sizeof(WCHAR)) != 0 ||
+      SourceString->Length > SourceString->MaximumLength ||
+      (SourceString->Buffer == NULL && (SourceString->Length != 0 || SourceString->MaximumLength != 0)))
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  return STATUS_SUCCESS;
+}
+
+int IMShimWcscmp(
+    _In_ const WCHAR *String1,
+    _In_ const WCHAR *String2)
+{
+  while (*String1 != L'\0' && *String1 == *String2)
+  {
+    String1++;
+    String2++;
+  }
+
+  return (int)*String1 - (int)*String2;
+}
+
+//------------------------------------------------------------------------
+//  Processors.
+//------------------------------------------------------------------------
+
+VOID IMShimSetProcessorCount(
+    _In_ ULONG Count)
+{
+  WriteNoFence(&ShimProcessorCount, (LONG)max(Count, 1));
+}
+
+VOID IMShimSetCurrentProcessor(
+    _In_ ULONG Number)
+{
+  ShimCurrentProcessor = Number;
+}
+
+ULONG
+KeQueryActiveProcessorCountEx(
+    _In_ USHORT GroupNumber)
+{
+  UNREFERENCED_PARAMETER(GroupNumber);
+
+  return (ULONG)ReadNoFence(&ShimProcessorCount);
+}
+
+ULONG
+KeGetCurrentProcessorNumberEx(
+    _Out_opt_ PPROCESSOR_NUMBER ProcNumber)
+{
+  // threads of the test play the processors it picked for them
+  if (NULL != ProcNumber)
+  {
+    ProcNumber->Group = 0;
+    ProcNumber->Number = (UCHAR)ShimCurrentProcessor;
+    ProcNumber->Reserved = 0;
+  }
+
+  return ShimCurrentProcessor;
+}
+
+//------------------------------------------------------------------------
+//  Objects and processes.
+//------------------------------------------------------------------------
+
+VOID IMShimSetCurrentProcessId(
+    _In_ HANDLE ProcessId)
+{
+  ShimCurrentProcessId = ProcessId;
+}
+
+HANDLE
+PsGetCurrentProcessId(VOID)
+{
+  return ShimCurrentProcessId;
+}
+
+PEPROCESS
+PsGetCurrentProcess(VOID)
+{
+  // the host process is the only one with an address space
+  return (PEPROCESS)&ShimProcesses;
+}
+
+VOID KeStackAttachProcess(
+    _Inout_ PEPROCESS Process,
+    _Out_ PRKAPC_STATE ApcState)
+{
+  ApcState->Process = Process;
+}
+
+VOID KeUnstackDetachProcess(
+    _In_ PRKAPC_STATE ApcState)
+{
+  ApcState->Process = NULL;
+}
+
+_Check_return_
+    NTSTATUS
+    IMShimRegisterProcess(
+        _In_ HANDLE ProcessId,
+        _In_ PCWSTR ImageFileName)
+{
+  NTSTATUS status = STATUS_INSUFFICIENT_RESOURCES;
+  UNICODE_STRING name;
+  ULONG i = 0;
+
+  RtlInitUnicodeString(&name, ImageFileName);
+
+  pthread_mutex_lock(&ShimProcessLock);
+
+  for (; i < IM_SHIM_MAX_PROCESSES; i++)
+  {
+    if (NULL == ShimProcesses[i].ProcessId)
+    {
+      ShimProcesses[i].ProcessId = ProcessId;
+      ShimProcesses[i].ImageFileName = name;
+      status = STATUS_SUCCESS;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&ShimProcessLock);
+
+  return status;
+}
+
+VOID IMShimUnregisterProcess(
+    _In_ HANDLE ProcessId)
+{
+  ULONG i = 0;
+
+  pthread_mutex_lock(&ShimProcessLock);
+
+  for (; i < IM_SHIM_MAX_PROCESSES; i++)
+  {
+    if (ProcessId == ShimProcesses[i].ProcessId)
+    {
+      RtlZeroMemory(&ShimProcesses[i], sizeof(IM_SHIM_PROCESS));
+    }
+  }
+
+  pthread_mutex_unlock(&ShimProcessLock);
+}
+
+NTSTATUS
+PsLookupProcessByProcessId(
+    _In_ HANDLE ProcessId,
+    _Outptr_ PEPROCESS *Process)
+{
+  NTSTATUS status = STATUS_INVALID_PARAMETER;
+  ULONG i = 0;
+
+  *Process = NULL;
+
+  pthread_mutex_lock(&ShimProcessLock);
+
+  for (; i < IM_SHIM_MAX_PROCESSES; i++)
+  {
+    if (NULL != ProcessId && ProcessId == ShimProcesses[i].ProcessId)
+    {
+      *Process = (PEPROCESS)&ShimProcesses[i];
+      status = STATUS_SUCCESS;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&ShimProcessLock);
+
+  return status;
+}
+
+NTSTATUS
+ObOpenObjectByPointer(
+    _In_ PVOID Object,
+    _In_ ULONG HandleAttributes,
+    _In_opt_ PVOID PassedAccessState,
+    _In_ ACCESS_MASK DesiredAccess,
+    _In_opt_ PVOID ObjectType,
+    _In_ KPROCESSOR_MODE AccessMode,
+    _Out_ PHANDLE Handle)
+{
+  UNREFERENCED_PARAMETER(HandleAttributes);
+  UNREFERENCED_PARAMETER(PassedAccessState);
+  UNREFERENCED_PARAMETER(DesiredAccess);
+  UNREFERENCED_PARAMETER(ObjectType);
+  UNREFERENCED_PARAMETER(AccessMode);
+
+  *Handle = (HANDLE)Object;
+
+  return STATUS_SUCCESS;
+}
+
+VOID ObDereferenceObject(
+    _In_ PVOID Object)
+{
+  UNREFERENCED_PARAMETER(Object);
+}
+
+NTSTATUS
+ZwClose(
+    _In_ HANDLE Handle)
+{
+  UNREFERENCED_PARAMETER(Handle);
+
+  return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwQueryInformationProcess(
+    _In_ HANDLE ProcessHandle,
+    _In_ PROCESSINFOCLASS ProcessInformationClass,
+    _Out_ PVOID ProcessInformation,
+    _In_ ULONG ProcessInformationLength,
+    _Out_opt_ PULONG ReturnLength)
+{
+  PIM_SHIM_PROCESS process = (PIM_SHIM_PROCESS)ProcessHandle;
+  PUNICODE_STRING imageName = (PUNICODE_STRING)ProcessInformation;
+  ULONG required = 0;
+
+  if (NULL == process || ProcessImageFileName != ProcessInformationClass)
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  //
+  // same layout as the kernel: UNICODE_STRING followed by its buffer
+  //
+  required = sizeof(UNICODE_STRING) + process->ImageFileName.Length + sizeof(WCHAR);
+
+  if (NULL != ReturnLength)
+  {
+    *ReturnLength = required;
+  }
+
+  if (ProcessInformationLength < required || NULL == ProcessInformation)
+  {
+    return STATUS_INFO_LENGTH_MISMATCH;
+  }
+
+  imageName->Buffer = (PWCH)(imageName + 1);
+  imageName->Length = process->ImageFileName.Length;
+  imageName->MaximumLength = (USHORT)(process->ImageFileName.Length + sizeof(WCHAR));
+  RtlCopyMemory(imageName->Buffer, process->ImageFileName.Buffer, process->ImageFileName.Length);
+  imageName->Buffer[imageName->Length / sizeof(WCHAR)] = L'\0';
+
+  return STATUS_SUCCESS;
+}
+
+//------------------------------------------------------------------------
+//  I/O and filter manager.
+//------------------------------------------------------------------------
+
+NTSTATUS
+FltGetFileNameInformation(
+    _In_ PFLT_CALLBACK_DATA CallbackData,
+    _In_ FLT_FILE_NAME_OPTIONS NameOptions,
+    _Outptr_ PFLT_FILE_NAME_INFORMATION *FileNameInformation)
+{
+  PFILE_OBJECT fileObject = NULL;
+  PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+
+  *FileNameInformation = NULL;
+
+  fileObject = CallbackData->Iopb->TargetFileObject;
+
+  if (NULL == fileObject || 0 == fileObject->FileName.Length)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  //
+  // filter manager hands out names from its cache, so this allocation is
+  // not accounted as driver pool usage
+  //
+  nameInfo = (PFLT_FILE_NAME_INFORMATION)calloc(1, sizeof(FLT_FILE_NAME_INFORMATION) + fileObject->FileName.Length + sizeof(WCHAR));
+
+  if (NULL == nameInfo)
+  {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+  nameInfo->Size = sizeof(FLT_FILE_NAME_INFORMATION);
+  // names of the fake volume are already long and full, so the opened
+  // name is the normalized one as well
+  nameInfo->Format = FlagOn(NameOptions, FLT_FILE_NAME_NORMALIZED) ? FLT_FILE_NAME_NORMALIZED : FLT_FILE_NAME_OPENED;
+  nameInfo->Name.Buffer = (PWCH)(nameInfo + 1);
+  nameInfo->Name.Length = fileObject->FileName.Length;
+  nameInfo->Name.MaximumLength = (USHORT)(fileObject->FileName.Length + sizeof(WCHAR));
+  RtlCopyMemory(nameInfo->Name.Buffer, fileObject->FileName.Buffer, fileObject->FileName.Length);
+
+  *FileNameInformation = nameInfo;
+
+  return STATUS_SUCCESS;
+}
+
+VOID FltReleaseFileNameInformation(
+    _In_ PFLT_FILE_NAME_INFORMATION FileNameInformation)
+{
+  free(FileNameInformation);
+}
+
+VOID FltCancelFileOpen(
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject)
+{
+  UNREFERENCED_PARAMETER(Instance);
+
+  if (NULL != FileObject)
+  {
+    FileObject->OpenCancelled = TRUE;
+  }
+}
+
+NTSTATUS
+IoReplaceFileObjectName(
+    _In_ PFILE_OBJECT FileObject,
+    _In_reads_bytes_(FileNameLength) PWSTR NewFileName,
+    _In_ USHORT FileNameLength)
+{
+  PWCH buffer = NULL;
+
+  buffer = (PWCH)malloc(FileNameLength + sizeof(WCHAR));
+
+  if (NULL == buffer)
+  {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+  RtlCopyMemory(buffer, NewFileName, FileNameLength);
+  buffer[FileNameLength / sizeof(WCHAR)] = L'\0';
+
+  if (FileObject->FileNameOwned)
+  {
+    free(FileObject->FileName.Buffer);
+  }
+
+  FileObject->FileName.Buffer = buffer;
+  FileObject->FileName.Length = FileNameLength;
+  FileObject->FileName.MaximumLength = (USHORT)(FileNameLength + sizeof(WCHAR));
+  FileObject->FileNameOwned = TRUE;
+
+  return STATUS_SUCCESS;
+}
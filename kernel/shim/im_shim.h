@@ -0,0 +1,66 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_shim.h
+
+Abstract:
+Host only controls of the kernel shim. Tests and benchmarks use them to
+play the role of the OS: which process is current, which image a process
+id maps to, which processor a thread runs on and how many pool
+allocations the driver code made.
+
+Environment:
+
+User mode (host)
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Function prototypes.
+//------------------------------------------------------------------------
+
+//
+// Processes
+//
+
+VOID IMShimSetCurrentProcessId(
+    _In_ HANDLE ProcessId);
+
+_Check_return_
+    NTSTATUS
+    IMShimRegisterProcess(
+        _In_ HANDLE ProcessId,
+        _In_ PCWSTR ImageFileName);
+
+VOID IMShimUnregisterProcess(
+    _In_ HANDLE ProcessId);
+
+//
+// Processors: count the active ones and which one the calling thread
+// runs on, 1 and 0 by default. The count is read at IMInitList.
+//
+
+VOID IMShimSetProcessorCount(
+    _In_ ULONG Count);
+
+VOID IMShimSetCurrentProcessor(
+    _In_ ULONG Number);
+
+//
+// Pool accounting
+//
+
+LONGLONG
+IMShimGetPoolAllocations(VOID);
+
+LONGLONG
+IMShimGetPoolOutstanding(VOID);
+
+VOID IMShimResetPoolCounters(VOID);
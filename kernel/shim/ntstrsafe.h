@@ -0,0 +1,34 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+ntstrsafe.h
+
+Abstract:
+User mode stand-in for the WDK ntstrsafe.h (see fltKernel.h in this folder)
+
+Environment:
+
+User mode (host)
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "fltKernel.h"
+
+//------------------------------------------------------------------------
+//  Function prototypes.
+//------------------------------------------------------------------------
+
+NTSTATUS
+RtlUnicodeStringValidate(
+    _In_opt_ PCUNICODE_STRING SourceString);
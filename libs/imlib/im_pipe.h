@@ -0,0 +1,268 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_pipe.h
+
+Abstract:
+Hand-off of records from the reader thread of the lib to its workers. Every
+worker has a bounded queue of Depth entries of EntrySize bytes, the reader
+puts the record to the queue of the worker its key maps to, so records of
+one key are passed by one worker in order they were read. Queue has one
+producer (reader) and one consumer (worker), its indexes are free running
+counters on their own cache lines.
+
+Worker which found its queue empty sets WorkerWaiting and checks once more
+before it sleeps, reader which commits an entry takes the flag and wakes
+it. Reader which waits for room sets ReaderWaiting the same way and the
+worker which releases an entry wakes it, so no wakeup is lost either way.
+
+Only interlocked and acquire/release routines are used, so the header
+compiles in user mode and on host. Threads and events are the caller's.
+
+Environment:
+
+User mode
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_PIPE_MAX_WORKERS 64
+
+//------------------------------------------------------------------------
+//  Structures.
+//------------------------------------------------------------------------
+
+//
+// Queue of one worker
+//
+typedef struct _IM_PIPE_QUEUE
+{
+  PUCHAR Entries;
+
+  //
+  // end of the committed entries and the last Head the reader saw, moved
+  // by the reader
+  //
+  DECLSPEC_CACHEALIGN volatile LONG Tail;
+  ULONG HeadCache;
+  volatile LONG ReaderWaiting;
+
+  //
+  // end of the released entries, moved by the worker
+  //
+  DECLSPEC_CACHEALIGN volatile LONG Head;
+  volatile LONG WorkerWaiting;
+
+} IM_PIPE_QUEUE, *PIM_PIPE_QUEUE;
+
+typedef struct _IM_PIPE
+{
+  ULONG Workers;
+
+  //
+  // entries of a queue, power of 2
+  //
+  ULONG Depth;
+
+  ULONG EntrySize;
+
+  IM_PIPE_QUEUE Queues[IM_PIPE_MAX_WORKERS];
+
+} IM_PIPE, *PIM_PIPE;
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+//
+// Queues take Workers * Depth * EntrySize bytes of Entries, Depth is a
+// power of 2
+//
+FORCEINLINE
+BOOLEAN
+IMPipeInit(
+    _Out_ PIM_PIPE Pipe,
+    _In_ ULONG Workers,
+    _In_ ULONG Depth,
+    _In_ ULONG EntrySize,
+    _In_ PVOID Entries)
+{
+  ULONG i = 0;
+
+  if (0 == Workers || Workers > IM_PIPE_MAX_WORKERS ||
+      Depth < 2 || 0 != (Depth & (Depth - 1)) ||
+      0 == EntrySize || NULL == Entries)
+  {
+    return FALSE;
+  }
+
+  RtlZeroMemory(Pipe, sizeof(IM_PIPE));
+
+  Pipe->Workers = Workers;
+  Pipe->Depth = Depth;
+  Pipe->EntrySize = EntrySize;
+
+  for (; i < Workers; i++)
+  {
+    Pipe->Queues[i].Entries = (PUCHAR)Entries + (SIZE_T)i * Depth * EntrySize;
+  }
+
+  return TRUE;
+}
+
+//
+// Worker which passes the records of the key
+//
+FORCEINLINE
+ULONG
+IMPipeWorker(
+    _In_ PIM_PIPE Pipe,
+    _In_ ULONG Key)
+{
+  return Key % Pipe->Workers;
+}
+
+//
+// Returns the next entry of the queue of the worker or NULL if the queue
+// is full, IMPipeCommit passes it. Reader only.
+//
+FORCEINLINE
+PVOID
+IMPipeReserve(
+    _Inout_ PIM_PIPE Pipe,
+    _In_ ULONG Worker)
+{
+  PIM_PIPE_QUEUE queue = &Pipe->Queues[Worker];
+  ULONG tail = (ULONG)ReadNoFence(&queue->Tail);
+
+  // Head is read again only when the queue looks full
+  if (tail - queue->HeadCache >= Pipe->Depth)
+  {
+    queue->HeadCache = (ULONG)ReadAcquire(&queue->Head);
+
+    if (tail - queue->HeadCache >= Pipe->Depth)
+    {
+      return NULL;
+    }
+  }
+
+  return queue->Entries + (SIZE_T)(tail & (Pipe->Depth - 1)) * Pipe->EntrySize;
+}
+
+//
+// Passes the reserved entry to the worker, returns TRUE if the worker
+// sleeps and has to be woken up
+//
+FORCEINLINE
+BOOLEAN
+IMPipeCommit(
+    _Inout_ PIM_PIPE Pipe,
+    _In_ ULONG Worker)
+{
+  PIM_PIPE_QUEUE queue = &Pipe->Queues[Worker];
+
+  // full barrier: entry is visible before the index, index before the flag is read
+  InterlockedExchange(&queue->Tail, queue->Tail + 1);
+
+  return 0 != ReadNoFence(&queue->WorkerWaiting) &&
+         0 != InterlockedExchange(&queue->WorkerWaiting, 0);
+}
+
+//
+// Asks the worker to wake the reader when it releases an entry, returns
+// FALSE if Room entries are free already and the reader should not sleep
+//
+FORCEINLINE
+BOOLEAN
+IMPipePrepareWaitRoom(
+    _Inout_ PIM_PIPE Pipe,
+    _In_ ULONG Worker,
+    _In_ ULONG Room)
+{
+  PIM_PIPE_QUEUE queue = &Pipe->Queues[Worker];
+
+  InterlockedExchange(&queue->ReaderWaiting, 1);
+
+  queue->HeadCache = (ULONG)ReadAcquire(&queue->Head);
+
+  if ((ULONG)queue->Tail - queue->HeadCache + Room <= Pipe->Depth)
+  {
+    InterlockedExchange(&queue->ReaderWaiting, 0);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+//
+// Returns the next entry of the worker or NULL if there is none. Worker
+// only.
+//
+FORCEINLINE
+PVOID
+IMPipePeek(
+    _Inout_ PIM_PIPE Pipe,
+    _In_ ULONG Worker)
+{
+  PIM_PIPE_QUEUE queue = &Pipe->Queues[Worker];
+  ULONG head = (ULONG)ReadNoFence(&queue->Head);
+
+  if ((ULONG)ReadAcquire(&queue->Tail) == head)
+  {
+    return NULL;
+  }
+
+  return queue->Entries + (SIZE_T)(head & (Pipe->Depth - 1)) * Pipe->EntrySize;
+}
+
+//
+// Gives the entry returned by the last peek back to the reader, returns
+// TRUE if the reader waits for room and has to be woken up
+//
+FORCEINLINE
+BOOLEAN
+IMPipeRelease(
+    _Inout_ PIM_PIPE Pipe,
+    _In_ ULONG Worker)
+{
+  PIM_PIPE_QUEUE queue = &Pipe->Queues[Worker];
+
+  // full barrier: the entry is done with before the index, index before the flag is read
+  InterlockedExchange(&queue->Head, queue->Head + 1);
+
+  return 0 != ReadNoFence(&queue->ReaderWaiting) &&
+         0 != InterlockedExchange(&queue->ReaderWaiting, 0);
+}
+
+//
+// Asks for the wakeup, returns FALSE if something was committed meanwhile
+// and the worker should not sleep
+//
+FORCEINLINE
+BOOLEAN
+IMPipePrepareWait(
+    _Inout_ PIM_PIPE Pipe,
+    _In_ ULONG Worker)
+{
+  PIM_PIPE_QUEUE queue = &Pipe->Queues[Worker];
+
+  InterlockedExchange(&queue->WorkerWaiting, 1);
+
+  if ((ULONG)ReadAcquire(&queue->Tail) != (ULONG)queue->Head)
+  {
+    InterlockedExchange(&queue->WorkerWaiting, 0);
+    return FALSE;
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,370 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_recv.h
+
+Abstract:
+Receive buffers of the lib. Receiver thread fills the buffers through the
+transport (GetRecordsCommand of the port, or a stand-in on host) one after
+another and hands them to the parser thread in order, so the driver fills
+the next buffer while the parser reads the previous one. Buffers go through
+the queue of im_pipe.h with one worker, receiver waits when the parser has
+every buffer, parser waits when there is none.
+
+Empty buffer is handed over as well, the parser knows the driver has no
+more records for now. Buffer of the failed request is not, the closed one
+is the last and tells the parser to stop.
+
+Buffers start at IM_RECEIVE_BUFFER_SIZE and grow up to MaxSize when the
+transport says the next request wants more: the first record left did not
+fit at all, or more records are left than the buffer took. A free buffer
+grows before it is filled, buffers are not shrunk.
+
+Environment:
+
+User mode
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <stdlib.h>
+
+#include "im_pipe.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_RECEIVE_BUFFER_SIZE 4096
+#define IM_RECEIVE_MAX_BUFFER_SIZE (16 * 1024 * 1024)
+#define IM_RECEIVE_MAX_BUFFERS 8
+
+//------------------------------------------------------------------------
+//  Structures.
+//------------------------------------------------------------------------
+
+typedef enum _IM_RECEIVE_STATUS
+{
+  IMReceiveRecords = 0, // Length bytes of records are in the buffer
+  IMReceiveEmpty,       // there are no records now, Wait for them
+  IMReceiveError,       // the request failed
+  IMReceiveClosed,      // the other side is gone
+  IMReceiveFull         // parser has every buffer
+} IM_RECEIVE_STATUS,
+    *PIM_RECEIVE_STATUS;
+
+typedef struct _IM_RECEIVE_BUFFER
+{
+  //
+  // Size bytes as the transport wrote them, records are Length bytes from
+  // Offset
+  //
+  PUCHAR Data;
+  ULONG Size;
+  ULONG Offset;
+  ULONG Length;
+
+  //
+  // bytes the next request wants, 0 if Size is enough
+  //
+  ULONG Required;
+
+  IM_RECEIVE_STATUS Status;
+
+} IM_RECEIVE_BUFFER, *PIM_RECEIVE_BUFFER;
+
+//
+// Source of the records. Receive fills Data of the buffer up to its Size
+// and sets Offset, Length and Required, Wait returns when there may be
+// records or in a while.
+//
+typedef IM_RECEIVE_STATUS (*IM_TRANSPORT_RECEIVE)(
+    _In_ PVOID Context,
+    _Inout_ PIM_RECEIVE_BUFFER Buffer);
+
+typedef IM_RECEIVE_STATUS (*IM_TRANSPORT_WAIT)(
+    _In_ PVOID Context);
+
+typedef struct _IM_TRANSPORT
+{
+  IM_TRANSPORT_RECEIVE Receive;
+  IM_TRANSPORT_WAIT Wait;
+  PVOID Context;
+} IM_TRANSPORT, *PIM_TRANSPORT;
+
+typedef struct _IM_RECEIVER
+{
+  IM_TRANSPORT Transport;
+
+  //
+  // size the free buffers grow to before they are filled, up to MaxSize
+  //
+  ULONG WantedSize;
+  ULONG MaxSize;
+
+  //
+  // queue of the buffers from the receiver to the parser, worker 0
+  //
+  IM_PIPE Pipe;
+
+  IM_RECEIVE_BUFFER Buffers[IM_RECEIVE_MAX_BUFFERS];
+
+} IM_RECEIVER, *PIM_RECEIVER;
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+FORCEINLINE
+VOID IMReceiverDeinit(
+    _Inout_ PIM_RECEIVER Receiver)
+{
+  ULONG i = 0;
+
+  for (; i < IM_RECEIVE_MAX_BUFFERS; i++)
+  {
+    free(Receiver->Buffers[i].Data);
+    Receiver->Buffers[i].Data = NULL;
+    Receiver->Buffers[i].Size = 0;
+  }
+}
+
+//
+// Buffers is a power of 2, from 2 to IM_RECEIVE_MAX_BUFFERS, MaxSize from
+// IM_RECEIVE_BUFFER_SIZE to IM_RECEIVE_MAX_BUFFER_SIZE. IMReceiverDeinit
+// frees the buffers.
+//
+FORCEINLINE
+BOOLEAN
+IMReceiverInit(
+    _Out_ PIM_RECEIVER Receiver,
+    _In_ const IM_TRANSPORT *Transport,
+    _In_ ULONG Buffers,
+    _In_ ULONG MaxSize)
+{
+  ULONG i = 0;
+
+  RtlZeroMemory(Receiver->Buffers, sizeof(Receiver->Buffers));
+
+  if (Buffers > IM_RECEIVE_MAX_BUFFERS ||
+      MaxSize < IM_RECEIVE_BUFFER_SIZE || MaxSize > IM_RECEIVE_MAX_BUFFER_SIZE ||
+      !IMPipeInit(&Receiver->Pipe, 1, Buffers, sizeof(IM_RECEIVE_BUFFER), Receiver->Buffers))
+  {
+    return FALSE;
+  }
+
+  Receiver->Transport = *Transport;
+  Receiver->WantedSize = IM_RECEIVE_BUFFER_SIZE;
+  Receiver->MaxSize = MaxSize;
+
+  for (; i < Buffers; i++)
+  {
+    Receiver->Buffers[i].Data = (PUCHAR)malloc(IM_RECEIVE_BUFFER_SIZE);
+
+    if (NULL == Receiver->Buffers[i].Data)
+    {
+      IMReceiverDeinit(Receiver);
+      return FALSE;
+    }
+
+    Receiver->Buffers[i].Size = IM_RECEIVE_BUFFER_SIZE;
+  }
+
+  return TRUE;
+}
+
+//
+// Grows the free buffer to Size, old records are not copied. FALSE if it
+// stays smaller.
+//
+FORCEINLINE
+BOOLEAN
+IMReceiverGrow(
+    _Inout_ PIM_RECEIVE_BUFFER Buffer,
+    _In_ ULONG Size)
+{
+  PUCHAR data = NULL;
+
+  if (Buffer->Size >= Size)
+  {
+    return TRUE;
+  }
+
+  data = (PUCHAR)malloc(Size);
+
+  if (NULL == data)
+  {
+    return FALSE;
+  }
+
+  free(Buffer->Data);
+  Buffer->Data = data;
+  Buffer->Size = Size;
+
+  return TRUE;
+}
+
+//
+// Fills the next free buffer through the transport and hands it to the
+// parser unless the request failed, *Wake is TRUE if the parser sleeps and
+// has to be woken up. IMReceiveFull if there is no free buffer. Buffer
+// too small for the first record grows and is filled again. Receiver only.
+//
+FORCEINLINE
+IM_RECEIVE_STATUS
+IMReceiverFill(
+    _Inout_ PIM_RECEIVER Receiver,
+    _Out_ PBOOLEAN Wake)
+{
+  PIM_RECEIVE_BUFFER buffer = NULL;
+  IM_RECEIVE_STATUS status = IMReceiveRecords;
+  ULONG size = 0;
+
+  *Wake = FALSE;
+
+  buffer = (PIM_RECEIVE_BUFFER)IMPipeReserve(&Receiver->Pipe, 0);
+
+  if (NULL == buffer)
+  {
+    return IMReceiveFull;
+  }
+
+  // smaller buffer still takes the records, the next one may grow
+  (VOID) IMReceiverGrow(buffer, Receiver->WantedSize);
+
+  for (;;)
+  {
+    buffer->Offset = 0;
+    buffer->Length = 0;
+    buffer->Required = 0;
+
+    status = Receiver->Transport.Receive(Receiver->Transport.Context, buffer);
+
+    if (IMReceiveRecords != status)
+    {
+      break;
+    }
+
+    if (buffer->Offset > buffer->Size || buffer->Length > buffer->Size - buffer->Offset)
+    {
+      status = IMReceiveError;
+      break;
+    }
+
+    // next power of 2, a record over MaxSize is never taken
+    size = Receiver->WantedSize;
+
+    while (size < buffer->Required && size < Receiver->MaxSize)
+    {
+      size *= 2;
+    }
+
+    Receiver->WantedSize = min(size, Receiver->MaxSize);
+
+    if (0 != buffer->Length || 0 == buffer->Required)
+    {
+      status = 0 != buffer->Length ? IMReceiveRecords : IMReceiveEmpty;
+      break;
+    }
+
+    if (buffer->Required > Receiver->MaxSize ||
+        buffer->Size >= buffer->Required ||
+        !IMReceiverGrow(buffer, Receiver->WantedSize))
+    {
+      status = IMReceiveError;
+      break;
+    }
+  }
+
+  if (IMReceiveError != status)
+  {
+    buffer->Status = status;
+    *Wake = IMPipeCommit(&Receiver->Pipe, 0);
+  }
+
+  return status;
+}
+
+//
+// Hands the closed buffer to the parser, the receiver stops after it.
+// FALSE if there is no free buffer.
+//
+FORCEINLINE
+BOOLEAN
+IMReceiverClose(
+    _Inout_ PIM_RECEIVER Receiver,
+    _Out_ PBOOLEAN Wake)
+{
+  PIM_RECEIVE_BUFFER buffer = (PIM_RECEIVE_BUFFER)IMPipeReserve(&Receiver->Pipe, 0);
+
+  *Wake = FALSE;
+
+  if (NULL == buffer)
+  {
+    return FALSE;
+  }
+
+  buffer->Offset = 0;
+  buffer->Length = 0;
+  buffer->Status = IMReceiveClosed;
+  *Wake = IMPipeCommit(&Receiver->Pipe, 0);
+
+  return TRUE;
+}
+
+//
+// Asks the parser to wake the receiver when it gives a buffer back,
+// returns FALSE if there is a free one already
+//
+FORCEINLINE
+BOOLEAN
+IMReceiverPrepareWaitRoom(
+    _Inout_ PIM_RECEIVER Receiver)
+{
+  return IMPipePrepareWaitRoom(&Receiver->Pipe, 0, 1);
+}
+
+//
+// Next filled buffer in order or NULL. Parser only.
+//
+FORCEINLINE
+PIM_RECEIVE_BUFFER
+IMReceiverPeek(
+    _Inout_ PIM_RECEIVER Receiver)
+{
+  return (PIM_RECEIVE_BUFFER)IMPipePeek(&Receiver->Pipe, 0);
+}
+
+//
+// Gives the buffer of the last peek back, returns TRUE if the receiver
+// waits for it and has to be woken up
+//
+FORCEINLINE
+BOOLEAN
+IMReceiverRelease(
+    _Inout_ PIM_RECEIVER Receiver)
+{
+  return IMPipeRelease(&Receiver->Pipe, 0);
+}
+
+//
+// Asks the receiver to wake the parser, returns FALSE if a buffer was
+// filled meanwhile
+//
+FORCEINLINE
+BOOLEAN
+IMReceiverPrepareWait(
+    _Inout_ PIM_RECEIVER Receiver)
+{
+  return IMPipePrepareWait(&Receiver->Pipe, 0);
+}
@@ -28,17 +28,70 @@ User mode
 #include "InjectorMonitorKrnl.h"
 #include "fltUser.h"
 #include "stdlib.h"
+#include "im_pipe.h"
+#include "im_recv.h"
 
 //------------------------------------------------------------------------
 //  Definitions.
 //------------------------------------------------------------------------
 
-#define BUFFER_SIZE 4096
+//
+// buffers of GetRecordsCommand in flight, the driver fills the next ones
+// while the requester thread parses one
+//
+#define IM_RECEIVE_BUFFERS 4
+
+//
+// buffers grow up to that many bytes when the driver has more records for
+// them unless IM_PIPELINE_CONFIG sets it, the longest record takes well
+// below it
+//
+#define IM_RECEIVE_BUFFER_LIMIT (1024 * 1024)
+#define IM_MIN_RECEIVE_BUFFER_LIMIT (2 * (IM_WIRE_REPLY_SIZE + IM_WIRE_RECORD_SIZE + IM_WIRE_NAMES * IM_WIRE_MAX_NAME_CHARS * sizeof(WCHAR)))
+
+C_ASSERT(IM_RECEIVE_BUFFER_LIMIT >= IM_MIN_RECEIVE_BUFFER_LIMIT);
+C_ASSERT(IM_MIN_RECEIVE_BUFFER_LIMIT >= IM_RECEIVE_BUFFER_SIZE);
+C_ASSERT(IM_MAX_RECEIVE_BUFFER_LIMIT <= IM_RECEIVE_MAX_BUFFER_SIZE);
+
+//
+// how often driver without WaitRecordsCommand is asked for records, ms
+//
+#define IM_POLL_INTERVAL 200
+
+C_ASSERT(IM_MAX_PIPELINE_WORKERS <= IM_PIPE_MAX_WORKERS);
 
 //------------------------------------------------------------------------
 //  Local globals.
 //------------------------------------------------------------------------
 
+//
+// String of the interned name, kept until its id comes with another one.
+// Buffer only grows, the next string of the id usually fits in it.
+//
+typedef struct _IM_NAME
+{
+  PWCHAR Buffer;
+  ULONG Size;
+  ULONG Capacity;
+
+} IM_NAME, *PIM_NAME;
+
+//
+// Worker of the pipeline
+//
+typedef struct _IM_WORKER
+{
+  struct _IM_CONTEXT *Context;
+  ULONG Index;
+  HANDLE Thread;
+
+  //
+  // set by the reader when the worker sleeps and gets a record
+  //
+  HANDLE Wakeup;
+
+} IM_WORKER, *PIM_WORKER;
+
 //
 // Globals of the lib
 //
@@ -65,9 +118,84 @@ typedef struct _IM_CONTEXT
   BOOLEAN isDown;
 
   //
-  // callback from user app
+  // callback from user app, IMRecordFromView passes records of the views
+  // to RecordCallback and IMAppendView to BatchCallback if one was given
   //
+  IM_RECORD_VIEW_CALLBACK ViewCallback;
   IM_RECORD_CALLBACK RecordCallback;
+  IM_RECORD_BATCH_CALLBACK BatchCallback;
+
+  //
+  // views of the batch not passed yet, up to MaxViews, the first of them
+  // was taken at ViewsTime
+  //
+  PIM_RECORD_VIEW Views;
+  ULONG ViewCount;
+  ULONG MaxViews;
+  ULONG BatchMilliseconds;
+  ULONGLONG ViewsTime;
+
+  //
+  // requester thread reads the records and IMPipeView hands them to the
+  // workers, which pass them to PipeCallback. Reader sleeps on PipeRoom
+  // while the queue of the worker is full.
+  //
+  IM_RECORD_VIEW_CALLBACK PipeCallback;
+  IM_PIPE Pipe;
+  PIM_RECORD_VIEW PipeEntries;
+  IM_PIPELINE_KEY PipeKey;
+  HANDLE PipeRoom;
+  __volatile LONG IsPipeDown;
+  ULONG_PTR ReaderAffinity;
+  ULONG_PTR WorkerAffinity;
+  IM_WORKER Workers[IM_PIPE_MAX_WORKERS];
+
+  //
+  // records are copied: receiver thread fills the buffers and the requester
+  // thread parses them, each sets the event of the other when it sleeps
+  //
+  IM_RECEIVER Receiver;
+  HANDLE ReceiverThread;
+  HANDLE ReceiverWakeup;
+  HANDLE ParserWakeup;
+
+  //
+  // ring of records mapped by the driver, NULL if records are copied
+  //
+  PIM_RING_HEADER SharedRecords;
+
+  //
+  // reader of the ring, used by the requester thread only
+  //
+  IM_RING_CONSUMER Consumer;
+
+  //
+  // requester thread sleeps in the driver until that many records are
+  // queued or for WaitMilliseconds
+  //
+  ULONG LowWatermark;
+  ULONG WaitMilliseconds;
+
+  //
+  // bytes the receive buffers grow up to, see IM_PIPELINE_CONFIG
+  //
+  ULONG ReceiveBufferLimit;
+
+  //
+  // names by id - 1, driver sends the string with the first record of it
+  //
+  IM_NAME Names[IM_MAX_INTERNED_NAMES];
+
+  //
+  // reader of the batch GetRecordsCommand returned, keeps the strings the
+  // next ones of the batch are built from
+  //
+  IM_WIRE_BATCH_DECODER Batch;
+
+  //
+  // records the driver dropped, sum of its gap markers
+  //
+  __volatile LONGLONG LostRecords;
 
 } IM_CONTEXT, *PIM_CONTEXT;
 
@@ -80,7 +208,7 @@ IM_CONTEXT Globals;
 _Check_return_
     HRESULT
     IMInitilizeImpl(
-        _In_ IM_RECORD_CALLBACK Callback,
+        _In_ IM_RECORD_VIEW_CALLBACK Callback,
         _In_ PIM_CONTEXT Context);
 
 VOID IMDeinitilizeImpl(
@@ -95,7 +223,7 @@ _Check_return_
 _Check_return_
     HRESULT
     IMInitContext(
-        _In_ IM_RECORD_CALLBACK Callback,
+        _In_ IM_RECORD_VIEW_CALLBACK Callback,
         _In_ PIM_CONTEXT Context);
 
 VOID IMDeinitContext(
@@ -104,20 +232,121 @@ VOID IMDeinitContext(
 _Check_return_
     HRESULT
     IMInitCollector(
-        _In_ IM_RECORD_CALLBACK Callback,
+        _In_ IM_RECORD_VIEW_CALLBACK Callback,
+        _In_ PIM_CONTEXT Context);
+
+_Check_return_
+    HRESULT
+    IMInitWorkers(
+        _In_ PIM_CONTEXT Context);
+
+VOID IMDeinitWorkers(
+    _In_ PIM_CONTEXT Context);
+
+_Check_return_
+    HRESULT
+    IMInitReceiver(
         _In_ PIM_CONTEXT Context);
 
+VOID IMDeinitReceiver(
+    _In_ PIM_CONTEXT Context);
+
+ULONG_PTR
+IMAffinityOf(
+    _In_ ULONG_PTR Mask,
+    _In_ ULONG Index);
+
+_Check_return_
+    HRESULT
+    IMMapRecords(
+        _In_ PIM_CONTEXT Context);
+
+IM_RECEIVE_STATUS
+IMReceivePort(
+    _In_ PVOID Context,
+    _Inout_ PIM_RECEIVE_BUFFER Buffer);
+
+IM_RECEIVE_STATUS
+IMWaitPort(
+    _In_ PVOID Context);
+
+DWORD
+WINAPI
+IMReceiveRecords(
+    _In_ LPVOID lpParameter);
+
+VOID IMParseRecords(
+    _In_ PIM_CONTEXT Context,
+    _In_reads_bytes_(Length) PCHAR Buffer,
+    _In_ ULONG Length);
+
 DWORD
 WINAPI
 IMRetrieveRecords(
     _In_ LPVOID lpParameter);
 
+DWORD
+WINAPI
+IMReadSharedRecords(
+    _In_ LPVOID lpParameter);
+
+DWORD
+WINAPI
+IMPassRecords(
+    _In_ LPVOID lpParameter);
+
+_Check_return_
+    HRESULT
+    IMViewRecord(
+        _In_ PIM_CONTEXT Context,
+        _In_reads_bytes_(Length) PCHAR Entry,
+        _In_ ULONG Length,
+        _Out_ PIM_RECORD_VIEW Record,
+        _Out_ PULONG EntryLength);
+
+_Check_return_
+    HRESULT
+    IMViewBatch(
+        _In_ PIM_CONTEXT Context,
+        _In_reads_bytes_(Length) PCHAR Batch,
+        _In_ ULONG Length);
+
+_Check_return_
+    HRESULT
+    IMMakeView(
+        _In_ PIM_CONTEXT Context,
+        _In_ PIM_WIRE_RECORD WireRecord,
+        _In_reads_(IM_AMOUNT_OF_DATA) const UCHAR **Strings,
+        _Out_ PIM_RECORD_VIEW Record);
+
+HRESULT
+IMRecordFromView(
+    _In_ PCIM_RECORD_VIEW View);
+
+HRESULT
+IMAppendView(
+    _In_ PCIM_RECORD_VIEW View);
+
+VOID IMFlushViews(
+    _In_ PIM_CONTEXT Context);
+
+VOID IMFlushDueViews(
+    _In_ PIM_CONTEXT Context);
+
+HRESULT
+IMPipeView(
+    _In_ PCIM_RECORD_VIEW View);
+
+VOID IMDrainPipe(
+    _In_ PIM_CONTEXT Context);
+
 _Check_return_
     HRESULT
-    IMMoveRecord(
-        PCHAR *SourceRecord,
-        PIM_RECORD *TargetRecord,
-        PULONG Pointer);
+    IMLookupName(
+        _In_ PIM_CONTEXT Context,
+        _In_ PIM_WIRE_NAME Data,
+        _In_reads_bytes_opt_(Data->Size) const UCHAR *String,
+        _Outptr_result_maybenull_ PIM_NAME *Name);
 
 _Check_return_
 HRESULT
@@ -128,7 +357,43 @@ _Inout_ PCHAR Buffer,
 _In_ ULONG BufferSize,
 _Inout_ PULONG ReturnLen);
 
-VOID IMFreeRecord(PIM_RECORD Record);
+_Check_return_
+    HRESULT
+    IMRequestRecords(
+        _In_ PIM_CONTEXT Context,
+        _Out_writes_bytes_(BufferSize) PCHAR Buffer,
+        _In_ ULONG BufferSize,
+        _Out_ PULONG ReturnLen);
+
+_Check_return_
+    HRESULT
+    IMWaitRecords(
+        _In_ PIM_CONTEXT Context);
+
+_Check_return_
+    HRESULT
+    IMSendOverflow(
+        _In_ PIM_CONTEXT Context,
+        _In_ IM_OVERFLOW_POLICY Policy,
+        _In_ ULONG Milliseconds);
+
+_Check_return_
+    HRESULT
+    IMSendBudget(
+        _In_ PIM_CONTEXT Context,
+        _In_ ULONG Bytes);
+
+_Check_return_
+    HRESULT
+    IMQueryStatistics(
+        _In_ PIM_CONTEXT Context,
+        _Out_ PIM_RECORDS_STATISTICS Statistics);
+
+_Check_return_
+    HRESULT
+    IMSendCoalesce(
+        _In_ PIM_CONTEXT Context,
+        _In_ ULONG Milliseconds);
 
 //------------------------------------------------------------------------
 //  Functions.
@@ -139,9 +404,84 @@ _Check_return_
     IMInitilize(
         _In_ IM_RECORD_CALLBACK Callback)
 {
+  IF_FALSE_RETURN_RESULT(Callback != NULL, E_INVALIDARG);
+
+  Globals.RecordCallback = Callback;
+  Globals.BatchCallback = NULL;
+  Globals.PipeCallback = NULL;
+  Globals.ReceiveBufferLimit = IM_RECEIVE_BUFFER_LIMIT;
+
+  return IMInitilizeImpl(IMRecordFromView, &Globals);
+}
+
+_Check_return_
+    HRESULT
+    IMInitilizeView(
+        _In_ IM_RECORD_VIEW_CALLBACK Callback)
+{
+  Globals.RecordCallback = NULL;
+  Globals.BatchCallback = NULL;
+  Globals.PipeCallback = NULL;
+  Globals.ReceiveBufferLimit = IM_RECEIVE_BUFFER_LIMIT;
+
   return IMInitilizeImpl(Callback, &Globals);
 }
 
+_Check_return_
+    HRESULT
+    IMInitilizeBatch(
+        _In_ IM_RECORD_BATCH_CALLBACK Callback,
+        _In_ ULONG MaxRecords,
+        _In_ ULONG MaxMilliseconds)
+{
+  IF_FALSE_RETURN_RESULT(Callback != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(0 != MaxRecords && MaxRecords <= IM_MAX_BATCH_RECORDS, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(MaxMilliseconds <= IM_MAX_BATCH_WAIT, E_INVALIDARG);
+
+  Globals.Views = (PIM_RECORD_VIEW)calloc(MaxRecords, sizeof(IM_RECORD_VIEW));
+  IF_FALSE_RETURN_RESULT(Globals.Views != NULL, E_OUTOFMEMORY);
+
+  Globals.RecordCallback = NULL;
+  Globals.BatchCallback = Callback;
+  Globals.PipeCallback = NULL;
+  Globals.MaxViews = MaxRecords;
+  Globals.BatchMilliseconds = MaxMilliseconds;
+  Globals.ReceiveBufferLimit = IM_RECEIVE_BUFFER_LIMIT;
+
+  return IMInitilizeImpl(IMAppendView, &Globals);
+}
+
+_Check_return_
+    HRESULT
+    IMInitilizePipeline(
+        _In_ IM_RECORD_VIEW_CALLBACK Callback,
+        _In_ const IM_PIPELINE_CONFIG *Config)
+{
+  IF_FALSE_RETURN_RESULT(Callback != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Config != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(0 != Config->Workers && Config->Workers <= IM_MAX_PIPELINE_WORKERS, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Config->QueueDepth >= 2 && Config->QueueDepth <= IM_MAX_PIPELINE_DEPTH, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(0 == (Config->QueueDepth & (Config->QueueDepth - 1)), E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Config->Key < IMPipelineKeys, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(0 == Config->ReceiveBufferLimit || Config->ReceiveBufferLimit >= IM_MIN_RECEIVE_BUFFER_LIMIT, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Config->ReceiveBufferLimit <= IM_MAX_RECEIVE_BUFFER_LIMIT, E_INVALIDARG);
+
+  Globals.PipeEntries = (PIM_RECORD_VIEW)calloc((SIZE_T)Config->Workers * Config->QueueDepth, sizeof(IM_RECORD_VIEW));
+  IF_FALSE_RETURN_RESULT(Globals.PipeEntries != NULL, E_OUTOFMEMORY);
+
+  (VOID) IMPipeInit(&Globals.Pipe, Config->Workers, Config->QueueDepth, sizeof(IM_RECORD_VIEW), Globals.PipeEntries);
+
+  Globals.RecordCallback = NULL;
+  Globals.BatchCallback = NULL;
+  Globals.PipeCallback = Callback;
+  Globals.PipeKey = Config->Key;
+  Globals.ReaderAffinity = Config->ReaderAffinity;
+  Globals.WorkerAffinity = Config->WorkerAffinity;
+  Globals.ReceiveBufferLimit = 0 != Config->ReceiveBufferLimit ? Config->ReceiveBufferLimit : IM_RECEIVE_BUFFER_LIMIT;
+
+  return IMInitilizeImpl(IMPipeView, &Globals);
+}
+
 _Check_return_
     HRESULT
     IMDeinitilize()
@@ -150,12 +490,91 @@ _Check_return_
   return S_OK;
 }
 
+_Check_return_
+    HRESULT
+    IMSetOverflowPolicy(
+        _In_ IM_OVERFLOW_POLICY Policy,
+        _In_ ULONG Milliseconds)
+{
+  return IMSendOverflow(&Globals, Policy, Milliseconds);
+}
+
+_Check_return_
+    HRESULT
+    IMGetLostRecords(
+        _Out_ PULONGLONG Lost)
+{
+  IF_FALSE_RETURN_RESULT(Lost != NULL, E_INVALIDARG);
+
+  *Lost = (ULONGLONG)InterlockedCompareExchange64(&Globals.LostRecords, 0, 0);
+
+  return S_OK;
+}
+
+_Check_return_
+    HRESULT
+    IMSetRecordsBudget(
+        _In_ ULONG Bytes)
+{
+  return IMSendBudget(&Globals, Bytes);
+}
+
+_Check_return_
+    HRESULT
+    IMGetRecordsBytes(
+        _Out_ PULONGLONG Bytes,
+        _Out_ PULONGLONG MaxBytes)
+{
+  HRESULT hResult = S_OK;
+  IM_RECORDS_STATISTICS statistics;
+
+  IF_FALSE_RETURN_RESULT(Bytes != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(MaxBytes != NULL, E_INVALIDARG);
+
+  hResult = IMQueryStatistics(&Globals, &statistics);
+  IF_FALSE_RETURN_RESULT(SUCCEEDED(hResult), hResult);
+
+  *Bytes = statistics.QueuedBytes;
+  *MaxBytes = statistics.MaxQueuedBytes;
+
+  return S_OK;
+}
+
+_Check_return_
+    HRESULT
+    IMGetVerdictCounters(
+        _Out_ PULONGLONG Hits,
+        _Out_ PULONGLONG Misses)
+{
+  HRESULT hResult = S_OK;
+  IM_RECORDS_STATISTICS statistics;
+
+  IF_FALSE_RETURN_RESULT(Hits != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Misses != NULL, E_INVALIDARG);
+
+  hResult = IMQueryStatistics(&Globals, &statistics);
+  IF_FALSE_RETURN_RESULT(SUCCEEDED(hResult), hResult);
+
+  *Hits = statistics.VerdictHits;
+  *Misses = statistics.VerdictMisses;
+
+  return S_OK;
+}
+
+_Check_return_
+    HRESULT
+    IMSetCoalesceWindow(
+        _In_ ULONG Milliseconds)
+{
+  return IMSendCoalesce(&Globals, Milliseconds);
+}
+
 //------------------------------------------------------------------------
 
 _Check_return_
     HRESULT
     IMInitilizeImpl(
-        _In_ IM_RECORD_CALLBACK Callback,
+        _In_ IM_RECORD_VIEW_CALLBACK Callback,
         _In_ PIM_CONTEXT Context)
 {
   HRESULT hResult = S_OK;
@@ -172,6 +591,12 @@ _Check_return_
 
     HR_IF_FAIL_LEAVE(IMConnect(IM_PORT_NAME, &Context->Port));
 
+    // older driver has no ring, records are copied then
+    if (FAILED(IMMapRecords(Context)))
+    {
+      LOG(("[IM] Shared records are not mapped, records will be copied\n"));
+    }
+
     HR_IF_FAIL_LEAVE(IMInitCollector(Callback, Context));
   }
   __finally
@@ -240,7 +665,7 @@ _Check_return_
 _Check_return_
     HRESULT
     IMInitContext(
-        _In_ IM_RECORD_CALLBACK Callback,
+        _In_ IM_RECORD_VIEW_CALLBACK Callback,
         _In_ PIM_CONTEXT Context)
 {
   IF_FALSE_RETURN_RESULT(Callback != NULL, E_INVALIDARG);
@@ -249,10 +674,24 @@ _Check_return_
   LOG(("[IM] Library context initialized\n"));
 
   Context->Port = INVALID_HANDLE_VALUE;
-  Context->RecordCallback = Callback;
+  Context->ViewCallback = Callback;
   Context->Semaphore = INVALID_HANDLE_VALUE;
   Context->Thread = INVALID_HANDLE_VALUE;
   Context->isDown = FALSE;
+  Context->SharedRecords = NULL;
+  Context->LowWatermark = 1;
+  Context->WaitMilliseconds = IM_RECORDS_WAIT;
+  Context->ViewCount = 0;
+
+  // driver holds the records of the batch until there are enough of them
+  if (NULL != Context->BatchCallback && 0 != Context->BatchMilliseconds)
+  {
+    Context->LowWatermark = Context->MaxViews;
+    Context->WaitMilliseconds = Context->BatchMilliseconds;
+  }
+
+  // new connection gets every string again
+  ZeroMemory(Context->Names, sizeof(Context->Names));
 
   return S_OK;
 }
@@ -260,6 +699,8 @@ _Check_return_
 VOID IMDeinitContext(
     _In_ PIM_CONTEXT Context)
 {
+  ULONG i = 0;
+
   IF_FALSE_RETURN(Context != NULL);
 
   LOG(("[IM] Waiting to kill requester thread\n"));
@@ -268,8 +709,16 @@ VOID IMDeinitContext(
 
   WaitForSingleObject(Context->Semaphore, INFINITE);
 
+  // parser stopped at the closed buffer, receiver has handed it over
+  IMDeinitReceiver(Context);
+
+  // reader is gone, workers pass what it queued and stop
+  IMDeinitWorkers(Context);
+
   if (INVALID_HANDLE_VALUE != Context->Port)
   {
+    // driver unmaps the ring when port is closed
+    Context->SharedRecords = NULL;
     CloseHandle(Context->Port);
     Context->Port = INVALID_HANDLE_VALUE;
     LOG(("[IM] Port closed\n"));
@@ -289,13 +738,27 @@ VOID IMDeinitContext(
     LOG(("[IM] Thread closed\n"));
   }
 
+  for (; i < IM_MAX_INTERNED_NAMES; i++)
+  {
+    free(Context->Names[i].Buffer);
+    Context->Names[i].Buffer = NULL;
+    Context->Names[i].Size = 0;
+    Context->Names[i].Capacity = 0;
+  }
+
+  free(Context->Views);
+  Context->Views = NULL;
+  Context->ViewCount = 0;
+  Context->MaxViews = 0;
+  Context->BatchCallback = NULL;
+
   LOG(("[IM] Library context deinitialized\n"));
 }
 
 _Check_return_
     HRESULT
     IMInitCollector(
-        _In_ IM_RECORD_CALLBACK Callback,
+        _In_ IM_RECORD_VIEW_CALLBACK Callback,
         _In_ PIM_CONTEXT Context)
 {
   ULONG threadId;
@@ -306,6 +769,13 @@ _Check_return_
 
   LOG(("[IM] Requester thread initialization\n"));
 
+  // workers wait for the records before the reader starts
+  if (NULL != Context->PipeCallback)
+  {
+    hResult = IMInitWorkers(Context);
+    IF_FALSE_RETURN_RESULT(SUCCEEDED(hResult), hResult);
+  }
+
   Context->Semaphore = CreateSemaphoreW(NULL,
                                         0,
                                         1,
@@ -318,10 +788,17 @@ _Check_return_
     return hResult;
   }
 
+  // copied records come through the receiver thread
+  if (NULL == Context->SharedRecords)
+  {
+    hResult = IMInitReceiver(Context);
+    IF_FALSE_RETURN_RESULT(SUCCEEDED(hResult), hResult);
+  }
+
   Context->Thread = CreateThread(
       NULL,
       0,
-      IMRetrieveRecords,
+      NULL != Context->SharedRecords ? IMReadSharedRecords : IMRetrieveRecords,
       (LPVOID)Context,
       0, &threadId);
 
@@ -332,107 +809,996 @@ _Check_return_
     return hResult;
   }
 
+  if (0 != Context->ReaderAffinity)
+  {
+    SetThreadAffinityMask(Context->Thread, Context->ReaderAffinity);
+  }
+
   LOG(("[IM] Requester thread initialized\n"));
 
   return hResult;
 }
 
-DWORD
-WINAPI
-IMRetrieveRecords(
-    _In_ LPVOID lpParameter)
+//
+// Starts the receiver thread which keeps its pool of receive buffers
+// posted to the port and hands the filled ones to the parser
+//
+_Check_return_
+    HRESULT
+    IMInitReceiver(
+        _In_ PIM_CONTEXT Context)
 {
-  PIM_CONTEXT context = NULL;
-  HRESULT hResult = S_OK;
-  PVOID alignedBuffer[BUFFER_SIZE / sizeof(PVOID)];
-  PCHAR buffer = (PCHAR)alignedBuffer;
-  ULONG returnLen = 0;
-  ULONG ttl = 10;
-  PVOID recordsBufferPointer;
-  ULONG i;
-  PIM_RECORD record;
+  IM_TRANSPORT transport;
+  ULONG threadId;
 
-  IF_FALSE_RETURN_RESULT(lpParameter != NULL, E_INVALIDARG);
+  LOG(("[IM] Starting receiver of %u buffers up to %u bytes\n", IM_RECEIVE_BUFFERS, Context->ReceiveBufferLimit));
 
-  context = (PIM_CONTEXT)lpParameter;
+  transport.Receive = IMReceivePort;
+  transport.Wait = IMWaitPort;
+  transport.Context = Context;
 
-  LOG(("[IM] Requester thread loop entering: \n"));
+  IF_FALSE_RETURN_RESULT(IMReceiverInit(&Context->Receiver, &transport, IM_RECEIVE_BUFFERS, Context->ReceiveBufferLimit), E_OUTOFMEMORY);
+
+  Context->ReceiverWakeup = CreateEventW(NULL, FALSE, FALSE, NULL);
+  IF_FALSE_RETURN_RESULT(Context->ReceiverWakeup != NULL, HRESULT_FROM_WIN32(GetLastError()));
+
+  Context->ParserWakeup = CreateEventW(NULL, FALSE, FALSE, NULL);
+  IF_FALSE_RETURN_RESULT(Context->ParserWakeup != NULL, HRESULT_FROM_WIN32(GetLastError()));
 
-#pragma warning(push)
-#pragma warning(disable : 4127) // conditional expression is constant
+  Context->ReceiverThread = CreateThread(NULL, 0, IMReceiveRecords, (LPVOID)Context, 0, &threadId);
+  IF_FALSE_RETURN_RESULT(Context->ReceiverThread != NULL, HRESULT_FROM_WIN32(GetLastError()));
 
-  while (TRUE)
+  // receiver sleeps in the driver, it shares the core of the reader
+  if (0 != Context->ReaderAffinity)
   {
+    SetThreadAffinityMask(Context->ReceiverThread, Context->ReaderAffinity);
+  }
 
-#pragma warning(pop)
-    i = 0;
-    returnLen = 0;
+  return S_OK;
+}
 
-    if (context->isDown)
-    {
-      break;
-    }
+VOID IMDeinitReceiver(
+    _In_ PIM_CONTEXT Context)
+{
+  if (NULL != Context->ReceiverThread)
+  {
+    WaitForSingleObject(Context->ReceiverThread, INFINITE);
+    CloseHandle(Context->ReceiverThread);
+    Context->ReceiverThread = NULL;
+  }
 
-    hResult = IMSend(
-        context->Port,
-        GetRecordsCommand,
-        buffer,
-        sizeof(alignedBuffer),
-        &returnLen);
+  if (NULL != Context->ReceiverWakeup)
+  {
+    CloseHandle(Context->ReceiverWakeup);
+    Context->ReceiverWakeup = NULL;
+  }
 
-    if (HRESULT_FROM_WIN32(ERROR_NO_MORE_ITEMS) == hResult)
-    {
-      //LOG(("  [IM] No items from kernel\n"));
-      Sleep(200);
-      continue;
-    }
+  if (NULL != Context->ParserWakeup)
+  {
+    CloseHandle(Context->ParserWakeup);
+    Context->ParserWakeup = NULL;
+  }
 
-    if (IS_ERROR(hResult))
-    {
-      if (HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE) == hResult)
+  IMReceiverDeinit(&Context->Receiver);
+}
+
+//
+// Starts the workers of the pipeline, each with its queue and event
+//
+_Check_return_
+    HRESULT
+    IMInitWorkers(
+        _In_ PIM_CONTEXT Context)
+{
+  PIM_WORKER worker = NULL;
+  ULONG threadId;
+  ULONG i = 0;
+
+  LOG(("[IM] Starting %u workers\n", Context->Pipe.Workers));
+
+  Context->IsPipeDown = 0;
+
+  Context->PipeRoom = CreateEventW(NULL, FALSE, FALSE, NULL);
+  IF_FALSE_RETURN_RESULT(Context->PipeRoom != NULL, HRESULT_FROM_WIN32(GetLastError()));
+
+  for (; i < Context->Pipe.Workers; i++)
+  {
+    worker = &Context->Workers[i];
+
+    worker->Context = Context;
+    worker->Index = i;
+
+    worker->Wakeup = CreateEventW(NULL, FALSE, FALSE, NULL);
+    IF_FALSE_RETURN_RESULT(worker->Wakeup != NULL, HRESULT_FROM_WIN32(GetLastError()));
+
+    worker->Thread = CreateThread(NULL, 0, IMPassRecords, (LPVOID)worker, 0, &threadId);
+    IF_FALSE_RETURN_RESULT(worker->Thread != NULL, HRESULT_FROM_WIN32(GetLastError()));
+
+    if (0 != Context->WorkerAffinity)
+    {
+      SetThreadAffinityMask(worker->Thread, IMAffinityOf(Context->WorkerAffinity, i));
+    }
+  }
+
+  return S_OK;
+}
+
+//
+// Stops the workers once they passed every queued record, the reader has
+// to be stopped before
+//
+VOID IMDeinitWorkers(
+    _In_ PIM_CONTEXT Context)
+{
+  PIM_WORKER worker = NULL;
+  ULONG i = 0;
+
+  if (NULL == Context->PipeCallback)
+  {
+    return;
+  }
+
+  InterlockedExchange(&Context->IsPipeDown, 1);
+
+  for (; i < Context->Pipe.Workers; i++)
+  {
+    worker = &Context->Workers[i];
+
+    if (NULL != worker->Thread)
+    {
+      SetEvent(worker->Wakeup);
+      WaitForSingleObject(worker->Thread, INFINITE);
+      CloseHandle(worker->Thread);
+      worker->Thread = NULL;
+    }
+
+    if (NULL != worker->Wakeup)
+    {
+      CloseHandle(worker->Wakeup);
+      worker->Wakeup = NULL;
+    }
+  }
+
+  if (NULL != Context->PipeRoom)
+  {
+    CloseHandle(Context->PipeRoom);
+    Context->PipeRoom = NULL;
+  }
+
+  free(Context->PipeEntries);
+  Context->PipeEntries = NULL;
+  Context->PipeCallback = NULL;
+  Context->ReaderAffinity = 0;
+  Context->WorkerAffinity = 0;
+
+  LOG(("[IM] Workers stopped\n"));
+}
+
+//
+// Index-th processor of the mask, the mask is taken in turn
+//
+ULONG_PTR
+IMAffinityOf(
+    _In_ ULONG_PTR Mask,
+    _In_ ULONG Index)
+{
+  ULONG_PTR bit = 0;
+  ULONG count = 0;
+
+  for (bit = 1; 0 != bit; bit <<= 1)
+  {
+    count += 0 != (Mask & bit);
+  }
+
+  Index %= count;
+
+  for (bit = 1; 0 != bit; bit <<= 1)
+  {
+    if (0 != (Mask & bit) && 0 == Index--)
+    {
+      break;
+    }
+  }
+
+  return bit;
+}
+
+//
+// Transport of the receiver, GetRecordsCommand fills the buffer. Reply of
+// the driver tells how large the next one should be.
+//
+IM_RECEIVE_STATUS
+IMReceivePort(
+    _In_ PVOID Context,
+    _Inout_ PIM_RECEIVE_BUFFER Buffer)
+{
+  IM_WIRE_REPLY reply;
+  ULONG returnLen = 0;
+  HRESULT hResult = IMRequestRecords((PIM_CONTEXT)Context, (PCHAR)Buffer->Data, Buffer->Size, &returnLen);
+
+  if (HRESULT_FROM_WIN32(ERROR_NO_MORE_ITEMS) == hResult)
+  {
+    return IMReceiveEmpty;
+  }
+
+  if (HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE) == hResult)
+  {
+    return IMReceiveClosed;
+  }
+
+  if (IS_ERROR(hResult))
+  {
+    return IMReceiveError;
+  }
+
+  // driver which does not know IM_RECORDS_REPORT sends the records only
+  if (!IMWireDecodeReply(Buffer->Data, returnLen, &reply))
+  {
+    Buffer->Length = returnLen;
+    return IMReceiveRecords;
+  }
+
+  Buffer->Offset = reply.Length;
+  Buffer->Length = returnLen - reply.Length;
+
+  // room for the record which did not fit, or for the ones left
+  if (0 != reply.Required)
+  {
+    Buffer->Required = reply.Required;
+  }
+  else if (0 != reply.Queued)
+  {
+    Buffer->Required = returnLen + min(reply.QueuedBytes, MAXULONG - returnLen);
+  }
+
+  return IMReceiveRecords;
+}
+
+//
+// driver wakes us up when records come, older one can only be polled
+//
+IM_RECEIVE_STATUS
+IMWaitPort(
+    _In_ PVOID Context)
+{
+  HRESULT hResult = IMWaitRecords((PIM_CONTEXT)Context);
+
+  if (HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE) == hResult)
+  {
+    return IMReceiveClosed;
+  }
+
+  if (IS_ERROR(hResult))
+  {
+    Sleep(IM_POLL_INTERVAL);
+    return IMReceiveError;
+  }
+
+  return IMReceiveRecords;
+}
+
+//
+// Receiver thread, fills the buffers while the requester thread parses the
+// previous ones. The last buffer it hands over is the closed one.
+//
+DWORD
+WINAPI
+IMReceiveRecords(
+    _In_ LPVOID lpParameter)
+{
+  PIM_CONTEXT context = NULL;
+  IM_RECEIVE_STATUS status = IMReceiveRecords;
+  BOOLEAN wake = FALSE;
+  ULONG ttl = 10;
+
+  IF_FALSE_RETURN_RESULT(lpParameter != NULL, E_INVALIDARG);
+
+  context = (PIM_CONTEXT)lpParameter;
+
+  LOG(("[IM] Receiver thread loop entering: \n"));
+
+  while (!context->isDown)
+  {
+    status = IMReceiverFill(&context->Receiver, &wake);
+
+    if (wake)
+    {
+      SetEvent(context->ParserWakeup);
+    }
+
+    if (IMReceiveRecords == status)
+    {
+      ttl = 10;
+      continue;
+    }
+
+    if (IMReceiveFull == status)
+    {
+      // parser has every buffer, it sets the event when it gives one back
+      if (IMReceiverPrepareWaitRoom(&context->Receiver))
+      {
+        WaitForSingleObject(context->ReceiverWakeup, INFINITE);
+      }
+      continue;
+    }
+
+    if (IMReceiveEmpty == status)
+    {
+      // driver without WaitRecordsCommand fails the wait, it is polled
+      status = IMWaitPort(context);
+
+      if (IMReceiveClosed != status)
+      {
+        continue;
+      }
+    }
+
+    if (IMReceiveClosed == status)
+    {
+      LOG(("[IM] The kernel component has unloaded. Exiting. Consider deinitialization\n"));
+      break;
+    }
+
+    LOG_B(("[IM] error send GetRecordsCommand\n"));
+    ttl--;
+    if (ttl == 0)
+    {
+      LOG_B(("[IM] error send GetRecordsCommand too many errors\n"));
+      break;
+    }
+  }
+
+  // closed buffer of the port is handed over already
+  while (IMReceiveClosed != status && !IMReceiverClose(&context->Receiver, &wake))
+  {
+    if (IMReceiverPrepareWaitRoom(&context->Receiver))
+    {
+      WaitForSingleObject(context->ReceiverWakeup, INFINITE);
+    }
+  }
+
+  if (wake)
+  {
+    SetEvent(context->ParserWakeup);
+  }
+
+  LOG(("[IM] Receiver loop broken\n"));
+
+  return 0;
+}
+
+//
+// Passes the records of one buffer of GetRecordsCommand
+//
+VOID IMParseRecords(
+    _In_ PIM_CONTEXT Context,
+    _In_reads_bytes_(Length) PCHAR Buffer,
+    _In_ ULONG Length)
+{
+  HRESULT hResult = S_OK;
+  ULONG entryLength = 0;
+  ULONG i = 0;
+  IM_RECORD_VIEW record;
+
+  // driver which knows batches sends one, older one sends records
+  if (IMWireIsBatch((const UCHAR *)Buffer, Length))
+  {
+    if (IS_ERROR(IMViewBatch(Context, Buffer, Length)))
+    {
+      LOG_B(("[IM] error view batch\n"));
+    }
+    return;
+  }
+
+  // strings of the names are cached, records point to them
+  while (i < Length)
+  {
+    hResult = IMViewRecord(Context, Buffer + i, Length - i, &record, &entryLength);
+
+    if (IS_ERROR(hResult))
+    {
+      LOG_B(("[IM] error view record\n"));
+      break;
+    }
+
+    // gap marker is counted, it is not a record
+    if (S_OK == hResult)
+    {
+      LOG(("  [IM] Sending item to callback\n"));
+      Context->ViewCallback(&record);
+    }
+
+    i += entryLength;
+  }
+}
+
+DWORD
+WINAPI
+IMRetrieveRecords(
+    _In_ LPVOID lpParameter)
+{
+  PIM_CONTEXT context = NULL;
+  PIM_RECEIVE_BUFFER buffer = NULL;
+
+  IF_FALSE_RETURN_RESULT(lpParameter != NULL, E_INVALIDARG);
+
+  context = (PIM_CONTEXT)lpParameter;
+
+  LOG(("[IM] Requester thread loop entering: \n"));
+
+  for (;;)
+  {
+    buffer = IMReceiverPeek(&context->Receiver);
+
+    if (NULL == buffer)
+    {
+      // receiver sets the event when it fills the next one
+      if (IMReceiverPrepareWait(&context->Receiver))
       {
-        LOG(("[IM] The kernel component of minispy has unloaded. Exiting. Consider deinitialization\n"));
+        WaitForSingleObject(context->ParserWakeup, INFINITE);
+      }
+      continue;
+    }
+
+    if (IMReceiveClosed == buffer->Status)
+    {
+      break;
+    }
+
+    if (IMReceiveEmpty == buffer->Status)
+    {
+      // batch is not held over the wait, the driver holds the records
+      IMFlushViews(context);
+    }
+    else
+    {
+      IMParseRecords(context, (PCHAR)buffer->Data + buffer->Offset, buffer->Length);
+      IMFlushDueViews(context);
+    }
+
+    if (IMReceiverRelease(&context->Receiver))
+    {
+      SetEvent(context->ReceiverWakeup);
+    }
+  }
+
+  IMFlushViews(context);
+
+  LOG(("[IM] Requestor loop broken\n"));
+
+  ReleaseSemaphore(context->Semaphore, 1, NULL);
+
+  return 0;
+}
+
+_Check_return_
+    HRESULT
+    IMMapRecords(
+        _In_ PIM_CONTEXT Context)
+{
+  HRESULT hResult = S_OK;
+  IM_SHARED_RECORDS_MAPPING mapping;
+  ULONG returnLen = 0;
+
+  IF_FALSE_RETURN_RESULT(Context != NULL, E_INVALIDARG);
+
+  LOG(("[IM] Mapping shared records\n"));
+
+  ZeroMemory(&mapping, sizeof(mapping));
+
+  hResult = IMSend(
+      Context->Port,
+      MapRecordsCommand,
+      (PCHAR)&mapping,
+      sizeof(mapping),
+      &returnLen);
+
+  IF_FALSE_RETURN_RESULT(SUCCEEDED(hResult), hResult);
+  IF_FALSE_RETURN_RESULT(sizeof(mapping) == returnLen, E_UNEXPECTED);
+  IF_FALSE_RETURN_RESULT(0 != mapping.Address, E_UNEXPECTED);
+
+  // header is laid out by the driver, check it before trusting it
+  if (!IMRingInitConsumer(&Context->Consumer, (PIM_RING_HEADER)(ULONG_PTR)mapping.Address, mapping.Size))
+  {
+    LOG_B(("[IM] Shared records header is wrong\n"));
+    return E_UNEXPECTED;
+  }
+
+  Context->SharedRecords = (PIM_RING_HEADER)(ULONG_PTR)mapping.Address;
+
+  LOG(("[IM] Shared records mapped, %u bytes\n", mapping.Size));
+
+  return S_OK;
+}
+
+DWORD
+WINAPI
+IMReadSharedRecords(
+    _In_ LPVOID lpParameter)
+{
+  PIM_CONTEXT context = NULL;
+  HRESULT hResult = S_OK;
+  IM_RECORD_VIEW record;
+  PCHAR entry = NULL;
+  ULONG length = 0;
+  ULONG entryLength = 0;
+  ULONG ttl = 10;
+  LONG dropped = 0;
+
+  IF_FALSE_RETURN_RESULT(lpParameter != NULL, E_INVALIDARG);
+
+  context = (PIM_CONTEXT)lpParameter;
+
+  LOG(("[IM] Shared records loop entering\n"));
+
+  while (!context->isDown)
+  {
+    entry = (PCHAR)IMRingPeek(&context->Consumer, &length);
+
+    if (NULL != entry)
+    {
+      // record lives until the callback returns, names are cached
+      if (S_OK == IMViewRecord(context, entry, length, &record, &entryLength))
+      {
+        LOG(("  [IM] Sending item to callback\n"));
+        context->ViewCallback(&record);
+      }
+
+      IMRingRelease(&context->Consumer);
+      IMFlushDueViews(context);
+      continue;
+    }
+
+    IMFlushViews(context);
+
+    if (dropped != context->SharedRecords->Dropped)
+    {
+      dropped = context->SharedRecords->Dropped;
+      LOG(("[IM] %d records dropped by the driver\n", dropped));
+    }
+
+    // something was published meanwhile, no need to sleep
+    if (!IMRingPrepareWait(&context->Consumer))
+    {
+      continue;
+    }
+
+    // driver answers when it rings the doorbell or in WaitMilliseconds
+    hResult = IMWaitRecords(context);
+
+    if (IS_ERROR(hResult))
+    {
+      if (HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE) == hResult)
+      {
+        LOG(("[IM] The kernel component has unloaded. Exiting. Consider deinitialization\n"));
         break;
       }
 
-      LOG_B(("[IM] error send GetRecordsCommand\n"));
-      ttl--;
-      if (ttl == 0)
-      {
-        LOG_B(("[IM] error send GetRecordsCommand too many errors\n"));
-        break;
-      }
+      LOG_B(("[IM] error send WaitRecordsCommand\n"));
+      ttl--;
+      if (ttl == 0)
+      {
+        LOG_B(("[IM] error send WaitRecordsCommand too many errors\n"));
+        break;
+      }
+      continue;
+    }
+
+    ttl = 10;
+  }
+
+  IMFlushViews(context);
+
+  LOG(("[IM] Shared records loop broken\n"));
+
+  ReleaseSemaphore(context->Semaphore, 1, NULL);
+
+  return 0;
+}
+
+//
+// Worker of the pipeline, passes records of its queue until the pipeline
+// is down and the queue is empty
+//
+DWORD
+WINAPI
+IMPassRecords(
+    _In_ LPVOID lpParameter)
+{
+  PIM_WORKER worker = NULL;
+  PIM_CONTEXT context = NULL;
+  PIM_RECORD_VIEW view = NULL;
+
+  IF_FALSE_RETURN_RESULT(lpParameter != NULL, E_INVALIDARG);
+
+  worker = (PIM_WORKER)lpParameter;
+  context = worker->Context;
+
+  for (;;)
+  {
+    view = (PIM_RECORD_VIEW)IMPipePeek(&context->Pipe, worker->Index);
+
+    if (NULL != view)
+    {
+      context->PipeCallback(view);
+
+      if (IMPipeRelease(&context->Pipe, worker->Index))
+      {
+        SetEvent(context->PipeRoom);
+      }
+      continue;
+    }
+
+    if (0 != ReadAcquire(&context->IsPipeDown))
+    {
+      break;
+    }
+
+    // reader sets the event when it queues the next one
+    if (IMPipePrepareWait(&context->Pipe, worker->Index))
+    {
+      WaitForSingleObject(worker->Wakeup, INFINITE);
+    }
+  }
+
+  return 0;
+}
+
+//
+// Record is a view of the entry, entry is written by the driver in the
+// wire format and decoded with the checks against its length. Names which
+// come with the record point into the entry. S_FALSE if the entry is a gap
+// marker and there is no record.
+//
+_Check_return_
+    HRESULT
+    IMViewRecord(
+        _In_ PIM_CONTEXT Context,
+        _In_reads_bytes_(Length) PCHAR Entry,
+        _In_ ULONG Length,
+        _Out_ PIM_RECORD_VIEW Record,
+        _Out_ PULONG EntryLength)
+{
+  HRESULT hResult = S_OK;
+  IM_WIRE_RECORD wireRecord;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA];
+
+  IF_FALSE_RETURN_RESULT(Context != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Entry != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Record != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(EntryLength != NULL, E_INVALIDARG);
+
+  ZeroMemory(Record, sizeof(IM_RECORD_VIEW));
+  *EntryLength = 0;
+
+  // every field is read once, the driver side can not change it under the checks
+  if (!IMWireDecodeRecord((const UCHAR *)Entry, Length, &wireRecord, strings))
+  {
+    LOG_B(("[IM] struct offset is wrong\n"));
+    return E_UNEXPECTED;
+  }
+
+  hResult = IMMakeView(Context, &wireRecord, strings, Record);
+  IF_FALSE_RETURN_RESULT(SUCCEEDED(hResult), hResult);
+
+  *EntryLength = wireRecord.Length;
+
+  return hResult;
+}
+
+//
+// Passes every record of the batch to the callback, the batch is decoded
+// in order from its header, names of the views point to the strings the
+// decoder built. Records decoded before a malformed one are delivered.
+//
+_Check_return_
+    HRESULT
+    IMViewBatch(
+        _In_ PIM_CONTEXT Context,
+        _In_reads_bytes_(Length) PCHAR Batch,
+        _In_ ULONG Length)
+{
+  HRESULT hResult = S_OK;
+  IM_WIRE_RECORD wireRecord;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA];
+  IM_RECORD_VIEW record;
+
+  IF_FALSE_RETURN_RESULT(Context != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Batch != NULL, E_INVALIDARG);
+
+  if (!IMWireBeginBatchDecode(&Context->Batch, (const UCHAR *)Batch, Length))
+  {
+    LOG_B(("[IM] batch header is wrong\n"));
+    return E_UNEXPECTED;
+  }
+
+  while (!IMWireIsBatchEnd(&Context->Batch))
+  {
+    if (!IMWireDecodeBatchRecord(&Context->Batch, &wireRecord, strings))
+    {
+      LOG_B(("[IM] record of the batch is wrong\n"));
+      return E_UNEXPECTED;
+    }
+
+    hResult = IMMakeView(Context, &wireRecord, strings, &record);
+    IF_FALSE_RETURN_RESULT(SUCCEEDED(hResult), hResult);
+
+    if (S_FALSE == hResult)
+    {
       continue;
     }
-    else
+
+    LOG(("  [IM] Sending item to callback\n"));
+    Context->ViewCallback(&record);
+  }
+
+  return S_OK;
+}
+
+//
+// View of the decoded one. String which came with it is taken to the cache
+// of the names and the view points to it where it came, the view of the
+// name sent before points to the cache. Views of a batch and of the
+// pipeline outlive the buffer, they always point to the cache. Gap marker
+// only adds to the lost records and returns S_FALSE.
+//
+_Check_return_
+    HRESULT
+    IMMakeView(
+        _In_ PIM_CONTEXT Context,
+        _In_ PIM_WIRE_RECORD WireRecord,
+        _In_reads_(IM_AMOUNT_OF_DATA) const UCHAR **Strings,
+        _Out_ PIM_RECORD_VIEW Record)
+{
+  HRESULT hResult = S_OK;
+  PIM_NAME names[IM_AMOUNT_OF_DATA];
+  const UCHAR *strings[IM_AMOUNT_OF_DATA] = {NULL, NULL};
+  ULONG i = 0;
+
+  ZeroMemory(Record, sizeof(IM_RECORD_VIEW));
+
+  if (0 != (WireRecord->Flags & IM_WIRE_GAP))
+  {
+    InterlockedExchangeAdd64(&Context->LostRecords, WireRecord->Lost);
+    LOG_B(("[IM] %u records lost by the driver\n", WireRecord->Lost));
+    return S_FALSE;
+  }
+
+  for (; i < IM_AMOUNT_OF_DATA; i++)
+  {
+    hResult = IMLookupName(Context, &WireRecord->Names[i], Strings[i], &names[i]);
+    IF_FALSE_RETURN_RESULT(SUCCEEDED(hResult), hResult);
+
+    if (NULL == Context->BatchCallback && NULL == Context->PipeCallback)
     {
-      ttl = 10;
+      strings[i] = Strings[i];
     }
+  }
+
+  Record->SequenceNumber = WireRecord->SequenceNumber;
+  Record->Time.QuadPart = WireRecord->Time;
+  Record->IsBlocked = 0 != (WireRecord->Flags & IM_WIRE_BLOCKED);
+  Record->IsSucceded = 0 != (WireRecord->Flags & IM_WIRE_SUCCEEDED);
+  Record->VideoMode = (IM_VIDEO_MODE_STATUS)WireRecord->VideoMode;
+  Record->Count = WireRecord->Count;
+  Record->LastTime.QuadPart = WireRecord->LastTime;
+
+  if (NULL != names[IM_PROCESS_NAME_INDEX])
+  {
+    Record->ProcessNameSize = names[IM_PROCESS_NAME_INDEX]->Size;
+    Record->ProcessNameId = WireRecord->Names[IM_PROCESS_NAME_INDEX].Id;
+    Record->ProcessName = NULL != strings[IM_PROCESS_NAME_INDEX]
+                              ? (LPCUWSTR)strings[IM_PROCESS_NAME_INDEX]
+                              : names[IM_PROCESS_NAME_INDEX]->Buffer;
+  }
+
+  if (NULL != names[IM_FILE_NAME_INDEX])
+  {
+    Record->FileNameSize = names[IM_FILE_NAME_INDEX]->Size;
+    Record->FileNameId = WireRecord->Names[IM_FILE_NAME_INDEX].Id;
+    Record->FileName = NULL != strings[IM_FILE_NAME_INDEX]
+                           ? (LPCUWSTR)strings[IM_FILE_NAME_INDEX]
+                           : names[IM_FILE_NAME_INDEX]->Buffer;
+  }
+
+  return S_OK;
+}
+
+//
+// Callback of the views for the app which gave IM_RECORD_CALLBACK, the
+// record is on the stack and its names are the ones of the view
+//
+HRESULT
+IMRecordFromView(
+    _In_ PCIM_RECORD_VIEW View)
+{
+  IM_RECORD record;
+
+  ZeroMemory(&record, sizeof(IM_RECORD));
+
+  record.Debug = 0xCEFAADDE;
+  record.TotalLength = sizeof(IM_RECORD) + View->ProcessNameSize + View->FileNameSize;
+  record.SequenceNumber = View->SequenceNumber;
+  record.Time = View->Time;
+  record.IsBlocked = View->IsBlocked;
+  record.IsSucceded = View->IsSucceded;
+  record.ProcessNameLength = View->ProcessNameSize / sizeof(WCHAR);
+  record.ProcessName = (PWCHAR)View->ProcessName;
+  record.FileNameLenght = View->FileNameSize / sizeof(WCHAR);
+  record.FileName = (PWCHAR)View->FileName;
+  record.VideoMode = View->VideoMode;
+  record.Count = View->Count;
+  record.LastTime = View->LastTime;
+
+  return Globals.RecordCallback(&record);
+}
+
+//
+// Callback of the views for the app which gave IM_RECORD_BATCH_CALLBACK,
+// the batch is passed once it is full
+//
+HRESULT
+IMAppendView(
+    _In_ PCIM_RECORD_VIEW View)
+{
+  if (0 == Globals.ViewCount)
+  {
+    Globals.ViewsTime = GetTickCount64();
+  }
+
+  Globals.Views[Globals.ViewCount++] = *View;
+
+  if (Globals.ViewCount == Globals.MaxViews)
+  {
+    IMFlushViews(&Globals);
+  }
+
+  return S_OK;
+}
+
+//
+// Passes the views taken so far, the requester thread calls it before it
+// waits and when it stops
+//
+VOID IMFlushViews(
+    _In_ PIM_CONTEXT Context)
+{
+  if (0 == Context->ViewCount)
+  {
+    return;
+  }
+
+  LOG(("  [IM] Sending %u items to callback\n", Context->ViewCount));
+  Context->BatchCallback(Context->Views, Context->ViewCount);
+  Context->ViewCount = 0;
+}
+
+//
+// Passes the views if the first of them is as old as the batch may get
+//
+VOID IMFlushDueViews(
+    _In_ PIM_CONTEXT Context)
+{
+  if (0 != Context->ViewCount &&
+      GetTickCount64() - Context->ViewsTime >= Context->BatchMilliseconds)
+  {
+    IMFlushViews(Context);
+  }
+}
+
+//
+// Callback of the views for the app which gave the pipeline, the view is
+// queued to the worker of its key. Reader waits while the queue is full.
+//
+HRESULT
+IMPipeView(
+    _In_ PCIM_RECORD_VIEW View)
+{
+  PIM_RECORD_VIEW entry = NULL;
+  ULONG worker = 0;
 
-    recordsBufferPointer = buffer;
+  worker = IMPipeWorker(&Globals.Pipe, IMPipelineKeyFile == Globals.PipeKey ? View->FileNameId : View->ProcessNameId);
 
-    while (i < returnLen)
+  while (NULL == (entry = (PIM_RECORD_VIEW)IMPipeReserve(&Globals.Pipe, worker)))
+  {
+    if (IMPipePrepareWaitRoom(&Globals.Pipe, worker, 1))
     {
-      hResult = IMMoveRecord((PCHAR *)&recordsBufferPointer, &record, &i);
+      WaitForSingleObject(Globals.PipeRoom, INFINITE);
+    }
+  }
 
-      if (IS_ERROR(hResult))
-      {
-        LOG_B(("[IM] error move record\n"));
-        continue;
-      }
+  *entry = *View;
 
-      LOG(("  [IM] Sending item to callback\n"));
-      context->RecordCallback(record);
+  if (IMPipeCommit(&Globals.Pipe, worker))
+  {
+    SetEvent(Globals.Workers[worker].Wakeup);
+  }
+
+  return S_OK;
+}
+
+//
+// Waits until the workers passed every queued view
+//
+VOID IMDrainPipe(
+    _In_ PIM_CONTEXT Context)
+{
+  ULONG i = 0;
 
-      IMFreeRecord(record);
+  if (NULL == Context->PipeCallback)
+  {
+    return;
+  }
+
+  for (; i < Context->Pipe.Workers; i++)
+  {
+    while (IMPipePrepareWaitRoom(&Context->Pipe, i, Context->Pipe.Depth))
+    {
+      WaitForSingleObject(Context->PipeRoom, INFINITE);
     }
   }
+}
 
-  LOG(("[IM] Requestor loop broken\n"));
+//
+// Name of the id in the record, string which came with it replaces the
+// cached one. Id without a string in the cache is not an error, record
+// goes without the name.
+//
+_Check_return_
+    HRESULT
+    IMLookupName(
+        _In_ PIM_CONTEXT Context,
+        _In_ PIM_WIRE_NAME Data,
+        _In_reads_bytes_opt_(Data->Size) const UCHAR *String,
+        _Outptr_result_maybenull_ PIM_NAME *Name)
+{
+  PIM_NAME name = NULL;
+  PWCHAR buffer = NULL;
 
-  ReleaseSemaphore(context->Semaphore, 1, NULL);
+  *Name = NULL;
 
-  return 0;
+  // the decoder checked that only names with ids have strings
+  if (0 == Data->Id)
+  {
+    return S_OK;
+  }
+
+  IF_FALSE_RETURN_RESULT(Data->Id <= IM_MAX_INTERNED_NAMES, E_UNEXPECTED);
+
+  name = &Context->Names[Data->Id - 1];
+
+  if (0 != Data->Size)
+  {
+    // views of the batch and of the workers may point to the string which
+    // is replaced
+    if (NULL != name->Buffer)
+    {
+      IMFlushViews(Context);
+      IMDrainPipe(Context);
+    }
+
+    if (Data->Size > name->Capacity)
+    {
+      buffer = (PWCHAR)realloc(name->Buffer, Data->Size);
+      IF_FALSE_RETURN_RESULT(buffer != NULL, E_OUTOFMEMORY);
+
+      name->Buffer = buffer;
+      name->Capacity = Data->Size;
+    }
+
+    RtlCopyMemory(name->Buffer, String, Data->Size);
+    name->Size = Data->Size;
+  }
+
+  if (NULL == name->Buffer)
+  {
+    LOG_B(("[IM] Name %u was not sent\n", Data->Id));
+    return S_OK;
+  }
+
+  *Name = name;
+
+  return S_OK;
 }
 
 HRESULT
@@ -447,8 +1813,7 @@ IMSend(
   IM_COMMAND_MESSAGE command;
 
   IF_FALSE_RETURN_RESULT(Port != INVALID_HANDLE_VALUE, E_INVALIDARG);
-  IF_FALSE_RETURN_RESULT(Buffer != NULL, E_INVALIDARG);
-  IF_FALSE_RETURN_RESULT(Buffer != 0, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Buffer != NULL || BufferSize == 0, E_INVALIDARG);
   IF_FALSE_RETURN_RESULT(ReturnLen != NULL, E_INVALIDARG);
 
   //LOG(("[IM] Sending message to kernel component 0x%x\n", Command));
@@ -468,107 +1833,194 @@ IMSend(
   return hResult;
 }
 
+//
+// Copies records, the command is followed by IM_GET_RECORDS asking for a
+// batch and the reply ahead of it
+//
 _Check_return_
     HRESULT
-    IMMoveRecord(
-        PCHAR *SourceRecord,
-        PIM_RECORD *TargetRecord,
-        PULONG Pointer)
+    IMRequestRecords(
+        _In_ PIM_CONTEXT Context,
+        _Out_writes_bytes_(BufferSize) PCHAR Buffer,
+        _In_ ULONG BufferSize,
+        _Out_ PULONG ReturnLen)
 {
-  PCHAR sourceRecord = NULL;
-  PIM_KRECORD kernelRecord;
-  PIM_RECORD record = NULL;
-  ULONG i;
-  PVOID tempBuffer;
+  ULONGLONG alignedMessage[(sizeof(IM_COMMAND_MESSAGE) + sizeof(IM_GET_RECORDS) + sizeof(ULONGLONG) - 1) / sizeof(ULONGLONG)];
+  PIM_COMMAND_MESSAGE command = (PIM_COMMAND_MESSAGE)alignedMessage;
+  PIM_GET_RECORDS get = (PIM_GET_RECORDS)command->Data;
 
-  IF_FALSE_RETURN_RESULT(SourceRecord != NULL, E_INVALIDARG);
-  IF_FALSE_RETURN_RESULT(TargetRecord != NULL, E_INVALIDARG);
-  IF_FALSE_RETURN_RESULT(Pointer != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Context != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Context->Port != INVALID_HANDLE_VALUE, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Buffer != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(ReturnLen != NULL, E_INVALIDARG);
 
-  sourceRecord = *SourceRecord;
+  ZeroMemory(alignedMessage, sizeof(alignedMessage));
 
-  IF_FALSE_RETURN_RESULT(sourceRecord != NULL, E_INVALIDARG);
+  command->Command = GetRecordsCommand;
+  get->Flags = IM_RECORDS_BATCH | IM_RECORDS_REPORT;
 
-  LOG(("[IM] Moving kernel record to user record\n"));
+  return FilterSendMessage(
+      Context->Port,
+      command,
+      sizeof(IM_COMMAND_MESSAGE) + sizeof(IM_GET_RECORDS),
+      Buffer,
+      BufferSize,
+      ReturnLen);
+}
 
-  kernelRecord = (PIM_KRECORD)sourceRecord;
-  record = (PIM_RECORD)malloc(sizeof(IM_RECORD));
+//
+// Sleeps in the driver, the command is followed by IM_WAIT_RECORDS
+//
+_Check_return_
+    HRESULT
+    IMWaitRecords(
+        _In_ PIM_CONTEXT Context)
+{
+  ULONGLONG alignedMessage[(sizeof(IM_COMMAND_MESSAGE) + sizeof(IM_WAIT_RECORDS) + sizeof(ULONGLONG) - 1) / sizeof(ULONGLONG)];
+  PIM_COMMAND_MESSAGE command = (PIM_COMMAND_MESSAGE)alignedMessage;
+  PIM_WAIT_RECORDS wait = (PIM_WAIT_RECORDS)command->Data;
+  ULONG returnLen = 0;
 
-  IF_FALSE_RETURN_RESULT(record != NULL, E_OUTOFMEMORY);
+  IF_FALSE_RETURN_RESULT(Context != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Context->Port != INVALID_HANDLE_VALUE, E_INVALIDARG);
 
-  ZeroMemory(record, sizeof(IM_RECORD));
+  ZeroMemory(alignedMessage, sizeof(alignedMessage));
 
-  if (0xCEFAADDE != kernelRecord->Debug)
-  {
-    LOG_B(("[IM] struct offset is wrong\n"));
-    return E_UNEXPECTED;
-  }
+  command->Command = WaitRecordsCommand;
+  wait->LowWatermark = Context->LowWatermark;
+  wait->Milliseconds = Context->WaitMilliseconds;
 
-  record->Debug = 0xCEFAADDE;
-  record->TotalLength = sizeof(IM_RECORD) + kernelRecord->Data[IM_PROCESS_NAME_INDEX].Size + kernelRecord->Data[IM_FILE_NAME_INDEX].Size;
-  record->SequenceNumber = kernelRecord->SequenceNumber;
-  record->Time = kernelRecord->Time;
-  record->IsBlocked = kernelRecord->IsBlocked;
-  record->IsSucceded = kernelRecord->IsSucceded;
-  record->VideoMode = kernelRecord->VideoModeStatus;
+  return FilterSendMessage(
+      Context->Port,
+      command,
+      sizeof(IM_COMMAND_MESSAGE) + sizeof(IM_WAIT_RECORDS),
+      NULL,
+      0,
+      &returnLen);
+}
 
-  record->ProcessNameLength = kernelRecord->Data[IM_PROCESS_NAME_INDEX].Size / sizeof(WCHAR);
-  record->FileNameLenght = kernelRecord->Data[IM_FILE_NAME_INDEX].Size / sizeof(WCHAR);
+//
+// Overflow policy, the command is followed by IM_OVERFLOW
+//
+_Check_return_
+    HRESULT
+    IMSendOverflow(
+        _In_ PIM_CONTEXT Context,
+        _In_ IM_OVERFLOW_POLICY Policy,
+        _In_ ULONG Milliseconds)
+{
+  ULONGLONG alignedMessage[(sizeof(IM_COMMAND_MESSAGE) + sizeof(IM_OVERFLOW) + sizeof(ULONGLONG) - 1) / sizeof(ULONGLONG)];
+  PIM_COMMAND_MESSAGE command = (PIM_COMMAND_MESSAGE)alignedMessage;
+  PIM_OVERFLOW overflow = (PIM_OVERFLOW)command->Data;
+  ULONG returnLen = 0;
 
-  sourceRecord += sizeof(IM_KRECORD);
-  *Pointer += sizeof(IM_KRECORD);
+  IF_FALSE_RETURN_RESULT(Context != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Context->Port != INVALID_HANDLE_VALUE && Context->Port != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Policy < IMOverflowPolicies, E_INVALIDARG);
 
-  for (i = 0; i < IM_AMOUNT_OF_DATA; i++)
-  {
-    if (kernelRecord->Data[i].Size == 0)
-    {
-      continue;
-    }
+  ZeroMemory(alignedMessage, sizeof(alignedMessage));
 
-    tempBuffer = malloc(kernelRecord->Data[i].Size);
-    RtlCopyMemory(tempBuffer, sourceRecord, kernelRecord->Data[i].Size);
+  command->Command = SetOverflowCommand;
+  overflow->Policy = Policy;
+  overflow->Milliseconds = Milliseconds;
 
-    switch (i)
-    {
-    case IM_PROCESS_NAME_INDEX:
-      record->ProcessName = tempBuffer;
-      break;
-    case IM_FILE_NAME_INDEX:
-      record->FileName = tempBuffer;
-      break;
-    default:
-      LOG_B(("[IM] Unexpected index\n"));
-      free(tempBuffer);
-      break;
-    }
+  return FilterSendMessage(
+      Context->Port,
+      command,
+      sizeof(IM_COMMAND_MESSAGE) + sizeof(IM_OVERFLOW),
+      NULL,
+      0,
+      &returnLen);
+}
 
-    sourceRecord += kernelRecord->Data[i].Size;
-    *Pointer += kernelRecord->Data[i].Size;
-  }
+//
+// Budget of the queued records, the command is followed by
+// IM_RECORDS_BUDGET
+//
+_Check_return_
+    HRESULT
+    IMSendBudget(
+        _In_ PIM_CONTEXT Context,
+        _In_ ULONG Bytes)
+{
+  ULONGLONG alignedMessage[(sizeof(IM_COMMAND_MESSAGE) + sizeof(IM_RECORDS_BUDGET) + sizeof(ULONGLONG) - 1) / sizeof(ULONGLONG)];
+  PIM_COMMAND_MESSAGE command = (PIM_COMMAND_MESSAGE)alignedMessage;
+  PIM_RECORDS_BUDGET budget = (PIM_RECORDS_BUDGET)command->Data;
+  ULONG returnLen = 0;
 
-  *SourceRecord = sourceRecord;
-  *TargetRecord = record;
+  IF_FALSE_RETURN_RESULT(Context != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Context->Port != INVALID_HANDLE_VALUE && Context->Port != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Bytes >= IM_MIN_RECORDS_BUDGET && Bytes <= IM_MAX_RECORDS_BUDGET, E_INVALIDARG);
 
-  LOG(("[IM] Record moved\n"));
+  ZeroMemory(alignedMessage, sizeof(alignedMessage));
 
-  return S_OK;
+  command->Command = SetBudgetCommand;
+  budget->Bytes = Bytes;
+
+  return FilterSendMessage(
+      Context->Port,
+      command,
+      sizeof(IM_COMMAND_MESSAGE) + sizeof(IM_RECORDS_BUDGET),
+      NULL,
+      0,
+      &returnLen);
 }
 
-VOID IMFreeRecord(PIM_RECORD Record)
+_Check_return_
+    HRESULT
+    IMQueryStatistics(
+        _In_ PIM_CONTEXT Context,
+        _Out_ PIM_RECORDS_STATISTICS Statistics)
 {
-  IF_FALSE_RETURN(Record != NULL);
+  IM_COMMAND_MESSAGE command;
+  ULONG returnLen = 0;
 
-  if (Record->FileNameLenght != 0 && Record->FileName != NULL)
-  {
-    free(Record->FileName);
-  }
+  IF_FALSE_RETURN_RESULT(Context != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Context->Port != INVALID_HANDLE_VALUE && Context->Port != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Statistics != NULL, E_INVALIDARG);
 
-  if (Record->ProcessNameLength != 0 && Record->ProcessName != NULL)
-  {
-    free(Record->ProcessName);
-  }
+  ZeroMemory(&command, sizeof(command));
+  ZeroMemory(Statistics, sizeof(IM_RECORDS_STATISTICS));
+
+  command.Command = GetStatisticsCommand;
+
+  return FilterSendMessage(
+      Context->Port,
+      &command,
+      sizeof(IM_COMMAND_MESSAGE),
+      Statistics,
+      sizeof(IM_RECORDS_STATISTICS),
+      &returnLen);
+}
+
+//
+// Coalescing window, the command is followed by IM_COALESCE
+//
+_Check_return_
+    HRESULT
+    IMSendCoalesce(
+        _In_ PIM_CONTEXT Context,
+        _In_ ULONG Milliseconds)
+{
+  ULONGLONG alignedMessage[(sizeof(IM_COMMAND_MESSAGE) + sizeof(IM_COALESCE) + sizeof(ULONGLONG) - 1) / sizeof(ULONGLONG)];
+  PIM_COMMAND_MESSAGE command = (PIM_COMMAND_MESSAGE)alignedMessage;
+  PIM_COALESCE coalesce = (PIM_COALESCE)command->Data;
+  ULONG returnLen = 0;
+
+  IF_FALSE_RETURN_RESULT(Context != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Context->Port != INVALID_HANDLE_VALUE && Context->Port != NULL, E_INVALIDARG);
+  IF_FALSE_RETURN_RESULT(Milliseconds <= IM_MAX_COALESCE_WINDOW, E_INVALIDARG);
 
-  free(Record);
+  ZeroMemory(alignedMessage, sizeof(alignedMessage));
 
-  LOG(("[IM] Record freed\n"));
-}
\ No newline at end of file
+  command->Command = SetCoalesceCommand;
+  coalesce->Milliseconds = Milliseconds;
+
+  return FilterSendMessage(
+      Context->Port,
+      command,
+      sizeof(IM_COMMAND_MESSAGE) + sizeof(IM_COALESCE),
+      NULL,
+      0,
+      &returnLen);
+}
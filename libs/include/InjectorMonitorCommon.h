@@ -19,6 +19,25 @@ User mode
 
 #pragma once
 
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+//
+// bytes the records queued for the client may take: by default, the least
+// and the most SetBudgetCommand and the RecordsBudget value of the
+// Parameters key of the driver accept
+//
+#define IM_DEFAULT_RECORDS_BUDGET (128 * 1024)
+#define IM_MIN_RECORDS_BUDGET (4 * 1024)
+#define IM_MAX_RECORDS_BUDGET (16 * 1024 * 1024)
+
+//
+// longest window of identical records coalesced into one, ms. 0 turns
+// coalescing off, it is off by default.
+//
+#define IM_MAX_COALESCE_WINDOW 10000
+
 //------------------------------------------------------------------------
 //  Structures.
 //------------------------------------------------------------------------
@@ -34,4 +53,32 @@ typedef enum _IM_VIDEO_MODE_STATUS
   IM_VIDEO_HW_TO_SW  // game tried to load in hardware but finally loaded in hardware
 
 } IM_VIDEO_MODE_STATUS,
-    *PIM_VIDEO_MODE_STATUS;
\ No newline at end of file
+    *PIM_VIDEO_MODE_STATUS;
+
+//
+// What is done with a record when the queue of the driver is full.
+// Records dropped by any policy are counted by the lib, see
+// IMGetLostRecords.
+//
+typedef enum _IM_OVERFLOW_POLICY
+{
+  IMOverflowDropNewest = 0, // the new record is dropped
+  IMOverflowDropOldest = 1, // the oldest queued record is dropped for the new one
+  IMOverflowBlock = 2,      // producer waits for room, then drops the new record
+  IMOverflowPolicies
+
+} IM_OVERFLOW_POLICY;
+
+//
+// Why the records were dropped, index of IM_RECORDS_STATISTICS.Dropped
+//
+typedef enum _IM_DROP_REASON
+{
+  IMDropQueueFull = 0,   // queue was full, the new record is dropped
+  IMDropOldest = 1,      // pushed out of the queue by a newer record
+  IMDropWaitTimeout = 2, // queue stayed full while the producer waited
+  IMDropNoMemory = 3,    // record or its name could not be allocated
+  IMDropRingFull = 4,    // shared ring had no room
+  IMDropReasons
+
+} IM_DROP_REASON;
@@ -39,6 +39,23 @@ User mode
 #define IM_API HRESULT
 #endif
 
+//
+// most records and ms of a batch, see IMInitilizeBatch
+//
+#define IM_MAX_BATCH_RECORDS 1024
+#define IM_MAX_BATCH_WAIT 10000
+
+//
+// most workers and records queued to a worker, see IMInitilizePipeline
+//
+#define IM_MAX_PIPELINE_WORKERS 64
+#define IM_MAX_PIPELINE_DEPTH 4096
+
+//
+// most bytes a receive buffer grows to, see IM_PIPELINE_CONFIG
+//
+#define IM_MAX_RECEIVE_BUFFER_LIMIT (16 * 1024 * 1024)
+
 //------------------------------------------------------------------------
 //  Structures.
 //------------------------------------------------------------------------
@@ -60,7 +77,8 @@ typedef struct _IM_RECORD
   ULONG TotalLength;
 
   //
-  // Order number of the record for logging
+  // Order number of the record for logging. Blocked and video mode records
+  // are delivered ahead of the others, a lower number may come after them.
   //
   ULONGLONG SequenceNumber;
 
@@ -104,8 +122,112 @@ typedef struct _IM_RECORD
   //
   IM_VIDEO_MODE_STATUS VideoMode;
 
+  //
+  // identical records the driver coalesced into this one, from Time to
+  // LastTime. 1 and Time if it is one, see IMSetCoalesceWindow
+  //
+  ULONG Count;
+
+  LARGE_INTEGER LastTime;
+
 } IM_RECORD, *PIM_RECORD;
 
+//
+// Record as the lib decoded it, nothing is copied or allocated for it.
+// Name which came with the record points into the buffer the record was
+// received in, the one sent before points to the cache of the names. Names
+// are not aligned and belong to the lib, the view is valid until the
+// callback returns.
+//
+typedef struct _IM_RECORD_VIEW
+{
+  ULONGLONG SequenceNumber;
+
+  LARGE_INTEGER Time;
+
+  BOOLEAN IsBlocked;
+
+  BOOLEAN IsSucceded;
+
+  IM_VIDEO_MODE_STATUS VideoMode;
+
+  //
+  // see IM_RECORD
+  //
+  ULONG Count;
+
+  LARGE_INTEGER LastTime;
+
+  //
+  // bytes of the name with its '\0', zero if there is no name
+  //
+  ULONG ProcessNameSize;
+
+  LPCUWSTR ProcessName;
+
+  ULONG FileNameSize;
+
+  LPCUWSTR FileName;
+
+  //
+  // ids of the names, the same for the name until the id comes with another
+  // one, 0 if there is no name
+  //
+  ULONG ProcessNameId;
+
+  ULONG FileNameId;
+
+} IM_RECORD_VIEW, *PIM_RECORD_VIEW;
+
+typedef const IM_RECORD_VIEW *PCIM_RECORD_VIEW;
+
+//
+// Records which are passed in order they came, by one worker
+//
+typedef enum _IM_PIPELINE_KEY
+{
+  IMPipelineKeyProcess = 0,
+  IMPipelineKeyFile = 1,
+  IMPipelineKeys
+} IM_PIPELINE_KEY,
+    *PIM_PIPELINE_KEY;
+
+//
+// Threads of IMInitilizePipeline
+//
+typedef struct _IM_PIPELINE_CONFIG
+{
+  //
+  // threads which call the callback, 1 to IM_MAX_PIPELINE_WORKERS
+  //
+  ULONG Workers;
+
+  //
+  // records queued to a worker before the reader waits for it, power of 2
+  // up to IM_MAX_PIPELINE_DEPTH
+  //
+  ULONG QueueDepth;
+
+  IM_PIPELINE_KEY Key;
+
+  //
+  // processors of the thread which reads the records and of the workers,
+  // 0 leaves them to the system. Workers take processors of the mask in
+  // turn, one each.
+  //
+  ULONG_PTR ReaderAffinity;
+
+  ULONG_PTR WorkerAffinity;
+
+  //
+  // bytes a buffer of copied records grows up to when the driver has more
+  // of them, 0 is 1 MB. At least two of the longest records, up to
+  // IM_MAX_RECEIVE_BUFFER_LIMIT; a record over it fails the lib.
+  //
+  ULONG ReceiveBufferLimit;
+
+} IM_PIPELINE_CONFIG, *PIM_PIPELINE_CONFIG;
+
 //------------------------------------------------------------------------
 //  Callbacks definitions.
 //------------------------------------------------------------------------
@@ -115,6 +237,18 @@ typedef struct _IM_RECORD
 //
 typedef HRESULT (*IM_RECORD_CALLBACK)(PIM_RECORD Record);
 
+//
+// Same as IM_RECORD_CALLBACK, the record is not copied to pass it
+//
+typedef HRESULT (*IM_RECORD_VIEW_CALLBACK)(PCIM_RECORD_VIEW Record);
+
+//
+// Records taken at once, in order, Count is at least 1
+//
+typedef HRESULT (*IM_RECORD_BATCH_CALLBACK)(
+    _In_reads_(Count) PCIM_RECORD_VIEW Records,
+    _In_ ULONG Count);
+
 //------------------------------------------------------------------------
 //  Function defintions.
 //------------------------------------------------------------------------
@@ -124,6 +258,106 @@ _Check_return_
     IMInitilize(
         _In_ IM_RECORD_CALLBACK Callback);
 
+//
+// IMInitilize with the callback which gets views of the records. Records
+// of IMInitilize are built from the views, the callback of one of them is
+// used until IMDeinitilize.
+//
+_Check_return_
+    IM_API
+    IMInitilizeView(
+        _In_ IM_RECORD_VIEW_CALLBACK Callback);
+
+//
+// IMInitilize with the callback which gets the records in batches of at
+// most MaxRecords, up to IM_MAX_BATCH_RECORDS. Records are held while the
+// driver has more of them, until MaxRecords are taken or the first of them
+// is MaxMilliseconds old, up to IM_MAX_BATCH_WAIT. The driver is asked to
+// wake the lib when MaxRecords are queued or in MaxMilliseconds, 0 passes
+// the records of every wakeup right away. Names of the views point to the
+// cache of the names.
+//
+_Check_return_
+    IM_API
+    IMInitilizeBatch(
+        _In_ IM_RECORD_BATCH_CALLBACK Callback,
+        _In_ ULONG MaxRecords,
+        _In_ ULONG MaxMilliseconds);
+
+//
+// IMInitilizeView with the callback called by Config->Workers threads, so
+// a slow callback does not keep the records in the driver. Records of the
+// same Config->Key go to the same worker and are passed in order, records
+// of other keys may be passed at the same time. Names of the views point
+// to the cache of the names.
+//
+_Check_return_
+    IM_API
+    IMInitilizePipeline(
+        _In_ IM_RECORD_VIEW_CALLBACK Callback,
+        _In_ const IM_PIPELINE_CONFIG *Config);
+
+_Check_return_
+    IM_API
+    IMDeinitilize();
+
+//
+// Selects what the driver does with records the lib does not take in
+// time, Milliseconds is the wait of IMOverflowBlock. The driver is back to
+// IMOverflowDropNewest once the lib disconnects.
+//
+_Check_return_
+    IM_API
+    IMSetOverflowPolicy(
+        _In_ IM_OVERFLOW_POLICY Policy,
+        _In_ ULONG Milliseconds);
+
+//
+// Records the driver dropped so far, whatever the reason. They are not
+// passed to the callback.
+//
+_Check_return_
+    IM_API
+    IMGetLostRecords(
+        _Out_ PULONGLONG Lost);
+
+//
+// Bytes the driver keeps for records the lib has not taken yet, from
+// IM_MIN_RECORDS_BUDGET to IM_MAX_RECORDS_BUDGET. Records queued over a
+// smaller budget are kept, the budget stays after the lib disconnects.
+//
+_Check_return_
+    IM_API
+    IMSetRecordsBudget(
+        _In_ ULONG Bytes);
+
+//
+// Bytes the queued records take now and the most they took since the
+// driver started
+//
+_Check_return_
+    IM_API
+    IMGetRecordsBytes(
+        _Out_ PULONGLONG Bytes,
+        _Out_ PULONGLONG MaxBytes);
+
+//
+// Loads of the target processes the driver decided by the verdict of an
+// earlier load and the ones it had no verdict for, since the driver started
+//
+_Check_return_
+    IM_API
+    IMGetVerdictCounters(
+        _Out_ PULONGLONG Hits,
+        _Out_ PULONGLONG Misses);
+
+//
+// Records of the same process, file and verdict within Milliseconds of the
+// first one come as one with their Count, up to IM_MAX_COALESCE_WINDOW. The
+// first one comes right away, the rest once the window closes. 0 turns it
+// off, it is off after the lib disconnects.
+//
 _Check_return_
     IM_API
-    IMDeinitilize();
\ No newline at end of file
+    IMSetCoalesceWindow(
+        _In_ ULONG Milliseconds);
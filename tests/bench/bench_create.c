@@ -0,0 +1,237 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+bench_create.c
+
+Abstract:
+ns/op of the IRP_MJ_CREATE path of im_core on host
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_bench.h"
+#include "im_fake.h"
+#include "im_req.h"
+#include "im_rec.h"
+#include "im_shim.h"
+#include "im_vcache.h"
+#include "im_proc.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_BENCH_ITERATIONS 200000
+#define IM_BENCH_RECORDS_BUFFER_SIZE 4096
+#define IM_BENCH_RECORDS_PER_DRAIN 64
+
+//------------------------------------------------------------------------
+//  Benchmarks.
+//------------------------------------------------------------------------
+
+static VOID BenchSplitNameInformation(
+    _In_ ULONG Iterations)
+{
+  UNICODE_STRING fullName = CONSTANT_STRING(IM_FAKE_GAME_DIR L"valve\\client.dll");
+  PIM_NAME_INFORMATION nameInfo = NULL;
+  LONGLONG allocations = IMShimGetPoolAllocations();
+  ULONGLONG start = 0;
+  ULONG i = 0;
+
+  start = IMBenchNow();
+
+  for (; i < Iterations; i++)
+  {
+    if (NT_SUCCESS(IMSplitNameInformation(&fullName, &nameInfo)))
+    {
+      IMReleaseNameInformation(nameInfo);
+    }
+  }
+
+  IMBenchReport("IMSplitNameInformation + release", Iterations, IMBenchNow() - start);
+  printf("%-48s %10.1f allocations/op\n", "", (double)(IMShimGetPoolAllocations() - allocations) / (Iterations ? Iterations : 1));
+}
+
+static VOID BenchGetProcessNameInformation(
+    _In_ ULONG Iterations)
+{
+  PIM_NAME_INFORMATION nameInfo = NULL;
+  LONGLONG allocations = IMShimGetPoolAllocations();
+  ULONGLONG start = 0;
+  ULONG i = 0;
+
+  start = IMBenchNow();
+
+  // what every process creation in the system costs
+  for (; i < Iterations; i++)
+  {
+    if (NT_SUCCESS(IMGetProcessNameInformation(IM_FAKE_HL_PID, &nameInfo)))
+    {
+      IMReleaseNameInformation(nameInfo);
+    }
+  }
+
+  IMBenchReport("IMGetProcessNameInformation + release", Iterations, IMBenchNow() - start);
+  printf("%-48s %10.1f allocations/op\n", "", (double)(IMShimGetPoolAllocations() - allocations) / (Iterations ? Iterations : 1));
+}
+
+static VOID BenchDecideBlock(
+    _In_ ULONG Iterations)
+{
+  UNICODE_STRING processName = CONSTANT_STRING(IM_FAKE_HL_IMAGE);
+  UNICODE_STRING fullName = CONSTANT_STRING(IM_FAKE_VOLUME L"\\Games\\Steam\\steamclient.dll");
+  PIM_NAME_INFORMATION processNameInfo = NULL;
+  PIM_NAME_INFORMATION nameInfo = NULL;
+  PIM_TRIE policy = NULL;
+  BOOLEAN isBlocked = FALSE;
+  ULONGLONG start = 0;
+  ULONG i = 0;
+
+  IF_FALSE_RETURN(NT_SUCCESS(IMSplitNameInformation(&processName, &processNameInfo)));
+  IF_FALSE_RETURN(NT_SUCCESS(IMCreatePolicy(processNameInfo, &policy)));
+  IF_FALSE_RETURN(NT_SUCCESS(IMSplitNameInformation(&fullName, &nameInfo)));
+
+  start = IMBenchNow();
+
+  for (; i < Iterations; i++)
+  {
+    (VOID) IMDecideBlock(policy, nameInfo, &isBlocked);
+  }
+
+  IMBenchReport("IMDecideBlock (steam folder)", Iterations, IMBenchNow() - start);
+
+  IMReleaseNameInformation(nameInfo);
+  IMReleaseNameInformation(processNameInfo);
+  IMTrieFree(policy);
+}
+
+//
+// records alone: created, queued and drained in batches like the library does
+//
+static VOID BenchRecords(
+    _In_ ULONG Iterations)
+{
+  UNICODE_STRING fullName = CONSTANT_STRING(IM_FAKE_GAME_DIR L"valve\\client.dll");
+  static PVOID alignedBuffer[IM_BENCH_RECORDS_PER_DRAIN * IM_BENCH_RECORDS_BUFFER_SIZE / sizeof(PVOID)];
+  PIM_NAME_ENTRY processName = IMFindTargetProcess(IM_FAKE_HL_PID)->InternedName;
+  PIM_NAME_INFORMATION nameInfo = NULL;
+  PIM_KRECORD_LIST recordList = NULL;
+  IM_FAKE_CREATE create;
+  LONGLONG allocations = 0;
+  ULONGLONG start = 0;
+  ULONGLONG bytes = 0;
+  ULONG returnLen = 0;
+  ULONG i = 0;
+
+  IF_FALSE_RETURN(NT_SUCCESS(IMSplitNameInformation(&fullName, &nameInfo)));
+
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+  allocations = IMShimGetPoolAllocations();
+  start = IMBenchNow();
+
+  for (; i < Iterations; i++)
+  {
+    if (NT_SUCCESS(IMCreateRecord(&recordList, &create.Data, nameInfo, processName, IM_NOT_APPLICABLE, FALSE)))
+    {
+      IMPushRecord(recordList);
+    }
+
+    if (0 == (i + 1) % IM_BENCH_RECORDS_PER_DRAIN &&
+        NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, 0, alignedBuffer, sizeof(alignedBuffer), &returnLen)))
+    {
+      bytes += returnLen;
+    }
+  }
+
+  if (NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, 0, alignedBuffer, sizeof(alignedBuffer), &returnLen)))
+  {
+    bytes += returnLen;
+  }
+
+  IMBenchReport("record create + push + drain", Iterations, IMBenchNow() - start);
+  printf("%-48s %10.1f allocations/op\n", "", (double)(IMShimGetPoolAllocations() - allocations) / (Iterations ? Iterations : 1));
+  printf("%-48s %10.1f bytes to the client/op\n", "", (double)bytes / (Iterations ? Iterations : 1));
+
+  IMReleaseNameInformation(nameInfo);
+}
+
+static VOID BenchCreate(
+    _In_ const char *Name,
+    _In_ HANDLE ProcessId,
+    _In_ PCWSTR FileName,
+    _In_ BOOLEAN IsCached,
+    _In_ ULONG Iterations)
+{
+  IM_FAKE_CREATE create;
+  PVOID alignedBuffer[IM_BENCH_RECORDS_BUFFER_SIZE / sizeof(PVOID)];
+  LONGLONG allocations = 0;
+  ULONG returnLen = 0;
+  ULONGLONG start = 0;
+  ULONG i = 0;
+
+  IMShimSetCurrentProcessId(ProcessId);
+
+  allocations = IMShimGetPoolAllocations();
+  start = IMBenchNow();
+
+  for (; i < Iterations; i++)
+  {
+    if (!IsCached)
+    {
+      IMInvalidateVerdicts();
+    }
+
+    IMFakeInitCreate(&create, FileName, FILE_EXECUTE);
+    (VOID) IMFakeRunCreate(&create);
+
+    // the queue is bounded, drain it like the library would
+    (VOID) IMGetRecords(&Globals.RecordsHead, 0, alignedBuffer, sizeof(alignedBuffer), &returnLen);
+  }
+
+  IMBenchReport(Name, Iterations, IMBenchNow() - start);
+
+  // the record and the split name, a hit of the verdict cache does not split
+  printf("%-48s %10.1f allocations/op\n", "", (double)(IMShimGetPoolAllocations() - allocations) / (Iterations ? Iterations : 1));
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+  DRIVER_OBJECT driverObject;
+  ULONG iterations = IMBenchIterations(argc, argv, IM_BENCH_ITERATIONS);
+
+  if (!NT_SUCCESS(IMFakeStartDriver(&driverObject)))
+  {
+    printf("driver start failed\n");
+    return 1;
+  }
+
+  BenchSplitNameInformation(iterations);
+  BenchGetProcessNameInformation(iterations);
+  BenchDecideBlock(iterations);
+  BenchRecords(iterations);
+  BenchCreate("create, not a target process", IM_FAKE_OTHER_PID, IM_FAKE_GAME_DIR L"valve\\client.dll", TRUE, iterations);
+  BenchCreate("create + drain, allowed dll, uncached", IM_FAKE_HL_PID, IM_FAKE_GAME_DIR L"valve\\client.dll", FALSE, iterations);
+  BenchCreate("create + drain, blocked dll, uncached", IM_FAKE_HL_PID, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FALSE, iterations);
+  BenchCreate("create + drain, allowed dll", IM_FAKE_HL_PID, IM_FAKE_GAME_DIR L"valve\\client.dll", TRUE, iterations);
+  BenchCreate("create + drain, blocked dll", IM_FAKE_HL_PID, IM_FAKE_VOLUME L"\\Temp\\inject.dll", TRUE, iterations);
+
+  IMFakeStopDriver();
+
+  return 0;
+}
@@ -0,0 +1,162 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+bench_delivery.c
+
+Abstract:
+Latency from the push of a record to the consumer which has it, records
+come one by one at random moments. Consumer which polls every 200 ms, what
+IMRetrieveRecords did, against the one which sleeps in IMWaitForElements.
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <unistd.h>
+
+#include "im_bench.h"
+#include "im_list.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_BENCH_ITERATIONS 30
+#define IM_BENCH_MAX_GAP_MS 50
+#define IM_BENCH_POLL_MS 200
+#define IM_BENCH_WAIT_MS 1000
+
+typedef struct _IM_BENCH_ELEMENT
+{
+  LIST_ENTRY List;
+  ULONGLONG Pushed;
+} IM_BENCH_ELEMENT, *PIM_BENCH_ELEMENT;
+
+typedef struct _IM_BENCH_PRODUCER
+{
+  PIM_KLIST_HEAD ListHead;
+  ULONG Count;
+} IM_BENCH_PRODUCER, *PIM_BENCH_PRODUCER;
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static IM_BENCH_ELEMENT Elements[IM_BENCH_ITERATIONS];
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static VOID FreeNothing(
+    _In_ PLIST_ENTRY ListEntry)
+{
+  UNREFERENCED_PARAMETER(ListEntry);
+}
+
+static void *Produce(
+    void *Context)
+{
+  PIM_BENCH_PRODUCER producer = (PIM_BENCH_PRODUCER)Context;
+  ULONG i = 0;
+
+  for (; i < producer->Count; i++)
+  {
+    // same pseudo random gaps for both consumers
+    usleep((i * 37 % IM_BENCH_MAX_GAP_MS) * 1000);
+
+    Elements[i].Pushed = IMBenchNow();
+    IMPush(&Elements[i].List, producer->ListHead, 0, NULL);
+  }
+
+  return NULL;
+}
+
+//------------------------------------------------------------------------
+//  Benchmarks.
+//------------------------------------------------------------------------
+
+static VOID BenchDelivery(
+    _In_ BOOLEAN IsWaiting,
+    _In_ ULONG Iterations)
+{
+  IM_KLIST_HEAD listHead;
+  IM_BENCH_PRODUCER producer;
+  pthread_t thread;
+  PLIST_ENTRY entry = NULL;
+  ULONGLONG latency = 0;
+  ULONGLONG worst = 0;
+  ULONGLONG now = 0;
+  ULONG popped = 0;
+  char title[64];
+
+  RtlZeroMemory(&listHead, sizeof(listHead));
+
+  if (!NT_SUCCESS(IMInitList(&listHead, sizeof(ULONGLONG), IM_BENCH_ITERATIONS, FreeNothing)))
+  {
+    printf("list init failed\n");
+    return;
+  }
+
+  producer.ListHead = &listHead;
+  producer.Count = Iterations;
+  pthread_create(&thread, NULL, Produce, &producer);
+
+  while (popped < Iterations)
+  {
+    ExAcquireFastMutex(&listHead.ConsumerLock);
+    IMPop(&listHead, &entry);
+    ExReleaseFastMutex(&listHead.ConsumerLock);
+
+    if (NULL != entry)
+    {
+      now = IMBenchNow();
+      latency += now - CONTAINING_RECORD(entry, IM_BENCH_ELEMENT, List)->Pushed;
+      worst = max(worst, now - CONTAINING_RECORD(entry, IM_BENCH_ELEMENT, List)->Pushed);
+      popped++;
+      continue;
+    }
+
+    if (IsWaiting)
+    {
+      (VOID) IMWaitForElements(&listHead, 1, IM_BENCH_WAIT_MS);
+    }
+    else
+    {
+      usleep(IM_BENCH_POLL_MS * 1000);
+    }
+  }
+
+  pthread_join(thread, NULL);
+
+  snprintf(title, sizeof(title), "latency, %s", IsWaiting ? "wait for elements" : "poll every 200 ms");
+  IMBenchReport(title, popped, latency);
+  printf("%-48s %10.1f ms worst\n", "", (double)worst / 1000000);
+
+  IMDeinitList(&listHead);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+  ULONG iterations = IMBenchIterations(argc, argv, IM_BENCH_ITERATIONS);
+
+  BenchDelivery(FALSE, iterations);
+  BenchDelivery(TRUE, iterations);
+
+  return 0;
+}
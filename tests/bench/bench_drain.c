@@ -0,0 +1,265 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+bench_drain.c
+
+Abstract:
+Records drained by the client while 1 to 8 producer threads load files,
+each on a processor of its own, into a short queue whose producers wait
+for room. IMGetRecords, which takes the records which fit off the lanes
+under ConsumerLock and writes and frees them after it, against the drain
+it replaced, which wrote and freed every record under the lock. Reports
+ns per drained record and what a load cost.
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_bench.h"
+#include "im_fake.h"
+#include "im_list.h"
+#include "im_rec.h"
+#include "im_shim.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_BENCH_ITERATIONS 40000
+#define IM_BENCH_MAX_PRODUCERS 8
+#define IM_BENCH_BUFFER_SIZE (64 * 1024)
+
+typedef ULONG (*IM_BENCH_DRAIN)(
+    _Out_writes_bytes_(Size) PUCHAR Buffer,
+    _In_ ULONG Size);
+
+typedef struct _IM_BENCH_PRODUCER
+{
+  ULONG Processor;
+  ULONG Count;
+  ULONGLONG Elapsed;
+  __volatile LONG IsDone;
+} IM_BENCH_PRODUCER, *PIM_BENCH_PRODUCER;
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static ULONGLONG RecordsBuffer[IM_BENCH_BUFFER_SIZE / sizeof(ULONGLONG)];
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static ULONG Drain(
+    _Out_writes_bytes_(Size) PUCHAR Buffer,
+    _In_ ULONG Size)
+{
+  ULONG returnLen = 0;
+
+  if (!NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, 0, Buffer, Size, &returnLen)))
+  {
+    return 0;
+  }
+
+  return returnLen;
+}
+
+//
+// what IMGetRecords did: every record is written and freed under the lock,
+// gap markers are left out
+//
+static ULONG LockedDrain(
+    _Out_writes_bytes_(Size) PUCHAR Buffer,
+    _In_ ULONG Size)
+{
+  PLIST_ENTRY entry = NULL;
+  PIM_KRECORD_LIST recordList = NULL;
+  BOOLEAN isSending[IM_AMOUNT_OF_DATA];
+  BOOLEAN isFit = FALSE;
+  ULONG copied = 0;
+  ULONG length = 0;
+  KIRQL oldIrql;
+
+  ExAcquireFastMutex(&Globals.RecordsHead.ConsumerLock);
+
+  while (NULL != (entry = IMPeek(&Globals.RecordsHead)))
+  {
+    recordList = CONTAINING_RECORD(entry, IM_KRECORD_LIST, List);
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    length = IMBeginRecordNames(recordList, isSending);
+    isFit = Size >= copied + length;
+    IMEndRecordNames(recordList, isSending, isFit);
+    KeLowerIrql(oldIrql);
+
+    if (!isFit)
+    {
+      break;
+    }
+
+    IMWriteRecord(recordList, isSending, Buffer + copied, length);
+    copied += length;
+
+    IMPop(&Globals.RecordsHead, &entry);
+    IMFreeRecord(recordList);
+  }
+
+  ExReleaseFastMutex(&Globals.RecordsHead.ConsumerLock);
+
+  IMSignalRoom(&Globals.RecordsHead);
+
+  return copied;
+}
+
+//
+// Records of the buffer, gap markers are not counted
+//
+static ULONG CountRecords(
+    _In_reads_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length)
+{
+  IM_WIRE_RECORD record;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA];
+  ULONG offset = 0;
+  ULONG count = 0;
+
+  for (; offset < Length && IMWireDecodeRecord(Buffer + offset, Length - offset, &record, strings); offset += record.Length)
+  {
+    count += 0 == (record.Flags & IM_WIRE_GAP);
+  }
+
+  return count;
+}
+
+static void *Produce(
+    void *Context)
+{
+  PIM_BENCH_PRODUCER producer = (PIM_BENCH_PRODUCER)Context;
+  IM_FAKE_CREATE create;
+  ULONGLONG start = 0;
+  ULONG i = 0;
+
+  IMShimSetCurrentProcessor(producer->Processor);
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  start = IMBenchNow();
+
+  for (; i < producer->Count; i++)
+  {
+    IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+    (VOID) IMFakeRunCreate(&create);
+  }
+
+  producer->Elapsed = IMBenchNow() - start;
+
+  WriteRelease(&producer->IsDone, TRUE);
+
+  return NULL;
+}
+
+//------------------------------------------------------------------------
+//  Benchmarks.
+//------------------------------------------------------------------------
+
+static VOID BenchDrain(
+    _In_ const char *Name,
+    _In_ IM_BENCH_DRAIN DrainRecords,
+    _In_ ULONG Producers,
+    _In_ ULONG Iterations)
+{
+  DRIVER_OBJECT driverObject;
+  IM_OVERFLOW policy;
+  IM_BENCH_PRODUCER producers[IM_BENCH_MAX_PRODUCERS];
+  pthread_t threads[IM_BENCH_MAX_PRODUCERS];
+  ULONGLONG start = 0;
+  ULONGLONG elapsed = 0;
+  ULONGLONG loads = 0;
+  ULONG records = 0;
+  ULONG length = 0;
+  ULONG done = 0;
+  ULONG i = 0;
+  char title[64];
+
+  IMShimSetProcessorCount(Producers);
+
+  if (!NT_SUCCESS(IMFakeStartDriver(&driverObject)))
+  {
+    printf("driver start failed\n");
+    return;
+  }
+
+  // short queue, producers wait for the drain to make room
+  policy.Policy = IMOverflowBlock;
+  policy.Milliseconds = IM_OVERFLOW_MAX_WAIT;
+  (VOID) IMSetOverflow(&policy);
+  (VOID) IMSetRecordsBudget(IM_MIN_RECORDS_BUDGET);
+
+  start = IMBenchNow();
+
+  for (i = 0; i < Producers; i++)
+  {
+    producers[i].Processor = i;
+    producers[i].Count = Iterations / Producers;
+    producers[i].Elapsed = 0;
+    producers[i].IsDone = FALSE;
+    pthread_create(&threads[i], NULL, Produce, &producers[i]);
+  }
+
+  // the drain after the last load finds nothing
+  while (done < Producers || 0 != length)
+  {
+    for (done = 0, i = 0; i < Producers; i++)
+    {
+      done += 0 != ReadAcquire(&producers[i].IsDone);
+    }
+
+    length = DrainRecords((PUCHAR)RecordsBuffer, sizeof(RecordsBuffer));
+    records += CountRecords((PUCHAR)RecordsBuffer, length);
+  }
+
+  elapsed = IMBenchNow() - start;
+
+  for (i = 0; i < Producers; i++)
+  {
+    pthread_join(threads[i], NULL);
+    loads += producers[i].Elapsed;
+  }
+
+  snprintf(title, sizeof(title), "%s, %u producers", Name, Producers);
+  IMBenchReport(title, records, elapsed);
+  printf("%-48s %10.1f ns/load\n", "", (double)loads / (Iterations / Producers * Producers));
+
+  IMFakeStopDriver();
+
+  IMShimSetProcessorCount(1);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+  ULONG iterations = IMBenchIterations(argc, argv, IM_BENCH_ITERATIONS);
+  ULONG producers = 1;
+
+  for (; producers <= IM_BENCH_MAX_PRODUCERS; producers *= 2)
+  {
+    BenchDrain("drain, written under the lock", LockedDrain, producers, iterations);
+    BenchDrain("drain, written after the lock", Drain, producers, iterations);
+  }
+
+  return 0;
+}
@@ -0,0 +1,151 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+bench_fold.c
+
+Abstract:
+ns/op of the scalar, SSE2 and AVX2 case insensitive routines on paths
+from 16 to 520 symbols
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_bench.h"
+#include "im_fold.h"
+#include "im_utils.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_BENCH_ITERATIONS 1000000
+#define IM_BENCH_MAX_COUNT 520
+
+#define IM_BENCH_PATH L"\\Device\\HarddiskVolume3\\Games\\Steam\\steamapps\\common\\Half-Life\\valve\\"
+#define IM_BENCH_NAME L"client.dll"
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static WCHAR Path[IM_BENCH_MAX_COUNT];
+static WCHAR UpperPath[IM_BENCH_MAX_COUNT];
+
+static volatile LONG Sink;
+
+static const char *LevelNames[] = {"scalar", "sse2", "avx2"};
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+//
+// directories repeated up to the length, file name at the end
+//
+static VOID InitPaths(
+    _In_ ULONG Count)
+{
+  UNICODE_STRING dir = CONSTANT_STRING(IM_BENCH_PATH);
+  UNICODE_STRING name = CONSTANT_STRING(IM_BENCH_NAME);
+  ULONG nameCount = name.Length / sizeof(WCHAR);
+  ULONG i = 0;
+
+  for (; i < Count - nameCount; i++)
+  {
+    Path[i] = dir.Buffer[i % (dir.Length / sizeof(WCHAR))];
+  }
+
+  RtlCopyMemory(Path + i, name.Buffer, name.Length);
+
+  for (i = 0; i < Count; i++)
+  {
+    UpperPath[i] = (Path[i] >= L'a' && Path[i] <= L'z') ? Path[i] - (L'a' - L'A') : Path[i];
+  }
+}
+
+//------------------------------------------------------------------------
+//  Benchmarks.
+//------------------------------------------------------------------------
+
+static VOID BenchLevel(
+    _In_ IM_FOLD_LEVEL Level,
+    _In_ ULONG Count,
+    _In_ ULONG Iterations)
+{
+  UNICODE_STRING path;
+  UNICODE_STRING upperPath;
+  UNICODE_STRING name = CONSTANT_STRING(IM_BENCH_NAME);
+  ULONGLONG start = 0;
+  char title[64];
+  ULONG i = 0;
+
+  path.Buffer = Path;
+  path.Length = path.MaximumLength = (USHORT)(Count * sizeof(WCHAR));
+  upperPath.Buffer = UpperPath;
+  upperPath.Length = upperPath.MaximumLength = path.Length;
+
+  start = IMBenchNow();
+  for (i = 0; i < Iterations; i++)
+  {
+    Sink += IMIsEqualString(&path, &upperPath);
+  }
+  snprintf(title, sizeof(title), "%s, equal, %u symbols", LevelNames[Level], Count);
+  IMBenchReport(title, Iterations, IMBenchNow() - start);
+
+  // the whole path is its own prefix
+  start = IMBenchNow();
+  for (i = 0; i < Iterations; i++)
+  {
+    Sink += IMIsStartWithString(&path, &upperPath);
+  }
+  snprintf(title, sizeof(title), "%s, prefix, %u symbols", LevelNames[Level], Count);
+  IMBenchReport(title, Iterations, IMBenchNow() - start);
+
+  // the name is at the end of the path
+  start = IMBenchNow();
+  for (i = 0; i < Iterations; i++)
+  {
+    Sink += IMIsContainsString(&path, &name);
+  }
+  snprintf(title, sizeof(title), "%s, contains, %u symbols", LevelNames[Level], Count);
+  IMBenchReport(title, Iterations, IMBenchNow() - start);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+  static const ULONG counts[] = {16, 32, 64, 128, 260, 520};
+  ULONG iterations = IMBenchIterations(argc, argv, IM_BENCH_ITERATIONS);
+  IM_FOLD_LEVEL level = IM_FOLD_SCALAR;
+  ULONG i = 0;
+
+  for (; i < ARRAYSIZE(counts); i++)
+  {
+    InitPaths(counts[i]);
+
+    for (level = IM_FOLD_SCALAR; level <= IM_FOLD_AVX2; level++)
+    {
+      if (IMSelectFoldRoutines(level) == level)
+      {
+        BenchLevel(level, counts[i], iterations);
+      }
+    }
+  }
+
+  return 0;
+}
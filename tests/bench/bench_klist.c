@@ -0,0 +1,259 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+bench_klist.c
+
+Abstract:
+ns per element moved from 1 to 64 producer threads to one consumer: lanes
+of im_list.c, one per processor and merged in order by the consumer,
+against all producers on one lane and the spin lock protected list the
+lanes replaced. Every producer thread plays a processor of its own.
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <sched.h>
+
+#include "im_bench.h"
+#include "im_list.h"
+#include "im_shim.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_BENCH_ITERATIONS 400000
+#define IM_BENCH_MAX_PRODUCERS 64
+
+// ring never fills up, like the list: contention is measured, not back pressure
+#define IM_BENCH_MAX_ELEMENTS IM_BENCH_ITERATIONS
+
+//
+// what IM_KLIST_HEAD was: list, spin lock and event
+//
+typedef struct _IM_BENCH_LOCKED_LIST
+{
+  LIST_ENTRY ElementList;
+  KSPIN_LOCK ElementListLock;
+  KEVENT NewElementEvent;
+} IM_BENCH_LOCKED_LIST, *PIM_BENCH_LOCKED_LIST;
+
+typedef struct _IM_BENCH_PRODUCER
+{
+  PVOID Queue;
+  BOOLEAN IsRing;
+  PLIST_ENTRY Elements;
+  ULONG Count;
+  ULONG Processor;
+} IM_BENCH_PRODUCER, *PIM_BENCH_PRODUCER;
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static LIST_ENTRY Elements[IM_BENCH_ITERATIONS];
+
+static __volatile LONG Go;
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static VOID FreeNothing(
+    _In_ PLIST_ENTRY ListEntry)
+{
+  UNREFERENCED_PARAMETER(ListEntry);
+}
+
+//
+// what IMPushToList did for every record
+//
+static VOID LockedPush(
+    _In_ PIM_BENCH_LOCKED_LIST List,
+    _In_ PLIST_ENTRY ListEntry)
+{
+  KIRQL oldIrql;
+
+  KeAcquireSpinLock(&List->ElementListLock, &oldIrql);
+  InsertTailList(&List->ElementList, ListEntry);
+  KeSetEvent(&List->NewElementEvent, IO_NO_INCREMENT, FALSE);
+  KeReleaseSpinLock(&List->ElementListLock, oldIrql);
+}
+
+//
+// what IMGetRecords did for every record
+//
+static PLIST_ENTRY LockedPop(
+    _In_ PIM_BENCH_LOCKED_LIST List)
+{
+  PLIST_ENTRY entry = NULL;
+  KIRQL oldIrql;
+
+  KeAcquireSpinLock(&List->ElementListLock, &oldIrql);
+  if (!IsListEmpty(&List->ElementList))
+  {
+    entry = RemoveHeadList(&List->ElementList);
+  }
+  KeReleaseSpinLock(&List->ElementListLock, oldIrql);
+
+  return entry;
+}
+
+static void *Produce(
+    void *Context)
+{
+  PIM_BENCH_PRODUCER producer = (PIM_BENCH_PRODUCER)Context;
+  ULONG i = 0;
+
+  IMShimSetCurrentProcessor(producer->Processor);
+
+  while (!ReadAcquire(&Go))
+  {
+    sched_yield();
+  }
+
+  for (; i < producer->Count; i++)
+  {
+    if (!producer->IsRing)
+    {
+      LockedPush((PIM_BENCH_LOCKED_LIST)producer->Queue, &producer->Elements[i]);
+      continue;
+    }
+
+    while (!IMTryPush((PIM_KLIST_HEAD)producer->Queue, &producer->Elements[i], 0, NULL))
+    {
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+//------------------------------------------------------------------------
+//  Benchmarks.
+//------------------------------------------------------------------------
+
+static VOID BenchProducers(
+    _In_ const char *Name,
+    _In_ PVOID Queue,
+    _In_ BOOLEAN IsRing,
+    _In_ ULONG Producers,
+    _In_ ULONG Iterations)
+{
+  IM_BENCH_PRODUCER producers[IM_BENCH_MAX_PRODUCERS];
+  pthread_t threads[IM_BENCH_MAX_PRODUCERS];
+  PIM_KLIST_HEAD ring = (PIM_KLIST_HEAD)Queue;
+  PLIST_ENTRY entry = NULL;
+  ULONG perProducer = max(Iterations / Producers, 1);
+  ULONG total = perProducer * Producers;
+  ULONG popped = 0;
+  ULONGLONG start = 0;
+  char title[64];
+  ULONG i = 0;
+
+  Go = FALSE;
+
+  for (i = 0; i < Producers; i++)
+  {
+    producers[i].Queue = Queue;
+    producers[i].IsRing = IsRing;
+    producers[i].Elements = &Elements[i * perProducer];
+    producers[i].Count = perProducer;
+    producers[i].Processor = i;
+    pthread_create(&threads[i], NULL, Produce, &producers[i]);
+  }
+
+  start = IMBenchNow();
+  WriteRelease(&Go, TRUE);
+
+  while (popped < total)
+  {
+    if (IsRing)
+    {
+      ExAcquireFastMutex(&ring->ConsumerLock);
+      IMPop(ring, &entry);
+      ExReleaseFastMutex(&ring->ConsumerLock);
+    }
+    else
+    {
+      entry = LockedPop((PIM_BENCH_LOCKED_LIST)Queue);
+    }
+
+    if (NULL == entry)
+    {
+      sched_yield();
+      continue;
+    }
+
+    popped++;
+  }
+
+  for (i = 0; i < Producers; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  snprintf(title, sizeof(title), "%s, %u producers", Name, Producers);
+  IMBenchReport(title, total, IMBenchNow() - start);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+  static const ULONG producers[] = {1, 2, 4, 8, 16, 32, 64};
+  ULONG iterations = IMBenchIterations(argc, argv, IM_BENCH_ITERATIONS);
+  IM_BENCH_LOCKED_LIST list;
+  IM_KLIST_HEAD shared;
+  IM_KLIST_HEAD lanes;
+  ULONG i = 0;
+
+  RtlZeroMemory(&shared, sizeof(shared));
+
+  InitializeListHead(&list.ElementList);
+  KeInitializeSpinLock(&list.ElementListLock);
+  KeInitializeEvent(&list.NewElementEvent, NotificationEvent, FALSE);
+
+  // one processor, all producers push to the same lane
+  if (!NT_SUCCESS(IMInitList(&shared, sizeof(ULONG), IM_BENCH_MAX_ELEMENTS, FreeNothing)))
+  {
+    printf("list init failed\n");
+    return 1;
+  }
+
+  for (; i < ARRAYSIZE(producers); i++)
+  {
+    BenchProducers("spin lock list", &list, FALSE, producers[i], iterations);
+    BenchProducers("one lane", &shared, TRUE, producers[i], iterations);
+
+    // as many processors as producers, lanes are taken at init
+    RtlZeroMemory(&lanes, sizeof(lanes));
+    IMShimSetProcessorCount(producers[i]);
+
+    if (NT_SUCCESS(IMInitList(&lanes, sizeof(ULONG), IM_BENCH_MAX_ELEMENTS, FreeNothing)))
+    {
+      BenchProducers("lane per processor", &lanes, TRUE, producers[i], iterations);
+      IMDeinitList(&lanes);
+    }
+
+    IMShimSetProcessorCount(1);
+  }
+
+  IMDeinitList(&shared);
+
+  return 0;
+}
@@ -0,0 +1,149 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+bench_match.c
+
+Abstract:
+ns/op of the Aho-Corasick automaton against IMIsContainsString called for
+every restricted pattern, for growing amount of patterns
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_bench.h"
+#include "im_match.h"
+#include "im_utils.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_BENCH_ITERATIONS 20000
+#define IM_BENCH_MAX_PATTERNS 1000
+#define IM_BENCH_PATTERN_SIZE 32
+
+#define IM_BENCH_PREFIX L"injector"
+#define IM_BENCH_SUFFIX L".dll"
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static WCHAR PatternBuffers[IM_BENCH_MAX_PATTERNS][IM_BENCH_PATTERN_SIZE];
+static UNICODE_STRING Patterns[IM_BENCH_MAX_PATTERNS];
+
+static volatile ULONG Sink;
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static VOID InitPatterns()
+{
+  UNICODE_STRING prefix = CONSTANT_STRING(IM_BENCH_PREFIX);
+  UNICODE_STRING suffix = CONSTANT_STRING(IM_BENCH_SUFFIX);
+  ULONG length = prefix.Length / sizeof(WCHAR);
+  ULONG i = 0;
+
+  for (; i < IM_BENCH_MAX_PATTERNS; i++)
+  {
+    RtlCopyMemory(PatternBuffers[i], prefix.Buffer, prefix.Length);
+    PatternBuffers[i][length] = L'0' + (WCHAR)(i / 100);
+    PatternBuffers[i][length + 1] = L'0' + (WCHAR)(i / 10 % 10);
+    PatternBuffers[i][length + 2] = L'0' + (WCHAR)(i % 10);
+    RtlCopyMemory(&PatternBuffers[i][length + 3], suffix.Buffer, suffix.Length);
+
+    Patterns[i].Buffer = PatternBuffers[i];
+    Patterns[i].Length = prefix.Length + 3 * sizeof(WCHAR) + suffix.Length;
+    Patterns[i].MaximumLength = sizeof(PatternBuffers[i]);
+  }
+}
+
+//------------------------------------------------------------------------
+//  Benchmarks.
+//------------------------------------------------------------------------
+
+static VOID BenchContains(
+    _In_ const char *Name,
+    _In_ ULONG PatternCount,
+    _In_ PUNICODE_STRING String,
+    _In_ ULONG Iterations)
+{
+  ULONGLONG start = 0;
+  ULONG i = 0;
+  ULONG j = 0;
+
+  start = IMBenchNow();
+
+  for (; i < Iterations; i++)
+  {
+    for (j = 0; j < PatternCount && !IMIsContainsString(String, &Patterns[j]); j++)
+      ;
+
+    Sink += j;
+  }
+
+  IMBenchReport(Name, Iterations, IMBenchNow() - start);
+}
+
+static VOID BenchMatcher(
+    _In_ const char *Name,
+    _In_ ULONG PatternCount,
+    _In_ PUNICODE_STRING String,
+    _In_ ULONG Iterations)
+{
+  PIM_MATCHER matcher = NULL;
+  ULONGLONG start = 0;
+  ULONG i = 0;
+
+  IF_FALSE_RETURN(NT_SUCCESS(IMMatcherBuild(Patterns, PatternCount, &matcher)));
+
+  start = IMBenchNow();
+
+  for (; i < Iterations; i++)
+  {
+    Sink += IMMatcherSearch(matcher, String, NULL);
+  }
+
+  IMBenchReport(Name, Iterations, IMBenchNow() - start);
+
+  IMMatcherFree(matcher);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+  static const ULONG patternCounts[] = {1, 10, 100, 1000};
+  UNICODE_STRING path = CONSTANT_STRING(L"\\Device\\HarddiskVolume3\\Games\\Steam\\steamapps\\common\\Half-Life\\valve\\cl_dlls\\client.dll");
+  ULONG iterations = IMBenchIterations(argc, argv, IM_BENCH_ITERATIONS);
+  char name[64];
+  ULONG i = 0;
+
+  InitPatterns();
+
+  // a load which is not restricted is the common case, every pattern is checked
+  for (; i < ARRAYSIZE(patternCounts); i++)
+  {
+    snprintf(name, sizeof(name), "IMIsContainsString, %u patterns", patternCounts[i]);
+    BenchContains(name, patternCounts[i], &path, iterations);
+    snprintf(name, sizeof(name), "IMMatcherSearch, %u patterns", patternCounts[i]);
+    BenchMatcher(name, patternCounts[i], &path, iterations);
+  }
+
+  return 0;
+}
@@ -0,0 +1,240 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+bench_overflow.c
+
+Abstract:
+Producer which loads files ten times faster than the client drains their
+records, once per overflow policy. Reports what the loads cost, how many
+records got to the client and how many of them it knows were lost from
+the gap markers, which has to match the drop counters of the driver.
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <unistd.h>
+
+#include "im_bench.h"
+#include "im_fake.h"
+#include "im_list.h"
+#include "im_rec.h"
+#include "im_shim.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_BENCH_ITERATIONS 10000
+#define IM_BENCH_QUEUE 32
+#define IM_BENCH_PERIOD_US 1000
+#define IM_BENCH_DRAIN_RECORDS 4
+#define IM_BENCH_RATE 10
+
+typedef struct _IM_BENCH_OVERFLOW
+{
+  ULONG Iterations;
+  __volatile LONG IsDone;
+
+  // producer side
+  ULONG Opened;
+  ULONGLONG Elapsed;
+  ULONGLONG Worst;
+
+  // client side
+  ULONG Delivered;
+  ULONG Lost;
+} IM_BENCH_OVERFLOW, *PIM_BENCH_OVERFLOW;
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static PVOID RecordsBuffer[IM_BENCH_DRAIN_RECORDS * 256 / sizeof(PVOID)];
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+//
+// one IMGetRecords of the client, buffer for a few records only
+//
+static BOOLEAN Drain(
+    _Inout_ PIM_BENCH_OVERFLOW Overflow)
+{
+  PUCHAR buffer = (PUCHAR)RecordsBuffer;
+  IM_WIRE_RECORD record;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA] = {NULL, NULL};
+  ULONG returnLen = 0;
+  ULONG offset = 0;
+
+  RtlZeroMemory(&record, sizeof(record));
+
+  if (!NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, 0, buffer, IM_BENCH_DRAIN_RECORDS * IM_WIRE_RECORD_SIZE, &returnLen)) || 0 == returnLen)
+  {
+    return FALSE;
+  }
+
+  for (; offset < returnLen && IMWireDecodeRecord(buffer + offset, returnLen - offset, &record, strings); offset += record.Length)
+  {
+    if (record.Flags & IM_WIRE_GAP)
+    {
+      Overflow->Lost += record.Lost;
+      continue;
+    }
+
+    Overflow->Delivered++;
+  }
+
+  return TRUE;
+}
+
+static void *Consume(
+    void *Context)
+{
+  PIM_BENCH_OVERFLOW overflow = (PIM_BENCH_OVERFLOW)Context;
+
+  while (!overflow->IsDone)
+  {
+    (VOID) Drain(overflow);
+    usleep(IM_BENCH_PERIOD_US);
+  }
+
+  return NULL;
+}
+
+//
+// bursts of IM_BENCH_RATE times the records the client takes per period
+//
+static void *Produce(
+    void *Context)
+{
+  PIM_BENCH_OVERFLOW overflow = (PIM_BENCH_OVERFLOW)Context;
+  IM_FAKE_CREATE create;
+  ULONGLONG start = 0;
+  ULONGLONG elapsed = 0;
+  ULONG i = 0;
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  for (; i < overflow->Iterations; i++)
+  {
+    IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+
+    start = IMBenchNow();
+
+    if (STATUS_SUCCESS == IMFakeRunCreate(&create))
+    {
+      overflow->Opened++;
+    }
+
+    elapsed = IMBenchNow() - start;
+    overflow->Elapsed += elapsed;
+    overflow->Worst = max(overflow->Worst, elapsed);
+
+    if (0 == (i + 1) % (IM_BENCH_DRAIN_RECORDS * IM_BENCH_RATE))
+    {
+      usleep(IM_BENCH_PERIOD_US);
+    }
+  }
+
+  return NULL;
+}
+
+//------------------------------------------------------------------------
+//  Benchmarks.
+//------------------------------------------------------------------------
+
+static VOID BenchOverflow(
+    _In_ const char *Name,
+    _In_ IM_OVERFLOW_POLICY Policy,
+    _In_ ULONG Iterations)
+{
+  DRIVER_OBJECT driverObject;
+  IM_OVERFLOW policy;
+  IM_BENCH_OVERFLOW overflow;
+  IM_RECORDS_STATISTICS statistics;
+  pthread_t producer;
+  pthread_t consumer;
+  IM_FAKE_CREATE create;
+  ULONG dropped = 0;
+  ULONG returnLen = 0;
+  ULONG i = 0;
+
+  if (!NT_SUCCESS(IMFakeStartDriver(&driverObject)))
+  {
+    printf("driver start failed\n");
+    return;
+  }
+
+  policy.Policy = Policy;
+  policy.Milliseconds = IM_OVERFLOW_WAIT;
+  (VOID) IMSetOverflow(&policy);
+
+  RtlZeroMemory(&overflow, sizeof(overflow));
+
+  // names go to the client once, from here on every record takes
+  // IM_WIRE_RECORD_SIZE of the buffer
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+  (VOID) IMFakeRunCreate(&create);
+
+  // short queue, so the quick run overflows it as well
+  (VOID) IMSetRecordsBudget(max(IM_BENCH_QUEUE * (ULONG)IMCountBytes(&Globals.RecordsHead), IM_MIN_RECORDS_BUDGET));
+  (VOID) IMGetRecords(&Globals.RecordsHead, 0, RecordsBuffer, sizeof(RecordsBuffer), &returnLen);
+
+  overflow.Iterations = Iterations;
+
+  pthread_create(&consumer, NULL, Consume, &overflow);
+  pthread_create(&producer, NULL, Produce, &overflow);
+
+  pthread_join(producer, NULL);
+  InterlockedExchange(&overflow.IsDone, TRUE);
+  pthread_join(consumer, NULL);
+
+  // what is left, with the gap marker of the last drops
+  while (Drain(&overflow))
+  {
+  }
+
+  IMGetStatistics(&statistics);
+
+  for (; i < IMDropReasons; i++)
+  {
+    dropped += (ULONG)statistics.Dropped[i];
+  }
+
+  IMBenchReport(Name, Iterations, overflow.Elapsed);
+  printf("%-48s %10.1f ms worst load\n", "", (double)overflow.Worst / 1000000);
+  printf("%-48s %10u loads opened\n", "", overflow.Opened);
+  printf("%-48s %10u records delivered\n", "", overflow.Delivered);
+  printf("%-48s %10u records lost, %u dropped%s\n", "", overflow.Lost, dropped, overflow.Lost == dropped ? "" : " MISMATCH");
+
+  IMFakeStopDriver();
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+  ULONG iterations = IMBenchIterations(argc, argv, IM_BENCH_ITERATIONS);
+
+  BenchOverflow("overflow, drop newest", IMOverflowDropNewest, iterations);
+  BenchOverflow("overflow, drop oldest", IMOverflowDropOldest, iterations);
+  BenchOverflow("overflow, block producer briefly", IMOverflowBlock, iterations);
+
+  return 0;
+}
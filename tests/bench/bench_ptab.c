@@ -0,0 +1,144 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+bench_ptab.c
+
+Abstract:
+ns/op of the target process lookup done on every create in the system,
+hash table against the array scan it replaced, with 0 to 1024 running
+target instances
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_bench.h"
+#include "im_ptab.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_BENCH_ITERATIONS 2000000
+#define IM_BENCH_MAX_PROCESSES 1024
+
+#define IM_BENCH_PID(Index) ((HANDLE)(ULONG_PTR)(((Index) + 1) * 4))
+
+// ids of the processes which are not targets
+#define IM_BENCH_OTHER_PID(Index) IM_BENCH_PID(IM_BENCH_MAX_PROCESSES + ((Index) & 0xFFF))
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static IM_PROCESS_INFO Processes[IM_BENCH_MAX_PROCESSES];
+
+static volatile ULONG_PTR Sink;
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+//
+// what IMFindTargetProcess did over Globals.TargetProcessInfo
+//
+static PIM_PROCESS_INFO ScanProcesses(
+    _In_ ULONG Count,
+    _In_ HANDLE ProcessId)
+{
+  ULONG i = 0;
+
+  for (; i < Count; i++)
+  {
+    if (ProcessId == Processes[i].ProcessId)
+    {
+      return &Processes[i];
+    }
+  }
+
+  return NULL;
+}
+
+//------------------------------------------------------------------------
+//  Benchmarks.
+//------------------------------------------------------------------------
+
+static VOID BenchLookup(
+    _In_ ULONG Count,
+    _In_ ULONG Iterations)
+{
+  IM_PROCESS_TABLE table;
+  ULONGLONG start = 0;
+  char title[64];
+  ULONG i = 0;
+
+  IMProcessTableInit(&table);
+
+  for (i = 0; i < Count; i++)
+  {
+    Processes[i].ProcessId = IM_BENCH_PID(i);
+    (VOID) IMProcessTableInsert(&table, &Processes[i]);
+  }
+
+  start = IMBenchNow();
+  for (i = 0; i < Iterations; i++)
+  {
+    Sink += (ULONG_PTR)IMProcessTableLookup(&table, IM_BENCH_OTHER_PID(i));
+  }
+  snprintf(title, sizeof(title), "table, not a target, %u running", Count);
+  IMBenchReport(title, Iterations, IMBenchNow() - start);
+
+  start = IMBenchNow();
+  for (i = 0; i < Iterations; i++)
+  {
+    Sink += (ULONG_PTR)ScanProcesses(Count, IM_BENCH_OTHER_PID(i));
+  }
+  snprintf(title, sizeof(title), "array scan, not a target, %u running", Count);
+  IMBenchReport(title, Iterations, IMBenchNow() - start);
+
+  if (0 == Count)
+  {
+    return;
+  }
+
+  start = IMBenchNow();
+  for (i = 0; i < Iterations; i++)
+  {
+    Sink += (ULONG_PTR)IMProcessTableLookup(&table, IM_BENCH_PID(i % Count));
+  }
+  snprintf(title, sizeof(title), "table, target, %u running", Count);
+  IMBenchReport(title, Iterations, IMBenchNow() - start);
+
+  while (NULL != IMProcessTableRemoveAny(&table))
+  {
+  }
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+  static const ULONG counts[] = {0, 2, 16, 128, 1024};
+  ULONG iterations = IMBenchIterations(argc, argv, IM_BENCH_ITERATIONS);
+  ULONG i = 0;
+
+  for (; i < ARRAYSIZE(counts); i++)
+  {
+    BenchLookup(counts[i], iterations);
+  }
+
+  return 0;
+}
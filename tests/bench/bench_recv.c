@@ -0,0 +1,264 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+bench_recv.c
+
+Abstract:
+Buffers of records from a stand-in of the port which takes a while to
+answer, as the driver waiting in GetRecordsCommand does, parsed by a
+client which takes about as long. Receiving and parsing on one thread is
+compared with the receiver of im_recv.h and 2 and 4 buffers, where the
+next buffer is filled while the previous one is parsed.
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+
+#include "im_bench.h"
+#include "InjectorMonitorKrnl.h"
+#include "im_recv.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_BENCH_ITERATIONS 2000
+
+//
+// how long the port takes to answer and the client to parse a buffer
+//
+#define IM_BENCH_RECEIVE_US 50
+#define IM_BENCH_PARSE_NS 50000
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static UCHAR Records[IM_RECEIVE_BUFFER_SIZE];
+static ULONG RecordsLength;
+
+static ULONG Received;
+static ULONG Buffers;
+
+static IM_RECEIVER Receiver;
+
+static sem_t ReceiverWakeup;
+static sem_t ParserWakeup;
+
+static volatile ULONGLONG Sink;
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static IM_RECEIVE_STATUS Receive(
+    _In_ PVOID Context,
+    _Inout_ PIM_RECEIVE_BUFFER Buffer)
+{
+  UNREFERENCED_PARAMETER(Context);
+
+  if (Received == Buffers)
+  {
+    return IMReceiveClosed;
+  }
+
+  usleep(IM_BENCH_RECEIVE_US);
+
+  Buffer->Length = min(Buffer->Size, RecordsLength);
+  RtlCopyMemory(Buffer->Data, Records, Buffer->Length);
+  Received++;
+
+  return IMReceiveRecords;
+}
+
+static IM_RECEIVE_STATUS Wait(
+    _In_ PVOID Context)
+{
+  UNREFERENCED_PARAMETER(Context);
+
+  return IMReceiveRecords;
+}
+
+static const IM_TRANSPORT Transport = {Receive, Wait, NULL};
+
+//
+// Decodes the records and spends the rest of the time as the callback
+//
+static VOID Parse(
+    _In_reads_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length)
+{
+  const UCHAR *strings[IM_WIRE_NAMES];
+  IM_WIRE_RECORD record;
+  ULONGLONG start = IMBenchNow();
+  ULONG offset = 0;
+
+  while (offset < Length && IMWireDecodeRecord(Buffer + offset, Length - offset, &record, strings))
+  {
+    Sink += record.SequenceNumber;
+    offset += record.Length;
+  }
+
+  while (IMBenchNow() - start < IM_BENCH_PARSE_NS)
+  {
+    Sink++;
+  }
+}
+
+static VOID BuildRecords()
+{
+  const VOID *strings[IM_WIRE_NAMES] = {NULL, NULL};
+  IM_WIRE_RECORD record;
+  ULONG length = 0;
+
+  RtlZeroMemory(&record, sizeof(record));
+  record.Count = 1;
+
+  do
+  {
+    record.SequenceNumber++;
+    length = IMWireEncodeRecord(Records + RecordsLength, sizeof(Records) - RecordsLength, &record, strings);
+    RecordsLength += length;
+  } while (0 != length);
+}
+
+static PVOID ReceiveBuffers(
+    _In_ PVOID Parameter)
+{
+  IM_RECEIVE_STATUS status = IMReceiveRecords;
+  BOOLEAN wake = FALSE;
+
+  UNREFERENCED_PARAMETER(Parameter);
+
+  do
+  {
+    status = IMReceiverFill(&Receiver, &wake);
+
+    if (wake)
+    {
+      sem_post(&ParserWakeup);
+    }
+
+    if (IMReceiveFull == status && IMReceiverPrepareWaitRoom(&Receiver))
+    {
+      sem_wait(&ReceiverWakeup);
+    }
+  } while (IMReceiveClosed != status);
+
+  return NULL;
+}
+
+//
+// Request, parse, request again
+//
+static VOID BenchSync(
+    _In_ ULONG Iterations)
+{
+  ULONGLONG alignedBuffer[IM_RECEIVE_BUFFER_SIZE / sizeof(ULONGLONG)];
+  IM_RECEIVE_BUFFER buffer;
+  ULONGLONG start = 0;
+
+  Received = 0;
+  Buffers = Iterations;
+
+  RtlZeroMemory(&buffer, sizeof(buffer));
+  buffer.Data = (PUCHAR)alignedBuffer;
+  buffer.Size = sizeof(alignedBuffer);
+
+  start = IMBenchNow();
+
+  while (IMReceiveRecords == Receive(NULL, &buffer))
+  {
+    Parse(buffer.Data, buffer.Length);
+  }
+
+  IMBenchReport("one thread, one buffer", Iterations, IMBenchNow() - start);
+}
+
+static VOID BenchReceiver(
+    _In_ const char *Name,
+    _In_ ULONG Iterations,
+    _In_ ULONG Count)
+{
+  PIM_RECEIVE_BUFFER buffer = NULL;
+  pthread_t thread;
+  ULONGLONG start = 0;
+
+  Received = 0;
+  Buffers = Iterations;
+
+  (VOID) IMReceiverInit(&Receiver, &Transport, Count, IM_RECEIVE_BUFFER_SIZE);
+  sem_init(&ReceiverWakeup, 0, 0);
+  sem_init(&ParserWakeup, 0, 0);
+
+  start = IMBenchNow();
+
+  pthread_create(&thread, NULL, ReceiveBuffers, NULL);
+
+  for (;;)
+  {
+    buffer = IMReceiverPeek(&Receiver);
+
+    if (NULL == buffer)
+    {
+      if (IMReceiverPrepareWait(&Receiver))
+      {
+        sem_wait(&ParserWakeup);
+      }
+      continue;
+    }
+
+    if (IMReceiveClosed == buffer->Status)
+    {
+      break;
+    }
+
+    Parse(buffer->Data + buffer->Offset, buffer->Length);
+
+    if (IMReceiverRelease(&Receiver))
+    {
+      sem_post(&ReceiverWakeup);
+    }
+  }
+
+  IMBenchReport(Name, Iterations, IMBenchNow() - start);
+
+  pthread_join(thread, NULL);
+  sem_destroy(&ReceiverWakeup);
+  sem_destroy(&ParserWakeup);
+  IMReceiverDeinit(&Receiver);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+  ULONG iterations = IMBenchIterations(argc, argv, IM_BENCH_ITERATIONS);
+
+  BuildRecords();
+
+  printf("buffer of %u bytes, port answers in %u us, parsed in %u us\n", RecordsLength, IM_BENCH_RECEIVE_US, IM_BENCH_PARSE_NS / 1000);
+
+  BenchSync(iterations);
+  BenchReceiver("receiver thread, 2 buffers", iterations, 2);
+  BenchReceiver("receiver thread, 4 buffers", iterations, 4);
+
+  return 0;
+}
@@ -0,0 +1,162 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+bench_trie.c
+
+Abstract:
+ns/op of the directory root trie against the IMIsStartWithString chain
+it replaces in IMDecideBlock, for growing amount of roots
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_bench.h"
+#include "im_trie.h"
+#include "im_utils.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_BENCH_ITERATIONS 20000
+#define IM_BENCH_MAX_ROOTS 1000
+#define IM_BENCH_ROOT_SIZE 64
+
+#define IM_BENCH_PREFIX L"\\Device\\HarddiskVolume3\\Games\\game"
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static WCHAR RootBuffers[IM_BENCH_MAX_ROOTS][IM_BENCH_ROOT_SIZE];
+static IM_TRIE_RULE Rules[IM_BENCH_MAX_ROOTS];
+
+static volatile ULONG Sink;
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static VOID InitRules()
+{
+  UNICODE_STRING prefix = CONSTANT_STRING(IM_BENCH_PREFIX);
+  ULONG length = prefix.Length / sizeof(WCHAR);
+  ULONG i = 0;
+
+  for (; i < IM_BENCH_MAX_ROOTS; i++)
+  {
+    RtlCopyMemory(RootBuffers[i], prefix.Buffer, prefix.Length);
+    RootBuffers[i][length] = L'0' + (WCHAR)(i / 100);
+    RootBuffers[i][length + 1] = L'0' + (WCHAR)(i / 10 % 10);
+    RootBuffers[i][length + 2] = L'0' + (WCHAR)(i % 10);
+    RootBuffers[i][length + 3] = L'\\';
+
+    Rules[i].Root.Buffer = RootBuffers[i];
+    Rules[i].Root.Length = (USHORT)((length + 4) * sizeof(WCHAR));
+    Rules[i].Root.MaximumLength = sizeof(RootBuffers[i]);
+    Rules[i].Verdict = IM_TRIE_ALLOWED;
+  }
+}
+
+//------------------------------------------------------------------------
+//  Benchmarks.
+//------------------------------------------------------------------------
+
+static VOID BenchChain(
+    _In_ const char *Name,
+    _In_ ULONG RootCount,
+    _In_ PUNICODE_STRING Path,
+    _In_ ULONG Iterations)
+{
+  ULONGLONG start = 0;
+  ULONG i = 0;
+  ULONG j = 0;
+
+  start = IMBenchNow();
+
+  for (; i < Iterations; i++)
+  {
+    for (j = 0; j < RootCount && !IMIsStartWithString(Path, &Rules[j].Root); j++)
+      ;
+
+    Sink += j;
+  }
+
+  IMBenchReport(Name, Iterations, IMBenchNow() - start);
+}
+
+static VOID BenchTrie(
+    _In_ const char *Name,
+    _In_ ULONG RootCount,
+    _In_ PUNICODE_STRING Path,
+    _In_ ULONG Iterations)
+{
+  PIM_TRIE trie = NULL;
+  ULONGLONG start = 0;
+  ULONG i = 0;
+
+  IF_FALSE_RETURN(NT_SUCCESS(IMTrieBuild(Rules, RootCount, &trie)));
+
+  start = IMBenchNow();
+
+  for (; i < Iterations; i++)
+  {
+    Sink += IMTrieLookup(trie, Path);
+  }
+
+  IMBenchReport(Name, Iterations, IMBenchNow() - start);
+
+  IMTrieFree(trie);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+  static const ULONG rootCounts[] = {1, 10, 100, 1000};
+  WCHAR hitBuffer[IM_BENCH_ROOT_SIZE * 2];
+  UNICODE_STRING subDir = CONSTANT_STRING(L"bin\\x64\\");
+  UNICODE_STRING miss = CONSTANT_STRING(L"\\Device\\HarddiskVolume3\\Temp\\Injector\\");
+  UNICODE_STRING hit;
+  ULONG iterations = IMBenchIterations(argc, argv, IM_BENCH_ITERATIONS);
+  char name[64];
+  ULONG i = 0;
+
+  InitRules();
+
+  for (; i < ARRAYSIZE(rootCounts); i++)
+  {
+    // the chain is the slowest when the last root matches
+    hit.Buffer = hitBuffer;
+    hit.MaximumLength = sizeof(hitBuffer);
+    RtlCopyMemory(hitBuffer, Rules[rootCounts[i] - 1].Root.Buffer, Rules[rootCounts[i] - 1].Root.Length);
+    RtlCopyMemory((PCHAR)hitBuffer + Rules[rootCounts[i] - 1].Root.Length, subDir.Buffer, subDir.Length);
+    hit.Length = Rules[rootCounts[i] - 1].Root.Length + subDir.Length;
+
+    snprintf(name, sizeof(name), "chain, %u roots, last root", rootCounts[i]);
+    BenchChain(name, rootCounts[i], &hit, iterations);
+    snprintf(name, sizeof(name), "trie, %u roots, last root", rootCounts[i]);
+    BenchTrie(name, rootCounts[i], &hit, iterations);
+
+    snprintf(name, sizeof(name), "chain, %u roots, no root", rootCounts[i]);
+    BenchChain(name, rootCounts[i], &miss, iterations);
+    snprintf(name, sizeof(name), "trie, %u roots, no root", rootCounts[i]);
+    BenchTrie(name, rootCounts[i], &miss, iterations);
+  }
+
+  return 0;
+}
@@ -0,0 +1,450 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+bench_wire.c
+
+Abstract:
+ns/op and MB/s of encoding and decoding records in the wire format, with
+the strings of both names and with the ids only. Then a corpus of load
+paths as GetRecordsCommand returns it: bytes and buffers per record and
+decode speed of records one by one and of batches.
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_bench.h"
+#include "InjectorMonitorKrnl.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_BENCH_ITERATIONS 2000000
+#define IM_BENCH_RECORDS_PER_BUFFER 64
+
+#define IM_BENCH_CORPUS_RECORDS 16384
+#define IM_BENCH_CORPUS_BUFFER_SIZE 4096 // what imlib asks for
+#define IM_BENCH_CORPUS_NAMES 256
+#define IM_BENCH_CORPUS_NAME_CHARS 128
+
+#define IM_BENCH_PROCESS_NAME L"\\Device\\HarddiskVolume3\\Games\\Steam\\steamapps\\common\\Half-Life\\hl.exe"
+#define IM_BENCH_FILE_NAME L"\\Device\\HarddiskVolume3\\Games\\Steam\\steamapps\\common\\Half-Life\\valve\\cl_dlls\\client.dll"
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static UCHAR Buffer[IM_BENCH_RECORDS_PER_BUFFER * (IM_WIRE_RECORD_SIZE + sizeof(IM_BENCH_PROCESS_NAME) + sizeof(IM_BENCH_FILE_NAME))];
+
+static volatile ULONGLONG Sink;
+
+static const WCHAR *const Directories[] = {
+    L"\\Device\\HarddiskVolume3\\Games\\Steam\\steamapps\\common\\Half-Life\\",
+    L"\\Device\\HarddiskVolume3\\Games\\Steam\\steamapps\\common\\Half-Life\\valve\\cl_dlls\\",
+    L"\\Device\\HarddiskVolume3\\Games\\Steam\\steamapps\\common\\Half-Life\\valve\\dlls\\",
+    L"\\Device\\HarddiskVolume3\\Games\\Steam\\steamapps\\common\\Half-Life\\cstrike\\cl_dlls\\",
+    L"\\Device\\HarddiskVolume3\\Games\\Steam\\",
+    L"\\Device\\HarddiskVolume3\\Games\\Steam\\bin\\",
+    L"\\Device\\HarddiskVolume3\\Windows\\System32\\",
+    L"\\Device\\HarddiskVolume3\\Windows\\SysWOW64\\",
+    L"\\Device\\HarddiskVolume3\\Windows\\WinSxS\\x86_microsoft.windows.common-controls_6595b64144ccf1df_6.0.19041.1110_none_a8625c1886757984\\",
+    L"\\Device\\HarddiskVolume3\\Users\\player\\AppData\\Local\\Temp\\"};
+
+static const WCHAR *const Files[] = {
+    L"client.dll", L"hw.dll", L"sw.dll", L"steam_api.dll", L"d3d9.dll", L"opengl32.dll",
+    L"kernel32.dll", L"user32.dll", L"ws2_32.dll", L"vgui.dll", L"vgui2.dll", L"SDL2.dll",
+    L"filesystem_stdio.dll", L"tier0.dll", L"vstdlib.dll", L"inject.dll", L"comctl32.dll",
+    L"gameoverlayrenderer.dll", L"steamclient.dll", L"crashhandler.dll", L"mss32.dll", L"xinput1_3.dll",
+    L"dbghelp.dll", L"winmm.dll", L"mp.dll"};
+
+static const WCHAR *const Processes[] = {
+    L"\\Device\\HarddiskVolume3\\Games\\Steam\\steamapps\\common\\Half-Life\\hl.exe",
+    L"\\Device\\HarddiskVolume3\\Games\\Steam\\steam.exe",
+    L"\\Device\\HarddiskVolume3\\Games\\Steam\\steamapps\\common\\Half-Life\\hlds.exe"};
+
+//
+// paths of the corpus and the stream of records on them
+//
+static WCHAR Names[IM_BENCH_CORPUS_NAMES][IM_BENCH_CORPUS_NAME_CHARS];
+static ULONG NameSizes[IM_BENCH_CORPUS_NAMES];
+static ULONG NameCount;
+
+static IM_WIRE_RECORD Stream[IM_BENCH_CORPUS_RECORDS];
+static const VOID *StreamStrings[IM_BENCH_CORPUS_RECORDS][IM_WIRE_NAMES];
+
+//
+// buffers of GetRecordsCommand one after another, records and batches
+//
+static UCHAR RecordsOutput[IM_BENCH_CORPUS_RECORDS * IM_BENCH_CORPUS_BUFFER_SIZE / 16];
+static ULONG RecordsLength;
+static ULONG RecordsBuffers;
+static UCHAR BatchesOutput[IM_BENCH_CORPUS_RECORDS * IM_BENCH_CORPUS_BUFFER_SIZE / 16];
+static ULONG BatchesLength;
+static ULONG BatchesBuffers;
+
+static IM_WIRE_BATCH_DECODER Decoder;
+
+//------------------------------------------------------------------------
+//  Benchmarks.
+//------------------------------------------------------------------------
+
+static VOID BenchRecords(
+    _In_ BOOLEAN IsWithNames,
+    _In_ ULONG Iterations)
+{
+  const VOID *strings[IM_WIRE_NAMES] = {IM_BENCH_PROCESS_NAME, IM_BENCH_FILE_NAME};
+  const UCHAR *decodedStrings[IM_WIRE_NAMES] = {NULL, NULL};
+  IM_WIRE_RECORD record;
+  IM_WIRE_RECORD decoded;
+  ULONGLONG bytes = 0;
+  ULONGLONG start = 0;
+  ULONGLONG elapsed = 0;
+  ULONG length = 0;
+  ULONG offset = 0;
+  ULONG i = 0;
+  char title[64];
+
+  RtlZeroMemory(&record, sizeof(record));
+  RtlZeroMemory(&decoded, sizeof(decoded));
+  record.Flags = IM_WIRE_SUCCEEDED;
+  record.VideoMode = IM_NOT_APPLICABLE;
+  record.Names[IM_PROCESS_NAME_INDEX].Id = 1;
+  record.Names[IM_FILE_NAME_INDEX].Id = 2;
+
+  if (IsWithNames)
+  {
+    record.Names[IM_PROCESS_NAME_INDEX].Size = sizeof(IM_BENCH_PROCESS_NAME);
+    record.Names[IM_FILE_NAME_INDEX].Size = sizeof(IM_BENCH_FILE_NAME);
+  }
+
+  // buffer is filled like GetRecordsCommand does, records are packed
+  start = IMBenchNow();
+  for (i = 0; i < Iterations; i++)
+  {
+    record.SequenceNumber = i;
+    record.Time = (LONGLONG)i;
+
+    length = IMWireEncodeRecord(Buffer + offset, sizeof(Buffer) - offset, &record, strings);
+
+    if (0 == length)
+    {
+      offset = 0;
+      length = IMWireEncodeRecord(Buffer, sizeof(Buffer), &record, strings);
+    }
+
+    offset += length;
+    bytes += length;
+  }
+  elapsed = IMBenchNow() - start;
+
+  snprintf(title, sizeof(title), "encode, %s", IsWithNames ? "with names" : "ids only");
+  IMBenchReport(title, Iterations, elapsed);
+  printf("%-48s %10.1f bytes/op %8.1f MB/s\n", "", (double)bytes / (Iterations ? Iterations : 1), elapsed ? bytes * 1000.0 / elapsed : 0);
+
+  // and read back like the lib does
+  bytes = 0;
+  offset = 0;
+  start = IMBenchNow();
+  for (i = 0; i < Iterations; i++)
+  {
+    if (!IMWireDecodeRecord(Buffer + offset, sizeof(Buffer) - offset, &decoded, decodedStrings))
+    {
+      offset = 0;
+      (VOID) IMWireDecodeRecord(Buffer, sizeof(Buffer), &decoded, decodedStrings);
+    }
+
+    Sink += decoded.SequenceNumber + (ULONG_PTR)decodedStrings[IM_FILE_NAME_INDEX];
+
+    offset += decoded.Length;
+    bytes += decoded.Length;
+  }
+  elapsed = IMBenchNow() - start;
+
+  snprintf(title, sizeof(title), "decode, %s", IsWithNames ? "with names" : "ids only");
+  IMBenchReport(title, Iterations, elapsed);
+  printf("%-48s %10.1f bytes/op %8.1f MB/s\n", "", (double)bytes / (Iterations ? Iterations : 1), elapsed ? bytes * 1000.0 / elapsed : 0);
+}
+
+static ULONG BenchRandom(
+    _Inout_ PULONG Seed)
+{
+  *Seed = *Seed * 1103515245 + 12345;
+  return *Seed >> 16;
+}
+
+static ULONG BenchAppend(
+    _Inout_updates_(IM_BENCH_CORPUS_NAME_CHARS) PWCHAR Buffer,
+    _In_ ULONG Chars,
+    _In_ const WCHAR *String)
+{
+  for (; 0 != *String && Chars < IM_BENCH_CORPUS_NAME_CHARS - 1; String++)
+  {
+    Buffer[Chars++] = *String;
+  }
+
+  Buffer[Chars] = L'\0';
+
+  return Chars;
+}
+
+static ULONG BenchAddName(
+    _In_ const WCHAR *Directory,
+    _In_opt_ const WCHAR *File)
+{
+  ULONG chars = BenchAppend(Names[NameCount], 0, Directory);
+
+  if (NULL != File)
+  {
+    chars = BenchAppend(Names[NameCount], chars, File);
+  }
+
+  NameSizes[NameCount] = (chars + 1) * sizeof(WCHAR);
+
+  return NameCount++;
+}
+
+//
+// Records of a load storm: every process loads dlls of a few folders, ids
+// are given like the driver does and strings go with the first record of
+// the name only. Times differ by microseconds.
+//
+static VOID BenchBuildCorpus(
+    _In_ ULONG Records)
+{
+  ULONG directories = sizeof(Directories) / sizeof(Directories[0]);
+  ULONG files = sizeof(Files) / sizeof(Files[0]);
+  ULONG processes = sizeof(Processes) / sizeof(Processes[0]);
+  BOOLEAN isSent[IM_BENCH_CORPUS_NAMES];
+  LONGLONG time = 132000000000000000ll;
+  ULONG seed = 1;
+  ULONG process = 0;
+  ULONG file = 0;
+  ULONG i = 0;
+
+  NameCount = 0;
+  RtlZeroMemory(isSent, sizeof(isSent));
+
+  for (i = 0; i < processes; i++)
+  {
+    (VOID) BenchAddName(Processes[i], NULL);
+  }
+
+  for (i = 0; i < directories * files && NameCount < IM_BENCH_CORPUS_NAMES; i++)
+  {
+    (VOID) BenchAddName(Directories[i % directories], Files[i / directories]);
+  }
+
+  for (i = 0; i < Records; i++)
+  {
+    RtlZeroMemory(&Stream[i], sizeof(IM_WIRE_RECORD));
+
+    // half of the loads are of the game itself
+    process = BenchRandom(&seed) % 2 ? 0 : BenchRandom(&seed) % processes;
+    file = processes + BenchRandom(&seed) % (NameCount - processes);
+    time += 10 * (1 + BenchRandom(&seed) % 2000);
+
+    Stream[i].Flags = IM_WIRE_SUCCEEDED | (0 == BenchRandom(&seed) % 16 ? IM_WIRE_BLOCKED : 0);
+    Stream[i].SequenceNumber = 1 + i;
+    Stream[i].Time = time;
+    Stream[i].VideoMode = IM_NOT_APPLICABLE;
+    Stream[i].Names[IM_PROCESS_NAME_INDEX].Id = 1 + process;
+    Stream[i].Names[IM_FILE_NAME_INDEX].Id = 1 + file;
+    Stream[i].Names[IM_PROCESS_NAME_INDEX].Size = isSent[process] ? 0 : NameSizes[process];
+    Stream[i].Names[IM_FILE_NAME_INDEX].Size = isSent[file] ? 0 : NameSizes[file];
+
+    StreamStrings[i][IM_PROCESS_NAME_INDEX] = Names[process];
+    StreamStrings[i][IM_FILE_NAME_INDEX] = Names[file];
+
+    isSent[process] = TRUE;
+    isSent[file] = TRUE;
+  }
+}
+
+//
+// Fills buffers of IM_BENCH_CORPUS_BUFFER_SIZE like IMGetRecords does
+//
+static VOID BenchEncodeCorpus(
+    _In_ ULONG Records,
+    _In_ BOOLEAN IsBatch)
+{
+  IM_WIRE_BATCH_ENCODER encoder;
+  PUCHAR buffer = IsBatch ? BatchesOutput : RecordsOutput;
+  ULONG offset = 0;
+  ULONG bufferLength = 0;
+  ULONG buffers = 1;
+  ULONG length = 0;
+  ULONG i = 0;
+
+  (VOID) IMWireBeginBatch(&encoder, buffer, IM_BENCH_CORPUS_BUFFER_SIZE);
+
+  for (; i < Records; i++)
+  {
+    if (IsBatch)
+    {
+      if (0 == IMWireEncodeBatchRecord(&encoder, &Stream[i], StreamStrings[i]))
+      {
+        offset += IMWireEndBatch(&encoder);
+        buffers++;
+
+        (VOID) IMWireBeginBatch(&encoder, buffer + offset, IM_BENCH_CORPUS_BUFFER_SIZE);
+        (VOID) IMWireEncodeBatchRecord(&encoder, &Stream[i], StreamStrings[i]);
+      }
+
+      continue;
+    }
+
+    length = IMWireEncodeRecord(buffer + offset + bufferLength, IM_BENCH_CORPUS_BUFFER_SIZE - bufferLength, &Stream[i], StreamStrings[i]);
+
+    if (0 == length)
+    {
+      offset += bufferLength;
+      bufferLength = 0;
+      buffers++;
+
+      length = IMWireEncodeRecord(buffer + offset, IM_BENCH_CORPUS_BUFFER_SIZE, &Stream[i], StreamStrings[i]);
+    }
+
+    bufferLength += length;
+  }
+
+  if (IsBatch)
+  {
+    BatchesLength = offset + IMWireEndBatch(&encoder);
+    BatchesBuffers = buffers;
+  }
+  else
+  {
+    RecordsLength = offset + bufferLength;
+    RecordsBuffers = buffers;
+  }
+}
+
+static ULONG BenchDecodeCorpus(
+    _In_ BOOLEAN IsBatch)
+{
+  IM_WIRE_RECORD record;
+  const UCHAR *strings[IM_WIRE_NAMES] = {NULL, NULL};
+  PUCHAR buffer = IsBatch ? BatchesOutput : RecordsOutput;
+  ULONG length = IsBatch ? BatchesLength : RecordsLength;
+  ULONG offset = 0;
+  ULONG records = 0;
+
+  RtlZeroMemory(&record, sizeof(record));
+
+  while (offset < length)
+  {
+    if (!IsBatch)
+    {
+      if (!IMWireDecodeRecord(buffer + offset, length - offset, &record, strings))
+      {
+        break;
+      }
+
+      Sink += record.SequenceNumber + (ULONG_PTR)strings[IM_FILE_NAME_INDEX];
+      offset += record.Length;
+      records++;
+      continue;
+    }
+
+    if (!IMWireBeginBatchDecode(&Decoder, buffer + offset, length - offset))
+    {
+      break;
+    }
+
+    while (!IMWireIsBatchEnd(&Decoder) && IMWireDecodeBatchRecord(&Decoder, &record, strings))
+    {
+      Sink += record.SequenceNumber + (ULONG_PTR)strings[IM_FILE_NAME_INDEX];
+      records++;
+    }
+
+    offset += Decoder.Length;
+  }
+
+  return records;
+}
+
+static VOID BenchCorpus(
+    _In_ ULONG Iterations)
+{
+  ULONG records = min(Iterations, IM_BENCH_CORPUS_RECORDS);
+  ULONG passes = max(1, Iterations / records);
+  ULONGLONG start = 0;
+  ULONGLONG recordsElapsed = 0;
+  ULONGLONG batchesElapsed = 0;
+  ULONG decoded = 0;
+  ULONG i = 0;
+
+  BenchBuildCorpus(records);
+
+  start = IMBenchNow();
+  for (i = 0; i < passes; i++)
+  {
+    BenchEncodeCorpus(records, FALSE);
+  }
+  IMBenchReport("corpus encode, records", passes * records, IMBenchNow() - start);
+
+  start = IMBenchNow();
+  for (i = 0; i < passes; i++)
+  {
+    BenchEncodeCorpus(records, TRUE);
+  }
+  IMBenchReport("corpus encode, batches", passes * records, IMBenchNow() - start);
+
+  start = IMBenchNow();
+  for (i = 0; i < passes; i++)
+  {
+    decoded = BenchDecodeCorpus(FALSE);
+  }
+  recordsElapsed = IMBenchNow() - start;
+  IMBenchReport("corpus decode, records", passes * records, recordsElapsed);
+
+  if (decoded != records)
+  {
+    printf("corpus records decoded %u of %u\n", decoded, records);
+  }
+
+  start = IMBenchNow();
+  for (i = 0; i < passes; i++)
+  {
+    decoded = BenchDecodeCorpus(TRUE);
+  }
+  batchesElapsed = IMBenchNow() - start;
+  IMBenchReport("corpus decode, batches", passes * records, batchesElapsed);
+
+  if (decoded != records)
+  {
+    printf("corpus batches decoded %u of %u\n", decoded, records);
+  }
+
+  printf("%-48s %10u names %u records\n", "corpus", NameCount, records);
+  printf("%-48s %10.1f bytes/record %8.1f records/buffer\n", "records", (double)RecordsLength / records, (double)records / RecordsBuffers);
+  printf("%-48s %10.1f bytes/record %8.1f records/buffer\n", "batches", (double)BatchesLength / records, (double)records / BatchesBuffers);
+  printf("%-48s %10.2f x smaller %8.2f x fewer round trips\n", "batches", (double)RecordsLength / (BatchesLength ? BatchesLength : 1), (double)RecordsBuffers / BatchesBuffers);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+  ULONG iterations = IMBenchIterations(argc, argv, IM_BENCH_ITERATIONS);
+
+  BenchRecords(FALSE, iterations);
+  BenchRecords(TRUE, iterations);
+  BenchCorpus(iterations);
+
+  return 0;
+}
@@ -0,0 +1,63 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_bench.h
+
+Abstract:
+Timing helpers for the host benchmarks of im_core. Every benchmark accepts
+"--quick" to run a handful of iterations, which is how ctest runs them.
+
+Environment:
+
+User mode (host)
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <time.h>
+
+#include "fltKernel.h"
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+static inline ULONGLONG IMBenchNow()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (ULONGLONG)now.tv_sec * 1000000000ULL + (ULONGLONG)now.tv_nsec;
+}
+
+static inline ULONG IMBenchIterations(
+    _In_ int argc,
+    _In_ char *argv[],
+    _In_ ULONG Iterations)
+{
+  if (argc > 1 && 0 == strcmp(argv[1], "--quick"))
+  {
+    return Iterations < 100 ? Iterations : 100;
+  }
+
+  return Iterations;
+}
+
+static inline VOID IMBenchReport(
+    _In_ const char *Name,
+    _In_ ULONG Iterations,
+    _In_ ULONGLONG ElapsedNs)
+{
+  printf("%-48s %10u ops %12.1f ns/op\n", Name, Iterations, (double)ElapsedNs / (Iterations ? Iterations : 1));
+}
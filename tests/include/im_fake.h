@@ -0,0 +1,139 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_fake.h
+
+Abstract:
+Fake IRP_MJ_CREATE requests and target processes for the host tests and
+benchmarks of im_core
+
+Environment:
+
+User mode (host)
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im.h"
+#include "im_ops.h"
+#include "im_proc.h"
+#include "im_glob.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_FAKE_HL_PID ((HANDLE)(ULONG_PTR)0x1000)
+#define IM_FAKE_OTHER_PID ((HANDLE)(ULONG_PTR)0x2000)
+
+#define IM_FAKE_VOLUME L"\\Device\\HarddiskVolume3"
+#define IM_FAKE_GAME_DIR IM_FAKE_VOLUME L"\\Games\\Steam\\steamapps\\common\\Half-Life\\"
+#define IM_FAKE_HL_IMAGE IM_FAKE_GAME_DIR L"hl.exe"
+
+//------------------------------------------------------------------------
+//  Structures.
+//------------------------------------------------------------------------
+
+//
+// Everything FltMgr would hand to IMPreCreate / IMPostCreate
+//
+typedef struct _IM_FAKE_CREATE
+{
+  FLT_CALLBACK_DATA Data;
+  FLT_IO_PARAMETER_BLOCK Iopb;
+  FILE_OBJECT FileObject;
+  IO_SECURITY_CONTEXT SecurityContext;
+  FLT_RELATED_OBJECTS FltObjects;
+} IM_FAKE_CREATE, *PIM_FAKE_CREATE;
+
+//------------------------------------------------------------------------
+//  Functions.
+//------------------------------------------------------------------------
+
+static inline VOID IMFakeInitCreate(
+    _Out_ PIM_FAKE_CREATE Create,
+    _In_ PCWSTR FileName,
+    _In_ ACCESS_MASK DesiredAccess)
+{
+  RtlZeroMemory(Create, sizeof(IM_FAKE_CREATE));
+
+  RtlInitUnicodeString(&Create->FileObject.FileName, FileName);
+  Create->SecurityContext.DesiredAccess = DesiredAccess;
+
+  Create->Iopb.MajorFunction = IRP_MJ_CREATE;
+  Create->Iopb.TargetFileObject = &Create->FileObject;
+  Create->Iopb.Parameters.Create.SecurityContext = &Create->SecurityContext;
+
+  Create->Data.Iopb = &Create->Iopb;
+
+  Create->FltObjects.Size = sizeof(FLT_RELATED_OBJECTS);
+  Create->FltObjects.FileObject = &Create->FileObject;
+}
+
+static inline VOID IMFakeReleaseCreate(
+    _Inout_ PIM_FAKE_CREATE Create)
+{
+  if (Create->FileObject.FileNameOwned)
+  {
+    free(Create->FileObject.FileName.Buffer);
+    Create->FileObject.FileNameOwned = FALSE;
+  }
+}
+
+//
+// Runs the create through the filter callbacks the way FltMgr does and
+// returns the final status of the request
+//
+static inline NTSTATUS IMFakeRunCreate(
+    _Inout_ PIM_FAKE_CREATE Create)
+{
+  FLT_PREOP_CALLBACK_STATUS preStatus;
+  PVOID completionContext = NULL;
+
+  Create->Data.IoStatus.Status = STATUS_SUCCESS;
+
+  preStatus = IMPreCreate(&Create->Data, &Create->FltObjects, &completionContext);
+
+  if (FLT_PREOP_SUCCESS_WITH_CALLBACK == preStatus)
+  {
+    IMPostCreate(&Create->Data, &Create->FltObjects, completionContext, 0);
+  }
+
+  return Create->Data.IoStatus.Status;
+}
+
+//
+// Globals with hl.exe started as IM_FAKE_HL_PID
+//
+static inline NTSTATUS IMFakeStartDriver(
+    _Out_ PDRIVER_OBJECT DriverObject)
+{
+  NTSTATUS status = STATUS_SUCCESS;
+
+  RtlZeroMemory(DriverObject, sizeof(DRIVER_OBJECT));
+
+  NT_IF_FAIL_RETURN(IMInitializeGlobals(DriverObject));
+  NT_IF_FAIL_RETURN(IMShimRegisterProcess(IM_FAKE_HL_PID, IM_FAKE_HL_IMAGE));
+
+  IMCreateProcessNotifyRoutine(NULL, IM_FAKE_HL_PID, TRUE);
+
+  return status;
+}
+
+static inline VOID IMFakeStopDriver()
+{
+  IMCreateProcessNotifyRoutine(NULL, IM_FAKE_HL_PID, FALSE);
+  IMShimUnregisterProcess(IM_FAKE_HL_PID);
+  IMReleaseTargetProcesses();
+  IMDeinitializeGlobals();
+}
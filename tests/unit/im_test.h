@@ -0,0 +1,74 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+im_test.h
+
+Abstract:
+Minimal check macros for the host unit tests of im_core
+
+Environment:
+
+User mode (host)
+
+--*/
+
+#pragma once
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "fltKernel.h"
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static ULONG IMTestFailures = 0;
+
+//------------------------------------------------------------------------
+//  Check macroses.
+//------------------------------------------------------------------------
+
+//
+// Reports the '_exp' expression and continues, if it is FALSE.
+//
+#define IM_CHECK(_exp)                                                   \
+  if (!(_exp))                                                          \
+  {                                                                     \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #_exp);     \
+    IMTestFailures++;                                                   \
+  }
+
+//
+// Runs the test routine and prints its name.
+//
+#define IM_RUN(_test)          \
+  {                            \
+    printf("[ RUN ] %s\n", #_test); \
+    _test();                   \
+  }
+
+//
+// Exit code of the test binary.
+//
+#define IM_TEST_RESULT() (IMTestFailures == 0 ? 0 : 1)
+
+//
+// Compares UNICODE_STRING with a literal.
+//
+static inline BOOLEAN IMTestEquals(
+    _In_ PCUNICODE_STRING String,
+    _In_ PCWSTR Expected)
+{
+  UNICODE_STRING expected;
+
+  RtlInitUnicodeString(&expected, Expected);
+
+  return RtlEqualUnicodeString(String, &expected, FALSE);
+}
@@ -0,0 +1,278 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_coal.c
+
+Abstract:
+Host tests of coalescing of identical records in im_coal.c
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <unistd.h>
+
+#include "im_test.h"
+#include "im_fake.h"
+#include "im_coal.h"
+#include "im_list.h"
+#include "im_rec.h"
+#include "im_shim.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_TEST_RECORDS 16
+
+//
+// long enough for the loads of a test to be within one window
+//
+#define IM_TEST_LONG_WINDOW 5000
+#define IM_TEST_SHORT_WINDOW 20
+
+#define IM_TEST_ALLOWED IM_FAKE_GAME_DIR L"valve\\client.dll"
+#define IM_TEST_BLOCKED IM_FAKE_VOLUME L"\\Temp\\inject.dll"
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static IM_WIRE_BATCH_DECODER Decoder;
+
+static PVOID RecordsBuffer[4096 / sizeof(PVOID)];
+
+static IM_WIRE_RECORD Records[IM_TEST_RECORDS];
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static VOID CreateRecords(
+    _In_ PCWSTR FileName,
+    _In_ ULONG Count)
+{
+  IM_FAKE_CREATE create;
+  ULONG i = 0;
+
+  for (; i < Count; i++)
+  {
+    IMFakeInitCreate(&create, FileName, FILE_EXECUTE);
+    (VOID) IMFakeRunCreate(&create);
+    IMFakeReleaseCreate(&create);
+  }
+}
+
+//
+// Takes the queued records to Records, returns how many of them there are
+//
+static ULONG DrainRecords(
+    _In_ ULONG Flags)
+{
+  PUCHAR buffer = (PUCHAR)RecordsBuffer;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA] = {NULL, NULL};
+  ULONG returnLen = 0;
+  ULONG offset = 0;
+  ULONG count = 0;
+
+  if (!NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, Flags, buffer, sizeof(RecordsBuffer), &returnLen)))
+  {
+    return 0;
+  }
+
+  if (Flags & IM_RECORDS_BATCH)
+  {
+    IM_CHECK(IMWireBeginBatchDecode(&Decoder, buffer, returnLen));
+
+    while (count < IM_TEST_RECORDS && !IMWireIsBatchEnd(&Decoder) && IMWireDecodeBatchRecord(&Decoder, &Records[count], strings))
+    {
+      count++;
+    }
+
+    IM_CHECK(IMWireIsBatchEnd(&Decoder));
+
+    return count;
+  }
+
+  while (count < IM_TEST_RECORDS && offset < returnLen && IMWireDecodeRecord(buffer + offset, returnLen - offset, &Records[count], strings))
+  {
+    offset += Records[count++].Length;
+  }
+
+  IM_CHECK(offset == returnLen);
+
+  return count;
+}
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+//
+// First load of a burst goes right away, the rest comes as one record
+// once the window closes
+//
+static VOID TestBurst()
+{
+  DRIVER_OBJECT driverObject;
+  IM_RECORDS_STATISTICS statistics;
+  ULONG count = 0;
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  IM_CHECK(IMSetCoalesceWindow(IM_MAX_COALESCE_WINDOW + 1) == STATUS_INVALID_PARAMETER_2);
+  IM_CHECK(NT_SUCCESS(IMSetCoalesceWindow(IM_TEST_LONG_WINDOW)));
+
+  CreateRecords(IM_TEST_ALLOWED, 10);
+
+  count = DrainRecords(0);
+  IM_CHECK(count == 1);
+  IM_CHECK(!(Records[0].Flags & IM_WIRE_COALESCED) && Records[0].Count == 1);
+
+  // blocked loads of the same file are not the same records
+  CreateRecords(IM_TEST_BLOCKED, 3);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == 1);
+
+  // windows are closed in order they were opened
+  IM_CHECK(NT_SUCCESS(IMSetCoalesceWindow(0)));
+
+  count = DrainRecords(IM_RECORDS_BATCH);
+  IM_CHECK(count == 3);
+
+  IM_CHECK(Records[0].Flags & IM_WIRE_BLOCKED);
+  IM_CHECK(Records[0].Count == 1);
+
+  // blocked records go ahead of the allowed ones
+  IM_CHECK(Records[1].Flags & IM_WIRE_BLOCKED);
+  IM_CHECK(Records[1].Flags & IM_WIRE_COALESCED);
+  IM_CHECK(Records[1].Count == 2);
+
+  IM_CHECK(!(Records[2].Flags & IM_WIRE_BLOCKED));
+  IM_CHECK(Records[2].Flags & IM_WIRE_COALESCED);
+  IM_CHECK(Records[2].Count == 9);
+  IM_CHECK(Records[2].LastTime >= Records[2].Time);
+
+  // coalesced records take their place in the order when they go
+  IM_CHECK(Records[1].SequenceNumber > Records[0].SequenceNumber);
+
+  IMGetStatistics(&statistics);
+  IM_CHECK(statistics.Coalesced == 8 + 1);
+
+  // off, every load is a record
+  CreateRecords(IM_TEST_ALLOWED, 3);
+  IM_CHECK(DrainRecords(0) == 3);
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//
+// Due window is closed by the next record or by the client
+//
+static VOID TestExpiry()
+{
+  DRIVER_OBJECT driverObject;
+  ULONG timeout = 0;
+  ULONG count = 0;
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  IM_CHECK(IMCoalescerTimeout(&Globals.Coalescer) == MAXULONG);
+  IM_CHECK(NT_SUCCESS(IMSetCoalesceWindow(IM_TEST_SHORT_WINDOW)));
+
+  CreateRecords(IM_TEST_ALLOWED, 3);
+
+  timeout = IMCoalescerTimeout(&Globals.Coalescer);
+  IM_CHECK(timeout <= IM_TEST_SHORT_WINDOW);
+
+  usleep(2 * IM_TEST_SHORT_WINDOW * 1000);
+  IM_CHECK(IMCoalescerTimeout(&Globals.Coalescer) == 0);
+
+  // the load closes the window ahead of its own record and opens another
+  CreateRecords(IM_TEST_ALLOWED, 1);
+
+  count = DrainRecords(0);
+  IM_CHECK(count == 3);
+  IM_CHECK(Records[0].Count == 1);
+  IM_CHECK(Records[1].Count == 2 && (Records[1].Flags & IM_WIRE_COALESCED));
+  IM_CHECK(Records[2].Count == 1 && !(Records[2].Flags & IM_WIRE_COALESCED));
+  IM_CHECK(Records[2].Time >= Records[1].LastTime);
+
+  // window of a single record closes with nothing to send
+  usleep(2 * IM_TEST_SHORT_WINDOW * 1000);
+  IMCloseCoalescedRecords(FALSE);
+  IM_CHECK(IsListEmpty(&Globals.Coalescer.Expiry));
+  IM_CHECK(IMCoalescerTimeout(&Globals.Coalescer) == MAXULONG);
+  IM_CHECK(DrainRecords(0) == 0);
+
+  // the only one after the first comes late, as a record of its own
+  CreateRecords(IM_TEST_ALLOWED, 2);
+  usleep(2 * IM_TEST_SHORT_WINDOW * 1000);
+  IMCloseCoalescedRecords(FALSE);
+
+  count = DrainRecords(IM_RECORDS_BATCH);
+  IM_CHECK(count == 2);
+  IM_CHECK(Records[0].Count == 1 && Records[1].Count == 1);
+  IM_CHECK(!(Records[1].Flags & IM_WIRE_COALESCED));
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//
+// Records held in open windows are freed with the driver
+//
+static VOID TestHeld()
+{
+  DRIVER_OBJECT driverObject;
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  IM_CHECK(NT_SUCCESS(IMSetCoalesceWindow(IM_TEST_LONG_WINDOW)));
+
+  // video mode records are of another verdict
+  CreateRecords(IM_TEST_ALLOWED, 2);
+  CreateRecords(IM_TEST_BLOCKED, 3);
+  CreateRecords(IM_FAKE_GAME_DIR L"sw.dll", 2);
+  IM_CHECK(DrainRecords(0) == 3);
+  IM_CHECK(Records[1].VideoMode == IM_VIDEO_SW_TO_HW);
+
+  IM_CHECK(Globals.Coalescer.Coalesced == 1);
+  IM_CHECK(!IsListEmpty(&Globals.Coalescer.Expiry));
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestBurst);
+  IM_RUN(TestExpiry);
+  IM_RUN(TestHeld);
+
+  return IM_TEST_RESULT();
+}
@@ -0,0 +1,213 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_fold.c
+
+Abstract:
+Host tests of the case insensitive routines in im_fold.c, every vector
+level has to return the same results as the scalar one
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_test.h"
+#include "im_fold.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_TEST_MAX_COUNT 300
+#define IM_TEST_ROUNDS 4000
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+//
+// letters with both cases, range edges, non latin letters and symbols
+// which are negative for the signed vector compare
+//
+static const WCHAR Alphabet[] = {
+    L'a', L'A', L'z', L'Z', L'@', L'[', L'`', L'{', L'\\', L'.',
+    0x00C4, 0x00E4, 0xFF21, 0xFF41, 0x8041, 0xC061};
+
+static ULONG Seed = 12345;
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static ULONG Random(
+    _In_ ULONG Range)
+{
+  Seed = Seed * 1103515245 + 12345;
+
+  return (Seed >> 16) % Range;
+}
+
+static VOID RandomString(
+    _Out_writes_(Count) PWCHAR String,
+    _In_ ULONG Count,
+    _In_ ULONG AlphabetSize)
+{
+  ULONG i = 0;
+
+  for (; i < Count; i++)
+  {
+    String[i] = Alphabet[Random(AlphabetSize)];
+  }
+}
+
+static VOID FlipCase(
+    _Inout_updates_(Count) PWCHAR String,
+    _In_ ULONG Count)
+{
+  ULONG i = 0;
+
+  for (; i < Count; i++)
+  {
+    if (Random(2) && String[i] >= L'a' && String[i] <= L'z')
+    {
+      String[i] -= L'a' - L'A';
+    }
+    else if (Random(2) && String[i] >= L'A' && String[i] <= L'Z')
+    {
+      String[i] += L'a' - L'A';
+    }
+  }
+}
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+static VOID TestKnownResults()
+{
+  static const WCHAR path[] = L"\\Device\\HarddiskVolume3\\Games\\Steam\\steamapps\\common\\Half-Life\\valve\\cl_dlls\\client.dll";
+  static const WCHAR upper[] = L"\\DEVICE\\HARDDISKVOLUME3\\GAMES\\STEAM\\STEAMAPPS\\COMMON\\HALF-LIFE\\VALVE\\CL_DLLS\\CLIENT.DLL";
+  static const WCHAR fullWidth[] = {0xFF21, 0xFF22};
+  static const WCHAR fullWidthLower[] = {0xFF41, 0xFF42};
+  ULONG count = ARRAYSIZE(path) - 1;
+  IM_FOLD_LEVEL level = IM_FOLD_SCALAR;
+
+  for (; level <= IM_FOLD_AVX2; level++)
+  {
+    if (IMSelectFoldRoutines(level) != level)
+    {
+      continue;
+    }
+
+    IM_CHECK(IMFoldEqual(path, upper, count));
+    IM_CHECK(!IMFoldEqual(path, upper + 1, count - 1));
+
+    // only latin letters are folded
+    IM_CHECK(!IMFoldEqual(fullWidth, fullWidthLower, 2));
+
+    IM_CHECK(IMFoldFind(path, count, L"CLIENT.DLL", 10) == (LONG)count - 10);
+    IM_CHECK(IMFoldFind(path, count, L"steam", 5) == 30);
+    IM_CHECK(IMFoldFind(path, count, L"steam\\STEAMAPPS", 15) == 30);
+    IM_CHECK(IMFoldFind(path, count, L"\\", 1) == 0);
+    IM_CHECK(IMFoldFind(path, count, L"crashhandler", 12) == -1);
+    IM_CHECK(IMFoldFind(path, count, L"x", 0) == 0);
+    IM_CHECK(IMFoldFind(path, 4, path, 5) == -1);
+  }
+
+  IMSelectFoldRoutines(IM_FOLD_AVX2);
+}
+
+static VOID TestSameAsScalar()
+{
+  WCHAR a[IM_TEST_MAX_COUNT + 4];
+  WCHAR b[IM_TEST_MAX_COUNT + 4];
+  BOOLEAN expectedEqual = FALSE;
+  LONG expectedFind = 0;
+  ULONG round = 0;
+  ULONG count = 0;
+  ULONG subCount = 0;
+  ULONG start = 0;
+  ULONG offset = 0;
+  IM_FOLD_LEVEL level = IM_FOLD_SCALAR;
+
+  for (; round < IM_TEST_ROUNDS; round++)
+  {
+    count = Random(IM_TEST_MAX_COUNT);
+    offset = Random(4);
+
+    IMSelectFoldRoutines(IM_FOLD_SCALAR);
+
+    // search in a string of few symbols, so there are many candidates
+    RandomString(a + offset, count, 3);
+    subCount = 1 + Random(8);
+    start = count > subCount ? Random(count - subCount) : 0;
+    RtlCopyMemory(b, a + offset + start, subCount * sizeof(WCHAR));
+    FlipCase(b, subCount);
+    if (Random(2))
+    {
+      b[Random(subCount)] = Alphabet[Random(ARRAYSIZE(Alphabet))];
+    }
+
+    expectedFind = IMFoldFind(a + offset, count, b, subCount);
+
+    for (level = IM_FOLD_SSE2; level <= IM_FOLD_AVX2; level++)
+    {
+      if (IMSelectFoldRoutines(level) != level)
+      {
+        continue;
+      }
+
+      IM_CHECK(IMFoldFind(a + offset, count, b, subCount) == expectedFind);
+    }
+
+    // equality of the same string in other case, sometimes with one difference
+    RandomString(a + offset, count, ARRAYSIZE(Alphabet));
+    RtlCopyMemory(b, a + offset, count * sizeof(WCHAR));
+    FlipCase(b, count);
+
+    IMSelectFoldRoutines(IM_FOLD_SCALAR);
+    expectedEqual = IMFoldEqual(a + offset, b, count);
+    IM_CHECK(expectedEqual);
+
+    if (count != 0)
+    {
+      b[Random(count)] ^= 0x20;
+      expectedEqual = IMFoldEqual(a + offset, b, count);
+    }
+
+    for (level = IM_FOLD_SSE2; level <= IM_FOLD_AVX2; level++)
+    {
+      if (IMSelectFoldRoutines(level) != level)
+      {
+        continue;
+      }
+
+      IM_CHECK(IMFoldEqual(a + offset, b, count) == expectedEqual);
+    }
+  }
+
+  IMSelectFoldRoutines(IM_FOLD_AVX2);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestKnownResults);
+  IM_RUN(TestSameAsScalar);
+
+  return IM_TEST_RESULT();
+}
@@ -0,0 +1,884 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_list.c
+
+Abstract:
+Host tests of the lanes of elements with many producers and one consumer
+in im_list.c
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <sched.h>
+#include <unistd.h>
+
+#include "im_test.h"
+#include "im_list.h"
+#include "im_shim.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_TEST_MAX_ELEMENTS 4
+#define IM_TEST_PRODUCERS 8
+#define IM_TEST_PER_PRODUCER 20000
+#define IM_TEST_WAITS 20000
+#define IM_TEST_WAIT_MS 2000
+#define IM_TEST_RESIZES 200
+#define IM_TEST_LANES 4
+
+typedef struct _IM_TEST_ELEMENT
+{
+  LIST_ENTRY List;
+  ULONG Producer;
+  ULONG Index;
+  ULONGLONG SequenceNumber;
+} IM_TEST_ELEMENT, *PIM_TEST_ELEMENT;
+
+typedef struct _IM_TEST_DELAYED_PUSH
+{
+  PIM_KLIST_HEAD ListHead;
+  PLIST_ENTRY ListEntry;
+  ULONG DelayMs;
+} IM_TEST_DELAYED_PUSH, *PIM_TEST_DELAYED_PUSH;
+
+typedef struct _IM_TEST_DELAYED_POP
+{
+  PIM_KLIST_HEAD ListHead;
+  ULONG DelayMs;
+} IM_TEST_DELAYED_POP, *PIM_TEST_DELAYED_POP;
+
+typedef struct _IM_TEST_PRODUCER
+{
+  PIM_KLIST_HEAD ListHead;
+  PIM_TEST_ELEMENT Elements;
+  ULONG Producer;
+} IM_TEST_PRODUCER, *PIM_TEST_PRODUCER;
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static IM_TEST_ELEMENT Elements[IM_TEST_PRODUCERS * IM_TEST_PER_PRODUCER];
+
+static LONG ElementsFreed;
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static VOID CountFreed(
+    _In_ PLIST_ENTRY ListEntry)
+{
+  UNREFERENCED_PARAMETER(ListEntry);
+
+  ElementsFreed++;
+}
+
+static PIM_TEST_ELEMENT PopElement(
+    _In_ PIM_KLIST_HEAD ListHead)
+{
+  PLIST_ENTRY entry = NULL;
+
+  IMPop(ListHead, &entry);
+
+  return entry != NULL ? CONTAINING_RECORD(entry, IM_TEST_ELEMENT, List) : NULL;
+}
+
+static VOID PushOn(
+    _In_ PIM_KLIST_HEAD ListHead,
+    _In_ ULONG Processor,
+    _In_ ULONG Index)
+{
+  IMShimSetCurrentProcessor(Processor);
+
+  Elements[Index].Index = Index;
+  IM_CHECK(IMTryPush(ListHead, &Elements[Index].List, 0, &Elements[Index].SequenceNumber));
+
+  IMShimSetCurrentProcessor(0);
+}
+
+static void *Produce(
+    void *Context)
+{
+  PIM_TEST_PRODUCER producer = (PIM_TEST_PRODUCER)Context;
+  ULONG i = 0;
+
+  // every producer is a processor of its own, lanes are shared if there
+  // are less of them
+  IMShimSetCurrentProcessor(producer->Producer);
+
+  for (; i < IM_TEST_PER_PRODUCER; i++)
+  {
+    producer->Elements[i].Producer = producer->Producer;
+    producer->Elements[i].Index = i;
+
+    // ring is much smaller than the amount of elements, wait for consumer
+    while (!IMTryPush(producer->ListHead, &producer->Elements[i].List, 0, &producer->Elements[i].SequenceNumber))
+    {
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+static void *PushDelayed(
+    void *Context)
+{
+  PIM_TEST_DELAYED_PUSH push = (PIM_TEST_DELAYED_PUSH)Context;
+
+  usleep(push->DelayMs * 1000);
+  IMPush(push->ListEntry, push->ListHead, 0, NULL);
+
+  return NULL;
+}
+
+static void *PopDelayed(
+    void *Context)
+{
+  PIM_TEST_DELAYED_POP pop = (PIM_TEST_DELAYED_POP)Context;
+
+  usleep(pop->DelayMs * 1000);
+
+  ExAcquireFastMutex(&pop->ListHead->ConsumerLock);
+  (VOID) PopElement(pop->ListHead);
+  ExReleaseFastMutex(&pop->ListHead->ConsumerLock);
+
+  IMSignalRoom(pop->ListHead);
+
+  return NULL;
+}
+
+//
+// one element at a time, so the consumer goes to sleep for almost each
+//
+static void *ProduceSlowly(
+    void *Context)
+{
+  PIM_TEST_PRODUCER producer = (PIM_TEST_PRODUCER)Context;
+  ULONG i = 0;
+
+  for (; i < IM_TEST_WAITS; i++)
+  {
+    producer->Elements[i].Index = i;
+
+    while (!IMTryPush(producer->ListHead, &producer->Elements[i].List, 0, NULL))
+    {
+      sched_yield();
+    }
+
+    if (0 == i % 4)
+    {
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+//
+// pushes through IMPush, which waits while the rings are resized
+//
+static void *ProducePushing(
+    void *Context)
+{
+  PIM_TEST_PRODUCER producer = (PIM_TEST_PRODUCER)Context;
+  ULONG i = 0;
+
+  IMShimSetCurrentProcessor(producer->Producer);
+
+  for (; i < IM_TEST_PER_PRODUCER; i++)
+  {
+    producer->Elements[i].Producer = producer->Producer;
+    producer->Elements[i].Index = i;
+
+    while (!IMPush(&producer->Elements[i].List, producer->ListHead, 0, &producer->Elements[i].SequenceNumber))
+    {
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+static VOID TestPushPop()
+{
+  IM_KLIST_HEAD listHead;
+  ULONG i = 0;
+  ULONG lap = 0;
+
+  RtlZeroMemory(&listHead, sizeof(listHead));
+
+  IM_CHECK(NT_SUCCESS(IMInitList(&listHead, sizeof(ULONG), IM_TEST_MAX_ELEMENTS, CountFreed)));
+
+  // room for twice the limit
+  IM_CHECK(listHead.Lanes[0].SlotMask + 1 == 2 * IM_TEST_MAX_ELEMENTS);
+  IM_CHECK(IMPeek(&listHead) == NULL);
+  IM_CHECK(PopElement(&listHead) == NULL);
+  IM_CHECK(KeReadStateEvent(listHead.NewElementEvent) == 0);
+
+  for (i = 0; i <= listHead.Lanes[0].SlotMask; i++)
+  {
+    Elements[i].Index = i;
+    IM_CHECK(IMTryPush(&listHead, &Elements[i].List, 0, NULL));
+  }
+
+  IM_CHECK(!IMTryPush(&listHead, &Elements[i].List, 0, NULL));
+  IM_CHECK(KeReadStateEvent(listHead.NewElementEvent) != 0);
+
+  // peek does not take the element
+  IM_CHECK(IMPeek(&listHead) == &Elements[0].List);
+  IM_CHECK(IMPeek(&listHead) == &Elements[0].List);
+
+  for (i = 0; i <= listHead.Lanes[0].SlotMask; i++)
+  {
+    IM_CHECK(PopElement(&listHead) == &Elements[i]);
+  }
+
+  IM_CHECK(PopElement(&listHead) == NULL);
+
+  // positions go around the ring many times
+  for (lap = 0; lap < 1000; lap++)
+  {
+    for (i = 0; i < 3; i++)
+    {
+      IM_CHECK(IMTryPush(&listHead, &Elements[i].List, 0, NULL));
+    }
+
+    for (i = 0; i < 3; i++)
+    {
+      IM_CHECK(PopElement(&listHead) == &Elements[i]);
+    }
+  }
+
+  IM_CHECK(PopElement(&listHead) == NULL);
+
+  IMDeinitList(&listHead);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestPushWhenFull()
+{
+  IM_KLIST_HEAD listHead;
+  ULONG i = 0;
+
+  RtlZeroMemory(&listHead, sizeof(listHead));
+  ElementsFreed = 0;
+
+  IM_CHECK(NT_SUCCESS(IMInitList(&listHead, sizeof(ULONG), IM_TEST_MAX_ELEMENTS, CountFreed)));
+
+  // element which does not fit is freed and not counted
+  for (i = 0; i <= listHead.Lanes[0].SlotMask; i++)
+  {
+    IM_CHECK(IMPush(&Elements[i].List, &listHead, 0, NULL));
+  }
+
+  IM_CHECK(!IMPush(&Elements[i].List, &listHead, 0, NULL));
+
+  IM_CHECK(ElementsFreed == 1);
+  IM_CHECK(IMCountElements(&listHead) == (LONG)listHead.Lanes[0].SlotMask + 1);
+
+  // the rest is freed with the list
+  IMDeinitList(&listHead);
+
+  IM_CHECK(ElementsFreed == listHead.Lanes[0].SlotMask + 2);
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//
+// Producers on the given amount of processors, every element comes
+// exactly once, in order of its producer and of the sequence numbers
+//
+static VOID RunProducers(
+    _In_ ULONG Processors)
+{
+  IM_KLIST_HEAD listHead;
+  IM_TEST_PRODUCER producers[IM_TEST_PRODUCERS];
+  pthread_t threads[IM_TEST_PRODUCERS];
+  ULONG next[IM_TEST_PRODUCERS];
+  PIM_TEST_ELEMENT element = NULL;
+  ULONGLONG sequenceNumber = 0;
+  ULONG popped = 0;
+  ULONG i = 0;
+  BOOLEAN isOrdered = TRUE;
+
+  RtlZeroMemory(&listHead, sizeof(listHead));
+  RtlZeroMemory(next, sizeof(next));
+
+  IMShimSetProcessorCount(Processors);
+
+  IM_CHECK(NT_SUCCESS(IMInitList(&listHead, sizeof(ULONG), IM_TEST_MAX_ELEMENTS, CountFreed)));
+  IM_CHECK(listHead.LaneCount == Processors);
+
+  for (i = 0; i < IM_TEST_PRODUCERS; i++)
+  {
+    producers[i].ListHead = &listHead;
+    producers[i].Elements = &Elements[i * IM_TEST_PER_PRODUCER];
+    producers[i].Producer = i;
+    IM_CHECK(0 == pthread_create(&threads[i], NULL, Produce, &producers[i]));
+  }
+
+  while (popped < IM_TEST_PRODUCERS * IM_TEST_PER_PRODUCER)
+  {
+    ExAcquireFastMutex(&listHead.ConsumerLock);
+    element = PopElement(&listHead);
+    ExReleaseFastMutex(&listHead.ConsumerLock);
+
+    if (NULL == element)
+    {
+      sched_yield();
+      continue;
+    }
+
+    isOrdered = isOrdered && element->Index == next[element->Producer];
+    isOrdered = isOrdered && element->SequenceNumber > sequenceNumber;
+    next[element->Producer] = element->Index + 1;
+    sequenceNumber = element->SequenceNumber;
+    popped++;
+  }
+
+  for (i = 0; i < IM_TEST_PRODUCERS; i++)
+  {
+    pthread_join(threads[i], NULL);
+    IM_CHECK(next[i] == IM_TEST_PER_PRODUCER);
+  }
+
+  IM_CHECK(isOrdered);
+  IM_CHECK(PopElement(&listHead) == NULL);
+
+  IMDeinitList(&listHead);
+
+  IMShimSetProcessorCount(1);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//
+// producers share one lane
+//
+static VOID TestProducers()
+{
+  RunProducers(1);
+}
+
+//
+// lane per processor, two producers on each, merged by the consumer
+//
+static VOID TestLanes()
+{
+  RunProducers(IM_TEST_LANES);
+}
+
+//
+// Lanes of the processors the test switches to, numbers are known
+//
+static VOID TestMerge()
+{
+  IM_KLIST_HEAD listHead;
+  ULONG i = 0;
+
+  RtlZeroMemory(&listHead, sizeof(listHead));
+
+  IMShimSetProcessorCount(IM_TEST_LANES);
+
+  IM_CHECK(NT_SUCCESS(IMInitList(&listHead, sizeof(ULONG), IM_TEST_LANES * IM_TEST_MAX_ELEMENTS, CountFreed)));
+  IM_CHECK(listHead.LaneCount == IM_TEST_LANES);
+  IM_CHECK(listHead.Lanes[0].SlotMask + 1 == 2 * IM_TEST_MAX_ELEMENTS);
+
+  // lanes take blocks of numbers on their first push
+  PushOn(&listHead, 0, 0);
+  PushOn(&listHead, 1, 1);
+  PushOn(&listHead, 0, 2);
+  PushOn(&listHead, 2, 3);
+  PushOn(&listHead, 1, 4);
+
+  IM_CHECK(Elements[1].SequenceNumber == Elements[0].SequenceNumber + IM_KLIST_SEQUENCE_BLOCK);
+  IM_CHECK(Elements[2].SequenceNumber == Elements[0].SequenceNumber + 1);
+  IM_CHECK(IMCountElements(&listHead) == 5);
+
+  // consumer takes them in order of numbers, not of lanes or pushes
+  IM_CHECK(PopElement(&listHead) == &Elements[0]);
+  IM_CHECK(PopElement(&listHead) == &Elements[2]);
+  IM_CHECK(PopElement(&listHead) == &Elements[1]);
+  IM_CHECK(PopElement(&listHead) == &Elements[4]);
+  IM_CHECK(PopElement(&listHead) == &Elements[3]);
+  IM_CHECK(PopElement(&listHead) == NULL);
+
+  // idle lanes gave their blocks up, what they push now comes after the
+  // rest
+  PushOn(&listHead, 0, 5);
+  PushOn(&listHead, 3, 6);
+  IM_CHECK(Elements[5].SequenceNumber > Elements[3].SequenceNumber);
+
+  IM_CHECK(PopElement(&listHead) == &Elements[5]);
+  IM_CHECK(PopElement(&listHead) == &Elements[6]);
+
+  // element of the full lane goes to the next one and keeps its order
+  for (i = 0; i <= listHead.Lanes[0].SlotMask + 1; i++)
+  {
+    PushOn(&listHead, 0, 7 + i);
+  }
+
+  IM_CHECK(listHead.Lanes[1].Tail - listHead.Lanes[1].Head == 1);
+
+  for (i = 0; i <= listHead.Lanes[0].SlotMask + 1; i++)
+  {
+    IM_CHECK(PopElement(&listHead) == &Elements[7 + i]);
+  }
+
+  IM_CHECK(PopElement(&listHead) == NULL);
+
+  IMDeinitList(&listHead);
+
+  IMShimSetProcessorCount(1);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestWaitForElements()
+{
+  IM_KLIST_HEAD listHead;
+  IM_TEST_DELAYED_PUSH push;
+  pthread_t thread;
+  LARGE_INTEGER start;
+  LARGE_INTEGER now;
+
+  RtlZeroMemory(&listHead, sizeof(listHead));
+
+  IM_CHECK(NT_SUCCESS(IMInitList(&listHead, sizeof(ULONG), IM_TEST_MAX_ELEMENTS, CountFreed)));
+
+  // nothing comes, consumer sleeps the whole time
+  IM_CHECK(IMWaitForElements(&listHead, 1, 10) == STATUS_TIMEOUT);
+
+  // element is already there, no sleep
+  IM_CHECK(IMTryPush(&listHead, &Elements[0].List, 0, NULL));
+  IM_CHECK(IMWaitForElements(&listHead, 1, IM_TEST_WAIT_MS) == STATUS_SUCCESS);
+
+  // below the watermark, elements wait for the timeout
+  IM_CHECK(IMTryPush(&listHead, &Elements[1].List, 0, NULL));
+  IM_CHECK(IMWaitForElements(&listHead, 3, 10) == STATUS_TIMEOUT);
+  IM_CHECK(KeReadStateEvent(listHead.NewElementEvent) == 0);
+
+  // element which crosses the watermark wakes the consumer up
+  push.ListHead = &listHead;
+  push.ListEntry = &Elements[2].List;
+  push.DelayMs = 20;
+  IM_CHECK(0 == pthread_create(&thread, NULL, PushDelayed, &push));
+
+  KeQuerySystemTime(&start);
+  IM_CHECK(IMWaitForElements(&listHead, 3, IM_TEST_WAIT_MS) == STATUS_SUCCESS);
+  KeQuerySystemTime(&now);
+  IM_CHECK(now.QuadPart - start.QuadPart < IM_TEST_WAIT_MS * 10000LL / 2);
+
+  pthread_join(thread, NULL);
+
+  // watermark is capped by the limit of elements
+  IM_CHECK(IMWaitForElements(&listHead, MAXLONG, 10) == STATUS_TIMEOUT);
+  IM_CHECK(IMTryPush(&listHead, &Elements[3].List, 0, NULL));
+  IM_CHECK(IMWaitForElements(&listHead, MAXLONG, IM_TEST_WAIT_MS) == STATUS_SUCCESS);
+
+  IMDeinitList(&listHead);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestWaitForRoom()
+{
+  IM_KLIST_HEAD listHead;
+  IM_TEST_DELAYED_POP pop;
+  pthread_t thread;
+  LARGE_INTEGER start;
+  LARGE_INTEGER now;
+  ULONG i = 0;
+
+  RtlZeroMemory(&listHead, sizeof(listHead));
+
+  IM_CHECK(NT_SUCCESS(IMInitList(&listHead, sizeof(ULONG), IM_TEST_MAX_ELEMENTS, CountFreed)));
+
+  // below the limit, no sleep
+  IM_CHECK(IMWaitForRoom(&listHead, 0, IM_TEST_WAIT_MS) == STATUS_SUCCESS);
+
+  for (; i < IM_TEST_MAX_ELEMENTS; i++)
+  {
+    IM_CHECK(IMPush(&Elements[i].List, &listHead, 0, NULL));
+  }
+
+  // nobody takes elements, producer sleeps the whole time
+  KeQuerySystemTime(&start);
+  IM_CHECK(IMWaitForRoom(&listHead, 0, 10) == STATUS_TIMEOUT);
+  KeQuerySystemTime(&now);
+  IM_CHECK(now.QuadPart - start.QuadPart >= 10 * 10000LL);
+  IM_CHECK(listHead.RoomWaiters == 0);
+
+  // consumer which takes an element wakes the producer up
+  pop.ListHead = &listHead;
+  pop.DelayMs = 20;
+  IM_CHECK(0 == pthread_create(&thread, NULL, PopDelayed, &pop));
+
+  KeQuerySystemTime(&start);
+  IM_CHECK(IMWaitForRoom(&listHead, 0, IM_TEST_WAIT_MS) == STATUS_SUCCESS);
+  KeQuerySystemTime(&now);
+  IM_CHECK(now.QuadPart - start.QuadPart < IM_TEST_WAIT_MS * 10000LL / 2);
+
+  pthread_join(thread, NULL);
+
+  IM_CHECK(listHead.RoomWaiters == 0);
+
+  IMDeinitList(&listHead);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestNoLostWakeups()
+{
+  IM_KLIST_HEAD listHead;
+  IM_TEST_PRODUCER producer;
+  pthread_t thread;
+  PIM_TEST_ELEMENT element = NULL;
+  ULONG popped = 0;
+  ULONG sleeps = 0;
+  ULONG lostWakeups = 0;
+  BOOLEAN isOrdered = TRUE;
+
+  RtlZeroMemory(&listHead, sizeof(listHead));
+
+  IM_CHECK(NT_SUCCESS(IMInitList(&listHead, sizeof(ULONG), IM_TEST_MAX_ELEMENTS, CountFreed)));
+
+  producer.ListHead = &listHead;
+  producer.Elements = Elements;
+  producer.Producer = 0;
+  IM_CHECK(0 == pthread_create(&thread, NULL, ProduceSlowly, &producer));
+
+  // producer never pauses for the whole wait, timeout is a lost wakeup
+  while (popped < IM_TEST_WAITS)
+  {
+    ExAcquireFastMutex(&listHead.ConsumerLock);
+    element = PopElement(&listHead);
+    ExReleaseFastMutex(&listHead.ConsumerLock);
+
+    if (NULL != element)
+    {
+      isOrdered = isOrdered && element->Index == popped;
+      popped++;
+      continue;
+    }
+
+    sleeps++;
+
+    if (STATUS_TIMEOUT == IMWaitForElements(&listHead, 1, IM_TEST_WAIT_MS))
+    {
+      lostWakeups++;
+    }
+  }
+
+  pthread_join(thread, NULL);
+
+  IM_CHECK(isOrdered);
+  IM_CHECK(lostWakeups == 0);
+
+  printf("  %u elements, %u sleeps\n", popped, sleeps);
+
+  IMDeinitList(&listHead);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestResize()
+{
+  IM_KLIST_HEAD listHead;
+  ULONG i = 0;
+
+  RtlZeroMemory(&listHead, sizeof(listHead));
+
+  IM_CHECK(NT_SUCCESS(IMInitList(&listHead, sizeof(ULONG), IM_TEST_MAX_ELEMENTS, CountFreed)));
+  IM_CHECK(IMResizeList(&listHead, 0, 0) == STATUS_INVALID_PARAMETER_2);
+
+  // positions do not start at the first slot
+  for (i = 0; i < 3; i++)
+  {
+    IM_CHECK(IMTryPush(&listHead, &Elements[i].List, 0, NULL));
+    IM_CHECK(PopElement(&listHead) == &Elements[i]);
+  }
+
+  for (i = 0; i <= listHead.Lanes[0].SlotMask; i++)
+  {
+    IM_CHECK(IMTryPush(&listHead, &Elements[i].List, 0, NULL));
+  }
+
+  // grown ring keeps the elements in order and takes more of them
+  IM_CHECK(NT_SUCCESS(IMResizeList(&listHead, 4 * IM_TEST_MAX_ELEMENTS, 0)));
+  IM_CHECK(listHead.Lanes[0].SlotMask + 1 == 8 * IM_TEST_MAX_ELEMENTS);
+  IM_CHECK(listHead.MaxElementsToPush == 4 * IM_TEST_MAX_ELEMENTS);
+
+  for (i = 2 * IM_TEST_MAX_ELEMENTS; i < 8 * IM_TEST_MAX_ELEMENTS; i++)
+  {
+    IM_CHECK(IMTryPush(&listHead, &Elements[i].List, 0, NULL));
+  }
+
+  IM_CHECK(!IMTryPush(&listHead, &Elements[i].List, 0, NULL));
+
+  for (i = 0; i < 4 * IM_TEST_MAX_ELEMENTS; i++)
+  {
+    IM_CHECK(PopElement(&listHead) == &Elements[i]);
+  }
+
+  // ring shrinks as much as the queued elements let it
+  IM_CHECK(NT_SUCCESS(IMResizeList(&listHead, 1, 0)));
+  IM_CHECK(listHead.Lanes[0].SlotMask + 1 == 8 * IM_TEST_MAX_ELEMENTS);
+  IM_CHECK(listHead.MaxElementsToPush == 1);
+
+  for (i = 4 * IM_TEST_MAX_ELEMENTS; i < 8 * IM_TEST_MAX_ELEMENTS; i++)
+  {
+    IM_CHECK(PopElement(&listHead) == &Elements[i]);
+  }
+
+  IM_CHECK(PopElement(&listHead) == NULL);
+
+  IM_CHECK(NT_SUCCESS(IMResizeList(&listHead, 1, 0)));
+  IM_CHECK(listHead.Lanes[0].SlotMask + 1 == 2);
+
+  IM_CHECK(IMTryPush(&listHead, &Elements[0].List, 0, NULL));
+  IM_CHECK(IMTryPush(&listHead, &Elements[1].List, 0, NULL));
+  IM_CHECK(!IMTryPush(&listHead, &Elements[2].List, 0, NULL));
+  IM_CHECK(PopElement(&listHead) == &Elements[0]);
+  IM_CHECK(PopElement(&listHead) == &Elements[1]);
+
+  IMDeinitList(&listHead);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestResizeWhilePushing()
+{
+  IM_KLIST_HEAD listHead;
+  IM_TEST_PRODUCER producers[IM_TEST_PRODUCERS];
+  pthread_t threads[IM_TEST_PRODUCERS];
+  ULONG next[IM_TEST_PRODUCERS];
+  PIM_TEST_ELEMENT element = NULL;
+  ULONGLONG sequenceNumber = 0;
+  ULONG popped = 0;
+  ULONG resizes = 0;
+  ULONG i = 0;
+  BOOLEAN isOrdered = TRUE;
+
+  RtlZeroMemory(&listHead, sizeof(listHead));
+  RtlZeroMemory(next, sizeof(next));
+
+  IMShimSetProcessorCount(IM_TEST_LANES);
+
+  IM_CHECK(NT_SUCCESS(IMInitList(&listHead, sizeof(ULONG), IM_TEST_MAX_ELEMENTS, CountFreed)));
+
+  for (i = 0; i < IM_TEST_PRODUCERS; i++)
+  {
+    producers[i].ListHead = &listHead;
+    producers[i].Elements = &Elements[i * IM_TEST_PER_PRODUCER];
+    producers[i].Producer = i;
+    IM_CHECK(0 == pthread_create(&threads[i], NULL, ProducePushing, &producers[i]));
+  }
+
+  // rings are moved back and forth under the producers, nothing is lost
+  // or reordered
+  while (popped < IM_TEST_PRODUCERS * IM_TEST_PER_PRODUCER)
+  {
+    if (0 == popped % ((IM_TEST_PRODUCERS * IM_TEST_PER_PRODUCER) / IM_TEST_RESIZES) && resizes < IM_TEST_RESIZES)
+    {
+      IM_CHECK(NT_SUCCESS(IMResizeList(&listHead, 0 == resizes % 2 ? 64 * IM_TEST_MAX_ELEMENTS : 1, 0)));
+      resizes++;
+    }
+
+    ExAcquireFastMutex(&listHead.ConsumerLock);
+    element = PopElement(&listHead);
+    ExReleaseFastMutex(&listHead.ConsumerLock);
+
+    if (NULL == element)
+    {
+      sched_yield();
+      continue;
+    }
+
+    isOrdered = isOrdered && element->Index == next[element->Producer];
+    isOrdered = isOrdered && element->SequenceNumber > sequenceNumber;
+    next[element->Producer] = element->Index + 1;
+    sequenceNumber = element->SequenceNumber;
+    popped++;
+  }
+
+  for (i = 0; i < IM_TEST_PRODUCERS; i++)
+  {
+    pthread_join(threads[i], NULL);
+    IM_CHECK(next[i] == IM_TEST_PER_PRODUCER);
+  }
+
+  IM_CHECK(isOrdered);
+  IM_CHECK(resizes > 1);
+  IM_CHECK(PopElement(&listHead) == NULL);
+  IM_CHECK(IMCountElements(&listHead) == 0);
+
+  printf("  %u elements, %u resizes\n", popped, resizes);
+
+  IMDeinitList(&listHead);
+
+  IMShimSetProcessorCount(1);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestBytes()
+{
+  IM_KLIST_HEAD listHead;
+  ULONG i = 0;
+
+  RtlZeroMemory(&listHead, sizeof(listHead));
+
+  IM_CHECK(NT_SUCCESS(IMInitList(&listHead, sizeof(ULONG), IM_TEST_MAX_ELEMENTS, CountFreed)));
+
+  // no budget, only the amount counts
+  IM_CHECK(IMHasRoom(&listHead, MAXLONG));
+
+  IM_CHECK(NT_SUCCESS(IMResizeList(&listHead, IM_TEST_MAX_ELEMENTS, 100)));
+
+  // empty list takes an element over the budget
+  IM_CHECK(IMHasRoom(&listHead, 500));
+
+  IM_CHECK(IMTryPush(&listHead, &Elements[0].List, 60, NULL));
+  IM_CHECK(IMHasRoom(&listHead, 40));
+  IM_CHECK(!IMHasRoom(&listHead, 41));
+
+  // bytes of the popped element are given back
+  IM_CHECK(IMTryPush(&listHead, &Elements[1].List, 40, NULL));
+  IM_CHECK(IMCountBytes(&listHead) == 100);
+  IM_CHECK(PopElement(&listHead) == &Elements[0]);
+  IM_CHECK(IMCountBytes(&listHead) == 40);
+  IM_CHECK(listHead.MaxBytesPushed == 100);
+
+  // amount is still a limit
+  for (i = 2; i < IM_TEST_MAX_ELEMENTS + 1; i++)
+  {
+    IM_CHECK(IMTryPush(&listHead, &Elements[i].List, 0, NULL));
+  }
+
+  IM_CHECK(IMCountElements(&listHead) == IM_TEST_MAX_ELEMENTS);
+  IM_CHECK(!IMHasRoom(&listHead, 1));
+  IM_CHECK(IMWaitForRoom(&listHead, 1, 10) == STATUS_TIMEOUT);
+
+  while (NULL != PopElement(&listHead))
+  {
+  }
+
+  IM_CHECK(IMCountBytes(&listHead) == 0);
+  IM_CHECK(IMCountElements(&listHead) == 0);
+
+  IMDeinitList(&listHead);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestPriority()
+{
+  IM_KLIST_HEAD listHead;
+  PIM_TEST_ELEMENT priority = &Elements[IM_TEST_MAX_ELEMENTS];
+  ULONG i = 0;
+
+  RtlZeroMemory(&listHead, sizeof(listHead));
+  ElementsFreed = 0;
+
+  IM_CHECK(NT_SUCCESS(IMInitList(&listHead, sizeof(ULONG), IM_TEST_MAX_ELEMENTS, CountFreed)));
+
+  // priority element wakes the consumer whatever the watermark is
+  IM_CHECK(IMWaitForElements(&listHead, 3, 10) == STATUS_TIMEOUT);
+  IM_CHECK(IMTryPush(&listHead, &Elements[0].List, 10, &Elements[0].SequenceNumber));
+  IM_CHECK(KeReadStateEvent(listHead.NewElementEvent) == 0);
+  IM_CHECK(IMPushPriority(&priority[0].List, &listHead, 10, &priority[0].SequenceNumber));
+  IM_CHECK(KeReadStateEvent(listHead.NewElementEvent) != 0);
+  IM_CHECK(IMWaitForElements(&listHead, 3, 10) == STATUS_SUCCESS);
+
+  // it has room of its own, the full budget does not take it
+  for (i = 1; i < IM_TEST_MAX_ELEMENTS; i++)
+  {
+    IM_CHECK(IMTryPush(&listHead, &Elements[i].List, 10, &Elements[i].SequenceNumber));
+  }
+
+  IM_CHECK(!IMHasRoom(&listHead, 0));
+  IM_CHECK(IMPushPriority(&priority[1].List, &listHead, 10, &priority[1].SequenceNumber));
+
+  IM_CHECK(priority[0].SequenceNumber > Elements[0].SequenceNumber);
+  IM_CHECK(priority[1].SequenceNumber > priority[0].SequenceNumber);
+  IM_CHECK(IMCountElements(&listHead) == IM_TEST_MAX_ELEMENTS + 2);
+  IM_CHECK(IMCountBytes(&listHead) == 10 * IM_TEST_MAX_ELEMENTS);
+  IM_CHECK(!IMHasRoom(&listHead, 0));
+
+  // shared peek leaves them out, pop takes what was peeked
+  IM_CHECK(IMPeek(&listHead) == &priority[0].List);
+  IM_CHECK(IMPeekShared(&listHead) == &Elements[0].List);
+  IM_CHECK(PopElement(&listHead) == &Elements[0]);
+
+  // otherwise they go first, in their order
+  IM_CHECK(PopElement(&listHead) == &priority[0]);
+  IM_CHECK(IMPeek(&listHead) == &priority[1].List);
+  IM_CHECK(PopElement(&listHead) == &priority[1]);
+
+  for (i = 1; i < IM_TEST_MAX_ELEMENTS; i++)
+  {
+    IM_CHECK(PopElement(&listHead) == &Elements[i]);
+  }
+
+  IM_CHECK(PopElement(&listHead) == NULL);
+
+  // lane is bounded, element which does not fit is freed
+  for (i = 0; i < IM_KLIST_PRIORITY_SLOTS; i++)
+  {
+    IM_CHECK(IMPushPriority(&priority[i].List, &listHead, 0, NULL));
+  }
+
+  IM_CHECK(!IMPushPriority(&priority[i].List, &listHead, 0, NULL));
+  IM_CHECK(ElementsFreed == 1);
+  IM_CHECK(IMPeekShared(&listHead) == NULL);
+
+  // the rest is freed with the list
+  IMDeinitList(&listHead);
+
+  IM_CHECK(ElementsFreed == IM_KLIST_PRIORITY_SLOTS + 1);
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestPushPop);
+  IM_RUN(TestPushWhenFull);
+  IM_RUN(TestProducers);
+  IM_RUN(TestLanes);
+  IM_RUN(TestMerge);
+  IM_RUN(TestWaitForElements);
+  IM_RUN(TestWaitForRoom);
+  IM_RUN(TestNoLostWakeups);
+  IM_RUN(TestResize);
+  IM_RUN(TestResizeWhilePushing);
+  IM_RUN(TestBytes);
+  IM_RUN(TestPriority);
+
+  return IM_TEST_RESULT();
+}
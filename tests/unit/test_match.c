@@ -0,0 +1,121 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_match.c
+
+Abstract:
+Host tests of the Aho-Corasick automaton in im_match.c
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_test.h"
+#include "im_match.h"
+#include "im_utils.h"
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static LONG Search(
+    _In_ PIM_MATCHER Matcher,
+    _In_ PCWSTR String)
+{
+  UNICODE_STRING string;
+  ULONG index = 0;
+
+  RtlInitUnicodeString(&string, String);
+
+  return IMMatcherSearch(Matcher, &string, &index) ? (LONG)index : -1;
+}
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+static VOID TestSuffixes()
+{
+  UNICODE_STRING patterns[] = {
+      CONSTANT_STRING(L"he"),
+      CONSTANT_STRING(L"she"),
+      CONSTANT_STRING(L"his"),
+      CONSTANT_STRING(L"hers"),
+  };
+  PIM_MATCHER matcher = NULL;
+
+  IM_CHECK(NT_SUCCESS(IMMatcherBuild(patterns, ARRAYSIZE(patterns), &matcher)));
+  IM_CHECK(matcher->NodeCount == 10);
+
+  // "she" is reached first, "he" is its suffix and is found through the failure link
+  IM_CHECK(Search(matcher, L"ushers") == 1);
+  IM_CHECK(Search(matcher, L"xhix") == -1);
+  IM_CHECK(Search(matcher, L"ahis") == 2);
+  IM_CHECK(Search(matcher, L"") == -1);
+
+  IMMatcherFree(matcher);
+}
+
+static VOID TestCaseAndOverlap()
+{
+  UNICODE_STRING patterns[] = {
+      CONSTANT_STRING(L"Steam\\crashhandler.dll"),
+  };
+  UNICODE_STRING path = CONSTANT_STRING(L"\\Device\\HarddiskVolume3\\Steam\\Steam\\CrashHandler.DLL");
+  UNICODE_STRING fragment = CONSTANT_STRING(L"Steam\\crashhandler.dll");
+  PIM_MATCHER matcher = NULL;
+
+  IM_CHECK(NT_SUCCESS(IMMatcherBuild(patterns, ARRAYSIZE(patterns), &matcher)));
+
+  IM_CHECK(Search(matcher, L"\\Device\\HarddiskVolume3\\STEAM\\crashhandler.dll") == 0);
+  IM_CHECK(Search(matcher, L"\\Device\\HarddiskVolume3\\Steam\\steamclient.dll") == -1);
+
+  // overlapping candidates, the match starts at the second Steam folder
+  IM_CHECK(Search(matcher, path.Buffer) == 0);
+  IM_CHECK(IMIsContainsString(&path, &fragment));
+
+  IMMatcherFree(matcher);
+}
+
+static VOID TestInvalidPatterns()
+{
+  UNICODE_STRING patterns[] = {
+      CONSTANT_STRING(L"inject"),
+      {0, 0, NULL},
+  };
+  PIM_MATCHER matcher = NULL;
+
+  IM_CHECK(IMMatcherBuild(patterns, ARRAYSIZE(patterns), &matcher) == STATUS_INVALID_PARAMETER_1);
+  IM_CHECK(matcher == NULL);
+
+  // no patterns, nothing is found
+  IM_CHECK(NT_SUCCESS(IMMatcherBuild(patterns, 0, &matcher)));
+  IM_CHECK(Search(matcher, L"inject") == -1);
+  IMMatcherFree(matcher);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestSuffixes);
+  IM_RUN(TestCaseAndOverlap);
+  IM_RUN(TestInvalidPatterns);
+
+  return IM_TEST_RESULT();
+}
@@ -0,0 +1,253 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_ntab.c
+
+Abstract:
+Host tests of the table of interned names in im_ntab.c
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_test.h"
+#include "im_ntab.h"
+#include "im_shim.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_TEST_NAME_CHARS 16
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static IM_NAME_TABLE Table;
+static PIM_NAME_ENTRY Entries[IM_MAX_INTERNED_NAMES];
+
+//------------------------------------------------------------------------
+//  Helpers.
+//------------------------------------------------------------------------
+
+//
+// \dll<hex of the index>
+//
+static VOID IMTestName(
+    _In_ ULONG Index,
+    _Out_writes_(IM_TEST_NAME_CHARS) PWCHAR Buffer,
+    _Out_ PUNICODE_STRING Name)
+{
+  static const WCHAR prefix[] = L"\\dll";
+  ULONG length = sizeof(prefix) / sizeof(WCHAR) - 1;
+  ULONG i = 0;
+
+  RtlCopyMemory(Buffer, prefix, length * sizeof(WCHAR));
+
+  for (i = 0; i < 8; i++)
+  {
+    Buffer[length++] = L"0123456789abcdef"[(Index >> (28 - 4 * i)) & 0xF];
+  }
+
+  Name->Buffer = Buffer;
+  Name->Length = (USHORT)(length * sizeof(WCHAR));
+  Name->MaximumLength = (USHORT)(IM_TEST_NAME_CHARS * sizeof(WCHAR));
+}
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+static VOID TestIntern()
+{
+  UNICODE_STRING client = CONSTANT_STRING(L"\\Games\\valve\\client.dll");
+  UNICODE_STRING upper = CONSTANT_STRING(L"\\Games\\valve\\CLIENT.dll");
+  WCHAR buffer[sizeof(L"\\Games\\valve\\client.dll") / sizeof(WCHAR)];
+  UNICODE_STRING copy;
+  PIM_NAME_ENTRY first = NULL;
+  PIM_NAME_ENTRY second = NULL;
+  PIM_NAME_ENTRY other = NULL;
+
+  IM_CHECK(NT_SUCCESS(IMNameTableInit(&Table)));
+
+  IM_CHECK(NT_SUCCESS(IMNameTableIntern(&Table, &client, &first)));
+  IM_CHECK(first->Id == 1);
+  IM_CHECK(first->References == 1);
+  IM_CHECK(first->Name.Length == client.Length);
+  IM_CHECK(first->Name.MaximumLength == sizeof(L"\\Games\\valve\\client.dll"));
+  IM_CHECK(first->Name.Buffer[client.Length / sizeof(WCHAR)] == L'\0');
+
+  // same string from another buffer is the same name
+  RtlCopyMemory(buffer, client.Buffer, client.Length);
+  copy.Buffer = buffer;
+  copy.Length = client.Length;
+  copy.MaximumLength = sizeof(buffer);
+
+  IM_CHECK(NT_SUCCESS(IMNameTableIntern(&Table, &copy, &second)));
+  IM_CHECK(second == first);
+  IM_CHECK(first->References == 2);
+
+  // names are not folded
+  IM_CHECK(NT_SUCCESS(IMNameTableIntern(&Table, &upper, &other)));
+  IM_CHECK(other != first);
+  IM_CHECK(other->Id == 2);
+  IM_CHECK(Table.Count == 2);
+
+  IMNameTableReference(other);
+  IM_CHECK(other->References == 2);
+
+  IMNameTableRelease(other);
+  IMNameTableRelease(other);
+  IMNameTableRelease(second);
+  IMNameTableRelease(first);
+
+  // unreferenced names stay cached with their ids
+  IM_CHECK(NT_SUCCESS(IMNameTableIntern(&Table, &upper, &other)));
+  IM_CHECK(other->Id == 2);
+  IM_CHECK(Table.Count == 2);
+  IMNameTableRelease(other);
+
+  IM_CHECK(IMNameTableIntern(&Table, NULL, &other) == STATUS_INVALID_PARAMETER_2);
+
+  IMNameTableDeinit(&Table);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestEviction()
+{
+  WCHAR buffer[IM_TEST_NAME_CHARS];
+  UNICODE_STRING name;
+  PIM_NAME_ENTRY entry = NULL;
+  ULONG reused = 0;
+  ULONG i = 0;
+
+  IM_CHECK(NT_SUCCESS(IMNameTableInit(&Table)));
+
+  for (; i < IM_MAX_INTERNED_NAMES; i++)
+  {
+    IMTestName(i, buffer, &name);
+    IM_CHECK(NT_SUCCESS(IMNameTableIntern(&Table, &name, &Entries[i])));
+    IM_CHECK(Entries[i]->Id == i + 1);
+  }
+
+  IM_CHECK(Table.Count == IM_MAX_INTERNED_NAMES);
+
+  // every name is in use, none can go
+  IMTestName(IM_MAX_INTERNED_NAMES, buffer, &name);
+  IM_CHECK(IMNameTableIntern(&Table, &name, &entry) == STATUS_INSUFFICIENT_RESOURCES);
+  IM_CHECK(entry == NULL);
+
+  // one released name gives its id to the new one
+  IMNameTableRelease(Entries[7]);
+
+  IM_CHECK(NT_SUCCESS(IMNameTableIntern(&Table, &name, &entry)));
+  IM_CHECK(entry->Id == 8);
+  IM_CHECK(Table.Count == IM_MAX_INTERNED_NAMES);
+  Entries[7] = entry;
+
+  // evicted name comes back with another id
+  IMNameTableRelease(Entries[100]);
+
+  IMTestName(7, buffer, &name);
+  IM_CHECK(NT_SUCCESS(IMNameTableIntern(&Table, &name, &entry)));
+  IM_CHECK(entry->Id == 101);
+  Entries[100] = entry;
+
+  // looked up lately names get the second chance
+  IMNameTableRelease(Entries[200]);
+  IMNameTableRelease(Entries[300]);
+
+  IMTestName(200, buffer, &name);
+  IM_CHECK(NT_SUCCESS(IMNameTableIntern(&Table, &name, &entry)));
+  IM_CHECK(entry == Entries[200]);
+  IMNameTableRelease(entry);
+
+  IMTestName(IM_MAX_INTERNED_NAMES + 1, buffer, &name);
+  IM_CHECK(NT_SUCCESS(IMNameTableIntern(&Table, &name, &entry)));
+  reused = entry->Id;
+  IM_CHECK(reused == 301);
+  Entries[300] = entry;
+
+  for (i = 0; i < IM_MAX_INTERNED_NAMES; i++)
+  {
+    if (i != 200)
+    {
+      IMNameTableRelease(Entries[i]);
+    }
+  }
+
+  IMNameTableDeinit(&Table);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestSend()
+{
+  UNICODE_STRING client = CONSTANT_STRING(L"\\Games\\valve\\client.dll");
+  PIM_NAME_ENTRY entry = NULL;
+  KIRQL oldIrql;
+
+  IM_CHECK(NT_SUCCESS(IMNameTableInit(&Table)));
+  IM_CHECK(NT_SUCCESS(IMNameTableIntern(&Table, &client, &entry)));
+
+  KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+  // record did not go out, name is still to be sent
+  IM_CHECK(IMNameTableBeginSend(&Table, entry));
+  IMNameTableEndSend(entry, FALSE);
+
+  IM_CHECK(IMNameTableBeginSend(&Table, entry));
+  IMNameTableEndSend(entry, TRUE);
+
+  IM_CHECK(!IMNameTableBeginSend(&Table, entry));
+
+  KeLowerIrql(oldIrql);
+
+  // client which connected later has none of the names
+  IMNameTableNewClient(&Table);
+
+  KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+  IM_CHECK(IMNameTableBeginSend(&Table, entry));
+  IMNameTableEndSend(entry, TRUE);
+
+  IM_CHECK(!IMNameTableBeginSend(&Table, entry));
+
+  KeLowerIrql(oldIrql);
+
+  // generations wrap without 0 and the sending bit
+  Table.Generation = 0x7FFFFFFF;
+  IMNameTableNewClient(&Table);
+  IM_CHECK(Table.Generation == 1);
+
+  IMNameTableRelease(entry);
+  IMNameTableDeinit(&Table);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestIntern);
+  IM_RUN(TestEviction);
+  IM_RUN(TestSend);
+
+  return IM_TEST_RESULT();
+}
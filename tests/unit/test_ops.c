@@ -0,0 +1,1078 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_ops.c
+
+Abstract:
+Host tests of the create callbacks and decisions in im_ops.c
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <unistd.h>
+
+#include "im_test.h"
+#include "im_fake.h"
+#include "im_req.h"
+#include "im_list.h"
+#include "im_rec.h"
+#include "im_proc.h"
+#include "im_vcache.h"
+#include "im_ntab.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_TEST_RECORDS_BUFFER_SIZE 4096
+#define IM_TEST_OVERFLOW 5
+#define IM_TEST_PRODUCERS 4
+#define IM_TEST_LOADS 2000
+
+//
+// What the client got from the queue
+//
+typedef struct _IM_TEST_DRAINED
+{
+  ULONG Records;
+  ULONG Gaps;
+  ULONG Lost;
+
+  // records got before the last gap marker
+  ULONG RecordsBeforeGap;
+
+  ULONGLONG FirstSequenceNumber;
+  ULONGLONG LastSequenceNumber;
+
+  // records which came after a later one
+  ULONG Unordered;
+
+  // blocked records and the ones of them no other record came before
+  ULONG Blocked;
+  ULONG BlockedAhead;
+} IM_TEST_DRAINED, *PIM_TEST_DRAINED;
+
+//
+// Thread which loads files on a processor of its own
+//
+typedef struct _IM_TEST_PRODUCER
+{
+  ULONG Processor;
+  ULONG Created;
+  __volatile LONG IsDone;
+} IM_TEST_PRODUCER, *PIM_TEST_PRODUCER;
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static IM_WIRE_BATCH_DECODER Decoder;
+
+static PVOID RecordsBuffer[IM_TEST_RECORDS_BUFFER_SIZE / sizeof(PVOID)];
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static BOOLEAN DecideBlock(
+    _In_ PCWSTR FileName)
+{
+  UNICODE_STRING processName = CONSTANT_STRING(IM_FAKE_HL_IMAGE);
+  UNICODE_STRING fullName;
+  PIM_NAME_INFORMATION processNameInfo = NULL;
+  PIM_NAME_INFORMATION nameInfo = NULL;
+  PIM_TRIE policy = NULL;
+  BOOLEAN isBlocked = FALSE;
+
+  RtlInitUnicodeString(&fullName, FileName);
+
+  IM_CHECK(NT_SUCCESS(IMSplitNameInformation(&processName, &processNameInfo)));
+  IM_CHECK(NT_SUCCESS(IMCreatePolicy(processNameInfo, &policy)));
+  IM_CHECK(NT_SUCCESS(IMSplitNameInformation(&fullName, &nameInfo)));
+  IM_CHECK(NT_SUCCESS(IMDecideBlock(policy, nameInfo, &isBlocked)));
+
+  IMReleaseNameInformation(nameInfo);
+  IMReleaseNameInformation(processNameInfo);
+  IMTrieFree(policy);
+
+  return isBlocked;
+}
+
+//
+// Loads of an allowed file, returns how many of them were opened
+//
+static ULONG CreateRecords(
+    _In_ ULONG Count)
+{
+  IM_FAKE_CREATE create;
+  ULONG created = 0;
+  ULONG i = 0;
+
+  for (; i < Count; i++)
+  {
+    IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+
+    if (STATUS_SUCCESS == IMFakeRunCreate(&create))
+    {
+      created++;
+    }
+  }
+
+  return created;
+}
+
+static VOID CountRecord(
+    _In_ PIM_WIRE_RECORD Record,
+    _Inout_ PIM_TEST_DRAINED Drained)
+{
+  if (Record->Flags & IM_WIRE_GAP)
+  {
+    Drained->Gaps++;
+    Drained->Lost += Record->Lost;
+    Drained->RecordsBeforeGap = Drained->Records;
+    return;
+  }
+
+  if (0 == Drained->Records)
+  {
+    Drained->FirstSequenceNumber = Record->SequenceNumber;
+  }
+  else if (Record->SequenceNumber <= Drained->LastSequenceNumber)
+  {
+    Drained->Unordered++;
+  }
+
+  if (Record->Flags & IM_WIRE_BLOCKED)
+  {
+    Drained->BlockedAhead += Drained->Blocked == Drained->Records;
+    Drained->Blocked++;
+  }
+
+  Drained->LastSequenceNumber = Record->SequenceNumber;
+  Drained->Records++;
+}
+
+//
+// Gets records until the queue is empty, MaxCalls of IMGetRecords at most
+//
+static VOID DrainRecords(
+    _In_ ULONG Flags,
+    _In_ ULONG BufferSize,
+    _In_ ULONG MaxCalls,
+    _Out_ PIM_TEST_DRAINED Drained)
+{
+  PUCHAR buffer = (PUCHAR)RecordsBuffer;
+  IM_WIRE_RECORD record;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA] = {NULL, NULL};
+  ULONG returnLen = 0;
+  ULONG offset = 0;
+  ULONG calls = 0;
+
+  RtlZeroMemory(Drained, sizeof(IM_TEST_DRAINED));
+  RtlZeroMemory(&record, sizeof(record));
+
+  for (; calls < MaxCalls && NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, Flags, buffer, BufferSize, &returnLen)); calls++)
+  {
+    if (Flags & IM_RECORDS_BATCH)
+    {
+      IM_CHECK(IMWireBeginBatchDecode(&Decoder, buffer, returnLen));
+
+      while (!IMWireIsBatchEnd(&Decoder) && IMWireDecodeBatchRecord(&Decoder, &record, strings))
+      {
+        CountRecord(&record, Drained);
+      }
+
+      IM_CHECK(IMWireIsBatchEnd(&Decoder));
+      continue;
+    }
+
+    for (offset = 0; offset < returnLen && IMWireDecodeRecord(buffer + offset, returnLen - offset, &record, strings); offset += record.Length)
+    {
+      CountRecord(&record, Drained);
+    }
+
+    IM_CHECK(offset == returnLen);
+  }
+}
+
+//
+// Records of CreateRecords the budget takes, measured on one of them
+//
+static ULONG RecordsLimit()
+{
+  IM_TEST_DRAINED drained;
+  ULONG bytes = 0;
+
+  IM_CHECK(CreateRecords(1) == 1);
+  bytes = (ULONG)IMCountBytes(&Globals.RecordsHead);
+  DrainRecords(0, sizeof(RecordsBuffer), MAXULONG, &drained);
+
+  IM_CHECK(bytes > sizeof(IM_KRECORD_LIST));
+
+  return 0 != bytes ? (ULONG)Globals.RecordsHead.MaxBytesToPush / bytes : 0;
+}
+
+//
+// Lookups of the verdict caches as GetStatisticsCommand reports them
+//
+static BOOLEAN VerdictsCounted(
+    _In_ ULONGLONG Hits,
+    _In_ ULONGLONG Misses)
+{
+  IM_RECORDS_STATISTICS statistics;
+
+  IMGetStatistics(&statistics);
+
+  return statistics.VerdictHits == Hits && statistics.VerdictMisses == Misses;
+}
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+static VOID TestDecideBlock()
+{
+  DRIVER_OBJECT driverObject;
+
+  // restricted files are compiled with the globals
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IM_CHECK(!DecideBlock(IM_FAKE_VOLUME L"\\Windows\\Fonts\\arial.ttf"));
+  IM_CHECK(!DecideBlock(IM_FAKE_VOLUME L"\\WINDOWS\\System32\\d3d9.dll"));
+  IM_CHECK(!DecideBlock(IM_FAKE_GAME_DIR L"valve\\client.dll"));
+  IM_CHECK(!DecideBlock(IM_FAKE_VOLUME L"\\Games\\Steam\\steamclient.dll"));
+  IM_CHECK(DecideBlock(IM_FAKE_GAME_DIR L"valve\\client.exe"));
+  IM_CHECK(DecideBlock(IM_FAKE_VOLUME L"\\Games\\Steam\\crashhandler.dll"));
+  IM_CHECK(DecideBlock(IM_FAKE_VOLUME L"\\Temp\\inject.dll"));
+  IM_CHECK(DecideBlock(IM_FAKE_VOLUME L"\\Games\\SteamHack\\inject.dll"));
+  IM_CHECK(DecideBlock(IM_FAKE_VOLUME L"\\Games\\Steam\\Steam\\CrashHandler.dll"));
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestCreateCallbacks()
+{
+  DRIVER_OBJECT driverObject;
+  IM_FAKE_CREATE create;
+  PVOID alignedBuffer[IM_TEST_RECORDS_BUFFER_SIZE / sizeof(PVOID)];
+  PCHAR buffer = (PCHAR)alignedBuffer;
+  IM_WIRE_RECORD record;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA];
+  ULONGLONG sequenceNumber = 0;
+  ULONG returnLen = 0;
+  ULONG offset = 0;
+  ULONG count = 0;
+
+  RtlZeroMemory(&record, sizeof(record));
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  // allowed load
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+  IM_CHECK(!create.FileObject.OpenCancelled);
+
+  // restricted load
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+  IM_CHECK(create.FileObject.OpenCancelled);
+
+  // software renderer is redirected to hardware one
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"sw.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_REPARSE);
+  IM_CHECK(IMTestEquals(&create.FileObject.FileName, IM_FAKE_GAME_DIR L"hw.dll"));
+  IMFakeReleaseCreate(&create);
+
+  // not an execute open, nothing is logged
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_READ_DATA);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+
+  // not a target process, nothing is logged
+  IMShimSetCurrentProcessId(IM_FAKE_OTHER_PID);
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+  IM_CHECK(!create.FileObject.OpenCancelled);
+
+  IM_CHECK(NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, 0, buffer, sizeof(alignedBuffer), &returnLen)));
+
+  while (offset < returnLen)
+  {
+    IM_CHECK(IMWireDecodeRecord((PUCHAR)buffer + offset, returnLen - offset, &record, strings));
+    IM_CHECK(record.Flags & IM_WIRE_SUCCEEDED);
+
+    // blocked and video mode records come ahead of the allowed one
+    switch (count)
+    {
+    case 0:
+      IM_CHECK(record.Flags & IM_WIRE_BLOCKED);
+      sequenceNumber = record.SequenceNumber;
+      break;
+    case 1:
+      IM_CHECK(record.VideoMode == IM_VIDEO_SW_TO_HW);
+      IM_CHECK(record.SequenceNumber == sequenceNumber + 1);
+      break;
+    case 2:
+      IM_CHECK(!(record.Flags & IM_WIRE_BLOCKED));
+      IM_CHECK(record.SequenceNumber == 1);
+      break;
+    default:
+      break;
+    }
+
+    offset += record.Length;
+    count++;
+  }
+
+  IM_CHECK(count == 3);
+  IM_CHECK(IMGetRecords(&Globals.RecordsHead, 0, buffer, sizeof(alignedBuffer), &returnLen) == STATUS_NO_MORE_ENTRIES);
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestCachedVerdicts()
+{
+  DRIVER_OBJECT driverObject;
+  IM_FAKE_CREATE create;
+  FILE_OBJECT relatedObject;
+  PVOID alignedBuffer[IM_TEST_RECORDS_BUFFER_SIZE / sizeof(PVOID)];
+  PCHAR buffer = (PCHAR)alignedBuffer;
+  IM_WIRE_RECORD record;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA];
+  ULONG clientId = 0;
+  ULONG returnLen = 0;
+  ULONG offset = 0;
+  ULONG count = 0;
+
+  RtlZeroMemory(&record, sizeof(record));
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  // first loads are decided in post create and remembered
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+  IM_CHECK(create.FileObject.OpenCancelled);
+  IM_CHECK(VerdictsCounted(0, 2));
+
+  // repeated loads are decided in pre create, blocked one is not even opened
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+  IM_CHECK(!create.FileObject.OpenCancelled);
+  IM_CHECK(VerdictsCounted(2, 2));
+
+  // only loads are blocked and logged
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_READ_DATA);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+  IM_CHECK(VerdictsCounted(3, 2));
+
+  // relative opens are looked up by the opened name, names are not folded
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+  create.FileObject.RelatedFileObject = &relatedObject;
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\TEMP\\inject.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+  IM_CHECK(create.FileObject.OpenCancelled);
+  IM_CHECK(VerdictsCounted(4, 3));
+
+  // video mode is decided every time, it is never cached
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"sw.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_REPARSE);
+  IMFakeReleaseCreate(&create);
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"sw.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_REPARSE);
+  IMFakeReleaseCreate(&create);
+  IM_CHECK(VerdictsCounted(4, 5));
+
+  // an instance was torn down, everything is decided again
+  IMInvalidateVerdicts();
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+  IM_CHECK(create.FileObject.OpenCancelled);
+  IM_CHECK(VerdictsCounted(4, 6));
+
+  // cached loads are logged like the decided ones
+  IM_CHECK(NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, 0, buffer, sizeof(alignedBuffer), &returnLen)));
+
+  while (offset < returnLen)
+  {
+    IM_CHECK(IMWireDecodeRecord((PUCHAR)buffer + offset, returnLen - offset, &record, strings));
+    IM_CHECK(record.Flags & IM_WIRE_SUCCEEDED);
+
+    // blocked and video mode records come ahead of the allowed ones
+    if (count < 6)
+    {
+      IM_CHECK((record.Flags & IM_WIRE_BLOCKED) || IM_NOT_APPLICABLE != record.VideoMode);
+    }
+    else if (6 == count)
+    {
+      IM_CHECK(!(record.Flags & IM_WIRE_BLOCKED));
+      clientId = record.Names[IM_FILE_NAME_INDEX].Id;
+    }
+    else if (7 == count)
+    {
+      // name came with the first allowed record
+      IM_CHECK(!(record.Flags & IM_WIRE_BLOCKED));
+      IM_CHECK(record.Names[IM_FILE_NAME_INDEX].Id == clientId);
+      IM_CHECK(record.Names[IM_FILE_NAME_INDEX].Size == 0);
+    }
+
+    offset += record.Length;
+    count++;
+  }
+
+  IM_CHECK(count == 9);
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestRecordNames()
+{
+  DRIVER_OBJECT driverObject;
+  IM_FAKE_CREATE create;
+  PVOID alignedBuffer[IM_TEST_RECORDS_BUFFER_SIZE / sizeof(PVOID)];
+  PCHAR buffer = (PCHAR)alignedBuffer;
+  IM_WIRE_RECORD record;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA];
+  PIM_KRECORD_LIST recordList = NULL;
+  PIM_NAME_ENTRY processName = NULL;
+  PIM_NAME_INFORMATION nameInfo = NULL;
+  UNICODE_STRING fullName = CONSTANT_STRING(IM_FAKE_GAME_DIR L"valve\\client.dll");
+  ULONG names = 0;
+  ULONG returnLen = 0;
+
+  RtlZeroMemory(&record, sizeof(record));
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+  processName = IMFindTargetProcess(IM_FAKE_HL_PID)->InternedName;
+
+  // the first record of a name carries it, null terminated, in index order
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+  IM_CHECK(NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, 0, buffer, sizeof(alignedBuffer), &returnLen)));
+
+  IM_CHECK(IMWireDecodeRecord((PUCHAR)buffer, returnLen, &record, strings));
+  IM_CHECK(returnLen == record.Length);
+  IM_CHECK(record.Names[IM_PROCESS_NAME_INDEX].Id == processName->Id);
+  IM_CHECK(record.Names[IM_FILE_NAME_INDEX].Id != processName->Id && record.Names[IM_FILE_NAME_INDEX].Id != 0);
+  IM_CHECK(record.Names[IM_PROCESS_NAME_INDEX].Size == sizeof(IM_FAKE_HL_IMAGE));
+  IM_CHECK(record.Names[IM_FILE_NAME_INDEX].Size == sizeof(IM_FAKE_GAME_DIR L"valve\\client.dll"));
+  IM_CHECK(record.Length == IM_WIRE_RECORD_SIZE + sizeof(IM_FAKE_HL_IMAGE) + sizeof(IM_FAKE_GAME_DIR L"valve\\client.dll"));
+  IM_CHECK(0 == wcscmp((PCWSTR)strings[IM_PROCESS_NAME_INDEX], IM_FAKE_HL_IMAGE));
+  IM_CHECK(0 == wcscmp((PCWSTR)strings[IM_FILE_NAME_INDEX], IM_FAKE_GAME_DIR L"valve\\client.dll"));
+
+  // then only the ids, and the name is not interned again
+  names = Globals.Names.Count;
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+  IM_CHECK(NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, 0, buffer, sizeof(alignedBuffer), &returnLen)));
+
+  IM_CHECK(IMWireDecodeRecord((PUCHAR)buffer, returnLen, &record, strings));
+  IM_CHECK(returnLen == IM_WIRE_RECORD_SIZE);
+  IM_CHECK(NULL == strings[IM_PROCESS_NAME_INDEX] && NULL == strings[IM_FILE_NAME_INDEX]);
+  IM_CHECK(record.Names[IM_PROCESS_NAME_INDEX].Size == 0 && record.Names[IM_FILE_NAME_INDEX].Size == 0);
+  IM_CHECK(record.Names[IM_PROCESS_NAME_INDEX].Id == processName->Id);
+  IM_CHECK(Globals.Names.Count == names);
+
+  // record which does not fit with a new name leaves it unsent
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+  IM_CHECK(IMGetRecords(&Globals.RecordsHead, 0, buffer, IM_WIRE_RECORD_SIZE, &returnLen) == STATUS_NO_MORE_ENTRIES);
+  IM_CHECK(NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, 0, buffer, sizeof(alignedBuffer), &returnLen)));
+  IM_CHECK(IMWireDecodeRecord((PUCHAR)buffer, returnLen, &record, strings));
+  IM_CHECK(record.Flags & IM_WIRE_BLOCKED);
+  IM_CHECK(record.Names[IM_PROCESS_NAME_INDEX].Size == 0);
+  IM_CHECK(record.Names[IM_FILE_NAME_INDEX].Size == sizeof(IM_FAKE_VOLUME L"\\Temp\\inject.dll"));
+  IM_CHECK(0 == wcscmp((PCWSTR)strings[IM_FILE_NAME_INDEX], IM_FAKE_VOLUME L"\\Temp\\inject.dll"));
+
+  // new client gets every name again
+  IMNameTableNewClient(&Globals.Names);
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+  IM_CHECK(NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, 0, buffer, sizeof(alignedBuffer), &returnLen)));
+  IM_CHECK(IMWireDecodeRecord((PUCHAR)buffer, returnLen, &record, strings));
+  IM_CHECK(record.Length == IM_WIRE_RECORD_SIZE + sizeof(IM_FAKE_HL_IMAGE) + sizeof(IM_FAKE_GAME_DIR L"valve\\client.dll"));
+
+  // process named like the file it loads sends the name once
+  IM_CHECK(NT_SUCCESS(IMSplitNameInformation(&fullName, &nameInfo)));
+  IM_CHECK(NT_SUCCESS(IMNameTableIntern(&Globals.Names, &fullName, &processName)));
+  IM_CHECK(NT_SUCCESS(IMCreateRecord(&recordList, &create.Data, nameInfo, processName, IM_NOT_APPLICABLE, FALSE)));
+  IMPushRecord(recordList);
+  IMNameTableRelease(processName);
+  IMReleaseNameInformation(nameInfo);
+
+  IMNameTableNewClient(&Globals.Names);
+  IM_CHECK(NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, 0, buffer, sizeof(alignedBuffer), &returnLen)));
+  IM_CHECK(IMWireDecodeRecord((PUCHAR)buffer, returnLen, &record, strings));
+  IM_CHECK(record.Names[IM_PROCESS_NAME_INDEX].Id == record.Names[IM_FILE_NAME_INDEX].Id);
+  IM_CHECK(record.Length == IM_WIRE_RECORD_SIZE + sizeof(IM_FAKE_GAME_DIR L"valve\\client.dll"));
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestRecordBatch()
+{
+  DRIVER_OBJECT driverObject;
+  IM_FAKE_CREATE create;
+  PVOID alignedBuffer[IM_TEST_RECORDS_BUFFER_SIZE / sizeof(PVOID)];
+  PCHAR buffer = (PCHAR)alignedBuffer;
+  IM_WIRE_RECORD record;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA] = {NULL, NULL};
+  ULONGLONG sequenceNumber = 0;
+  ULONG returnLen = 0;
+
+  RtlZeroMemory(&record, sizeof(record));
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+
+  // first record does not fit with its names, they stay unsent
+  IM_CHECK(IMGetRecords(&Globals.RecordsHead, IM_RECORDS_BATCH, buffer, IM_WIRE_BATCH_HEADER_SIZE + 16, &returnLen) == STATUS_NO_MORE_ENTRIES);
+  IM_CHECK(IMGetRecords(&Globals.RecordsHead, IM_RECORDS_BATCH, buffer, IM_WIRE_BATCH_HEADER_SIZE - 1, &returnLen) == STATUS_NO_MORE_ENTRIES);
+
+  IM_CHECK(NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, IM_RECORDS_BATCH, buffer, sizeof(alignedBuffer), &returnLen)));
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == 0);
+
+  // smaller than the three records with the same strings
+  IM_CHECK(returnLen < 3 * IM_WIRE_RECORD_SIZE + sizeof(IM_FAKE_HL_IMAGE) + sizeof(IM_FAKE_GAME_DIR L"valve\\client.dll") + sizeof(IM_FAKE_VOLUME L"\\Temp\\inject.dll"));
+  IM_CHECK(IMWireIsBatch((PUCHAR)buffer, returnLen));
+  IM_CHECK(IMWireBeginBatchDecode(&Decoder, (PUCHAR)buffer, returnLen));
+
+  // blocked record goes first and takes the strings of the process along
+  IM_CHECK(IMWireDecodeBatchRecord(&Decoder, &record, strings));
+  IM_CHECK(record.Flags & IM_WIRE_BLOCKED);
+  IM_CHECK(record.Names[IM_PROCESS_NAME_INDEX].Size == sizeof(IM_FAKE_HL_IMAGE));
+  IM_CHECK(NULL != strings[IM_PROCESS_NAME_INDEX] && 0 == wcscmp((PCWSTR)strings[IM_PROCESS_NAME_INDEX], IM_FAKE_HL_IMAGE));
+  IM_CHECK(NULL != strings[IM_FILE_NAME_INDEX] && 0 == wcscmp((PCWSTR)strings[IM_FILE_NAME_INDEX], IM_FAKE_VOLUME L"\\Temp\\inject.dll"));
+
+  // the volume is not sent again
+  IM_CHECK(IMWireDecodeBatchRecord(&Decoder, &record, strings));
+  IM_CHECK(!(record.Flags & IM_WIRE_BLOCKED));
+  IM_CHECK(NULL == strings[IM_PROCESS_NAME_INDEX]);
+  IM_CHECK(record.Names[IM_FILE_NAME_INDEX].Size == sizeof(IM_FAKE_GAME_DIR L"valve\\client.dll"));
+  IM_CHECK(NULL != strings[IM_FILE_NAME_INDEX] && 0 == wcscmp((PCWSTR)strings[IM_FILE_NAME_INDEX], IM_FAKE_GAME_DIR L"valve\\client.dll"));
+  IM_CHECK(record.Length < IM_WIRE_RECORD_SIZE + sizeof(IM_FAKE_GAME_DIR L"valve\\client.dll") - sizeof(IM_FAKE_VOLUME) + sizeof(WCHAR));
+  sequenceNumber = record.SequenceNumber;
+
+  IM_CHECK(IMWireDecodeBatchRecord(&Decoder, &record, strings));
+  IM_CHECK(record.SequenceNumber == sequenceNumber + 1);
+  IM_CHECK(NULL == strings[IM_PROCESS_NAME_INDEX] && NULL == strings[IM_FILE_NAME_INDEX]);
+  IM_CHECK(record.Names[IM_FILE_NAME_INDEX].Id != 0);
+
+  IM_CHECK(IMWireIsBatchEnd(&Decoder));
+
+  IMFakeStopDriver();
+
+  // names the batch was written against are released
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//
+// Client which asks for the reply learns the size of the record which
+// did not fit and how many are left, instead of waiting for nothing
+//
+static VOID TestRecordsReport()
+{
+  DRIVER_OBJECT driverObject;
+  IM_FAKE_CREATE create;
+  PVOID alignedBuffer[IM_TEST_RECORDS_BUFFER_SIZE / sizeof(PVOID)];
+  PUCHAR buffer = (PUCHAR)alignedBuffer;
+  IM_WIRE_RECORD record;
+  IM_WIRE_REPLY reply;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA];
+  const ULONG flagsOf[] = {IM_RECORDS_REPORT, IM_RECORDS_REPORT | IM_RECORDS_BATCH};
+  ULONG flags = 0;
+  ULONG returnLen = 0;
+  ULONG i = 0;
+
+  RtlZeroMemory(&record, sizeof(record));
+  RtlZeroMemory(&reply, sizeof(reply));
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  for (; i < ARRAYSIZE(flagsOf); i++)
+  {
+    flags = flagsOf[i];
+
+    IMNameTableNewClient(&Globals.Names);
+
+    IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+    IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+    IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+    IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+
+    IM_CHECK(IMGetRecords(&Globals.RecordsHead, flags, buffer, IM_WIRE_REPLY_SIZE - 1, &returnLen) == STATUS_BUFFER_TOO_SMALL);
+
+    // the first record with its names does not fit, only the reply comes
+    IM_CHECK(IMGetRecords(&Globals.RecordsHead, flags, buffer, IM_WIRE_REPLY_SIZE + IM_WIRE_RECORD_SIZE, &returnLen) == STATUS_SUCCESS);
+    IM_CHECK(returnLen == IM_WIRE_REPLY_SIZE);
+    IM_CHECK(IMWireDecodeReply(buffer, returnLen, &reply));
+    IM_CHECK(reply.Queued == 2 && reply.QueuedBytes != 0);
+    IM_CHECK(reply.Required > IM_WIRE_REPLY_SIZE + IM_WIRE_RECORD_SIZE);
+
+    // the buffer of that size takes it, the next one is left
+    IM_CHECK(IMGetRecords(&Globals.RecordsHead, flags, buffer, reply.Required, &returnLen) == STATUS_SUCCESS);
+    IM_CHECK(returnLen == reply.Required);
+    IM_CHECK(IMWireDecodeReply(buffer, returnLen, &reply));
+    IM_CHECK(reply.Required == 0 && reply.Queued == 1);
+
+    if (FlagOn(flags, IM_RECORDS_BATCH))
+    {
+      IM_CHECK(IMWireBeginBatchDecode(&Decoder, buffer + reply.Length, returnLen - reply.Length));
+      IM_CHECK(IMWireDecodeBatchRecord(&Decoder, &record, strings));
+      IM_CHECK(IMWireIsBatchEnd(&Decoder));
+    }
+    else
+    {
+      IM_CHECK(IMWireDecodeRecord(buffer + reply.Length, returnLen - reply.Length, &record, strings));
+      IM_CHECK(record.Length == returnLen - reply.Length);
+    }
+
+    IM_CHECK(record.Names[IM_FILE_NAME_INDEX].Size == sizeof(IM_FAKE_GAME_DIR L"valve\\client.dll"));
+
+    IM_CHECK(IMGetRecords(&Globals.RecordsHead, flags, buffer, sizeof(alignedBuffer), &returnLen) == STATUS_SUCCESS);
+    IM_CHECK(IMWireDecodeReply(buffer, returnLen, &reply));
+    IM_CHECK(reply.Required == 0 && reply.Queued == 0 && reply.QueuedBytes == 0);
+
+    // nothing queued, no reply
+    IM_CHECK(IMGetRecords(&Globals.RecordsHead, flags, buffer, sizeof(alignedBuffer), &returnLen) == STATUS_NO_MORE_ENTRIES);
+  }
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestOverflowDropNewest()
+{
+  DRIVER_OBJECT driverObject;
+  IM_RECORDS_STATISTICS statistics;
+  IM_TEST_DRAINED drained;
+  ULONG limit = 0;
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+  limit = RecordsLimit();
+
+  // the default, records after the limit are dropped and counted, their
+  // loads go on
+  IM_CHECK(CreateRecords(limit + IM_TEST_OVERFLOW) == limit + IM_TEST_OVERFLOW);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == limit);
+
+  IMGetStatistics(&statistics);
+  IM_CHECK(statistics.Overflow.Policy == IMOverflowDropNewest);
+  IM_CHECK(statistics.Queued == limit);
+  IM_CHECK(statistics.Dropped[IMDropQueueFull] == IM_TEST_OVERFLOW);
+  IM_CHECK(statistics.Dropped[IMDropOldest] == 0);
+
+  // no record comes after them, the gap marker ends the last drain
+  DrainRecords(0, sizeof(RecordsBuffer), MAXULONG, &drained);
+  IM_CHECK(drained.Records == limit);
+  IM_CHECK(drained.Gaps == 1 && drained.Lost == IM_TEST_OVERFLOW);
+  IM_CHECK(drained.RecordsBeforeGap == limit);
+  IM_CHECK(Globals.Overflow.Lost == 0);
+
+  // the next record after the drops carries the gap marker ahead of it
+  IM_CHECK(CreateRecords(limit + IM_TEST_OVERFLOW) == limit + IM_TEST_OVERFLOW);
+  DrainRecords(0, IM_WIRE_RECORD_SIZE, 1, &drained);
+  IM_CHECK(drained.Records == 1 && drained.Gaps == 0);
+  IM_CHECK(CreateRecords(1) == 1);
+
+  DrainRecords(IM_RECORDS_BATCH, sizeof(RecordsBuffer), MAXULONG, &drained);
+  IM_CHECK(drained.Records == limit);
+  IM_CHECK(drained.Gaps == 1 && drained.Lost == IM_TEST_OVERFLOW);
+  IM_CHECK(drained.RecordsBeforeGap == limit - 1);
+
+  // sequence numbers are taken by kept records only
+  IM_CHECK(drained.LastSequenceNumber - drained.FirstSequenceNumber == limit - 1);
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestOverflowDropOldest()
+{
+  DRIVER_OBJECT driverObject;
+  IM_OVERFLOW overflow;
+  IM_TEST_DRAINED drained;
+  ULONGLONG sequenceNumber = 0;
+  ULONG limit = 0;
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+  limit = RecordsLimit();
+
+  overflow.Policy = IMOverflowPolicies;
+  overflow.Milliseconds = 0;
+  IM_CHECK(IMSetOverflow(&overflow) == STATUS_INVALID_PARAMETER_1);
+
+  overflow.Policy = IMOverflowDropOldest;
+  IM_CHECK(NT_SUCCESS(IMSetOverflow(&overflow)));
+
+  // numbers are taken at push, the last one so far is of this record
+  IM_CHECK(CreateRecords(1) == 1);
+  DrainRecords(0, sizeof(RecordsBuffer), MAXULONG, &drained);
+  sequenceNumber = drained.LastSequenceNumber;
+
+  // every load gets its record, the oldest ones make room
+  IM_CHECK(CreateRecords(limit + IM_TEST_OVERFLOW) == limit + IM_TEST_OVERFLOW);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == limit);
+  IM_CHECK(Globals.Overflow.Dropped[IMDropOldest] == IM_TEST_OVERFLOW);
+  IM_CHECK(Globals.Overflow.Dropped[IMDropQueueFull] == 0);
+
+  // the gap is where the dropped ones were, ahead of the newest records
+  DrainRecords(IM_RECORDS_BATCH, sizeof(RecordsBuffer), MAXULONG, &drained);
+  IM_CHECK(drained.Records == limit);
+  IM_CHECK(drained.Gaps == 1 && drained.Lost == IM_TEST_OVERFLOW);
+  IM_CHECK(drained.RecordsBeforeGap == 0);
+  IM_CHECK(drained.FirstSequenceNumber == sequenceNumber + IM_TEST_OVERFLOW + 1);
+  IM_CHECK(drained.LastSequenceNumber == sequenceNumber + IM_TEST_OVERFLOW + limit);
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestPriorityRecords()
+{
+  DRIVER_OBJECT driverObject;
+  IM_FAKE_CREATE create;
+  IM_OVERFLOW overflow;
+  IM_TEST_DRAINED drained;
+  ULONG limit = 0;
+  ULONG i = 0;
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+  limit = RecordsLimit();
+
+  // the first blocked load is decided after the open, the full queue does
+  // not take its record either
+  IM_CHECK(CreateRecords(limit + 1) == limit + 1);
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+  IM_CHECK(create.FileObject.OpenCancelled);
+  IM_CHECK(Globals.Overflow.Dropped[IMDropQueueFull] == 1);
+
+  DrainRecords(IM_RECORDS_BATCH, sizeof(RecordsBuffer), MAXULONG, &drained);
+  IM_CHECK(drained.Records == limit + 1 && drained.Lost == 1);
+  IM_CHECK(drained.Blocked == 1 && drained.BlockedAhead == 1);
+
+  overflow.Policy = IMOverflowDropOldest;
+  overflow.Milliseconds = 0;
+  IM_CHECK(NT_SUCCESS(IMSetOverflow(&overflow)));
+
+  // blocked loads amid a flood, the flood drops only its own records
+  IM_CHECK(CreateRecords(limit) == limit);
+
+  for (; i < IM_TEST_OVERFLOW; i++)
+  {
+    IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+    IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+    IM_CHECK(CreateRecords(limit) == limit);
+  }
+
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == limit + IM_TEST_OVERFLOW);
+  IM_CHECK(Globals.Overflow.Dropped[IMDropOldest] == IM_TEST_OVERFLOW * limit);
+
+  // and come to the client ahead of it
+  DrainRecords(IM_RECORDS_BATCH, sizeof(RecordsBuffer), MAXULONG, &drained);
+  IM_CHECK(drained.Records == limit + IM_TEST_OVERFLOW);
+  IM_CHECK(drained.Blocked == IM_TEST_OVERFLOW && drained.BlockedAhead == IM_TEST_OVERFLOW);
+  IM_CHECK(drained.Lost == IM_TEST_OVERFLOW * limit);
+
+  // full queue drops the newest records, not the ones decided already
+  overflow.Policy = IMOverflowDropNewest;
+  IM_CHECK(NT_SUCCESS(IMSetOverflow(&overflow)));
+  IM_CHECK(CreateRecords(limit + 1) == limit + 1);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == limit);
+
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"sw.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_REPARSE);
+  IMFakeReleaseCreate(&create);
+
+  DrainRecords(IM_RECORDS_BATCH, sizeof(RecordsBuffer), MAXULONG, &drained);
+  IM_CHECK(drained.Records == limit + 2);
+  IM_CHECK(drained.Blocked == 1 && drained.BlockedAhead == 1);
+  IM_CHECK(drained.Unordered == 1);
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static void *DrainDelayed(
+    void *Context)
+{
+  usleep(20 * 1000);
+
+  DrainRecords(0, sizeof(RecordsBuffer), 1, (PIM_TEST_DRAINED)Context);
+
+  return NULL;
+}
+
+static VOID TestOverflowBlock()
+{
+  DRIVER_OBJECT driverObject;
+  IM_OVERFLOW overflow;
+  IM_TEST_DRAINED drained;
+  IM_TEST_DRAINED drainedBefore;
+  pthread_t thread;
+  ULONG limit = 0;
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+  limit = RecordsLimit();
+
+  // the wait is capped, the load does not wait for the client for long
+  overflow.Policy = IMOverflowBlock;
+  overflow.Milliseconds = MAXULONG;
+  IM_CHECK(NT_SUCCESS(IMSetOverflow(&overflow)));
+  IM_CHECK(Globals.Overflow.Milliseconds == IM_OVERFLOW_MAX_WAIT);
+
+  overflow.Milliseconds = 10;
+  IM_CHECK(NT_SUCCESS(IMSetOverflow(&overflow)));
+
+  // nobody drains, the producer gives up on the record after the wait
+  IM_CHECK(CreateRecords(limit + 1) == limit + 1);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == limit);
+  IM_CHECK(Globals.Overflow.Dropped[IMDropWaitTimeout] == 1);
+
+  // client which takes a record in time lets the producer go on
+  overflow.Milliseconds = IM_OVERFLOW_MAX_WAIT;
+  IM_CHECK(NT_SUCCESS(IMSetOverflow(&overflow)));
+  IM_CHECK(0 == pthread_create(&thread, NULL, DrainDelayed, &drainedBefore));
+  IM_CHECK(CreateRecords(1) == 1);
+  pthread_join(thread, NULL);
+
+  IM_CHECK(Globals.Overflow.Dropped[IMDropWaitTimeout] == 1);
+  IM_CHECK(Globals.RecordsHead.RoomWaiters == 0);
+
+  DrainRecords(0, sizeof(RecordsBuffer), MAXULONG, &drained);
+  IM_CHECK(drainedBefore.Records > 0);
+  IM_CHECK(drainedBefore.Records + drained.Records == limit + 1);
+  IM_CHECK(drainedBefore.Lost + drained.Lost == 1);
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static void *ProduceRecords(
+    void *Context)
+{
+  PIM_TEST_PRODUCER producer = (PIM_TEST_PRODUCER)Context;
+
+  IMShimSetCurrentProcessor(producer->Processor);
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  producer->Created = CreateRecords(IM_TEST_LOADS);
+
+  WriteRelease(&producer->IsDone, TRUE);
+
+  return NULL;
+}
+
+//
+// Drains take the records off the lanes and write them after the lock,
+// while loads go on: every record comes once and in order, or is counted
+// in a gap marker
+//
+static VOID TestDrainWhileLoading()
+{
+  DRIVER_OBJECT driverObject;
+  IM_TEST_PRODUCER producers[IM_TEST_PRODUCERS];
+  pthread_t threads[IM_TEST_PRODUCERS];
+  IM_TEST_DRAINED drained;
+  ULONGLONG lastSequenceNumber = 0;
+  ULONG records = 0;
+  ULONG lost = 0;
+  ULONG created = 0;
+  ULONG done = 0;
+  ULONG i = 0;
+
+  IMShimSetProcessorCount(IM_TEST_PRODUCERS);
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  for (; i < IM_TEST_PRODUCERS; i++)
+  {
+    producers[i].Processor = i;
+    producers[i].Created = 0;
+    producers[i].IsDone = FALSE;
+    IM_CHECK(0 == pthread_create(&threads[i], NULL, ProduceRecords, &producers[i]));
+  }
+
+  // small buffer, the record which does not fit stays for the next drain
+  for (;;)
+  {
+    DrainRecords(IM_RECORDS_BATCH, 1024, 1, &drained);
+
+    IM_CHECK(0 == drained.Unordered);
+    IM_CHECK(0 == drained.Records || drained.FirstSequenceNumber > lastSequenceNumber);
+
+    if (0 != drained.Records)
+    {
+      lastSequenceNumber = drained.LastSequenceNumber;
+    }
+
+    records += drained.Records;
+    lost += drained.Lost;
+
+    if (done == IM_TEST_PRODUCERS && 0 == drained.Records && 0 == drained.Lost)
+    {
+      break;
+    }
+
+    // the drain after the last load finds nothing
+    for (done = 0, i = 0; i < IM_TEST_PRODUCERS; i++)
+    {
+      done += 0 != ReadAcquire(&producers[i].IsDone);
+    }
+  }
+
+  for (i = 0; i < IM_TEST_PRODUCERS; i++)
+  {
+    pthread_join(threads[i], NULL);
+    created += producers[i].Created;
+  }
+
+  // loads of the dropped records go on as well
+  IM_CHECK(created == IM_TEST_PRODUCERS * IM_TEST_LOADS);
+  IM_CHECK(records + lost == created);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == 0);
+
+  IMFakeStopDriver();
+
+  IMShimSetProcessorCount(1);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestRecordsBudget()
+{
+  DRIVER_OBJECT driverObject;
+  IM_RECORDS_STATISTICS statistics;
+  IM_TEST_DRAINED drained;
+  ULONGLONG bytes = 0;
+  ULONG limit = 0;
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  IM_CHECK(IMSetRecordsBudget(IM_MIN_RECORDS_BUDGET - 1) == STATUS_INVALID_PARAMETER_1);
+  IM_CHECK(IMSetRecordsBudget(IM_MAX_RECORDS_BUDGET + 1) == STATUS_INVALID_PARAMETER_1);
+  IM_CHECK(Globals.RecordsHead.MaxBytesToPush == IM_DEFAULT_RECORDS_BUDGET);
+
+  IM_CHECK(NT_SUCCESS(IMSetRecordsBudget(IM_MIN_RECORDS_BUDGET)));
+  limit = RecordsLimit();
+  IM_CHECK(limit > 1);
+
+  // queue is full by bytes long before the amount of records
+  IM_CHECK(CreateRecords(limit + 1) == limit + 1);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == limit);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) < Globals.RecordsHead.MaxElementsToPush);
+
+  IMGetStatistics(&statistics);
+  bytes = statistics.QueuedBytes / limit;
+  IM_CHECK(statistics.Budget == IM_MIN_RECORDS_BUDGET);
+  IM_CHECK(statistics.QueuedBytes == limit * bytes);
+  IM_CHECK(statistics.QueuedBytes + bytes > IM_MIN_RECORDS_BUDGET);
+  IM_CHECK(statistics.MaxQueuedBytes == statistics.QueuedBytes);
+
+  // grown store keeps the queued records and takes more
+  IM_CHECK(NT_SUCCESS(IMSetRecordsBudget(4 * IM_MIN_RECORDS_BUDGET)));
+  IM_CHECK(CreateRecords(limit) == limit);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == 2 * limit);
+
+  // shrunk one keeps them as well, new records are dropped until the
+  // client took enough of them
+  IM_CHECK(NT_SUCCESS(IMSetRecordsBudget(IM_MIN_RECORDS_BUDGET)));
+  IM_CHECK(Globals.RecordsHead.Lanes[0].SlotMask + 1 >= 2 * limit);
+  IM_CHECK(CreateRecords(1) == 1);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == 2 * limit);
+
+  DrainRecords(IM_RECORDS_BATCH, sizeof(RecordsBuffer), MAXULONG, &drained);
+  IM_CHECK(drained.Records == 2 * limit);
+  IM_CHECK(drained.Lost == 2);
+  IM_CHECK(drained.LastSequenceNumber - drained.FirstSequenceNumber == 2 * limit - 1);
+
+  IMGetStatistics(&statistics);
+  IM_CHECK(statistics.Queued == 0 && statistics.QueuedBytes == 0);
+  IM_CHECK(statistics.MaxQueuedBytes == 2 * limit * bytes);
+
+  IM_CHECK(CreateRecords(1) == 1);
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestDecideBlock);
+  IM_RUN(TestCreateCallbacks);
+  IM_RUN(TestCachedVerdicts);
+  IM_RUN(TestRecordNames);
+  IM_RUN(TestRecordBatch);
+  IM_RUN(TestRecordsReport);
+  IM_RUN(TestOverflowDropNewest);
+  IM_RUN(TestOverflowDropOldest);
+  IM_RUN(TestOverflowBlock);
+  IM_RUN(TestPriorityRecords);
+  IM_RUN(TestRecordsBudget);
+  IM_RUN(TestDrainWhileLoading);
+
+  return IM_TEST_RESULT();
+}
@@ -0,0 +1,283 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_pipe.c
+
+Abstract:
+Host tests of the hand-off of records to the workers of the lib in im_pipe.h,
+records come from a stand-in of the reader thread
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <semaphore.h>
+#include <unistd.h>
+
+#include "im_test.h"
+#include "im_pipe.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_TEST_WORKERS 4
+#define IM_TEST_DEPTH 8
+#define IM_TEST_KEYS 13
+#define IM_TEST_RECORDS 200000
+
+//
+// key which is slow to pass, the others must not wait for it
+//
+#define IM_TEST_SLOW_KEY 5
+
+//------------------------------------------------------------------------
+//  Structures.
+//------------------------------------------------------------------------
+
+typedef struct _IM_TEST_RECORD
+{
+  ULONG Key;
+  ULONG Index; // of the record within its key
+} IM_TEST_RECORD, *PIM_TEST_RECORD;
+
+typedef struct _IM_TEST_WORKER
+{
+  ULONG Worker;
+  sem_t Wakeup;
+  ULONG Passed;
+  BOOLEAN IsOrdered;
+} IM_TEST_WORKER, *PIM_TEST_WORKER;
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static IM_PIPE Pipe;
+
+static IM_TEST_RECORD Entries[IM_TEST_WORKERS * IM_TEST_DEPTH];
+
+static IM_TEST_WORKER Workers[IM_TEST_WORKERS];
+
+static sem_t ReaderWakeup;
+
+static volatile LONG IsDown;
+
+//
+// next index of every key the reader reads and the worker passes, a key
+// is passed by one worker only
+//
+static ULONG Read[IM_TEST_KEYS];
+static ULONG Next[IM_TEST_KEYS];
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static PVOID Work(
+    _In_ PVOID Parameter)
+{
+  PIM_TEST_WORKER worker = (PIM_TEST_WORKER)Parameter;
+  PIM_TEST_RECORD record = NULL;
+
+  for (;;)
+  {
+    record = (PIM_TEST_RECORD)IMPipePeek(&Pipe, worker->Worker);
+
+    if (NULL != record)
+    {
+      worker->IsOrdered = worker->IsOrdered &&
+                          IMPipeWorker(&Pipe, record->Key) == worker->Worker &&
+                          record->Index == Next[record->Key];
+      Next[record->Key] = record->Index + 1;
+      worker->Passed++;
+
+      if (IM_TEST_SLOW_KEY == record->Key && 0 == record->Index % 64)
+      {
+        usleep(100);
+      }
+
+      if (IMPipeRelease(&Pipe, worker->Worker))
+      {
+        sem_post(&ReaderWakeup);
+      }
+      continue;
+    }
+
+    if (0 != ReadAcquire(&IsDown))
+    {
+      break;
+    }
+
+    if (IMPipePrepareWait(&Pipe, worker->Worker))
+    {
+      sem_wait(&worker->Wakeup);
+    }
+  }
+
+  return NULL;
+}
+
+//
+// Reader puts the record to the queue of its key, waits while it is full
+//
+static VOID ReadRecord(
+    _In_ ULONG Key)
+{
+  ULONG worker = IMPipeWorker(&Pipe, Key);
+  PIM_TEST_RECORD record = NULL;
+
+  while (NULL == (record = (PIM_TEST_RECORD)IMPipeReserve(&Pipe, worker)))
+  {
+    if (IMPipePrepareWaitRoom(&Pipe, worker, 1))
+    {
+      sem_wait(&ReaderWakeup);
+    }
+  }
+
+  record->Key = Key;
+  record->Index = Read[Key]++;
+
+  if (IMPipeCommit(&Pipe, worker))
+  {
+    sem_post(&Workers[worker].Wakeup);
+  }
+}
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+//
+// Queue is bounded and wakes the side which asked for it
+//
+static VOID TestQueue()
+{
+  PIM_TEST_RECORD record = NULL;
+  ULONG i = 0;
+
+  IM_CHECK(!IMPipeInit(&Pipe, 0, IM_TEST_DEPTH, sizeof(IM_TEST_RECORD), Entries));
+  IM_CHECK(!IMPipeInit(&Pipe, IM_PIPE_MAX_WORKERS + 1, IM_TEST_DEPTH, sizeof(IM_TEST_RECORD), Entries));
+  IM_CHECK(!IMPipeInit(&Pipe, 1, 6, sizeof(IM_TEST_RECORD), Entries));
+  IM_CHECK(IMPipeInit(&Pipe, 2, IM_TEST_DEPTH, sizeof(IM_TEST_RECORD), Entries));
+
+  // empty worker sleeps and the first record wakes it, the next does not
+  IM_CHECK(NULL == IMPipePeek(&Pipe, 0));
+  IM_CHECK(IMPipePrepareWait(&Pipe, 0));
+
+  for (; i < IM_TEST_DEPTH; i++)
+  {
+    record = (PIM_TEST_RECORD)IMPipeReserve(&Pipe, 0);
+    IM_CHECK(NULL != record);
+    record->Index = i;
+    IM_CHECK(IMPipeCommit(&Pipe, 0) == (0 == i));
+  }
+
+  // queues of the workers are apart
+  IM_CHECK(NULL == IMPipeReserve(&Pipe, 0));
+  IM_CHECK(NULL != IMPipeReserve(&Pipe, 1));
+  IM_CHECK(!IMPipePrepareWait(&Pipe, 0));
+
+  // full reader sleeps until the worker releases one, and until the queue
+  // is empty when it waits for the workers
+  IM_CHECK(IMPipePrepareWaitRoom(&Pipe, 0, 1));
+
+  record = (PIM_TEST_RECORD)IMPipePeek(&Pipe, 0);
+  IM_CHECK(NULL != record && 0 == record->Index);
+  IM_CHECK(IMPipeRelease(&Pipe, 0));
+
+  IM_CHECK(!IMPipePrepareWaitRoom(&Pipe, 0, 1));
+  IM_CHECK(IMPipePrepareWaitRoom(&Pipe, 0, IM_TEST_DEPTH));
+  IM_CHECK(NULL != IMPipeReserve(&Pipe, 0));
+
+  for (i = 1; i < IM_TEST_DEPTH; i++)
+  {
+    record = (PIM_TEST_RECORD)IMPipePeek(&Pipe, 0);
+    IM_CHECK(NULL != record && i == record->Index);
+    IM_CHECK(IMPipeRelease(&Pipe, 0) == (1 == i));
+  }
+
+  IM_CHECK(NULL == IMPipePeek(&Pipe, 0));
+  IM_CHECK(!IMPipePrepareWaitRoom(&Pipe, 0, IM_TEST_DEPTH));
+}
+
+//
+// Records of every key are passed in order they were read and by one
+// worker, whatever the others do
+//
+static VOID TestOrder()
+{
+  pthread_t threads[IM_TEST_WORKERS];
+  ULONG passed = 0;
+  ULONG i = 0;
+
+  RtlZeroMemory(Read, sizeof(Read));
+  RtlZeroMemory(Next, sizeof(Next));
+  WriteRelease(&IsDown, 0);
+
+  IM_CHECK(IMPipeInit(&Pipe, IM_TEST_WORKERS, IM_TEST_DEPTH, sizeof(IM_TEST_RECORD), Entries));
+  IM_CHECK(0 == sem_init(&ReaderWakeup, 0, 0));
+
+  for (i = 0; i < IM_TEST_WORKERS; i++)
+  {
+    Workers[i].Worker = i;
+    Workers[i].Passed = 0;
+    Workers[i].IsOrdered = TRUE;
+    IM_CHECK(0 == sem_init(&Workers[i].Wakeup, 0, 0));
+    IM_CHECK(0 == pthread_create(&threads[i], NULL, Work, &Workers[i]));
+  }
+
+  // keys come in bursts of one and of a few, as loads of a process do
+  for (i = 0; i < IM_TEST_RECORDS; i++)
+  {
+    ReadRecord((i / (1 + i % 3)) % IM_TEST_KEYS);
+  }
+
+  // every queue is empty once its worker is done with the records
+  for (i = 0; i < IM_TEST_WORKERS; i++)
+  {
+    while (IMPipePrepareWaitRoom(&Pipe, i, IM_TEST_DEPTH))
+    {
+      sem_wait(&ReaderWakeup);
+    }
+  }
+
+  WriteRelease(&IsDown, 1);
+
+  for (i = 0; i < IM_TEST_WORKERS; i++)
+  {
+    sem_post(&Workers[i].Wakeup);
+    pthread_join(threads[i], NULL);
+    sem_destroy(&Workers[i].Wakeup);
+
+    IM_CHECK(Workers[i].IsOrdered);
+    passed += Workers[i].Passed;
+  }
+
+  sem_destroy(&ReaderWakeup);
+
+  IM_CHECK(passed == IM_TEST_RECORDS);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestQueue);
+  IM_RUN(TestOrder);
+
+  return IM_TEST_RESULT();
+}
@@ -0,0 +1,168 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_ptab.c
+
+Abstract:
+Host tests of the target processes table in im_ptab.c and of the process
+notify routine which fills it
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_test.h"
+#include "im_fake.h"
+#include "im_ptab.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_TEST_PROCESSES 1000
+
+#define IM_TEST_PID(Index) ((HANDLE)(ULONG_PTR)(((Index) + 1) * 4))
+
+#define IM_TEST_SECOND_HL_PID ((HANDLE)(ULONG_PTR)0x1004)
+#define IM_TEST_CS_PID ((HANDLE)(ULONG_PTR)0x3000)
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static IM_PROCESS_INFO Processes[IM_TEST_PROCESSES];
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+static VOID TestTable()
+{
+  IM_PROCESS_TABLE table;
+  PIM_PROCESS_INFO process = NULL;
+  ULONG i = 0;
+  ULONG removed = 0;
+
+  IMProcessTableInit(&table);
+
+  IM_CHECK(IMProcessTableLookup(&table, IM_TEST_PID(0)) == NULL);
+  IM_CHECK(IMProcessTableRemove(&table, IM_TEST_PID(0)) == NULL);
+
+  // many more processes than buckets
+  for (i = 0; i < IM_TEST_PROCESSES; i++)
+  {
+    Processes[i].ProcessId = IM_TEST_PID(i);
+    IM_CHECK(IMProcessTableInsert(&table, &Processes[i]) == NULL);
+  }
+
+  IM_CHECK(table.Count == IM_TEST_PROCESSES);
+
+  for (i = 0; i < IM_TEST_PROCESSES; i++)
+  {
+    IM_CHECK(IMProcessTableLookup(&table, IM_TEST_PID(i)) == &Processes[i]);
+  }
+
+  IM_CHECK(IMProcessTableLookup(&table, IM_TEST_PID(IM_TEST_PROCESSES)) == NULL);
+
+  for (i = 0; i < IM_TEST_PROCESSES; i += 2)
+  {
+    IM_CHECK(IMProcessTableRemove(&table, IM_TEST_PID(i)) == &Processes[i]);
+  }
+
+  for (i = 0; i < IM_TEST_PROCESSES; i++)
+  {
+    IM_CHECK(IMProcessTableLookup(&table, IM_TEST_PID(i)) == (i % 2 ? &Processes[i] : NULL));
+  }
+
+  while (NULL != (process = IMProcessTableRemoveAny(&table)))
+  {
+    IM_CHECK((process - Processes) % 2 == 1);
+    removed++;
+  }
+
+  IM_CHECK(removed == IM_TEST_PROCESSES / 2);
+  IM_CHECK(table.Count == 0);
+}
+
+static VOID TestReplace()
+{
+  IM_PROCESS_TABLE table;
+  IM_PROCESS_INFO first;
+  IM_PROCESS_INFO second;
+
+  IMProcessTableInit(&table);
+
+  first.ProcessId = second.ProcessId = IM_TEST_PID(7);
+
+  IM_CHECK(IMProcessTableInsert(&table, &first) == NULL);
+  IM_CHECK(IMProcessTableInsert(&table, &second) == &first);
+  IM_CHECK(IMProcessTableLookup(&table, IM_TEST_PID(7)) == &second);
+  IM_CHECK(table.Count == 1);
+}
+
+static VOID TestInstances()
+{
+  DRIVER_OBJECT driverObject;
+  PIM_PROCESS_INFO first = NULL;
+  PIM_PROCESS_INFO second = NULL;
+  PIM_PROCESS_INFO cs = NULL;
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+  IM_CHECK(NT_SUCCESS(IMShimRegisterProcess(IM_TEST_SECOND_HL_PID, IM_FAKE_HL_IMAGE)));
+  IM_CHECK(NT_SUCCESS(IMShimRegisterProcess(IM_TEST_CS_PID, IM_FAKE_VOLUME L"\\Games\\csgo.exe")));
+  IM_CHECK(NT_SUCCESS(IMShimRegisterProcess(IM_FAKE_OTHER_PID, IM_FAKE_VOLUME L"\\Windows\\notepad.exe")));
+
+  IMCreateProcessNotifyRoutine(NULL, IM_TEST_SECOND_HL_PID, TRUE);
+  IMCreateProcessNotifyRoutine(NULL, IM_TEST_CS_PID, TRUE);
+  IMCreateProcessNotifyRoutine(NULL, IM_FAKE_OTHER_PID, TRUE);
+
+  // every instance is kept, the older one is not dropped
+  first = IMFindTargetProcess(IM_FAKE_HL_PID);
+  second = IMFindTargetProcess(IM_TEST_SECOND_HL_PID);
+  cs = IMFindTargetProcess(IM_TEST_CS_PID);
+
+  IM_CHECK(first != NULL && second != NULL && first != second);
+  IM_CHECK(cs != NULL && IMTestEquals(&cs->NameInfo->Name, L"csgo.exe"));
+  IM_CHECK(IMFindTargetProcess(IM_FAKE_OTHER_PID) == NULL);
+  IM_CHECK(Globals.TargetProcesses.Count == 3);
+
+  IMCreateProcessNotifyRoutine(NULL, IM_TEST_SECOND_HL_PID, FALSE);
+  IMCreateProcessNotifyRoutine(NULL, IM_FAKE_OTHER_PID, FALSE);
+
+  IM_CHECK(IMFindTargetProcess(IM_TEST_SECOND_HL_PID) == NULL);
+  IM_CHECK(IMFindTargetProcess(IM_FAKE_HL_PID) == first);
+  IM_CHECK(Globals.TargetProcesses.Count == 2);
+
+  IMShimUnregisterProcess(IM_TEST_SECOND_HL_PID);
+  IMShimUnregisterProcess(IM_TEST_CS_PID);
+  IMShimUnregisterProcess(IM_FAKE_OTHER_PID);
+
+  // csgo is still running, it is released with the driver
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestTable);
+  IM_RUN(TestReplace);
+  IM_RUN(TestInstances);
+
+  return IM_TEST_RESULT();
+}
@@ -0,0 +1,506 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_recv.c
+
+Abstract:
+Host tests of the receive buffers of the lib in im_recv.h, driven by an
+in-process stand-in of the port
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <semaphore.h>
+#include <unistd.h>
+
+#include "im_test.h"
+#include "InjectorMonitorKrnl.h"
+#include "im_recv.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_TEST_BUFFERS 2000
+
+//
+// largest buffer of the growth test and the longest name in it
+//
+#define IM_TEST_MAX_SIZE 16384
+#define IM_TEST_NAME_CHARS 10000
+
+//------------------------------------------------------------------------
+//  Structures.
+//------------------------------------------------------------------------
+
+//
+// Stand-in of the port: buffers of records numbered one after another,
+// every EmptyEvery-th request finds no records, closed after Buffers
+//
+typedef struct _IM_TEST_SOURCE
+{
+  ULONGLONG SequenceNumber;
+  ULONG EmptyEvery;
+  ULONG Buffers;
+  ULONG Requests;
+  ULONG Filled;
+  ULONG Waits;
+
+  //
+  // buffers filled while the parser was busy with another one
+  //
+  volatile LONG IsParsing;
+  ULONG FilledWhileParsing;
+
+} IM_TEST_SOURCE, *PIM_TEST_SOURCE;
+
+//
+// Stand-in of the port which reports what is left as the driver does:
+// records of IM_WIRE_RECORD_SIZE, the first with a file name of NameSize
+// bytes of Name
+//
+typedef struct _IM_TEST_BURST
+{
+  ULONGLONG SequenceNumber;
+  ULONG Records;
+  ULONG NameSize;
+  ULONG Requests;
+
+} IM_TEST_BURST, *PIM_TEST_BURST;
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static IM_TEST_SOURCE Source;
+
+static IM_TEST_BURST Burst;
+
+static WCHAR Name[IM_TEST_NAME_CHARS];
+
+static IM_RECEIVER Receiver;
+
+static sem_t ReceiverWakeup;
+static sem_t ParserWakeup;
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static IM_RECEIVE_STATUS Receive(
+    _In_ PVOID Context,
+    _Inout_ PIM_RECEIVE_BUFFER Buffer)
+{
+  PIM_TEST_SOURCE source = (PIM_TEST_SOURCE)Context;
+  const VOID *strings[IM_WIRE_NAMES] = {NULL, NULL};
+  IM_WIRE_RECORD record;
+  ULONG length = 0;
+
+  source->Requests++;
+
+  if (source->Filled == source->Buffers)
+  {
+    return IMReceiveClosed;
+  }
+
+  if (0 != source->EmptyEvery && 0 == source->Requests % source->EmptyEvery)
+  {
+    return IMReceiveEmpty;
+  }
+
+  RtlZeroMemory(&record, sizeof(record));
+  record.Count = 1;
+
+  for (;;)
+  {
+    record.SequenceNumber = source->SequenceNumber + 1;
+
+    length = IMWireEncodeRecord(Buffer->Data + Buffer->Length, Buffer->Size - Buffer->Length, &record, strings);
+
+    if (0 == length)
+    {
+      break;
+    }
+
+    source->SequenceNumber++;
+    Buffer->Length += length;
+  }
+
+  if (0 != ReadAcquire(&source->IsParsing))
+  {
+    source->FilledWhileParsing++;
+  }
+
+  source->Filled++;
+
+  return IMReceiveRecords;
+}
+
+static IM_RECEIVE_STATUS Wait(
+    _In_ PVOID Context)
+{
+  ((PIM_TEST_SOURCE)Context)->Waits++;
+
+  return IMReceiveRecords;
+}
+
+static const IM_TRANSPORT Transport = {Receive, Wait, &Source};
+
+static IM_RECEIVE_STATUS ReceiveBurst(
+    _In_ PVOID Context,
+    _Inout_ PIM_RECEIVE_BUFFER Buffer)
+{
+  PIM_TEST_BURST burst = (PIM_TEST_BURST)Context;
+  const VOID *strings[IM_WIRE_NAMES] = {NULL, NULL};
+  IM_WIRE_RECORD record;
+  ULONG length = 0;
+
+  burst->Requests++;
+
+  if (0 == burst->Records)
+  {
+    return IMReceiveEmpty;
+  }
+
+  RtlZeroMemory(&record, sizeof(record));
+  record.Count = 1;
+
+  for (; 0 != burst->Records; burst->Records--)
+  {
+    record.SequenceNumber = burst->SequenceNumber + 1;
+    record.Names[IM_FILE_NAME_INDEX].Id = 0 != burst->NameSize ? 1 : 0;
+    record.Names[IM_FILE_NAME_INDEX].Size = burst->NameSize;
+
+    // end of the name, it is null terminated
+    strings[IM_FILE_NAME_INDEX] = Name + IM_TEST_NAME_CHARS - burst->NameSize / sizeof(WCHAR);
+
+    length = IMWireEncodeRecord(Buffer->Data + Buffer->Length, Buffer->Size - Buffer->Length, &record, strings);
+
+    if (0 == length)
+    {
+      // the record which did not fit and the ones after it
+      Buffer->Required = Buffer->Length + IM_WIRE_RECORD_SIZE * burst->Records + burst->NameSize;
+      break;
+    }
+
+    burst->SequenceNumber++;
+    burst->NameSize = 0;
+    Buffer->Length += length;
+  }
+
+  return IMReceiveRecords;
+}
+
+static const IM_TRANSPORT BurstTransport = {ReceiveBurst, Wait, &Burst};
+
+static VOID InitSource(
+    _In_ ULONG Buffers,
+    _In_ ULONG EmptyEvery)
+{
+  RtlZeroMemory(&Source, sizeof(Source));
+
+  Source.Buffers = Buffers;
+  Source.EmptyEvery = EmptyEvery;
+}
+
+//
+// Receiver thread as the lib runs it
+//
+static PVOID ReceiveBuffers(
+    _In_ PVOID Parameter)
+{
+  IM_RECEIVE_STATUS status = IMReceiveRecords;
+  BOOLEAN wake = FALSE;
+
+  UNREFERENCED_PARAMETER(Parameter);
+
+  for (;;)
+  {
+    status = IMReceiverFill(&Receiver, &wake);
+
+    if (wake)
+    {
+      sem_post(&ParserWakeup);
+    }
+
+    if (IMReceiveClosed == status)
+    {
+      break;
+    }
+
+    if (IMReceiveFull == status && IMReceiverPrepareWaitRoom(&Receiver))
+    {
+      sem_wait(&ReceiverWakeup);
+    }
+
+    if (IMReceiveEmpty == status)
+    {
+      (VOID) Receiver.Transport.Wait(Receiver.Transport.Context);
+    }
+  }
+
+  return NULL;
+}
+
+//
+// Records of the buffer follow the previous ones, returns the last number
+//
+static BOOLEAN ParseBuffer(
+    _In_ PIM_RECEIVE_BUFFER Buffer,
+    _Inout_ PULONGLONG SequenceNumber)
+{
+  const UCHAR *strings[IM_WIRE_NAMES];
+  IM_WIRE_RECORD record;
+  PUCHAR data = Buffer->Data + Buffer->Offset;
+  ULONG offset = 0;
+
+  while (offset < Buffer->Length)
+  {
+    if (!IMWireDecodeRecord(data + offset, Buffer->Length - offset, &record, strings) ||
+        record.SequenceNumber != *SequenceNumber + 1)
+    {
+      return FALSE;
+    }
+
+    *SequenceNumber = record.SequenceNumber;
+    offset += record.Length;
+  }
+
+  return offset == Buffer->Length;
+}
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+//
+// Buffers are handed over in order they were filled, empty ones too
+//
+static VOID TestFill()
+{
+  PIM_RECEIVE_BUFFER buffer = NULL;
+  ULONGLONG sequenceNumber = 0;
+  BOOLEAN wake = FALSE;
+
+  InitSource(3, 3);
+
+  IM_CHECK(!IMReceiverInit(&Receiver, &Transport, 3, IM_RECEIVE_BUFFER_SIZE));
+  IM_CHECK(!IMReceiverInit(&Receiver, &Transport, IM_RECEIVE_MAX_BUFFERS * 2, IM_RECEIVE_BUFFER_SIZE));
+  IM_CHECK(!IMReceiverInit(&Receiver, &Transport, 2, IM_RECEIVE_BUFFER_SIZE - 1));
+  IM_CHECK(!IMReceiverInit(&Receiver, &Transport, 2, IM_RECEIVE_MAX_BUFFER_SIZE + 1));
+  IM_CHECK(IMReceiverInit(&Receiver, &Transport, 2, IM_RECEIVE_BUFFER_SIZE));
+
+  // parser sleeps and the first buffer wakes it
+  IM_CHECK(NULL == IMReceiverPeek(&Receiver));
+  IM_CHECK(IMReceiverPrepareWait(&Receiver));
+
+  IM_CHECK(IMReceiverFill(&Receiver, &wake) == IMReceiveRecords && wake);
+  IM_CHECK(IMReceiverFill(&Receiver, &wake) == IMReceiveRecords && !wake);
+
+  // parser has both, the driver is not asked
+  IM_CHECK(IMReceiverFill(&Receiver, &wake) == IMReceiveFull);
+  IM_CHECK(Source.Requests == 2);
+  IM_CHECK(IMReceiverPrepareWaitRoom(&Receiver));
+
+  buffer = IMReceiverPeek(&Receiver);
+  IM_CHECK(NULL != buffer && IMReceiveRecords == buffer->Status && 0 != buffer->Length);
+  IM_CHECK(ParseBuffer(buffer, &sequenceNumber));
+  IM_CHECK(IMReceiverRelease(&Receiver));
+
+  // the third request finds nothing, parser is told so
+  IM_CHECK(IMReceiverFill(&Receiver, &wake) == IMReceiveEmpty);
+  IM_CHECK(IMReceiverFill(&Receiver, &wake) == IMReceiveFull);
+
+  buffer = IMReceiverPeek(&Receiver);
+  IM_CHECK(NULL != buffer && IMReceiveRecords == buffer->Status && ParseBuffer(buffer, &sequenceNumber));
+  IM_CHECK(!IMReceiverRelease(&Receiver));
+
+  buffer = IMReceiverPeek(&Receiver);
+  IM_CHECK(NULL != buffer && IMReceiveEmpty == buffer->Status && 0 == buffer->Length);
+  IM_CHECK(!IMReceiverRelease(&Receiver));
+
+  IM_CHECK(IMReceiverFill(&Receiver, &wake) == IMReceiveRecords);
+
+  buffer = IMReceiverPeek(&Receiver);
+  IM_CHECK(NULL != buffer && ParseBuffer(buffer, &sequenceNumber));
+  IM_CHECK(!IMReceiverRelease(&Receiver));
+
+  // closed buffer comes after the records
+  IM_CHECK(IMReceiverFill(&Receiver, &wake) == IMReceiveClosed);
+
+  buffer = IMReceiverPeek(&Receiver);
+  IM_CHECK(NULL != buffer && IMReceiveClosed == buffer->Status);
+  IM_CHECK(sequenceNumber == Source.SequenceNumber);
+
+  // buffers did not grow, nothing was left behind
+  IM_CHECK(Receiver.WantedSize == IM_RECEIVE_BUFFER_SIZE);
+
+  IMReceiverDeinit(&Receiver);
+}
+
+//
+// Buffer grows for the record which does not fit and for the records left,
+// up to the largest size
+//
+static VOID TestGrow()
+{
+  PIM_RECEIVE_BUFFER buffer = NULL;
+  ULONGLONG sequenceNumber = 0;
+  BOOLEAN wake = FALSE;
+  ULONG i = 0;
+
+  for (; i < IM_TEST_NAME_CHARS - 1; i++)
+  {
+    Name[i] = L'a';
+  }
+
+  RtlZeroMemory(&Burst, sizeof(Burst));
+
+  IM_CHECK(IMReceiverInit(&Receiver, &BurstTransport, 2, IM_TEST_MAX_SIZE));
+
+  // nothing fits the first buffer, it is filled again twice as large
+  Burst.Records = 1;
+  Burst.NameSize = 3000 * sizeof(WCHAR);
+
+  IM_CHECK(IMReceiverFill(&Receiver, &wake) == IMReceiveRecords);
+  IM_CHECK(Burst.Requests == 2 && Burst.Records == 0);
+  IM_CHECK(Receiver.WantedSize == 2 * IM_RECEIVE_BUFFER_SIZE);
+
+  buffer = IMReceiverPeek(&Receiver);
+  IM_CHECK(NULL != buffer && buffer->Size == 2 * IM_RECEIVE_BUFFER_SIZE);
+  IM_CHECK(ParseBuffer(buffer, &sequenceNumber));
+  (VOID) IMReceiverRelease(&Receiver);
+
+  // more records are left than the buffer took, the next one takes them
+  Burst.Records = 300;
+
+  IM_CHECK(IMReceiverFill(&Receiver, &wake) == IMReceiveRecords);
+  IM_CHECK(Receiver.WantedSize == IM_TEST_MAX_SIZE);
+  IM_CHECK(IMReceiverFill(&Receiver, &wake) == IMReceiveRecords);
+  IM_CHECK(Burst.Records == 0 && Burst.Requests == 4);
+
+  buffer = IMReceiverPeek(&Receiver);
+  IM_CHECK(NULL != buffer && buffer->Size == 2 * IM_RECEIVE_BUFFER_SIZE);
+  IM_CHECK(buffer->Length == (2 * IM_RECEIVE_BUFFER_SIZE / IM_WIRE_RECORD_SIZE) * IM_WIRE_RECORD_SIZE);
+  IM_CHECK(ParseBuffer(buffer, &sequenceNumber));
+  (VOID) IMReceiverRelease(&Receiver);
+
+  buffer = IMReceiverPeek(&Receiver);
+  IM_CHECK(NULL != buffer && buffer->Size == IM_TEST_MAX_SIZE);
+  IM_CHECK(ParseBuffer(buffer, &sequenceNumber));
+  IM_CHECK(sequenceNumber == 301);
+  (VOID) IMReceiverRelease(&Receiver);
+
+  // no more, the driver is waited for
+  IM_CHECK(IMReceiverFill(&Receiver, &wake) == IMReceiveEmpty);
+  IM_CHECK(NULL != IMReceiverPeek(&Receiver));
+  (VOID) IMReceiverRelease(&Receiver);
+
+  // record over the largest size is not taken, the buffer is not handed over
+  Burst.Records = 1;
+  Burst.NameSize = (IM_TEST_NAME_CHARS - 1) * sizeof(WCHAR);
+
+  IM_CHECK(IMReceiverFill(&Receiver, &wake) == IMReceiveError);
+  IM_CHECK(NULL == IMReceiverPeek(&Receiver));
+  IM_CHECK(Receiver.WantedSize == IM_TEST_MAX_SIZE);
+
+  IMReceiverDeinit(&Receiver);
+}
+
+//
+// Parser reads a buffer while the receiver fills the next one, every
+// record comes once and in order
+//
+static VOID TestOverlap()
+{
+  PIM_RECEIVE_BUFFER buffer = NULL;
+  pthread_t thread;
+  ULONGLONG sequenceNumber = 0;
+  ULONG parsed = 0;
+  ULONG empty = 0;
+  BOOLEAN isOrdered = TRUE;
+  BOOLEAN isClosed = FALSE;
+
+  InitSource(IM_TEST_BUFFERS, 7);
+
+  IM_CHECK(IMReceiverInit(&Receiver, &Transport, 4, IM_RECEIVE_BUFFER_SIZE));
+  IM_CHECK(0 == sem_init(&ReceiverWakeup, 0, 0));
+  IM_CHECK(0 == sem_init(&ParserWakeup, 0, 0));
+  IM_CHECK(0 == pthread_create(&thread, NULL, ReceiveBuffers, NULL));
+
+  while (!isClosed)
+  {
+    buffer = IMReceiverPeek(&Receiver);
+
+    if (NULL == buffer)
+    {
+      if (IMReceiverPrepareWait(&Receiver))
+      {
+        sem_wait(&ParserWakeup);
+      }
+      continue;
+    }
+
+    isClosed = IMReceiveClosed == buffer->Status;
+
+    if (IMReceiveEmpty == buffer->Status)
+    {
+      empty++;
+    }
+    else if (!isClosed)
+    {
+      WriteRelease(&Source.IsParsing, 1);
+      isOrdered = isOrdered && ParseBuffer(buffer, &sequenceNumber);
+
+      // parsing takes a while, the receiver goes on meanwhile
+      if (0 == parsed++ % 16)
+      {
+        usleep(200);
+      }
+
+      WriteRelease(&Source.IsParsing, 0);
+    }
+
+    if (IMReceiverRelease(&Receiver))
+    {
+      sem_post(&ReceiverWakeup);
+    }
+  }
+
+  pthread_join(thread, NULL);
+  sem_destroy(&ReceiverWakeup);
+  sem_destroy(&ParserWakeup);
+  IMReceiverDeinit(&Receiver);
+
+  IM_CHECK(isOrdered);
+  IM_CHECK(parsed == IM_TEST_BUFFERS);
+  IM_CHECK(sequenceNumber == Source.SequenceNumber);
+  IM_CHECK(Source.Waits == (Source.Requests - 1) / 7);
+  IM_CHECK(empty == Source.Waits);
+  IM_CHECK(Source.FilledWhileParsing > 0);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestFill);
+  IM_RUN(TestGrow);
+  IM_RUN(TestOverlap);
+
+  return IM_TEST_RESULT();
+}
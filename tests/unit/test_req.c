@@ -0,0 +1,178 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_req.c
+
+Abstract:
+Host tests of the name information requests in im_req.c
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_test.h"
+#include "im_fake.h"
+#include "im_req.h"
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+static VOID TestSplitNameInformation()
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  UNICODE_STRING fullName = CONSTANT_STRING(IM_FAKE_GAME_DIR L"valve\\client.dll");
+  PIM_NAME_INFORMATION nameInfo = NULL;
+
+  status = IMSplitNameInformation(&fullName, &nameInfo);
+
+  IM_CHECK(NT_SUCCESS(status));
+  IM_CHECK(nameInfo != NULL);
+  IF_FALSE_RETURN(nameInfo != NULL);
+
+  IM_CHECK(IMTestEquals(&nameInfo->FullName, IM_FAKE_GAME_DIR L"valve\\client.dll"));
+  IM_CHECK(IMTestEquals(&nameInfo->ParentDir, IM_FAKE_GAME_DIR L"valve\\"));
+  IM_CHECK(IMTestEquals(&nameInfo->Name, L"client.dll"));
+  IM_CHECK(IMTestEquals(&nameInfo->Extension, L"dll"));
+
+  IMReleaseNameInformation(nameInfo);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestSplitIsOneAllocation()
+{
+  UNICODE_STRING fullName = CONSTANT_STRING(IM_FAKE_GAME_DIR L"valve\\client.dll");
+  PIM_NAME_INFORMATION nameInfo = NULL;
+  LONGLONG allocations = IMShimGetPoolAllocations();
+  PWCH end = NULL;
+
+  IM_CHECK(NT_SUCCESS(IMSplitNameInformation(&fullName, &nameInfo)));
+  IF_FALSE_RETURN(nameInfo != NULL);
+
+  IM_CHECK(IMShimGetPoolAllocations() - allocations == 1);
+
+  // parts are views into the null terminated full name
+  end = nameInfo->FullName.Buffer + nameInfo->FullName.Length / sizeof(WCHAR);
+  IM_CHECK(nameInfo->FullName.Buffer != fullName.Buffer);
+  IM_CHECK(*end == L'\0');
+  IM_CHECK(nameInfo->ParentDir.Buffer == nameInfo->FullName.Buffer);
+  IM_CHECK(nameInfo->Name.Buffer + nameInfo->Name.Length / sizeof(WCHAR) == end);
+  IM_CHECK(nameInfo->Extension.Buffer + nameInfo->Extension.Length / sizeof(WCHAR) == end);
+
+  IMReleaseNameInformation(nameInfo);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestSplitWithoutDelimeters()
+{
+  UNICODE_STRING noExtension = CONSTANT_STRING(L"\\Device\\hl");
+  UNICODE_STRING noFolder = CONSTANT_STRING(L"hl.exe");
+  UNICODE_STRING hidden = CONSTANT_STRING(L"\\Device\\.dll");
+  PIM_NAME_INFORMATION nameInfo = NULL;
+
+  IM_CHECK(NT_SUCCESS(IMSplitNameInformation(&noExtension, &nameInfo)));
+  IM_CHECK(IMTestEquals(&nameInfo->ParentDir, L"\\Device\\"));
+  IM_CHECK(IMTestEquals(&nameInfo->Name, L"hl"));
+  IM_CHECK(IMTestEquals(&nameInfo->Extension, L""));
+  IM_CHECK(nameInfo->Extension.Buffer != NULL);
+  IMReleaseNameInformation(nameInfo);
+
+  // the same split as IMSplitString: the whole string is the parent dir
+  IM_CHECK(NT_SUCCESS(IMSplitNameInformation(&noFolder, &nameInfo)));
+  IM_CHECK(IMTestEquals(&nameInfo->ParentDir, L"hl.exe"));
+  IM_CHECK(IMTestEquals(&nameInfo->Name, L""));
+  IM_CHECK(IMTestEquals(&nameInfo->Extension, L""));
+  IMReleaseNameInformation(nameInfo);
+
+  // a dot in front of the name is not an extension
+  IM_CHECK(NT_SUCCESS(IMSplitNameInformation(&hidden, &nameInfo)));
+  IM_CHECK(IMTestEquals(&nameInfo->Name, L".dll"));
+  IM_CHECK(IMTestEquals(&nameInfo->Extension, L""));
+  IMReleaseNameInformation(nameInfo);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestGetProcessNameInformation()
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  PIM_NAME_INFORMATION nameInfo = NULL;
+  LONGLONG allocations = 0;
+
+  IM_CHECK(NT_SUCCESS(IMShimRegisterProcess(IM_FAKE_HL_PID, IM_FAKE_HL_IMAGE)));
+
+  allocations = IMShimGetPoolAllocations();
+  status = IMGetProcessNameInformation(IM_FAKE_HL_PID, &nameInfo);
+
+  IM_CHECK(NT_SUCCESS(status));
+  IM_CHECK(nameInfo != NULL);
+
+  // image name is queried into the name information itself
+  IM_CHECK(IMShimGetPoolAllocations() - allocations == 1);
+
+  if (nameInfo != NULL)
+  {
+    IM_CHECK(IMTestEquals(&nameInfo->Name, L"hl.exe"));
+    IM_CHECK(IMTestEquals(&nameInfo->ParentDir, IM_FAKE_GAME_DIR));
+    IMReleaseNameInformation(nameInfo);
+  }
+
+  status = IMGetProcessNameInformation(IM_FAKE_OTHER_PID, &nameInfo);
+
+  IM_CHECK(!NT_SUCCESS(status));
+  IM_CHECK(nameInfo == NULL);
+
+  IMShimUnregisterProcess(IM_FAKE_HL_PID);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestGetFileNameInformation()
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  IM_FAKE_CREATE create;
+  PIM_NAME_INFORMATION nameInfo = NULL;
+
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"hw.dll", FILE_EXECUTE);
+
+  status = IMGetFileNameInformation(&create.Data, &nameInfo);
+
+  IM_CHECK(NT_SUCCESS(status));
+  IM_CHECK(nameInfo != NULL);
+
+  if (nameInfo != NULL)
+  {
+    IM_CHECK(IMTestEquals(&nameInfo->Name, L"hw.dll"));
+    IMReleaseNameInformation(nameInfo);
+  }
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestSplitNameInformation);
+  IM_RUN(TestSplitIsOneAllocation);
+  IM_RUN(TestSplitWithoutDelimeters);
+  IM_RUN(TestGetProcessNameInformation);
+  IM_RUN(TestGetFileNameInformation);
+
+  return IM_TEST_RESULT();
+}
@@ -0,0 +1,654 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_ring.c
+
+Abstract:
+Host tests of the ring of records shared with the client, the protocol in
+InjectorMonitorRing.h between two processes and the driver side in im_shm.c
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "im_test.h"
+#include "im_fake.h"
+#include "im_list.h"
+#include "im_rec.h"
+#include "im_shm.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_TEST_RING_SIZE (IM_RING_HEADER_SIZE + IM_RING_MIN_DATA_SIZE)
+#define IM_TEST_RECORDS_BUFFER_SIZE 4096
+
+#define IM_TEST_PRODUCERS 4
+#define IM_TEST_PER_PRODUCER 50000
+#define IM_TEST_MAX_PAYLOAD 200
+#define IM_TEST_WAIT_MS 2000
+
+//
+// Entry written by the producer process
+//
+typedef struct _IM_TEST_PAYLOAD
+{
+  ULONG Producer;
+  ULONG Index;
+  UCHAR Bytes[];
+} IM_TEST_PAYLOAD, *PIM_TEST_PAYLOAD;
+
+typedef struct _IM_TEST_PRODUCER
+{
+  PIM_RING_PRODUCER Ring;
+  ULONG Producer;
+  int Doorbell;
+} IM_TEST_PRODUCER, *PIM_TEST_PRODUCER;
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static ULONG PayloadLength(
+    _In_ ULONG Producer,
+    _In_ ULONG Index)
+{
+  return sizeof(IM_TEST_PAYLOAD) + (Producer * 31 + Index * 7) % IM_TEST_MAX_PAYLOAD;
+}
+
+static UCHAR PayloadByte(
+    _In_ ULONG Producer,
+    _In_ ULONG Index,
+    _In_ ULONG Offset)
+{
+  return (UCHAR)(Producer + Index + Offset);
+}
+
+static BOOLEAN Write(
+    _In_ PIM_RING_PRODUCER Ring,
+    _In_ ULONG Producer,
+    _In_ ULONG Index,
+    _Out_ PBOOLEAN IsWaiting)
+{
+  ULONG length = PayloadLength(Producer, Index);
+  PIM_TEST_PAYLOAD payload = NULL;
+  ULONG position = 0;
+  ULONG total = 0;
+  ULONG i = 0;
+
+  *IsWaiting = FALSE;
+
+  payload = (PIM_TEST_PAYLOAD)IMRingReserve(Ring, length, 0, &position, &total);
+
+  if (NULL == payload)
+  {
+    return FALSE;
+  }
+
+  payload->Producer = Producer;
+  payload->Index = Index;
+
+  for (; i < length - sizeof(IM_TEST_PAYLOAD); i++)
+  {
+    payload->Bytes[i] = PayloadByte(Producer, Index, i);
+  }
+
+  *IsWaiting = IMRingCommit(Ring, position, total);
+
+  return TRUE;
+}
+
+static BOOLEAN IsPayloadValid(
+    _In_ PIM_TEST_PAYLOAD Payload,
+    _In_ ULONG Length)
+{
+  ULONG i = 0;
+
+  if (Payload->Producer >= IM_TEST_PRODUCERS ||
+      IM_RING_ALIGN(PayloadLength(Payload->Producer, Payload->Index)) != IM_RING_ALIGN(Length))
+  {
+    return FALSE;
+  }
+
+  for (; i < PayloadLength(Payload->Producer, Payload->Index) - sizeof(IM_TEST_PAYLOAD); i++)
+  {
+    if (Payload->Bytes[i] != PayloadByte(Payload->Producer, Payload->Index, i))
+    {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static void *Produce(
+    void *Context)
+{
+  PIM_TEST_PRODUCER producer = (PIM_TEST_PRODUCER)Context;
+  BOOLEAN isWaiting = FALSE;
+  char bell = 0;
+  ULONG i = 0;
+
+  for (; i < IM_TEST_PER_PRODUCER; i++)
+  {
+    // ring is much smaller than everything written, wait for consumer
+    while (!Write(producer->Ring, producer->Producer, i, &isWaiting))
+    {
+      sched_yield();
+    }
+
+    if (isWaiting && 1 != write(producer->Doorbell, &bell, 1))
+    {
+      return (void *)1;
+    }
+  }
+
+  return NULL;
+}
+
+//
+// Child process: the driver side with its own producer state over the
+// memory it shares with the parent
+//
+static int RunProducers(
+    _In_ PIM_RING_HEADER Header,
+    _In_ int Doorbell)
+{
+  IM_RING_PRODUCER ring;
+  IM_TEST_PRODUCER producers[IM_TEST_PRODUCERS];
+  pthread_t threads[IM_TEST_PRODUCERS];
+  void *result = NULL;
+  int exitCode = 0;
+  ULONG i = 0;
+
+  IMRingInitProducer(&ring, Header, IM_TEST_RING_SIZE);
+
+  for (i = 0; i < IM_TEST_PRODUCERS; i++)
+  {
+    producers[i].Ring = &ring;
+    producers[i].Producer = i;
+    producers[i].Doorbell = Doorbell;
+
+    if (0 != pthread_create(&threads[i], NULL, Produce, &producers[i]))
+    {
+      return 2;
+    }
+  }
+
+  for (i = 0; i < IM_TEST_PRODUCERS; i++)
+  {
+    pthread_join(threads[i], &result);
+    exitCode = NULL != result ? 3 : exitCode;
+  }
+
+  return exitCode;
+}
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+static VOID TestFormat()
+{
+  static ULONGLONG memory[IM_TEST_RING_SIZE / sizeof(ULONGLONG)];
+  PIM_RING_HEADER header = (PIM_RING_HEADER)memory;
+  IM_RING_CONSUMER consumer;
+
+  // entries take power of 2 bytes behind the header
+  IM_CHECK(!IMRingFormat(header, IM_RING_HEADER_SIZE));
+  IM_CHECK(!IMRingFormat(header, IM_RING_HEADER_SIZE + IM_RING_MIN_DATA_SIZE / 2));
+  IM_CHECK(!IMRingFormat(header, IM_TEST_RING_SIZE + IM_RING_ALIGNMENT));
+  IM_CHECK(IMRingFormat(header, IM_TEST_RING_SIZE));
+
+  IM_CHECK(header->DataSize == IM_RING_MIN_DATA_SIZE);
+  IM_CHECK(header->WriteIndex == 0 && header->ReadIndex == 0);
+
+  // consumer does not trust the header
+  IM_CHECK(!IMRingInitConsumer(&consumer, header, IM_TEST_RING_SIZE * 2));
+
+  header->Version++;
+  IM_CHECK(!IMRingInitConsumer(&consumer, header, IM_TEST_RING_SIZE));
+  header->Version--;
+
+  header->Magic = 0;
+  IM_CHECK(!IMRingInitConsumer(&consumer, header, IM_TEST_RING_SIZE));
+
+  IM_CHECK(IMRingFormat(header, IM_TEST_RING_SIZE));
+  IM_CHECK(IMRingInitConsumer(&consumer, header, IM_TEST_RING_SIZE));
+}
+
+static VOID TestWrapAndFull()
+{
+  static ULONGLONG memory[IM_TEST_RING_SIZE / sizeof(ULONGLONG)];
+  PIM_RING_HEADER header = (PIM_RING_HEADER)memory;
+  IM_RING_PRODUCER producer;
+  IM_RING_CONSUMER consumer;
+  PIM_TEST_PAYLOAD payload = NULL;
+  BOOLEAN isWaiting = FALSE;
+  BOOLEAN isValid = TRUE;
+  ULONG written = 0;
+  ULONG consumed = 0;
+  ULONG length = 0;
+  ULONG lap = 0;
+
+  IM_CHECK(IMRingFormat(header, IM_TEST_RING_SIZE));
+  IM_CHECK(IMRingInitConsumer(&consumer, header, IM_TEST_RING_SIZE));
+  IMRingInitProducer(&producer, header, IM_TEST_RING_SIZE);
+
+  IM_CHECK(IMRingPeek(&consumer, &length) == NULL);
+
+  // entry which can never fit is refused
+  IM_CHECK(IMRingReserve(&producer, IM_RING_MIN_DATA_SIZE, 0, &length, &length) == NULL);
+
+  // fill up, the last entry does not fit
+  while (Write(&producer, 0, written, &isWaiting))
+  {
+    IM_CHECK(!isWaiting);
+    written++;
+  }
+
+  IM_CHECK(written > 1);
+
+  // entries of every length go around the ring, tail is skipped with padding
+  for (lap = 0; lap < 20000; lap++)
+  {
+    payload = (PIM_TEST_PAYLOAD)IMRingPeek(&consumer, &length);
+
+    if (NULL == payload)
+    {
+      break;
+    }
+
+    isValid = isValid && IsPayloadValid(payload, length) && payload->Index == consumed;
+    IMRingRelease(&consumer);
+    consumed++;
+
+    while (Write(&producer, 0, written, &isWaiting))
+    {
+      written++;
+    }
+  }
+
+  IM_CHECK(isValid);
+  IM_CHECK(lap == 20000);
+  IM_CHECK((ULONG)header->WriteIndex > 20 * IM_RING_MIN_DATA_SIZE);
+
+  while (NULL != (payload = (PIM_TEST_PAYLOAD)IMRingPeek(&consumer, &length)))
+  {
+    IMRingRelease(&consumer);
+    consumed++;
+  }
+
+  IM_CHECK(consumed == written);
+
+  // one doorbell per sleep
+  IM_CHECK(IMRingPrepareWait(&consumer));
+  IM_CHECK(Write(&producer, 0, written++, &isWaiting) && isWaiting);
+  IM_CHECK(Write(&producer, 0, written++, &isWaiting) && !isWaiting);
+
+  // nothing to sleep for if entry is there
+  IM_CHECK(!IMRingPrepareWait(&consumer));
+  IM_CHECK(header->ConsumerWaiting == 0);
+
+  // broken write index, everything published is skipped
+  header->WriteIndex = (LONG)(consumer.ReadIndex + IM_RING_MIN_DATA_SIZE * 2);
+  IM_CHECK(IMRingPeek(&consumer, &length) == NULL);
+  IM_CHECK((ULONG)header->ReadIndex == (ULONG)header->WriteIndex);
+}
+
+static VOID TestProcesses()
+{
+  PIM_RING_HEADER header = NULL;
+  IM_RING_CONSUMER consumer;
+  PIM_TEST_PAYLOAD payload = NULL;
+  struct pollfd doorbell;
+  ULONG next[IM_TEST_PRODUCERS];
+  BOOLEAN isValid = TRUE;
+  ULONG consumed = 0;
+  ULONG length = 0;
+  ULONG sleeps = 0;
+  ULONG lostWakeups = 0;
+  char bells[64];
+  int pipeFds[2];
+  int childStatus = 0;
+  pid_t child = 0;
+  ULONG i = 0;
+
+  RtlZeroMemory(next, sizeof(next));
+
+  // the client process and the driver share only this memory and the doorbell
+  header = (PIM_RING_HEADER)mmap(NULL, IM_TEST_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  IM_CHECK(MAP_FAILED != (void *)header);
+  IM_CHECK(0 == pipe(pipeFds));
+
+  if (MAP_FAILED == (void *)header)
+  {
+    return;
+  }
+
+  IM_CHECK(IMRingFormat(header, IM_TEST_RING_SIZE));
+  IM_CHECK(IMRingInitConsumer(&consumer, header, IM_TEST_RING_SIZE));
+
+  child = fork();
+
+  if (0 == child)
+  {
+    close(pipeFds[0]);
+    _exit(RunProducers(header, pipeFds[1]));
+  }
+
+  close(pipeFds[1]);
+  IM_CHECK(child > 0);
+
+  doorbell.fd = pipeFds[0];
+  doorbell.events = POLLIN;
+
+  // every entry comes exactly once, in order of its producer and intact
+  while (child > 0 && consumed < IM_TEST_PRODUCERS * IM_TEST_PER_PRODUCER)
+  {
+    payload = (PIM_TEST_PAYLOAD)IMRingPeek(&consumer, &length);
+
+    if (NULL != payload)
+    {
+      isValid = isValid && IsPayloadValid(payload, length) && payload->Index == next[payload->Producer];
+      next[payload->Producer % IM_TEST_PRODUCERS] = payload->Index + 1;
+      IMRingRelease(&consumer);
+      consumed++;
+      continue;
+    }
+
+    if (!IMRingPrepareWait(&consumer))
+    {
+      continue;
+    }
+
+    sleeps++;
+
+    // published entry without the doorbell is a lost wakeup
+    if (0 == poll(&doorbell, 1, IM_TEST_WAIT_MS))
+    {
+      lostWakeups++;
+      InterlockedExchange(&header->ConsumerWaiting, 0);
+      continue;
+    }
+
+    if (read(pipeFds[0], bells, 1) <= 0)
+    {
+      break;
+    }
+  }
+
+  if (child > 0)
+  {
+    IM_CHECK(child == waitpid(child, &childStatus, 0));
+    IM_CHECK(WIFEXITED(childStatus) && 0 == WEXITSTATUS(childStatus));
+  }
+
+  for (i = 0; i < IM_TEST_PRODUCERS; i++)
+  {
+    IM_CHECK(next[i] == IM_TEST_PER_PRODUCER);
+  }
+
+  IM_CHECK(isValid);
+  IM_CHECK(lostWakeups == 0);
+  IM_CHECK(IMRingPeek(&consumer, &length) == NULL);
+  IM_CHECK(header->Dropped == 0);
+
+  printf("  %u entries, %u sleeps\n", consumed, sleeps);
+
+  close(pipeFds[0]);
+  munmap(header, IM_TEST_RING_SIZE);
+}
+
+static VOID TestDriverRecords()
+{
+  DRIVER_OBJECT driverObject;
+  IM_FAKE_CREATE create;
+  IM_RING_CONSUMER consumer;
+  PVOID alignedBuffer[IM_TEST_RECORDS_BUFFER_SIZE / sizeof(PVOID)];
+  PCHAR buffer = (PCHAR)alignedBuffer;
+  PVOID userAddress = NULL;
+  PVOID otherAddress = NULL;
+  IM_WIRE_RECORD record;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA];
+  PUCHAR entry = NULL;
+  ULONGLONG sequenceNumber = 0;
+  ULONG returnLen = 0;
+  ULONG length = 0;
+  ULONG count = 0;
+
+  RtlZeroMemory(&consumer, sizeof(consumer));
+  RtlZeroMemory(&record, sizeof(record));
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  // queued before the client maps the ring
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == 1);
+
+  IM_CHECK(IMWaitSharedRecords(&Globals.SharedRecords, 0) == STATUS_DEVICE_NOT_CONNECTED);
+  IM_CHECK(NT_SUCCESS(IMMapSharedRecords(&Globals.SharedRecords, IM_SHARED_RECORDS_SIZE, &userAddress)));
+  IM_CHECK(IMMapSharedRecords(&Globals.SharedRecords, IM_SHARED_RECORDS_SIZE, &otherAddress) == STATUS_DEVICE_ALREADY_ATTACHED);
+  IM_CHECK(IMRingInitConsumer(&consumer, (PIM_RING_HEADER)userAddress, IM_SHARED_RECORDS_SIZE));
+
+  IMMoveRecordsToShared(&Globals.RecordsHead, &Globals.SharedRecords);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == 0);
+
+  // written straight to the ring, client is woken up
+  IM_CHECK(IMRingPrepareWait(&consumer) == FALSE);
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == 0);
+
+  while (NULL != (entry = (PUCHAR)IMRingPeek(&consumer, &length)))
+  {
+    IM_CHECK(IMWireDecodeRecord(entry, length, &record, strings));
+    // queued one was numbered by its lane, the ring takes the next block
+    IM_CHECK(record.SequenceNumber > sequenceNumber);
+    IM_CHECK(!!(record.Flags & IM_WIRE_BLOCKED) == (count == 1));
+    sequenceNumber = record.SequenceNumber;
+
+    // null terminated strings of the names the client has not got yet
+    // follow the record in place, the process name only comes once
+    if (0 == count)
+    {
+      IM_CHECK(0 == wcscmp((PCWSTR)strings[IM_PROCESS_NAME_INDEX], IM_FAKE_HL_IMAGE));
+    }
+    else
+    {
+      IM_CHECK(strings[IM_PROCESS_NAME_INDEX] == NULL);
+    }
+
+    IM_CHECK(0 == wcscmp((PCWSTR)strings[IM_FILE_NAME_INDEX], count == 0 ? IM_FAKE_GAME_DIR L"valve\\client.dll" : IM_FAKE_VOLUME L"\\Temp\\inject.dll"));
+
+    IMRingRelease(&consumer);
+    count++;
+  }
+
+  IM_CHECK(count == 2);
+
+  // client sleeps, doorbell rings on the next record
+  IM_CHECK(IMRingPrepareWait(&consumer));
+  IM_CHECK(IMWaitSharedRecords(&Globals.SharedRecords, 0) == STATUS_TIMEOUT);
+  IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+  IM_CHECK(IMWaitSharedRecords(&Globals.SharedRecords, 0) == STATUS_SUCCESS);
+  IM_CHECK(IMRingPeek(&consumer, &length) != NULL);
+
+  // records go to the list again once the client is gone
+  IMUnmapSharedRecords(&Globals.SharedRecords);
+  IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+  IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+  IM_CHECK(NT_SUCCESS(IMGetRecords(&Globals.RecordsHead, 0, buffer, sizeof(alignedBuffer), &returnLen)));
+  IM_CHECK(IMWireDecodeRecord((PUCHAR)buffer, returnLen, &record, strings));
+  IM_CHECK(returnLen == record.Length);
+  IM_CHECK(record.Flags & IM_WIRE_BLOCKED);
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestDriverRingFull()
+{
+  DRIVER_OBJECT driverObject;
+  IM_FAKE_CREATE create;
+  IM_RING_CONSUMER consumer;
+  IM_WIRE_RECORD record;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA] = {NULL, NULL};
+  PUCHAR entry = NULL;
+  PVOID userAddress = NULL;
+  ULONG length = 0;
+  ULONG count = 0;
+  ULONG i = 0;
+
+  RtlZeroMemory(&consumer, sizeof(consumer));
+  RtlZeroMemory(&record, sizeof(record));
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  IM_CHECK(NT_SUCCESS(IMMapSharedRecords(&Globals.SharedRecords, IM_TEST_RING_SIZE, &userAddress)));
+  IM_CHECK(IMRingInitConsumer(&consumer, (PIM_RING_HEADER)userAddress, IM_TEST_RING_SIZE));
+
+  // client does not read, records which do not fit are dropped and counted
+  for (i = 0; i < 100; i++)
+  {
+    IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+    IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+  }
+
+  while (NULL != IMRingPeek(&consumer, &length))
+  {
+    IMRingRelease(&consumer);
+    count++;
+  }
+
+  IM_CHECK(count > 0 && count < 100);
+  IM_CHECK((ULONG)consumer.Header->Dropped == 100 - count);
+  IM_CHECK(IMCountElements(&Globals.RecordsHead) == 0);
+  IM_CHECK(Globals.Overflow.Dropped[IMDropRingFull] == 100 - count);
+
+  // client is told about them before it sleeps, with one gap marker
+  IMWriteSharedLost(&Globals.SharedRecords);
+
+  entry = (PUCHAR)IMRingPeek(&consumer, &length);
+  IM_CHECK(NULL != entry && IMWireDecodeRecord(entry, length, &record, strings));
+  IM_CHECK(record.Flags & IM_WIRE_GAP);
+  IM_CHECK(record.Lost == 100 - count);
+  IM_CHECK(record.Names[IM_PROCESS_NAME_INDEX].Id == 0 && record.Names[IM_FILE_NAME_INDEX].Id == 0);
+  IMRingRelease(&consumer);
+
+  IM_CHECK(Globals.Overflow.Lost == 0);
+  IM_CHECK(NULL == IMRingPeek(&consumer, &length));
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+static VOID TestDriverRingPriority()
+{
+  DRIVER_OBJECT driverObject;
+  IM_FAKE_CREATE create;
+  IM_RING_CONSUMER consumer;
+  IM_WIRE_RECORD record;
+  const UCHAR *strings[IM_AMOUNT_OF_DATA] = {NULL, NULL};
+  PUCHAR entry = NULL;
+  PVOID userAddress = NULL;
+  LONGLONG dropped = 0;
+  ULONG length = 0;
+  ULONG count = 0;
+  ULONG i = 0;
+
+  RtlZeroMemory(&consumer, sizeof(consumer));
+  RtlZeroMemory(&record, sizeof(record));
+
+  IM_CHECK(NT_SUCCESS(IMFakeStartDriver(&driverObject)));
+
+  IMShimSetCurrentProcessId(IM_FAKE_HL_PID);
+
+  IM_CHECK(NT_SUCCESS(IMMapSharedRecords(&Globals.SharedRecords, IM_TEST_RING_SIZE, &userAddress)));
+  IM_CHECK(IMRingInitConsumer(&consumer, (PIM_RING_HEADER)userAddress, IM_TEST_RING_SIZE));
+
+  // flood of allowed loads fills the ring up to the part it leaves free
+  for (i = 0; i < 100; i++)
+  {
+    IMFakeInitCreate(&create, IM_FAKE_GAME_DIR L"valve\\client.dll", FILE_EXECUTE);
+    IM_CHECK(IMFakeRunCreate(&create) == STATUS_SUCCESS);
+  }
+
+  dropped = Globals.Overflow.Dropped[IMDropRingFull];
+  IM_CHECK(dropped > 0);
+
+  // blocked loads amid it are still written, with the gap marker ahead
+  for (i = 0; i < 2; i++)
+  {
+    IMFakeInitCreate(&create, IM_FAKE_VOLUME L"\\Temp\\inject.dll", FILE_EXECUTE);
+    IM_CHECK(IMFakeRunCreate(&create) == STATUS_ACCESS_DENIED);
+  }
+
+  IM_CHECK(Globals.Overflow.Dropped[IMDropRingFull] == dropped);
+
+  while (NULL != (entry = (PUCHAR)IMRingPeek(&consumer, &length)))
+  {
+    IM_CHECK(IMWireDecodeRecord(entry, length, &record, strings));
+
+    if (count == 100 - dropped)
+    {
+      IM_CHECK(record.Flags & IM_WIRE_GAP);
+      IM_CHECK(record.Lost == dropped);
+    }
+    else
+    {
+      IM_CHECK(!!(record.Flags & IM_WIRE_BLOCKED) == (count > 100 - dropped));
+    }
+
+    IMRingRelease(&consumer);
+    count++;
+  }
+
+  IM_CHECK(count == 100 - dropped + 3);
+
+  IMFakeStopDriver();
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestFormat);
+  IM_RUN(TestWrapAndFull);
+  IM_RUN(TestProcesses);
+  IM_RUN(TestDriverRecords);
+  IM_RUN(TestDriverRingFull);
+  IM_RUN(TestDriverRingPriority);
+
+  return IM_TEST_RESULT();
+}
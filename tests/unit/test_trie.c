@@ -0,0 +1,164 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_trie.c
+
+Abstract:
+Host tests of the directory root trie in im_trie.c
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_test.h"
+#include "im_trie.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_TEST_VOLUME L"\\Device\\HarddiskVolume3"
+
+//------------------------------------------------------------------------
+//  Local functions.
+//------------------------------------------------------------------------
+
+static IM_TRIE_VERDICT Lookup(
+    _In_ PIM_TRIE Trie,
+    _In_ PCWSTR Path)
+{
+  UNICODE_STRING path;
+
+  RtlInitUnicodeString(&path, Path);
+
+  return IMTrieLookup(Trie, &path);
+}
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+static VOID TestLongestRoot()
+{
+  IM_TRIE_RULE rules[] = {
+      {CONSTANT_STRING(IM_TEST_VOLUME L"\\Windows\\"), IM_TRIE_TRUSTED},
+      {CONSTANT_STRING(IM_TEST_VOLUME L"\\Games\\Steam\\"), IM_TRIE_ALLOWED},
+      {CONSTANT_STRING(IM_TEST_VOLUME L"\\Games\\Steam\\userdata\\"), IM_TRIE_DENIED},
+      {CONSTANT_STRING(IM_TEST_VOLUME L"\\Games\\Steam\\userdata\\cfg"), IM_TRIE_ALLOWED},
+  };
+  PIM_TRIE trie = NULL;
+
+  IM_CHECK(NT_SUCCESS(IMTrieBuild(rules, ARRAYSIZE(rules), &trie)));
+  IM_CHECK(trie->NodeCount == 8);
+
+  IM_CHECK(Lookup(trie, IM_TEST_VOLUME L"\\Windows\\") == IM_TRIE_TRUSTED);
+  IM_CHECK(Lookup(trie, IM_TEST_VOLUME L"\\Windows\\Fonts\\") == IM_TRIE_TRUSTED);
+  IM_CHECK(Lookup(trie, IM_TEST_VOLUME L"\\Games\\Steam\\bin\\") == IM_TRIE_ALLOWED);
+  IM_CHECK(Lookup(trie, IM_TEST_VOLUME L"\\Games\\Steam\\userdata\\123\\") == IM_TRIE_DENIED);
+  IM_CHECK(Lookup(trie, IM_TEST_VOLUME L"\\Games\\Steam\\userdata\\cfg\\") == IM_TRIE_ALLOWED);
+
+  // not below any root
+  IM_CHECK(Lookup(trie, IM_TEST_VOLUME L"\\Games\\") == IM_TRIE_NONE);
+  IM_CHECK(Lookup(trie, IM_TEST_VOLUME L"\\Temp\\") == IM_TRIE_NONE);
+  IM_CHECK(Lookup(trie, L"") == IM_TRIE_NONE);
+
+  IMTrieFree(trie);
+}
+
+static VOID TestComponents()
+{
+  IM_TRIE_RULE rules[] = {
+      {CONSTANT_STRING(IM_TEST_VOLUME L"\\Games\\Steam"), IM_TRIE_ALLOWED},
+  };
+  PIM_TRIE trie = NULL;
+
+  IM_CHECK(NT_SUCCESS(IMTrieBuild(rules, ARRAYSIZE(rules), &trie)));
+
+  // case is folded, empty components are skipped
+  IM_CHECK(Lookup(trie, L"\\DEVICE\\harddiskvolume3\\GAMES\\steam\\") == IM_TRIE_ALLOWED);
+  IM_CHECK(Lookup(trie, IM_TEST_VOLUME L"\\\\Games\\Steam\\\\bin") == IM_TRIE_ALLOWED);
+
+  // roots are directories, not character prefixes
+  IM_CHECK(Lookup(trie, IM_TEST_VOLUME L"\\Games\\SteamHack\\") == IM_TRIE_NONE);
+  IM_CHECK(Lookup(trie, IM_TEST_VOLUME L"\\Games\\Stea\\") == IM_TRIE_NONE);
+
+  IMTrieFree(trie);
+}
+
+static VOID TestDuplicateRoots()
+{
+  IM_TRIE_RULE rules[] = {
+      {CONSTANT_STRING(IM_TEST_VOLUME L"\\Games\\"), IM_TRIE_DENIED},
+      {CONSTANT_STRING(IM_TEST_VOLUME L"\\games\\"), IM_TRIE_ALLOWED},
+  };
+  PIM_TRIE trie = NULL;
+
+  IM_CHECK(NT_SUCCESS(IMTrieBuild(rules, ARRAYSIZE(rules), &trie)));
+  IM_CHECK(trie->NodeCount == 4);
+
+  // the most restrictive verdict is kept
+  IM_CHECK(Lookup(trie, IM_TEST_VOLUME L"\\Games\\Steam\\") == IM_TRIE_DENIED);
+
+  IMTrieFree(trie);
+}
+
+static VOID TestManyRoots()
+{
+  UNICODE_STRING prefix = CONSTANT_STRING(IM_TEST_VOLUME L"\\Games\\game");
+  WCHAR buffers[64][64];
+  IM_TRIE_RULE rules[64];
+  PIM_TRIE trie = NULL;
+  ULONG length = prefix.Length / sizeof(WCHAR);
+  ULONG i = 0;
+
+  for (; i < ARRAYSIZE(rules); i++)
+  {
+    // wide fan out at one level, children are searched by hash
+    RtlCopyMemory(buffers[i], prefix.Buffer, prefix.Length);
+    buffers[i][length] = L'0' + (WCHAR)(i / 10);
+    buffers[i][length + 1] = L'0' + (WCHAR)(i % 10);
+    buffers[i][length + 2] = L'\\';
+
+    rules[i].Root.Buffer = buffers[i];
+    rules[i].Root.Length = (USHORT)((length + 3) * sizeof(WCHAR));
+    rules[i].Root.MaximumLength = sizeof(buffers[i]);
+    rules[i].Verdict = (i % 2) ? IM_TRIE_ALLOWED : IM_TRIE_DENIED;
+  }
+
+  IM_CHECK(NT_SUCCESS(IMTrieBuild(rules, ARRAYSIZE(rules), &trie)));
+  IM_CHECK(trie->NodeCount == 4 + ARRAYSIZE(rules));
+
+  for (i = 0; i < ARRAYSIZE(rules); i++)
+  {
+    IM_CHECK(IMTrieLookup(trie, &rules[i].Root) == rules[i].Verdict);
+  }
+
+  IMTrieFree(trie);
+
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestLongestRoot);
+  IM_RUN(TestComponents);
+  IM_RUN(TestDuplicateRoots);
+  IM_RUN(TestManyRoots);
+
+  return IM_TEST_RESULT();
+}
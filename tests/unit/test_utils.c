@@ -0,0 +1,113 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_utils.c
+
+Abstract:
+Host tests of the string helpers in im_utils.c
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_test.h"
+#include "im_utils.h"
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+static VOID TestIsStartWithString()
+{
+  UNICODE_STRING path = CONSTANT_STRING(L"\\Device\\HarddiskVolume3\\Windows\\System32\\");
+  UNICODE_STRING prefix = CONSTANT_STRING(L"\\device\\harddiskvolume3\\WINDOWS\\");
+  UNICODE_STRING other = CONSTANT_STRING(L"\\Device\\HarddiskVolume3\\Games\\");
+  UNICODE_STRING longer = CONSTANT_STRING(L"\\Device\\HarddiskVolume3\\Windows\\System32\\drivers\\");
+
+  IM_CHECK(IMIsStartWithString(&path, &prefix));
+  IM_CHECK(IMIsStartWithString(&path, &path));
+  IM_CHECK(!IMIsStartWithString(&path, &other));
+  IM_CHECK(!IMIsStartWithString(&path, &longer));
+}
+
+static VOID TestIsContainsString()
+{
+  UNICODE_STRING path = CONSTANT_STRING(L"\\Device\\HarddiskVolume3\\Steam\\CrashHandler.dll");
+  UNICODE_STRING fragment = CONSTANT_STRING(L"steam\\crashhandler.dll");
+  UNICODE_STRING other = CONSTANT_STRING(L"steam\\steamclient.dll");
+
+  IM_CHECK(IMIsContainsString(&path, &fragment));
+  IM_CHECK(!IMIsContainsString(&path, &other));
+}
+
+static VOID TestSplitString()
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  UNICODE_STRING path = CONSTANT_STRING(L"\\Device\\HarddiskVolume3\\Games\\hl.exe");
+  UNICODE_STRING beginning = {0};
+  UNICODE_STRING ending = {0};
+
+  status = IMSplitString(&path, &beginning, &ending, L'\\', -1);
+
+  IM_CHECK(NT_SUCCESS(status));
+  IM_CHECK(IMTestEquals(&beginning, L"\\Device\\HarddiskVolume3\\Games\\"));
+  IM_CHECK(IMTestEquals(&ending, L"hl.exe"));
+
+  ExFreePool(beginning.Buffer);
+  ExFreePool(ending.Buffer);
+  RtlZeroMemory(&beginning, sizeof(UNICODE_STRING));
+
+  status = IMSplitString(&path, &beginning, NULL, L'\\', -3);
+
+  IM_CHECK(NT_SUCCESS(status));
+  IM_CHECK(IMTestEquals(&beginning, L"\\Device\\"));
+
+  ExFreePool(beginning.Buffer);
+}
+
+static VOID TestConcatStrings()
+{
+  NTSTATUS status = STATUS_SUCCESS;
+  UNICODE_STRING start = CONSTANT_STRING(L"\\Games\\");
+  UNICODE_STRING end = CONSTANT_STRING(L"hw.dll");
+  UNICODE_STRING result = {0};
+
+  status = IMConcatStrings(&result, &start, &end);
+
+  IM_CHECK(NT_SUCCESS(status));
+  IM_CHECK(IMTestEquals(&result, L"\\Games\\hw.dll"));
+  IM_CHECK(result.Buffer[result.Length / sizeof(WCHAR)] == L'\0');
+
+  ExFreePool(result.Buffer);
+}
+
+static VOID TestPoolBalance()
+{
+  IM_CHECK(IMShimGetPoolOutstanding() == 0);
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestIsStartWithString);
+  IM_RUN(TestIsContainsString);
+  IM_RUN(TestSplitString);
+  IM_RUN(TestConcatStrings);
+  IM_RUN(TestPoolBalance);
+
+  return IM_TEST_RESULT();
+}
@@ -0,0 +1,613 @@
+/*++
+
+author:
+
+Daulet Tumbayev
+
+Module Name:
+
+test_wire.c
+
+Abstract:
+Host tests of the record wire format in InjectorMonitorWire.h
+
+Environment:
+
+User mode (host)
+
+--*/
+
+//------------------------------------------------------------------------
+//  Includes.
+//------------------------------------------------------------------------
+
+#include "im_test.h"
+#include "InjectorMonitorKrnl.h"
+
+//------------------------------------------------------------------------
+//  Definitions.
+//------------------------------------------------------------------------
+
+#define IM_TEST_PROCESS_NAME L"\\hl.exe"
+#define IM_TEST_FILE_NAME L"\\client.dll"
+
+#define IM_TEST_BATCH_RECORDS 4
+
+//------------------------------------------------------------------------
+//  Globals.
+//------------------------------------------------------------------------
+
+static IM_WIRE_BATCH_DECODER Decoder;
+
+//------------------------------------------------------------------------
+//  Helpers.
+//------------------------------------------------------------------------
+
+static VOID IMTestRecord(
+    _Out_ PIM_WIRE_RECORD Record,
+    _In_ BOOLEAN IsWithNames)
+{
+  RtlZeroMemory(Record, sizeof(IM_WIRE_RECORD));
+
+  Record->Flags = IM_WIRE_BLOCKED | IM_WIRE_SUCCEEDED;
+  Record->SequenceNumber = 0x0102030405060708ull;
+  Record->Time = 0x1112131415161718ll;
+  Record->VideoMode = IM_VIDEO_SW_TO_HW;
+  Record->Names[IM_PROCESS_NAME_INDEX].Id = 0x21222324;
+  Record->Names[IM_FILE_NAME_INDEX].Id = 0x31323334;
+
+  if (IsWithNames)
+  {
+    Record->Names[IM_PROCESS_NAME_INDEX].Size = sizeof(IM_TEST_PROCESS_NAME);
+    Record->Names[IM_FILE_NAME_INDEX].Size = sizeof(IM_TEST_FILE_NAME);
+  }
+}
+
+//------------------------------------------------------------------------
+//  Tests.
+//------------------------------------------------------------------------
+
+//
+// bytes are the format, not the structure of the compiler
+//
+static VOID TestLayout()
+{
+  static const UCHAR expected[IM_WIRE_RECORD_SIZE] = {
+      0x30, 0x00, 0x00, 0x00, // Length
+      0x02, 0x00,             // Version
+      0x03, 0x00,             // Flags
+      0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01,
+      0x18, 0x17, 0x16, 0x15, 0x14, 0x13, 0x12, 0x11,
+      0x04, 0x00, 0x00, 0x00, // VideoMode
+      0x00, 0x00, 0x00, 0x00, // Lost
+      0x24, 0x23, 0x22, 0x21, 0x00, 0x00, 0x00, 0x00,
+      0x34, 0x33, 0x32, 0x31, 0x00, 0x00, 0x00, 0x00};
+  const VOID *strings[IM_WIRE_NAMES] = {NULL, NULL};
+  IM_WIRE_RECORD record;
+  UCHAR buffer[IM_WIRE_RECORD_SIZE + 1];
+
+  IMTestRecord(&record, FALSE);
+
+  IM_CHECK(IMWireRecordLength(&record) == IM_WIRE_RECORD_SIZE);
+  IM_CHECK(IMWireEncodeRecord(buffer, IM_WIRE_RECORD_SIZE - 1, &record, strings) == 0);
+
+  RtlFillMemory(buffer, sizeof(buffer), 0xCC);
+
+  IM_CHECK(IMWireEncodeRecord(buffer, sizeof(buffer), &record, strings) == IM_WIRE_RECORD_SIZE);
+  IM_CHECK(0 == memcmp(buffer, expected, IM_WIRE_RECORD_SIZE));
+  IM_CHECK(buffer[IM_WIRE_RECORD_SIZE] == 0xCC);
+}
+
+static VOID TestRoundTrip()
+{
+  const VOID *strings[IM_WIRE_NAMES] = {IM_TEST_PROCESS_NAME, IM_TEST_FILE_NAME};
+  const UCHAR *decodedStrings[IM_WIRE_NAMES] = {NULL, NULL};
+  IM_WIRE_RECORD record;
+  IM_WIRE_RECORD decoded;
+  ULONGLONG alignedBuffer[32];
+  PUCHAR buffer = (PUCHAR)alignedBuffer;
+  ULONG length = 0;
+  ULONG offset = 0;
+
+  RtlZeroMemory(&decoded, sizeof(decoded));
+  IMTestRecord(&record, TRUE);
+
+  // records follow each other without alignment
+  for (offset = 0; offset < 8; offset++)
+  {
+    length = IMWireEncodeRecord(buffer + offset, sizeof(alignedBuffer) - offset, &record, strings);
+    IM_CHECK(length == IM_WIRE_RECORD_SIZE + sizeof(IM_TEST_PROCESS_NAME) + sizeof(IM_TEST_FILE_NAME));
+
+    IM_CHECK(IMWireDecodeRecord(buffer + offset, length, &decoded, decodedStrings));
+    IM_CHECK(decoded.Length == length);
+    IM_CHECK(decoded.Version == IM_WIRE_VERSION);
+    IM_CHECK(decoded.Flags == record.Flags);
+    IM_CHECK(decoded.SequenceNumber == record.SequenceNumber);
+    IM_CHECK(decoded.Time == record.Time);
+    IM_CHECK(decoded.VideoMode == record.VideoMode);
+    IM_CHECK(decoded.Names[IM_PROCESS_NAME_INDEX].Id == record.Names[IM_PROCESS_NAME_INDEX].Id);
+    IM_CHECK(decoded.Names[IM_FILE_NAME_INDEX].Size == sizeof(IM_TEST_FILE_NAME));
+
+    // strings follow in order of the index
+    IM_CHECK(decodedStrings[IM_PROCESS_NAME_INDEX] == buffer + offset + IM_WIRE_RECORD_SIZE);
+    IM_CHECK(0 == memcmp(decodedStrings[IM_PROCESS_NAME_INDEX], IM_TEST_PROCESS_NAME, sizeof(IM_TEST_PROCESS_NAME)));
+    IM_CHECK(0 == memcmp(decodedStrings[IM_FILE_NAME_INDEX], IM_TEST_FILE_NAME, sizeof(IM_TEST_FILE_NAME)));
+  }
+
+  // the name already sent has no string
+  record.Names[IM_PROCESS_NAME_INDEX].Size = 0;
+  length = IMWireEncodeRecord(buffer, sizeof(alignedBuffer), &record, strings);
+
+  IM_CHECK(IMWireDecodeRecord(buffer, length, &decoded, decodedStrings));
+  IM_CHECK(decodedStrings[IM_PROCESS_NAME_INDEX] == NULL);
+  IM_CHECK(decodedStrings[IM_FILE_NAME_INDEX] == buffer + IM_WIRE_RECORD_SIZE);
+}
+
+//
+// whatever the other side wrote, nothing out of the record is pointed to
+//
+static VOID TestMalformed()
+{
+  const VOID *strings[IM_WIRE_NAMES] = {IM_TEST_PROCESS_NAME, IM_TEST_FILE_NAME};
+  const UCHAR *decodedStrings[IM_WIRE_NAMES] = {NULL, NULL};
+  IM_WIRE_RECORD record;
+  IM_WIRE_RECORD decoded;
+  ULONGLONG alignedBuffer[32];
+  PUCHAR buffer = (PUCHAR)alignedBuffer;
+  ULONG length = 0;
+
+  IMTestRecord(&record, TRUE);
+  length = IMWireEncodeRecord(buffer, sizeof(alignedBuffer), &record, strings);
+
+  // less than the fixed part or than the record says
+  IM_CHECK(!IMWireDecodeRecord(buffer, IM_WIRE_RECORD_SIZE - 1, &decoded, decodedStrings));
+  IM_CHECK(!IMWireDecodeRecord(buffer, length - 1, &decoded, decodedStrings));
+
+  // other version
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_RECORD, Version), IM_WIRE_VERSION + 1, sizeof(USHORT));
+  IM_CHECK(!IMWireDecodeRecord(buffer, length, &decoded, decodedStrings));
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_RECORD, Version), IM_WIRE_VERSION, sizeof(USHORT));
+
+  // Length shorter than the fixed part
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_RECORD, Length), IM_WIRE_RECORD_SIZE - 2, sizeof(ULONG));
+  IM_CHECK(!IMWireDecodeRecord(buffer, length, &decoded, decodedStrings));
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_RECORD, Length), length, sizeof(ULONG));
+
+  // strings out of the record
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_RECORD, Names) + sizeof(IM_WIRE_NAME) + FIELD_OFFSET(IM_WIRE_NAME, Size), sizeof(IM_TEST_FILE_NAME) + 2, sizeof(ULONG));
+  IM_CHECK(!IMWireDecodeRecord(buffer, length, &decoded, decodedStrings));
+
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_RECORD, Names) + sizeof(IM_WIRE_NAME) + FIELD_OFFSET(IM_WIRE_NAME, Size), 0xFFFFFFFF, sizeof(ULONG));
+  IM_CHECK(!IMWireDecodeRecord(buffer, length, &decoded, decodedStrings));
+
+  // half of a symbol
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_RECORD, Names) + sizeof(IM_WIRE_NAME) + FIELD_OFFSET(IM_WIRE_NAME, Size), sizeof(IM_TEST_FILE_NAME) - 1, sizeof(ULONG));
+  IM_CHECK(!IMWireDecodeRecord(buffer, length, &decoded, decodedStrings));
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_RECORD, Names) + sizeof(IM_WIRE_NAME) + FIELD_OFFSET(IM_WIRE_NAME, Size), sizeof(IM_TEST_FILE_NAME), sizeof(ULONG));
+
+  // string of no name
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_RECORD, Names) + FIELD_OFFSET(IM_WIRE_NAME, Id), 0, sizeof(ULONG));
+  IM_CHECK(!IMWireDecodeRecord(buffer, length, &decoded, decodedStrings));
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_RECORD, Names) + FIELD_OFFSET(IM_WIRE_NAME, Id), 1, sizeof(ULONG));
+
+  IM_CHECK(IMWireDecodeRecord(buffer, length, &decoded, decodedStrings));
+}
+
+static VOID TestVarint()
+{
+  static const ULONGLONG values[] = {0, 1, 0x7F, 0x80, 0x3FFF, 0x4000, MAXULONG, ~0ull};
+  static const UCHAR tooLong[IM_WIRE_MAX_VARINT + 1] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x81, 0x00};
+  UCHAR buffer[IM_WIRE_MAX_VARINT];
+  ULONGLONG value = 0;
+  ULONG length = 0;
+  ULONG i = 0;
+
+  for (; i < sizeof(values) / sizeof(values[0]); i++)
+  {
+    length = IMWirePutVarint(buffer, values[i]);
+    IM_CHECK(length == IMWireVarintLength(values[i]));
+    IM_CHECK(IMWireGetVarint(buffer, length, &value) == length);
+    IM_CHECK(value == values[i]);
+
+    // cut one is not read
+    IM_CHECK(IMWireGetVarint(buffer, length - 1, &value) == 0);
+  }
+
+  IM_CHECK(IMWireVarintLength(~0ull) == IM_WIRE_MAX_VARINT);
+  IM_CHECK(IMWireGetVarint(tooLong, sizeof(tooLong), &value) == 0);
+
+  // differences of both signs
+  IM_CHECK(IMWireZigZag(0) == 0);
+  IM_CHECK(IMWireZigZag((ULONGLONG)-1) == 1);
+  IM_CHECK(IMWireZigZag(1) == 2);
+  IM_CHECK(IMWireUnZigZag(IMWireZigZag((ULONGLONG)-12345)) == (ULONGLONG)-12345);
+}
+
+//
+// strings are written against the previous ones of their index, numbers
+// against the previous record
+//
+static VOID TestBatch()
+{
+  static const WCHAR *fileNames[IM_TEST_BATCH_RECORDS] = {
+      L"\\Device\\HarddiskVolume3\\Games\\valve\\client.dll",
+      L"\\Device\\HarddiskVolume3\\Games\\valve\\server.dll",
+      NULL,
+      L"\\Device\\HarddiskVolume3\\Temp\\inject.dll"};
+  static const ULONG fileNameSizes[IM_TEST_BATCH_RECORDS] = {
+      sizeof(L"\\Device\\HarddiskVolume3\\Games\\valve\\client.dll"),
+      sizeof(L"\\Device\\HarddiskVolume3\\Games\\valve\\server.dll"),
+      0,
+      sizeof(L"\\Device\\HarddiskVolume3\\Temp\\inject.dll")};
+  static const LONGLONG times[IM_TEST_BATCH_RECORDS] = {132000000000000000ll, 132000000000000120ll, 132000000000000100ll, 132000000000000300ll};
+  IM_WIRE_BATCH_ENCODER encoder;
+  IM_WIRE_BATCH_ENCODER plan;
+  IM_WIRE_RECORD records[IM_TEST_BATCH_RECORDS];
+  IM_WIRE_RECORD decoded;
+  const VOID *strings[IM_WIRE_NAMES];
+  const UCHAR *decodedStrings[IM_WIRE_NAMES] = {NULL, NULL};
+  ULONGLONG alignedBuffer[64];
+  PUCHAR buffer = (PUCHAR)alignedBuffer + 1;
+  ULONG lengths[IM_TEST_BATCH_RECORDS];
+  ULONG length = 0;
+  ULONG i = 0;
+
+  RtlZeroMemory(&decoded, sizeof(decoded));
+
+  IM_CHECK(!IMWireBeginBatch(&encoder, buffer, IM_WIRE_BATCH_HEADER_SIZE - 1));
+  IM_CHECK(IMWireBeginBatch(&encoder, buffer, sizeof(alignedBuffer) - 1));
+  plan = encoder;
+
+  for (; i < IM_TEST_BATCH_RECORDS; i++)
+  {
+    IMTestRecord(&records[i], FALSE);
+    records[i].SequenceNumber = 1000 + i;
+    records[i].Time = times[i];
+    records[i].Names[IM_PROCESS_NAME_INDEX].Id = 1;
+    records[i].Names[IM_FILE_NAME_INDEX].Id = 2 + i;
+
+    strings[IM_PROCESS_NAME_INDEX] = IM_TEST_PROCESS_NAME;
+    strings[IM_FILE_NAME_INDEX] = fileNames[i];
+
+    if (0 == i)
+    {
+      records[i].Names[IM_PROCESS_NAME_INDEX].Size = sizeof(IM_TEST_PROCESS_NAME);
+    }
+
+    records[i].Names[IM_FILE_NAME_INDEX].Size = fileNameSizes[i];
+
+    length = IMWireBatchRecordLength(&encoder, &records[i], strings);
+    lengths[i] = IMWireEncodeBatchRecord(&encoder, &records[i], strings);
+    IM_CHECK(lengths[i] == length);
+
+    // planned without writing, the same as written
+    IM_CHECK(IMWireReserveBatchRecord(&plan, &records[i], strings) == length);
+    IM_CHECK(plan.Length == encoder.Length);
+  }
+
+  plan.Size = plan.Length;
+  IM_CHECK(IMWireReserveBatchRecord(&plan, &records[0], strings) == 0);
+  IM_CHECK(plan.Length == encoder.Length);
+
+  // the second name differs in the last 10 symbols, the third has none
+  IM_CHECK(lengths[1] == 1 + 1 + 1 + 2 + 1 + 1 + 1 + 1 + 11 * sizeof(WCHAR));
+  IM_CHECK(lengths[2] == 1 + 1 + 1 + 1 + 1 + 1);
+
+  IM_CHECK(IMWireEndBatch(&encoder) == IM_WIRE_BATCH_HEADER_SIZE + lengths[0] + lengths[1] + lengths[2] + lengths[3]);
+  IM_CHECK(IMWireIsBatch(buffer, encoder.Length));
+  IM_CHECK(!IMWireIsBatch(buffer, IM_WIRE_BATCH_HEADER_SIZE - 1));
+
+  // batch is read to its own length only
+  IM_CHECK(IMWireBeginBatchDecode(&Decoder, buffer, encoder.Length + 1));
+  IM_CHECK(Decoder.Length == encoder.Length);
+
+  for (i = 0; i < IM_TEST_BATCH_RECORDS; i++)
+  {
+    IM_CHECK(!IMWireIsBatchEnd(&Decoder));
+    IM_CHECK(IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+    IM_CHECK(decoded.Length == lengths[i]);
+    IM_CHECK(decoded.Flags == records[i].Flags);
+    IM_CHECK(decoded.VideoMode == records[i].VideoMode);
+    IM_CHECK(decoded.SequenceNumber == records[i].SequenceNumber);
+    IM_CHECK(decoded.Time == records[i].Time);
+    IM_CHECK(decoded.Names[IM_FILE_NAME_INDEX].Id == records[i].Names[IM_FILE_NAME_INDEX].Id);
+    IM_CHECK(decoded.Names[IM_FILE_NAME_INDEX].Size == records[i].Names[IM_FILE_NAME_INDEX].Size);
+    IM_CHECK((NULL == fileNames[i]) == (NULL == decodedStrings[IM_FILE_NAME_INDEX]));
+
+    if (NULL != fileNames[i] && NULL != decodedStrings[IM_FILE_NAME_INDEX])
+    {
+      IM_CHECK(0 == memcmp(decodedStrings[IM_FILE_NAME_INDEX], fileNames[i], decoded.Names[IM_FILE_NAME_INDEX].Size));
+    }
+  }
+
+  IM_CHECK(IMWireIsBatchEnd(&Decoder));
+  IM_CHECK(!IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+
+  // the record which does not fit leaves the batch as it was
+  IM_CHECK(IMWireBeginBatch(&encoder, buffer, IM_WIRE_BATCH_HEADER_SIZE + 8));
+  strings[IM_FILE_NAME_INDEX] = fileNames[0];
+  records[0].Names[IM_FILE_NAME_INDEX].Size = fileNameSizes[0];
+  IM_CHECK(IMWireEncodeBatchRecord(&encoder, &records[0], strings) == 0);
+  IM_CHECK(encoder.Length == IM_WIRE_BATCH_HEADER_SIZE);
+  IM_CHECK(encoder.NameChars[IM_FILE_NAME_INDEX] == 0);
+}
+
+static VOID TestMalformedBatch()
+{
+  const VOID *strings[IM_WIRE_NAMES] = {IM_TEST_PROCESS_NAME, IM_TEST_FILE_NAME};
+  const UCHAR *decodedStrings[IM_WIRE_NAMES] = {NULL, NULL};
+  IM_WIRE_BATCH_ENCODER encoder;
+  IM_WIRE_RECORD record;
+  IM_WIRE_RECORD decoded;
+  UCHAR buffer[256];
+  UCHAR copy[256];
+  ULONG length = 0;
+  ULONG i = 0;
+
+  IMTestRecord(&record, TRUE);
+
+  IM_CHECK(IMWireBeginBatch(&encoder, buffer, sizeof(buffer)));
+  IM_CHECK(IMWireEncodeBatchRecord(&encoder, &record, strings) != 0);
+  length = IMWireEndBatch(&encoder);
+
+  // record is not a batch
+  IM_CHECK(IMWireEncodeRecord(copy, sizeof(copy), &record, strings) != 0);
+  IM_CHECK(!IMWireBeginBatchDecode(&Decoder, copy, sizeof(copy)));
+
+  // batch longer than the buffer
+  IM_CHECK(!IMWireBeginBatchDecode(&Decoder, buffer, length - 1));
+
+  // every cut of the record is rejected
+  for (i = IM_WIRE_BATCH_HEADER_SIZE + 1; i < length; i++)
+  {
+    RtlCopyMemory(copy, buffer, length);
+    IMWirePut(copy + FIELD_OFFSET(IM_WIRE_BATCH, Length), i, sizeof(ULONG));
+
+    IM_CHECK(IMWireBeginBatchDecode(&Decoder, copy, length));
+    IM_CHECK(!IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+  }
+
+  // the first string can not share with nothing: head, video mode,
+  // differences of 8 and 8 bytes, id of 4 bytes, then shared symbols
+  RtlCopyMemory(copy, buffer, length);
+  IM_CHECK(copy[IM_WIRE_BATCH_HEADER_SIZE + 1 + 1 + 9 + 9 + 5] == 0);
+  copy[IM_WIRE_BATCH_HEADER_SIZE + 1 + 1 + 9 + 9 + 5] = 1;
+  IM_CHECK(IMWireBeginBatchDecode(&Decoder, copy, length));
+  IM_CHECK(!IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+
+  // string of no name
+  record.Names[IM_PROCESS_NAME_INDEX].Id = 0;
+  IM_CHECK(IMWireBeginBatch(&encoder, buffer, sizeof(buffer)));
+  IM_CHECK(IMWireEncodeBatchRecord(&encoder, &record, strings) != 0);
+  length = IMWireEndBatch(&encoder);
+
+  IM_CHECK(IMWireBeginBatchDecode(&Decoder, buffer, length));
+  IM_CHECK(!IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+}
+
+//
+// gap marker takes the place of the lost records and leaves the state of
+// the batch to the records around it
+//
+static VOID TestGap()
+{
+  const VOID *strings[IM_WIRE_NAMES] = {IM_TEST_PROCESS_NAME, IM_TEST_FILE_NAME};
+  const VOID *noStrings[IM_WIRE_NAMES] = {NULL, NULL};
+  const UCHAR *decodedStrings[IM_WIRE_NAMES] = {NULL, NULL};
+  IM_WIRE_BATCH_ENCODER encoder;
+  IM_WIRE_RECORD record;
+  IM_WIRE_RECORD gap;
+  IM_WIRE_RECORD decoded;
+  UCHAR buffer[256];
+  ULONG length = 0;
+
+  RtlZeroMemory(&decoded, sizeof(decoded));
+  IMTestRecord(&record, TRUE);
+  IMWireMakeGap(&gap, 300);
+
+  // fixed fields only, the number at the offset of Lost
+  IM_CHECK(IMWireEncodeRecord(buffer, sizeof(buffer), &gap, noStrings) == IM_WIRE_RECORD_SIZE);
+  IM_CHECK(IMWireGet(buffer + FIELD_OFFSET(IM_WIRE_RECORD, Lost), sizeof(ULONG)) == 300);
+  IM_CHECK(IMWireDecodeRecord(buffer, IM_WIRE_RECORD_SIZE, &decoded, decodedStrings));
+  IM_CHECK(decoded.Flags == IM_WIRE_GAP && decoded.Lost == 300);
+  IM_CHECK(decoded.Names[IM_PROCESS_NAME_INDEX].Id == 0 && decodedStrings[IM_FILE_NAME_INDEX] == NULL);
+
+  // head and the varint of the number
+  IM_CHECK(IMWireBeginBatch(&encoder, buffer, sizeof(buffer)));
+  IM_CHECK(IMWireEncodeBatchRecord(&encoder, &record, strings) != 0);
+  IM_CHECK(IMWireBatchRecordLength(&encoder, &gap, noStrings) == 3);
+  IM_CHECK(IMWireEncodeBatchRecord(&encoder, &gap, noStrings) == 3);
+
+  record.SequenceNumber++;
+  record.Names[IM_PROCESS_NAME_INDEX].Size = 0;
+  IM_CHECK(IMWireEncodeBatchRecord(&encoder, &record, strings) != 0);
+  length = IMWireEndBatch(&encoder);
+
+  IM_CHECK(IMWireBeginBatchDecode(&Decoder, buffer, length));
+  IM_CHECK(IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+  IM_CHECK(!(decoded.Flags & IM_WIRE_GAP));
+
+  IM_CHECK(IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+  IM_CHECK(decoded.Flags == IM_WIRE_GAP && decoded.Lost == 300);
+  IM_CHECK(decoded.Length == 3);
+  IM_CHECK(decodedStrings[IM_PROCESS_NAME_INDEX] == NULL && decodedStrings[IM_FILE_NAME_INDEX] == NULL);
+
+  // differences and strings are against the record before the gap
+  IM_CHECK(IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+  IM_CHECK(decoded.SequenceNumber == record.SequenceNumber);
+  IM_CHECK(decoded.Time == record.Time);
+  IM_CHECK(decoded.Lost == 0);
+  IM_CHECK(0 == memcmp(decodedStrings[IM_FILE_NAME_INDEX], IM_TEST_FILE_NAME, sizeof(IM_TEST_FILE_NAME)));
+  IM_CHECK(IMWireIsBatchEnd(&Decoder));
+
+  // gap with a string or without the number is malformed
+  buffer[IM_WIRE_BATCH_HEADER_SIZE] = (UCHAR)((IM_WIRE_GAP << IM_WIRE_BATCH_FLAGS_SHIFT) | IM_WIRE_BATCH_STRING(0));
+  buffer[IM_WIRE_BATCH_HEADER_SIZE + 1] = 1;
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_BATCH, Length), IM_WIRE_BATCH_HEADER_SIZE + 2, sizeof(ULONG));
+  IM_CHECK(IMWireBeginBatchDecode(&Decoder, buffer, IM_WIRE_BATCH_HEADER_SIZE + 2));
+  IM_CHECK(!IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+
+  buffer[IM_WIRE_BATCH_HEADER_SIZE] = (UCHAR)(IM_WIRE_GAP << IM_WIRE_BATCH_FLAGS_SHIFT);
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_BATCH, Length), IM_WIRE_BATCH_HEADER_SIZE + 1, sizeof(ULONG));
+  IM_CHECK(IMWireBeginBatchDecode(&Decoder, buffer, IM_WIRE_BATCH_HEADER_SIZE + 1));
+  IM_CHECK(!IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+}
+
+//
+// Coalesced record carries its count and last time behind the strings,
+// in the batch as varints, and the other records decode as one of one
+//
+static VOID TestCoalesced()
+{
+  const VOID *strings[IM_WIRE_NAMES] = {IM_TEST_PROCESS_NAME, IM_TEST_FILE_NAME};
+  const UCHAR *decodedStrings[IM_WIRE_NAMES] = {NULL, NULL};
+  IM_WIRE_BATCH_ENCODER encoder;
+  IM_WIRE_RECORD record;
+  IM_WIRE_RECORD coalesced;
+  IM_WIRE_RECORD decoded;
+  UCHAR buffer[256];
+  ULONG length = 0;
+  ULONG plainLength = 0;
+
+  RtlZeroMemory(&decoded, sizeof(decoded));
+  IMTestRecord(&record, TRUE);
+  IMTestRecord(&coalesced, TRUE);
+
+  coalesced.Flags |= IM_WIRE_COALESCED;
+  coalesced.SequenceNumber = record.SequenceNumber + 1;
+  coalesced.Time = record.Time - 5000;
+  coalesced.LastTime = record.Time + 7000;
+  coalesced.Count = 300;
+
+  plainLength = IMWireRecordLength(&record);
+  length = IMWireRecordLength(&coalesced);
+  IM_CHECK(length == plainLength + IM_WIRE_COALESCED_SIZE);
+
+  IM_CHECK(IMWireEncodeRecord(buffer, length - 1, &coalesced, strings) == 0);
+  IM_CHECK(IMWireEncodeRecord(buffer, sizeof(buffer), &coalesced, strings) == length);
+  IM_CHECK(IMWireGet(buffer + plainLength, sizeof(LONGLONG)) == (ULONGLONG)coalesced.LastTime);
+  IM_CHECK(IMWireGet(buffer + plainLength + sizeof(LONGLONG), sizeof(ULONG)) == 300);
+
+  IM_CHECK(IMWireDecodeRecord(buffer, length, &decoded, decodedStrings));
+  IM_CHECK(decoded.Length == length);
+  IM_CHECK(decoded.Flags == coalesced.Flags);
+  IM_CHECK(decoded.Time == coalesced.Time && decoded.LastTime == coalesced.LastTime);
+  IM_CHECK(decoded.Count == 300);
+  IM_CHECK(0 == memcmp(decodedStrings[IM_FILE_NAME_INDEX], IM_TEST_FILE_NAME, sizeof(IM_TEST_FILE_NAME)));
+
+  // the count is not there
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_RECORD, Length), length - 1, sizeof(ULONG));
+  IM_CHECK(!IMWireDecodeRecord(buffer, length, &decoded, decodedStrings));
+
+  IM_CHECK(IMWireEncodeRecord(buffer, sizeof(buffer), &record, strings) == plainLength);
+  IM_CHECK(IMWireDecodeRecord(buffer, plainLength, &decoded, decodedStrings));
+  IM_CHECK(decoded.Count == 1 && decoded.LastTime == record.Time);
+
+  // first time before the previous record is a negative difference
+  IM_CHECK(IMWireBeginBatch(&encoder, buffer, sizeof(buffer)));
+  IM_CHECK(IMWireEncodeBatchRecord(&encoder, &record, strings) != 0);
+
+  coalesced.Names[IM_PROCESS_NAME_INDEX].Size = 0;
+  coalesced.Names[IM_FILE_NAME_INDEX].Size = 0;
+  length = IMWireBatchRecordLength(&encoder, &coalesced, strings);
+  IM_CHECK(IMWireEncodeBatchRecord(&encoder, &coalesced, strings) == length);
+
+  record.SequenceNumber += 2;
+  record.Names[IM_PROCESS_NAME_INDEX].Size = 0;
+  record.Names[IM_FILE_NAME_INDEX].Size = 0;
+  IM_CHECK(IMWireEncodeBatchRecord(&encoder, &record, strings) != 0);
+
+  IM_CHECK(IMWireBeginBatchDecode(&Decoder, buffer, IMWireEndBatch(&encoder)));
+  IM_CHECK(IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+  IM_CHECK(decoded.Count == 1 && decoded.LastTime == decoded.Time);
+
+  IM_CHECK(IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+  IM_CHECK(decoded.Length == length);
+  IM_CHECK(decoded.Flags == coalesced.Flags);
+  IM_CHECK(decoded.SequenceNumber == coalesced.SequenceNumber);
+  IM_CHECK(decoded.Time == coalesced.Time && decoded.LastTime == coalesced.LastTime);
+  IM_CHECK(decoded.Count == 300);
+
+  IM_CHECK(IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+  IM_CHECK(decoded.SequenceNumber == record.SequenceNumber && decoded.Time == record.Time);
+  IM_CHECK(decoded.Count == 1);
+  IM_CHECK(IMWireIsBatchEnd(&Decoder));
+
+  // the last time is cut, it is right before the ids
+  IM_CHECK(IMWireBeginBatch(&encoder, buffer, sizeof(buffer)));
+  length = IMWireEncodeBatchRecord(&encoder, &coalesced, strings);
+  IM_CHECK(length != 0);
+  (VOID) IMWireEndBatch(&encoder);
+  length -= IMWireVarintLength(coalesced.Names[IM_PROCESS_NAME_INDEX].Id) + IMWireVarintLength(coalesced.Names[IM_FILE_NAME_INDEX].Id) + 1;
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_BATCH, Length), IM_WIRE_BATCH_HEADER_SIZE + length, sizeof(ULONG));
+  IM_CHECK(IMWireBeginBatchDecode(&Decoder, buffer, IM_WIRE_BATCH_HEADER_SIZE + length));
+  IM_CHECK(!IMWireDecodeBatchRecord(&Decoder, &decoded, decodedStrings));
+}
+
+//
+// Reply goes ahead of the records, told apart from them by its version
+//
+static VOID TestReply()
+{
+  const VOID *strings[IM_WIRE_NAMES] = {IM_TEST_PROCESS_NAME, IM_TEST_FILE_NAME};
+  const UCHAR *decodedStrings[IM_WIRE_NAMES] = {NULL, NULL};
+  IM_WIRE_BATCH_ENCODER encoder;
+  IM_WIRE_RECORD record;
+  IM_WIRE_REPLY reply;
+  IM_WIRE_REPLY decoded;
+  UCHAR buffer[256];
+
+  RtlZeroMemory(&reply, sizeof(reply));
+  reply.Required = 70000;
+  reply.Queued = 12;
+  reply.QueuedBytes = MAXULONG;
+
+  IM_CHECK(IMWireEncodeReply(buffer, IM_WIRE_REPLY_SIZE - 1, &reply) == 0);
+  IM_CHECK(IMWireEncodeReply(buffer, sizeof(buffer), &reply) == IM_WIRE_REPLY_SIZE);
+  IM_CHECK(IMWireIsReply(buffer, IM_WIRE_REPLY_SIZE));
+  IM_CHECK(!IMWireIsBatch(buffer, IM_WIRE_REPLY_SIZE));
+  IM_CHECK(!IMWireIsReply(buffer, IM_WIRE_REPLY_SIZE - 1));
+
+  IM_CHECK(IMWireDecodeReply(buffer, IM_WIRE_REPLY_SIZE, &decoded));
+  IM_CHECK(decoded.Length == IM_WIRE_REPLY_SIZE);
+  IM_CHECK(decoded.Required == 70000 && decoded.Queued == 12 && decoded.QueuedBytes == MAXULONG);
+
+  // records and batches are not replies
+  IMTestRecord(&record, TRUE);
+  IM_CHECK(IMWireEncodeRecord(buffer, sizeof(buffer), &record, strings) != 0);
+  IM_CHECK(!IMWireIsReply(buffer, sizeof(buffer)));
+  IM_CHECK(IMWireBeginBatch(&encoder, buffer, sizeof(buffer)));
+  IM_CHECK(IMWireEncodeBatchRecord(&encoder, &record, strings) != 0);
+  (VOID) IMWireEndBatch(&encoder);
+  IM_CHECK(!IMWireIsReply(buffer, sizeof(buffer)));
+
+  // longer reply of a later driver is skipped as a whole, shorter one is malformed
+  IM_CHECK(IMWireEncodeReply(buffer, sizeof(buffer), &reply) == IM_WIRE_REPLY_SIZE);
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_REPLY, Length), IM_WIRE_REPLY_SIZE + 8, sizeof(ULONG));
+  IM_CHECK(!IMWireDecodeReply(buffer, IM_WIRE_REPLY_SIZE, &decoded));
+  IM_CHECK(IMWireDecodeReply(buffer, IM_WIRE_REPLY_SIZE + 8, &decoded));
+  IM_CHECK(decoded.Length == IM_WIRE_REPLY_SIZE + 8 && decoded.Queued == 12);
+
+  IMWirePut(buffer + FIELD_OFFSET(IM_WIRE_REPLY, Length), IM_WIRE_REPLY_SIZE - 1, sizeof(ULONG));
+  IM_CHECK(!IMWireDecodeReply(buffer, sizeof(buffer), &decoded));
+  IM_CHECK(!IMWireDecodeRecord(buffer, sizeof(buffer), &record, decodedStrings));
+}
+
+//------------------------------------------------------------------------
+//  Main.
+//------------------------------------------------------------------------
+
+int main()
+{
+  IM_RUN(TestLayout);
+  IM_RUN(TestRoundTrip);
+  IM_RUN(TestMalformed);
+  IM_RUN(TestVarint);
+  IM_RUN(TestBatch);
+  IM_RUN(TestMalformedBatch);
+  IM_RUN(TestGap);
+  IM_RUN(TestCoalesced);
+  IM_RUN(TestReply);
+
+  return IM_TEST_RESULT();
+}